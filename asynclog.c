@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "asynclog.h"
+
+// Defines
+
+// How long asynclog_flush() sleeps between checks on whether everything has
+// been written out, in microseconds
+#define ASYNCLOG_IDLE_SLEEP (2000)
+
+#if (ASYNCLOG_RECORDS & (ASYNCLOG_RECORDS - 1))
+#error "The number of log records must be a power of two"
+#endif
+
+#if (ASYNCLOG_HEX_PREFIX >= ASYNCLOG_RECORD_SIZE)
+#error "The hex dump prefix must leave space in the record for data"
+#endif
+
+// Structure definitions
+
+/**
+ * A slot in the ring buffer. The sequence number says whose turn it is: a
+ * producer may fill the slot when it equals the producer's position, and the
+ * background thread may write it out when it's one greater.
+ */
+typedef struct _AsyncLogRecord {
+	gint sequence;
+	int level;
+	bool hex;
+	gsize length;
+	gsize total;
+	char text[ASYNCLOG_RECORD_SIZE];
+} AsyncLogRecord;
+
+// Function prototypes
+
+static gpointer asynclog_thread(gpointer user_data);
+static AsyncLogRecord * asynclog_reserve();
+static void asynclog_commit(AsyncLogRecord * record);
+static void asynclog_output(AsyncLogRecord const * record);
+static void asynclog_wake();
+
+// Static variables
+
+static AsyncLogRecord asynclog_ring[ASYNCLOG_RECORDS];
+static gint asynclog_head = 0;
+static gint asynclog_tail = 0;
+static gint asynclog_running = 0;
+static gint asynclog_droppedcount = 0;
+static GThread * asynclog_drain = NULL;
+// Set while the background thread is waiting for records, so that producers
+// only take the lock to wake it when it's actually asleep. Zeroed static
+// mutexes and conditions need no initialisation
+static gint asynclog_sleeping = 0;
+static GMutex asynclog_lock;
+static GCond asynclog_cond;
+
+// Function definitions
+
+/**
+ * Start the background thread that writes out log records. Until this is
+ * called, and after asynclog_stop(), messages are written out synchronously.
+ */
+void asynclog_start() {
+	guint pos;
+
+	if (asynclog_drain == NULL) {
+		for (pos = 0; pos < ASYNCLOG_RECORDS; pos++) {
+			asynclog_ring[pos].sequence = pos;
+		}
+		asynclog_head = 0;
+		asynclog_tail = 0;
+
+		g_atomic_int_set(&asynclog_running, 1);
+		asynclog_drain = g_thread_new("asynclog", asynclog_thread, NULL);
+	}
+}
+
+/**
+ * Write out any outstanding records and stop the background thread.
+ */
+void asynclog_stop() {
+	guint dropped;
+
+	if (asynclog_drain != NULL) {
+		g_atomic_int_set(&asynclog_running, 0);
+		asynclog_wake();
+		g_thread_join(asynclog_drain);
+		asynclog_drain = NULL;
+
+		dropped = asynclog_dropped();
+		if (dropped > 0) {
+			fprintf(stderr, "%u log messages were dropped\n", dropped);
+		}
+	}
+}
+
+/**
+ * Wait until everything logged so far has been written out.
+ */
+void asynclog_flush() {
+	if (g_atomic_int_get(&asynclog_running) != 0) {
+		while (g_atomic_int_get(&asynclog_tail) != g_atomic_int_get(&asynclog_head)) {
+			g_usleep(ASYNCLOG_IDLE_SLEEP);
+		}
+	}
+	fflush(stdout);
+}
+
+/**
+ * Get the number of messages discarded because the ring buffer was full.
+ *
+ * @return the number of messages dropped since the logger was started
+ */
+guint asynclog_dropped() {
+	return (guint)g_atomic_int_get(&asynclog_droppedcount);
+}
+
+/**
+ * Log a message. Use the ASYNCLOG() macro rather than calling this directly
+ * so that the call is compiled out below the build's log level.
+ *
+ * @param level the syslog priority of the message
+ * @param format printf-style format string
+ */
+void asynclog_write(int level, char const * format, ...) {
+	va_list args;
+	AsyncLogRecord * record;
+	AsyncLogRecord local;
+
+	record = asynclog_reserve();
+	if ((record == NULL) && (g_atomic_int_get(&asynclog_running) == 0)) {
+		record = &local;
+	}
+
+	if (record != NULL) {
+		va_start(args, format);
+		vsnprintf(record->text, ASYNCLOG_RECORD_SIZE, format, args);
+		va_end(args);
+
+		record->level = level;
+		record->hex = FALSE;
+
+		if (record == &local) {
+			asynclog_output(record);
+		}
+		else {
+			asynclog_commit(record);
+		}
+	}
+}
+
+/**
+ * Log binary data as hex. Data beyond the space in a record is counted but
+ * not shown. Use the ASYNCLOG_HEX() macro rather than calling this directly.
+ *
+ * @param level the syslog priority of the message
+ * @param prefix text to output before the hex
+ * @param data the data to output
+ * @param length the number of bytes of data
+ */
+void asynclog_hex(int level, char const * prefix, void const * data, gsize length) {
+	AsyncLogRecord * record;
+	AsyncLogRecord local;
+
+	record = asynclog_reserve();
+	if ((record == NULL) && (g_atomic_int_get(&asynclog_running) == 0)) {
+		record = &local;
+	}
+
+	if (record != NULL) {
+		g_strlcpy(record->text, prefix, ASYNCLOG_HEX_PREFIX);
+		record->total = length;
+		record->length = MIN(length, ASYNCLOG_RECORD_SIZE - ASYNCLOG_HEX_PREFIX);
+		memcpy(record->text + ASYNCLOG_HEX_PREFIX, data, record->length);
+
+		record->level = level;
+		record->hex = TRUE;
+
+		if (record == &local) {
+			asynclog_output(record);
+		}
+		else {
+			asynclog_commit(record);
+		}
+	}
+}
+
+/**
+ * Claim the next free slot in the ring buffer. Safe to call from any thread
+ * and never blocks; if the buffer is full the message is dropped.
+ *
+ * @return the slot to fill, or NULL if the logger isn't running or is full
+ */
+static AsyncLogRecord * asynclog_reserve() {
+	AsyncLogRecord * record;
+	gint pos;
+	gint sequence;
+	gint difference;
+
+	if (g_atomic_int_get(&asynclog_running) == 0) {
+		return NULL;
+	}
+
+	record = NULL;
+	pos = g_atomic_int_get(&asynclog_head);
+	while (record == NULL) {
+		sequence = g_atomic_int_get(&asynclog_ring[pos & (ASYNCLOG_RECORDS - 1)].sequence);
+		difference = (gint)((guint)sequence - (guint)pos);
+		if (difference == 0) {
+			if (g_atomic_int_compare_and_exchange(&asynclog_head, pos, (gint)((guint)pos + 1))) {
+				record = &asynclog_ring[pos & (ASYNCLOG_RECORDS - 1)];
+			}
+			else {
+				pos = g_atomic_int_get(&asynclog_head);
+			}
+		}
+		else if (difference < 0) {
+			// Still waiting to be written out
+			g_atomic_int_inc(&asynclog_droppedcount);
+			return NULL;
+		}
+		else {
+			// Another thread claimed it first
+			pos = g_atomic_int_get(&asynclog_head);
+		}
+	}
+
+	return record;
+}
+
+/**
+ * Hand a filled slot over to the background thread.
+ *
+ * @param record the slot returned by asynclog_reserve()
+ */
+static void asynclog_commit(AsyncLogRecord * record) {
+	g_atomic_int_set(&record->sequence, (gint)((guint)record->sequence + 1));
+
+	if (g_atomic_int_get(&asynclog_sleeping) != 0) {
+		asynclog_wake();
+	}
+}
+
+/**
+ * Wake the background thread if it's waiting for records.
+ */
+static void asynclog_wake() {
+	g_mutex_lock(&asynclog_lock);
+	g_cond_signal(&asynclog_cond);
+	g_mutex_unlock(&asynclog_lock);
+}
+
+/**
+ * Write out a single record, formatting it as hex if it contains binary data.
+ *
+ * @param record the record to output
+ */
+static void asynclog_output(AsyncLogRecord const * record) {
+	static char const digits[] = "0123456789ABCDEF";
+	char hex[(ASYNCLOG_RECORD_SIZE - ASYNCLOG_HEX_PREFIX) * 2 + 1];
+	guchar const * data;
+	FILE * stream;
+	gsize pos;
+
+	stream = (record->level <= LOG_ERR) ? stderr : stdout;
+
+	if (record->hex == TRUE) {
+		data = (guchar const *)(record->text + ASYNCLOG_HEX_PREFIX);
+		for (pos = 0; pos < record->length; pos++) {
+			hex[pos * 2] = digits[data[pos] >> 4];
+			hex[(pos * 2) + 1] = digits[data[pos] & 0x0f];
+		}
+		hex[record->length * 2] = '\0';
+
+		if (record->length < record->total) {
+			fprintf(stream, "%s%s... (%lu bytes)\n", record->text, hex, record->total);
+		}
+		else {
+			fprintf(stream, "%s%s\n", record->text, hex);
+		}
+	}
+	else {
+		fputs(record->text, stream);
+	}
+}
+
+/**
+ * Background thread; writes out records as they're committed, and carries on
+ * until the buffer is empty once it's been asked to stop. When there's
+ * nothing to write it blocks until a producer commits a record, so an idle
+ * service doesn't wake up to poll.
+ *
+ * @param user_data unused
+ * @return NULL
+ */
+static gpointer asynclog_thread(gpointer user_data) {
+	AsyncLogRecord * record;
+	gint pos;
+	bool written;
+
+	pos = g_atomic_int_get(&asynclog_tail);
+	written = FALSE;
+
+	while (TRUE) {
+		record = &asynclog_ring[pos & (ASYNCLOG_RECORDS - 1)];
+		if (g_atomic_int_get(&record->sequence) == (gint)((guint)pos + 1)) {
+			asynclog_output(record);
+			written = TRUE;
+
+			// Free the slot for the producer that comes round next time
+			g_atomic_int_set(&record->sequence, (gint)((guint)pos + ASYNCLOG_RECORDS));
+			pos = (gint)((guint)pos + 1);
+			g_atomic_int_set(&asynclog_tail, pos);
+		}
+		else {
+			if (written == TRUE) {
+				fflush(stdout);
+				written = FALSE;
+			}
+			if ((g_atomic_int_get(&asynclog_running) == 0) && (pos == g_atomic_int_get(&asynclog_head))) {
+				break;
+			}
+
+			// Say we're going to sleep before checking again, so that a record
+			// committed in between either is seen here or wakes us up
+			g_mutex_lock(&asynclog_lock);
+			g_atomic_int_set(&asynclog_sleeping, 1);
+			if ((g_atomic_int_get(&record->sequence) != (gint)((guint)pos + 1)) && (g_atomic_int_get(&asynclog_running) != 0)) {
+				g_cond_wait(&asynclog_cond, &asynclog_lock);
+			}
+			g_atomic_int_set(&asynclog_sleeping, 0);
+			g_mutex_unlock(&asynclog_lock);
+		}
+	}
+
+	fflush(stdout);
+
+	return NULL;
+}
+
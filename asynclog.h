@@ -0,0 +1,60 @@
+#ifndef __ASYNCLOG_H
+#define __ASYNCLOG_H
+
+#include <stdbool.h>
+#include <syslog.h>
+#include <glib.h>
+
+// Defines
+
+// Messages less severe than this are compiled out entirely. Uses the syslog
+// priorities, so build with e.g. -DASYNCLOG_LEVEL=LOG_DEBUG to see every
+// chunk sent and received
+#ifndef ASYNCLOG_LEVEL
+#define ASYNCLOG_LEVEL LOG_INFO
+#endif
+
+// Number of records the ring buffer holds; must be a power of two
+#define ASYNCLOG_RECORDS (1024)
+// Maximum length of a formatted record, including the terminator
+#define ASYNCLOG_RECORD_SIZE (256)
+// Maximum length of the text preceding a hex dump
+#define ASYNCLOG_HEX_PREFIX (48)
+
+/**
+ * Log a printf-style message at the given syslog priority. Below
+ * ASYNCLOG_LEVEL the call, including evaluation of its arguments, is removed
+ * by the compiler.
+ */
+#define ASYNCLOG(level, ...) \
+	do { \
+		if ((level) <= ASYNCLOG_LEVEL) { \
+			asynclog_write((level), __VA_ARGS__); \
+		} \
+	} while (0)
+
+/**
+ * Log binary data. Only the raw bytes are copied by the caller; the hex
+ * formatting is done by the background thread.
+ */
+#define ASYNCLOG_HEX(level, prefix, data, length) \
+	do { \
+		if ((level) <= ASYNCLOG_LEVEL) { \
+			asynclog_hex((level), (prefix), (data), (length)); \
+		} \
+	} while (0)
+
+// Function prototypes
+
+void asynclog_start();
+void asynclog_stop();
+void asynclog_flush();
+guint asynclog_dropped();
+
+void asynclog_write(int level, char const * format, ...) G_GNUC_PRINTF(2, 3);
+void asynclog_hex(int level, char const * prefix, void const * data, gsize length);
+
+// Function definitions
+
+#endif
+
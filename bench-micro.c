@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "pico/buffer.h"
+
+#include "reassembly.h"
+#include "framing.h"
+#include "uuid.h"
+#include "hcicontroller.h"
+
+// Defines
+
+#define DEFAULT_MESSAGE_SIZES "64,256,1024,4096,16384"
+// The default MTU's notification size, a typical negotiated size, the most
+// an LE data packet carries, and the most an attribute can hold
+#define DEFAULT_CHUNK_SIZES "20,128,244,512"
+// Time to spend measuring each case, in milliseconds
+#define DEFAULT_TIME (100)
+
+// Structure definitions
+
+/**
+ * The inputs for one combination of message and chunk size, prepared before
+ * timing so that only the code under test is measured.
+ */
+typedef struct _BenchCase {
+	gsize messagesize;
+	gsize chunksize;
+	GBytes * message;
+	// Version 1 chunks as the central writes them
+	GPtrArray * chunks;
+	// Version 2 chunks of two messages, alternated so that neither is taken
+	// for a repeat of the last
+	GPtrArray * framed[2];
+	guint framedmsg;
+	Buffer * buffer;
+	size_t remaining;
+	FramingReceive * receive;
+	guchar commitment[UUID_COMMITMENT_LENGTH];
+	bool ok;
+} BenchCase;
+
+typedef void (*BenchFunc)(BenchCase * bench);
+
+// Static variables
+
+// Allocations made through malloc(), calloc() and realloc(), which GLib's
+// allocators all use
+static guint64 bench_allocs = 0;
+static guint64 bench_allocbytes = 0;
+
+// Function prototypes
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t count, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+
+static guint64 bench_now();
+static BenchCase * bench_case_new(gsize messagesize, gsize chunksize);
+static void bench_case_delete(BenchCase * bench);
+static GArray * bench_sizes(char const * list);
+static void bench_reassembly(BenchCase * bench);
+static void bench_framing_receive(BenchCase * bench);
+static void bench_send_v1(BenchCase * bench);
+static void bench_send_v2(BenchCase * bench);
+static void bench_uuid(BenchCase * bench);
+static void bench_run(char const * label, char const * name, BenchFunc func, BenchCase * bench, guint time);
+static bool check_bytes(char const * name, guchar const * bytes, guint length, guchar const * expected, guint expectedlength);
+static bool check_hci_layout();
+
+// Function definitions
+
+/**
+ * Count each allocation before passing it on to the C library.
+ */
+void * malloc(size_t size) {
+	bench_allocs++;
+	bench_allocbytes += size;
+
+	return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size) {
+	bench_allocs++;
+	bench_allocbytes += count * size;
+
+	return __libc_calloc(count, size);
+}
+
+void * realloc(void * ptr, size_t size) {
+	bench_allocs++;
+	bench_allocbytes += size;
+
+	return __libc_realloc(ptr, size);
+}
+
+/**
+ * Read the monotonic clock.
+ *
+ * @return the time in nanoseconds
+ */
+static guint64 bench_now() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((guint64)now.tv_sec * 1000000000ull) + now.tv_nsec;
+}
+
+/**
+ * Prepare the inputs for one combination of message and chunk size.
+ *
+ * @param messagesize the size of the message
+ * @param chunksize the maximum size of each chunk, including its header
+ * @return the prepared case, to be freed with bench_case_delete()
+ */
+static BenchCase * bench_case_new(gsize messagesize, gsize chunksize) {
+	BenchCase * bench;
+	guchar * data;
+	guchar * chunk;
+	gsize sent;
+	gsize header;
+	gsize payload;
+	guint32 crc;
+	guint msg;
+	guint pos;
+
+	bench = g_new0(BenchCase, 1);
+	bench->messagesize = messagesize;
+	bench->chunksize = chunksize;
+
+	data = g_malloc(messagesize);
+	for (pos = 0; pos < messagesize; pos++) {
+		data[pos] = g_random_int_range(0, 256);
+	}
+	bench->message = g_bytes_new_take(data, messagesize);
+
+	// Counter byte on every chunk, and the length on the first
+	bench->chunks = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+	sent = 0;
+	while (sent < messagesize) {
+		header = (sent == 0) ? REASSEMBLY_HEADER_FIRST : REASSEMBLY_HEADER;
+		payload = MIN(chunksize - header, messagesize - sent);
+		chunk = g_malloc(header + payload);
+		chunk[0] = bench->chunks->len & 0xff;
+		if (sent == 0) {
+			chunk[1] = (messagesize >> 24) & 0xff;
+			chunk[2] = (messagesize >> 16) & 0xff;
+			chunk[3] = (messagesize >> 8) & 0xff;
+			chunk[4] = (messagesize >> 0) & 0xff;
+		}
+		memcpy(chunk + header, data + sent, payload);
+		g_ptr_array_add(bench->chunks, g_bytes_new_take(chunk, header + payload));
+		sent += payload;
+	}
+
+	crc = framing_crc32(data, messagesize);
+	for (msg = 0; msg < G_N_ELEMENTS(bench->framed); msg++) {
+		bench->framed[msg] = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+		sent = 0;
+		do {
+			g_ptr_array_add(bench->framed[msg], framing_chunk_new(bench->message, msg, crc, sent, messagesize, chunksize, &payload));
+			sent += payload;
+		} while (sent < messagesize);
+	}
+	bench->framedmsg = 0;
+
+	bench->buffer = buffer_new(0);
+	bench->remaining = 0;
+	bench->receive = framing_receive_new();
+
+	for (pos = 0; pos < UUID_COMMITMENT_LENGTH; pos++) {
+		bench->commitment[pos] = g_random_int_range(0, 256);
+	}
+
+	bench->ok = TRUE;
+
+	return bench;
+}
+
+static void bench_case_delete(BenchCase * bench) {
+	guint msg;
+
+	if (bench != NULL) {
+		g_bytes_unref(bench->message);
+		g_ptr_array_unref(bench->chunks);
+		for (msg = 0; msg < G_N_ELEMENTS(bench->framed); msg++) {
+			g_ptr_array_unref(bench->framed[msg]);
+		}
+		buffer_delete(bench->buffer);
+		framing_receive_delete(bench->receive);
+		g_free(bench);
+	}
+}
+
+/**
+ * Parse a comma-separated list of sizes.
+ *
+ * @param list the list to parse
+ * @return array of gsize, to be freed with g_array_unref()
+ */
+static GArray * bench_sizes(char const * list) {
+	GArray * sizes;
+	gchar ** items;
+	gsize size;
+	guint pos;
+
+	sizes = g_array_new(FALSE, FALSE, sizeof(gsize));
+	items = g_strsplit(list, ",", -1);
+	for (pos = 0; items[pos] != NULL; pos++) {
+		size = (gsize)g_ascii_strtoull(items[pos], NULL, 10);
+		if (size > 0) {
+			g_array_append_val(sizes, size);
+		}
+	}
+	g_strfreev(items);
+
+	return sizes;
+}
+
+/**
+ * Reassemble a version 1 message from its chunks, as receive_chunk() does.
+ */
+static void bench_reassembly(BenchCase * bench) {
+	GBytes * chunk;
+	REASSEMBLY result;
+	gsize length;
+	guchar const * data;
+	guint pos;
+
+	result = REASSEMBLY_INVALID;
+	for (pos = 0; pos < bench->chunks->len; pos++) {
+		chunk = g_ptr_array_index(bench->chunks, pos);
+		data = g_bytes_get_data(chunk, &length);
+		result = reassembly_append(bench->buffer, &bench->remaining, data, length);
+	}
+
+	if ((result != REASSEMBLY_COMPLETE) || (buffer_get_pos(bench->buffer) != bench->messagesize)) {
+		bench->ok = FALSE;
+	}
+}
+
+/**
+ * Reassemble and check a version 2 message from its chunks, as
+ * receive_chunk_framed() does.
+ */
+static void bench_framing_receive(BenchCase * bench) {
+	GPtrArray * chunks;
+	GBytes * chunk;
+	FRAMINGRX result;
+	gsize length;
+	guchar const * data;
+	guint pos;
+
+	chunks = bench->framed[bench->framedmsg];
+	bench->framedmsg = (bench->framedmsg + 1) % G_N_ELEMENTS(bench->framed);
+
+	result = FRAMINGRX_INVALID;
+	for (pos = 0; pos < chunks->len; pos++) {
+		chunk = g_ptr_array_index(chunks, pos);
+		data = g_bytes_get_data(chunk, &length);
+		result = framing_receive_data(bench->receive, data, length);
+	}
+
+	if (result != FRAMINGRX_COMPLETE) {
+		bench->ok = FALSE;
+	}
+}
+
+/**
+ * Frame a message with version 1 framing and cut it into chunks, as
+ * frame_message() and send_next_chunk() do.
+ */
+static void bench_send_v1(BenchCase * bench) {
+	GBytes * framed;
+	GBytes * chunk;
+	gsize size;
+	gsize sent;
+	gsize payload;
+
+	framed = framing_prefix_length(g_bytes_get_data(bench->message, NULL), bench->messagesize);
+	size = g_bytes_get_size(framed);
+
+	sent = 0;
+	while (sent < size) {
+		payload = MIN(size - sent, bench->chunksize);
+		chunk = g_bytes_new_from_bytes(framed, sent, payload);
+		g_bytes_unref(chunk);
+		sent += payload;
+	}
+
+	g_bytes_unref(framed);
+}
+
+/**
+ * Frame a message with version 2 framing and cut it into chunks, as
+ * frame_message() and send_next_chunk() do.
+ */
+static void bench_send_v2(BenchCase * bench) {
+	GBytes * chunk;
+	guint32 crc;
+	gsize sent;
+	gsize payload;
+
+	crc = framing_crc32(g_bytes_get_data(bench->message, NULL), bench->messagesize);
+
+	sent = 0;
+	do {
+		chunk = framing_chunk_new(bench->message, 0, crc, sent, bench->messagesize, bench->chunksize, &payload);
+		g_bytes_unref(chunk);
+		sent += payload;
+	} while (sent < bench->messagesize);
+}
+
+/**
+ * Derive both advertising UUIDs from a commitment, as create_uuids() does.
+ */
+static void bench_uuid(BenchCase * bench) {
+	uuid_from_commitment(bench->commitment, FALSE, bench->buffer);
+	uuid_from_commitment(bench->commitment, TRUE, bench->buffer);
+}
+
+/**
+ * Time an operation, repeating it in batches of doubling size until a batch
+ * takes at least the given time, and print the result of that batch.
+ *
+ * @param label label for the build being measured
+ * @param name the name of the operation
+ * @param func the operation
+ * @param bench the inputs to the operation
+ * @param time the minimum time to measure for, in milliseconds
+ */
+static void bench_run(char const * label, char const * name, BenchFunc func, BenchCase * bench, guint time) {
+	guint64 iterations;
+	guint64 iteration;
+	guint64 start;
+	guint64 elapsed;
+	guint64 allocs;
+	guint64 allocbytes;
+
+	bench->ok = TRUE;
+
+	// Warm up, so that buffers have reached their working size
+	func(bench);
+
+	iterations = 1;
+	do {
+		allocs = bench_allocs;
+		allocbytes = bench_allocbytes;
+		start = bench_now();
+		for (iteration = 0; iteration < iterations; iteration++) {
+			func(bench);
+		}
+		elapsed = bench_now() - start;
+		allocs = bench_allocs - allocs;
+		allocbytes = bench_allocbytes - allocbytes;
+		iterations *= 2;
+	} while (elapsed < (guint64)time * 1000000ull);
+	iterations /= 2;
+
+	printf("RESULT label=%s bench=%s message=%lu chunk=%lu ok=%d iterations=%lu ns_per_op=%.1f allocs_per_op=%.2f alloc_bytes_per_op=%.1f\n", label, name, (unsigned long)bench->messagesize, (unsigned long)bench->chunksize, bench->ok ? 1 : 0, (unsigned long)iterations, (double)elapsed / iterations, (double)allocs / iterations, (double)allocbytes / iterations);
+}
+
+/**
+ * Compare the bytes laid out for a command with those expected, reporting
+ * any difference.
+ *
+ * @param name what the bytes are, for the report
+ * @param bytes the bytes laid out
+ * @param length the number of bytes laid out
+ * @param expected the bytes expected
+ * @param expectedlength the number of bytes expected
+ * @return TRUE if they're the same, FALSE o/w
+ */
+static bool check_bytes(char const * name, guchar const * bytes, guint length, guchar const * expected, guint expectedlength) {
+	guint pos;
+
+	if (length != expectedlength) {
+		fprintf(stderr, "Check %s failed: %u bytes rather than %u\n", name, length, expectedlength);
+		return FALSE;
+	}
+
+	for (pos = 0; pos < length; pos++) {
+		if (bytes[pos] != expected[pos]) {
+			fprintf(stderr, "Check %s failed: byte %u is 0x%02x rather than 0x%02x\n", name, pos, bytes[pos], expected[pos]);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Check the HCI command layouts used for extended advertising against
+ * byte sequences worked out by hand from the Core Specification. These
+ * aren't timed, since they're only built when advertising changes, but a
+ * mistake in them can't otherwise be seen without a Bluetooth 5 controller.
+ *
+ * @return TRUE if every layout is as expected, FALSE o/w
+ */
+static bool check_hci_layout() {
+	guchar const uuid[] = {0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11, 0xf0, 0xde, 0xbc, 0x9a, 0x78, 0x56, 0x34, 0x12};
+	// Handle 0xe0, connectable legacy PDUs, 20 ms and 30 ms in 0.625 ms
+	// units, all channels, public address, no peer or filter, no power
+	// preference, LE 1M, SID 0, no scan request notifications
+	guchar const parameters[] = {0xe0, 0x13, 0x00, 0x20, 0x00, 0x00, 0x30, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7f, 0x01, 0x00, 0x01, 0x00, 0x00};
+	// Handle 0xe1, non-connectable legacy PDUs, 1000 ms, SID 1
+	guchar const parameterssecondary[] = {0xe1, 0x10, 0x00, 0x40, 0x06, 0x00, 0x40, 0x06, 0x00, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7f, 0x01, 0x00, 0x01, 0x01, 0x00};
+	// Handle 0xe0, complete data, unfragmented, 21 bytes of flags and UUID
+	guchar const data[] = {0xe0, 0x03, 0x01, 0x15, 0x02, 0x01, 0x06, 0x11, 0x07, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11, 0xf0, 0xde, 0xbc, 0x9a, 0x78, 0x56, 0x34, 0x12};
+	guchar bytes[4 + HCICONTROLLER_DATA_LENGTH];
+	guchar advert[HCICONTROLLER_DATA_LENGTH];
+	guint length;
+	bool ok;
+
+	ok = TRUE;
+
+	length = (hcicontroller_uuid_bytes("12345678-9abc-def0-1122-334455667788", bytes) == TRUE) ? HCICONTROLLER_UUID_LENGTH : 0;
+	ok = check_bytes("uuid", bytes, length, uuid, sizeof(uuid)) && ok;
+	length = (hcicontroller_uuid_bytes("123456789abcdef01122334455667788", bytes) == TRUE) ? HCICONTROLLER_UUID_LENGTH : 0;
+	ok = check_bytes("uuid-unhyphenated", bytes, length, uuid, sizeof(uuid)) && ok;
+	if ((hcicontroller_uuid_bytes("12345678-9abc-def0-1122-3344556677", bytes) == TRUE) || (hcicontroller_uuid_bytes("12345678-9abc-def0-1122-33445566778899", bytes) == TRUE) || (hcicontroller_uuid_bytes("12345678-9abc-def0-1122-33445566778g", bytes) == TRUE)) {
+		fprintf(stderr, "Check uuid-invalid failed: accepted an invalid UUID\n");
+		ok = FALSE;
+	}
+
+	hcicontroller_parameters_bytes(HCICONTROLLER_SET_PRIMARY, TRUE, 20, 30, bytes);
+	ok = check_bytes("parameters", bytes, HCICONTROLLER_PARAMETERS_LENGTH, parameters, sizeof(parameters)) && ok;
+	hcicontroller_parameters_bytes(HCICONTROLLER_SET_SECONDARY, FALSE, 1000, 1000, bytes);
+	ok = check_bytes("parameters-secondary", bytes, HCICONTROLLER_PARAMETERS_LENGTH, parameterssecondary, sizeof(parameterssecondary)) && ok;
+
+	length = hcicontroller_advert_data("12345678-9abc-def0-1122-334455667788", advert);
+	length = hcicontroller_data_bytes(HCICONTROLLER_SET_PRIMARY, advert, length, bytes);
+	ok = check_bytes("data", bytes, length, data, sizeof(data)) && ok;
+
+	printf("CHECK hci-layout ok=%d\n", ok ? 1 : 0);
+
+	return ok;
+}
+
+/**
+ * Main; the entry point of the benchmark.
+ *
+ * @param argc the number of arguments passed in
+ * @param argv array of arguments passed in
+ * @return zero if every operation gave the expected result, non-zero o/w
+ */
+gint main(gint argc, gchar * argv[]) {
+	GError * error;
+	GOptionContext * context;
+	gchar * label;
+	gchar * messagesizes;
+	gchar * chunksizes;
+	gint time;
+	GArray * messages;
+	GArray * chunks;
+	BenchCase * bench;
+	gsize messagesize;
+	gsize chunksize;
+	guint message;
+	guint chunk;
+	gint result;
+
+	label = NULL;
+	messagesizes = NULL;
+	chunksizes = NULL;
+	time = DEFAULT_TIME;
+
+	GOptionEntry entries[] = {
+		{"message-sizes", 's', 0, G_OPTION_ARG_STRING, &messagesizes, "Comma-separated message sizes, default " DEFAULT_MESSAGE_SIZES, "BYTES,..."},
+		{"chunk-sizes", 'c', 0, G_OPTION_ARG_STRING, &chunksizes, "Comma-separated chunk sizes including headers, default " DEFAULT_CHUNK_SIZES, "BYTES,..."},
+		{"time", 't', 0, G_OPTION_ARG_INT, &time, "Time to measure each case for", "MS"},
+		{"label", 'l', 0, G_OPTION_ARG_STRING, &label, "Label for the build being measured", "NAME"},
+		{NULL}
+	};
+
+	error = NULL;
+	context = g_option_context_new("- data path microbenchmarks");
+	g_option_context_set_summary(context, "Times reassembly, framing and UUID derivation over a range of message and chunk\nsizes, printing one RESULT line for each with the time and allocations per\noperation.");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (g_option_context_parse(context, &argc, &argv, &error) == FALSE) {
+		fprintf(stderr, "Error parsing options: %s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	messages = bench_sizes(messagesizes ? messagesizes : DEFAULT_MESSAGE_SIZES);
+	chunks = bench_sizes(chunksizes ? chunksizes : DEFAULT_CHUNK_SIZES);
+	time = MAX(time, 1);
+	result = check_hci_layout() ? 0 : 1;
+
+	for (message = 0; message < messages->len; message++) {
+		for (chunk = 0; chunk < chunks->len; chunk++) {
+			messagesize = g_array_index(messages, gsize, message);
+			chunksize = g_array_index(chunks, gsize, chunk);
+
+			// Version 2 chunks must have room for the first header and some data
+			if (chunksize <= FRAMING_HEADER_FIRST) {
+				fprintf(stderr, "Skipping chunk size %lu, which must be more than %d\n", (unsigned long)chunksize, FRAMING_HEADER_FIRST);
+				continue;
+			}
+
+			bench = bench_case_new(messagesize, chunksize);
+
+			bench_run(label ? label : "unlabelled", "reassembly", bench_reassembly, bench, time);
+			result |= bench->ok ? 0 : 1;
+			bench_run(label ? label : "unlabelled", "framing-receive", bench_framing_receive, bench, time);
+			result |= bench->ok ? 0 : 1;
+			bench_run(label ? label : "unlabelled", "send-v1", bench_send_v1, bench, time);
+			bench_run(label ? label : "unlabelled", "send-v2", bench_send_v2, bench, time);
+
+			bench_case_delete(bench);
+		}
+	}
+
+	// UUID derivation doesn't depend on the sizes
+	bench = bench_case_new(UUID_COMMITMENT_LENGTH, FRAMING_HEADER_FIRST + 1);
+	bench->messagesize = 0;
+	bench->chunksize = 0;
+	bench_run(label ? label : "unlabelled", "uuid", bench_uuid, bench, time);
+	bench_case_delete(bench);
+
+	g_array_unref(messages);
+	g_array_unref(chunks);
+	g_free(messagesizes);
+	g_free(chunksizes);
+	g_free(label);
+
+	return result;
+}
+
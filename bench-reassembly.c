@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "pico/buffer.h"
+
+#include "reassembly.h"
+
+// Defines
+
+// Must match the receive buffer size used by dbus-test.c before the bulk path
+#define CHARACTERISTIC_LENGTH (208)
+
+#define DEFAULT_MESSAGE_SIZE (4096)
+#define DEFAULT_CHUNK_SIZE (128)
+#define DEFAULT_ITERATIONS (2000)
+
+// Function prototypes
+
+static guint64 bench_cycles();
+static GPtrArray * bench_chunks(size_t messagesize, size_t chunksize);
+static REASSEMBLY reassemble_bytewise(Buffer * buffer, size_t * remaining, GVariant * value);
+static REASSEMBLY reassemble_bulk(Buffer * buffer, size_t * remaining, GVariant * value);
+
+typedef REASSEMBLY (*ReassembleFunc)(Buffer * buffer, size_t * remaining, GVariant * value);
+
+static void bench_run(char const * name, ReassembleFunc reassemble, GPtrArray * chunks, size_t messagesize, unsigned int iterations);
+
+/**
+ * Read a cycle counter, or nanoseconds where no cycle counter is available.
+ *
+ * @return the current cycle count
+ */
+static guint64 bench_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((guint64)now.tv_sec * 1000000000ull) + now.tv_nsec;
+#endif
+}
+
+/**
+ * Split a framed message into the chunks a central would write, using the
+ * same header format as the phone: a chunk counter byte on every chunk and a
+ * four-byte big-endian length after the counter on the first.
+ *
+ * @param messagesize the size of the message payload
+ * @param chunksize the maximum size of each chunk, including the header
+ * @return array of "ay" GVariant chunks
+ */
+static GPtrArray * bench_chunks(size_t messagesize, size_t chunksize) {
+	GPtrArray * chunks;
+	guchar * chunk;
+	size_t sent;
+	size_t header;
+	size_t payload;
+	guchar counter;
+
+	chunks = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+	chunk = g_malloc(chunksize);
+	sent = 0;
+	counter = 0;
+
+	while (sent < messagesize) {
+		chunk[0] = counter;
+		header = 1;
+		if (sent == 0) {
+			chunk[1] = (messagesize >> 24) & 0xff;
+			chunk[2] = (messagesize >> 16) & 0xff;
+			chunk[3] = (messagesize >> 8) & 0xff;
+			chunk[4] = (messagesize >> 0) & 0xff;
+			header = 5;
+		}
+
+		payload = MIN(chunksize - header, messagesize - sent);
+		memset(chunk + header, 'A' + (counter % 26), payload);
+
+		g_ptr_array_add(chunks, g_variant_ref_sink(g_variant_new_from_data(G_VARIANT_TYPE("ay"), chunk, header + payload, TRUE, NULL, NULL)));
+
+		sent += payload;
+		counter++;
+	}
+
+	g_free(chunk);
+
+	return chunks;
+}
+
+/**
+ * The receive path as it was: iterate over the bytes one at a time into a
+ * fixed staging array, then copy them again into the reassembly buffer.
+ */
+static REASSEMBLY reassemble_bytewise(Buffer * buffer, size_t * remaining, GVariant * value) {
+	unsigned char characteristic[CHARACTERISTIC_LENGTH];
+	GVariantIter * iter;
+	guchar data;
+	int length;
+
+	g_variant_get(value, "ay", &iter);
+
+	length = 0;
+	while ((g_variant_iter_loop(iter, "y", &data) && (length < (CHARACTERISTIC_LENGTH - 1)))) {
+		characteristic[length] = data;
+		length++;
+	}
+	g_variant_iter_free(iter);
+
+	characteristic[length] = 0;
+
+	if ((*remaining == 0) && (length > 5)) {
+		buffer_clear(buffer);
+
+		*remaining = 0;
+		*remaining |= ((unsigned char)characteristic[1]) << 24;
+		*remaining |= ((unsigned char)characteristic[2]) << 16;
+		*remaining |= ((unsigned char)characteristic[3]) << 8;
+		*remaining |= ((unsigned char)characteristic[4]) << 0;
+
+		buffer_append(buffer, characteristic + 5, length - 5);
+		*remaining -= length - 5;
+	}
+	else {
+		buffer_append(buffer, characteristic + 1, length - 1);
+		*remaining -= length - 1;
+	}
+
+	return (*remaining == 0) ? REASSEMBLY_COMPLETE : REASSEMBLY_PARTIAL;
+}
+
+/**
+ * The receive path as used by dbus-test.c.
+ */
+static REASSEMBLY reassemble_bulk(Buffer * buffer, size_t * remaining, GVariant * value) {
+	guchar const * data;
+	gsize length;
+
+	data = g_variant_get_fixed_array(value, &length, sizeof(guchar));
+
+	return reassembly_append(buffer, remaining, data, length);
+}
+
+/**
+ * Time reassembly of a message using the given receive function.
+ *
+ * @param name the name to report the result against
+ * @param reassemble the receive function to measure
+ * @param chunks the chunks making up the message
+ * @param messagesize the size of the message payload
+ * @param iterations the number of times to reassemble the message
+ */
+static void bench_run(char const * name, ReassembleFunc reassemble, GPtrArray * chunks, size_t messagesize, unsigned int iterations) {
+	Buffer * buffer;
+	size_t remaining;
+	unsigned int iteration;
+	unsigned int chunk;
+	guint64 start;
+	guint64 cycles;
+	REASSEMBLY result;
+
+	buffer = buffer_new(0);
+	remaining = 0;
+	result = REASSEMBLY_INVALID;
+
+	start = bench_cycles();
+	for (iteration = 0; iteration < iterations; iteration++) {
+		for (chunk = 0; chunk < chunks->len; chunk++) {
+			result = reassemble(buffer, &remaining, g_ptr_array_index(chunks, chunk));
+		}
+	}
+	cycles = bench_cycles() - start;
+
+	if ((result != REASSEMBLY_COMPLETE) || (buffer_get_pos(buffer) != messagesize)) {
+		printf("%s: reassembly failed\n", name);
+	}
+
+	printf("%-10s %10.1f cycles/KB\n", name, ((double)cycles * 1024.0) / ((double)messagesize * iterations));
+
+	buffer_delete(buffer);
+}
+
+/**
+ * Main; the entry point of the benchmark.
+ *
+ * Usage: bench-reassembly [message-size [chunk-size [iterations]]]
+ *
+ * @param argc the number of arguments passed in
+ * @param argv array of arguments passed in
+ * @return value returned on exit
+ */
+gint main(gint argc, gchar * argv[]) {
+	size_t messagesize;
+	size_t chunksize;
+	unsigned int iterations;
+	GPtrArray * chunks;
+
+	messagesize = (argc > 1) ? strtoul(argv[1], NULL, 10) : DEFAULT_MESSAGE_SIZE;
+	chunksize = (argc > 2) ? strtoul(argv[2], NULL, 10) : DEFAULT_CHUNK_SIZE;
+	iterations = (argc > 3) ? strtoul(argv[3], NULL, 10) : DEFAULT_ITERATIONS;
+
+	if ((messagesize < 1) || (chunksize < 6) || (chunksize >= CHARACTERISTIC_LENGTH) || (iterations < 1)) {
+		printf("Chunk size must be between 6 and %d bytes\n", CHARACTERISTIC_LENGTH - 1);
+		return 1;
+	}
+
+	printf("Message size %lu, chunk size %lu, %u iterations\n", messagesize, chunksize, iterations);
+
+	chunks = bench_chunks(messagesize, chunksize);
+
+	bench_run("bytewise", reassemble_bytewise, chunks, messagesize, iterations);
+	bench_run("bulk", reassemble_bulk, chunks, messagesize, iterations);
+
+	g_ptr_array_unref(chunks);
+
+	return 0;
+}
+
@@ -1,5 +1,14 @@
 gdbus-codegen --interface-prefix org.bluez --generate-c-code gdbus-generated --c-generate-object-manager interface.xml
 
-gcc -Wall -Werror -I. dbus-test.c gdbus-generated.c `pkg-config --cflags --libs glib-2.0 dbus-glib-1 gio-unix-2.0 libpico-1 gtk+-3.0 bluez` -o dbus-test
+gcc -Wall -Werror -DSERVICEBLE_GUI -I. dbus-test.c gdbus-generated.c reassembly.c framing.c uuid.c compress.c hcicontroller.c asynclog.c worker.c config.c control.c trace.c `pkg-config --cflags --libs glib-2.0 dbus-glib-1 gio-unix-2.0 libpico-1 gtk+-3.0 bluez zlib` -o dbus-test
 
+gcc -Wall -Werror -I. dbus-test.c gdbus-generated.c reassembly.c framing.c uuid.c compress.c hcicontroller.c asynclog.c worker.c config.c control.c trace.c `pkg-config --cflags --libs glib-2.0 dbus-glib-1 gio-unix-2.0 libpico-1 bluez zlib` -o dbus-test-headless
+
+gcc -Wall -Werror -O2 -I. bench-reassembly.c reassembly.c asynclog.c `pkg-config --cflags --libs glib-2.0 libpico-1` -o bench-reassembly
+
+gcc -Wall -Werror -O2 -I. bench-micro.c reassembly.c framing.c uuid.c hcicontroller.c asynclog.c `pkg-config --cflags --libs glib-2.0 libpico-1 bluez` -o bench-micro
+
+gcc -Wall -Werror -DSERVICEBLE_ECHO -I. dbus-test.c gdbus-generated.c reassembly.c framing.c uuid.c compress.c hcicontroller.c asynclog.c worker.c config.c control.c trace.c `pkg-config --cflags --libs glib-2.0 dbus-glib-1 gio-unix-2.0 libpico-1 bluez zlib` -o dbus-test-echo
+
+gcc -Wall -Werror -O2 -I. mock-bluez.c gdbus-generated.c framing.c compress.c asynclog.c `pkg-config --cflags --libs glib-2.0 gio-unix-2.0 zlib` -o bench-throughput
 
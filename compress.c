@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <zlib.h>
+
+#include "compress.h"
+#include "asynclog.h"
+
+// Defines
+
+// Messages are small, so a 4 KiB window and reduced memory level keep each
+// session's compressor to a few tens of kilobytes
+#define COMPRESS_WINDOW_BITS (12)
+#define COMPRESS_MEM_LEVEL (5)
+
+// Structure definitions
+
+/**
+ * Raw deflate streams, one in each direction, reset for each message so that
+ * every message can be decoded on its own. Both ends start each message from
+ * the same preset dictionary.
+ */
+struct _Compress {
+	z_stream deflater;
+	z_stream inflater;
+	bool deflateready;
+	bool inflateready;
+	gsize bytesin;
+	gsize bytesout;
+};
+
+// Static variables
+
+// Text that Pico messages are likely to share: the field names used by
+// libpico's JSON messages, and the base64 of the DER header of a P-256
+// public key. The most common strings come last, where deflate finds them
+// with the shortest distances
+static char const compress_dictionary[] =
+	"\"picoVersion\":2,\"returnedData\":\"\",\"extraData\":\"\","
+	"\"serviceEphemPublicKey\":\"MFkwEwYHKoZIzj0CAQYIKoZIzj0DAQcDQgAE"
+	"\",\"serviceNonce\":\"\",\"picoEphemeralPublicKey\":\"MFkwEwYHKoZIzj0CAQYIKoZIzj0DAQcDQgAE"
+	"\",\"picoNonce\":\"\",{\"sessionId\":0,\"iv\":\"\",\"encryptedData\":\"";
+
+// Function definitions
+
+/**
+ * Create the compression state for a single central.
+ *
+ * @return the new compression state
+ */
+Compress * compress_new() {
+	Compress * compress;
+
+	compress = g_new0(Compress, 1);
+
+	compress->deflateready = (deflateInit2(&compress->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -COMPRESS_WINDOW_BITS, COMPRESS_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK);
+	compress->inflateready = (inflateInit2(&compress->inflater, -COMPRESS_WINDOW_BITS) == Z_OK);
+	if ((compress->deflateready == FALSE) || (compress->inflateready == FALSE)) {
+		ASYNCLOG(LOG_ERR, "Error initialising compression\n");
+	}
+
+	compress->bytesin = 0;
+	compress->bytesout = 0;
+
+	return compress;
+}
+
+void compress_delete(Compress * compress) {
+	if (compress != NULL) {
+		if (compress->deflateready == TRUE) {
+			deflateEnd(&compress->deflater);
+		}
+		if (compress->inflateready == TRUE) {
+			inflateEnd(&compress->inflater);
+		}
+		g_free(compress);
+	}
+}
+
+/**
+ * Encode a message for sending. Messages below COMPRESS_THRESHOLD, or that
+ * don't get any smaller, are sent as they are. Either way the result starts
+ * with a byte giving the method used.
+ *
+ * @param compress the compression state
+ * @param data the message to encode
+ * @param length the number of bytes in the message
+ * @return the encoded message, to be freed with g_bytes_unref()
+ */
+GBytes * compress_encode(Compress * compress, guchar const * data, gsize length) {
+	guchar * encoded;
+	gsize size;
+	int result;
+
+	encoded = g_malloc(length + 1);
+	size = 0;
+
+	if ((length >= COMPRESS_THRESHOLD) && (compress->deflateready == TRUE)) {
+		deflateReset(&compress->deflater);
+		deflateSetDictionary(&compress->deflater, (Bytef const *)compress_dictionary, sizeof(compress_dictionary) - 1);
+
+		// Only worth it if the result, with its method byte, is smaller
+		compress->deflater.next_in = (Bytef *)data;
+		compress->deflater.avail_in = length;
+		compress->deflater.next_out = encoded + 1;
+		compress->deflater.avail_out = length - 1;
+
+		result = deflate(&compress->deflater, Z_FINISH);
+		if (result == Z_STREAM_END) {
+			encoded[0] = COMPRESS_METHOD_DEFLATE;
+			size = compress->deflater.total_out + 1;
+		}
+	}
+
+	if (size == 0) {
+		encoded[0] = COMPRESS_METHOD_NONE;
+		memcpy(encoded + 1, data, length);
+		size = length + 1;
+	}
+
+	compress->bytesin += length;
+	compress->bytesout += size;
+
+	return g_bytes_new_take(encoded, size);
+}
+
+/**
+ * Decode a received message.
+ *
+ * @param compress the compression state
+ * @param data the message as received, starting with its method byte
+ * @param length the number of bytes received
+ * @return the decoded message, to be freed with g_bytes_unref(), or NULL if
+ *         it couldn't be decoded
+ */
+GBytes * compress_decode(Compress * compress, guchar const * data, gsize length) {
+	GByteArray * decoded;
+	gsize used;
+	int result;
+
+	if (length < 1) {
+		ASYNCLOG(LOG_ERR, "Error, empty compressed message\n");
+		return NULL;
+	}
+
+	switch (data[0]) {
+		case COMPRESS_METHOD_NONE:
+			return g_bytes_new(data + 1, length - 1);
+		case COMPRESS_METHOD_DEFLATE:
+			if (compress->inflateready == FALSE) {
+				return NULL;
+			}
+			break;
+		default:
+			ASYNCLOG(LOG_ERR, "Error, unknown compression method %u\n", data[0]);
+			return NULL;
+	}
+
+	inflateReset(&compress->inflater);
+	inflateSetDictionary(&compress->inflater, (Bytef const *)compress_dictionary, sizeof(compress_dictionary) - 1);
+
+	decoded = g_byte_array_sized_new(length * 4);
+	compress->inflater.next_in = (Bytef *)(data + 1);
+	compress->inflater.avail_in = length - 1;
+	used = 0;
+
+	do {
+		if (used + 1024 > decoded->len) {
+			g_byte_array_set_size(decoded, MAX(decoded->len * 2, used + 1024));
+		}
+		compress->inflater.next_out = decoded->data + used;
+		compress->inflater.avail_out = decoded->len - used;
+
+		result = inflate(&compress->inflater, Z_NO_FLUSH);
+		used = decoded->len - compress->inflater.avail_out;
+	} while ((result == Z_OK) && (used <= COMPRESS_MAX_LENGTH));
+
+	if (result != Z_STREAM_END) {
+		ASYNCLOG(LOG_ERR, "Error decompressing message: %d\n", result);
+		g_byte_array_unref(decoded);
+		return NULL;
+	}
+
+	g_byte_array_set_size(decoded, used);
+
+	return g_byte_array_free_to_bytes(decoded);
+}
+
+/**
+ * Get the total size of the messages passed to compress_encode().
+ *
+ * @param compress the compression state
+ * @return the number of bytes before encoding
+ */
+gsize compress_get_bytes_in(Compress * compress) {
+	return compress->bytesin;
+}
+
+/**
+ * Get the total size of the messages returned by compress_encode().
+ *
+ * @param compress the compression state
+ * @return the number of bytes after encoding
+ */
+gsize compress_get_bytes_out(Compress * compress) {
+	return compress->bytesout;
+}
+
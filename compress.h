@@ -0,0 +1,35 @@
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+#include <glib.h>
+
+// Defines
+
+// Messages shorter than this are sent as they are; there's too little to
+// gain from compressing them
+#define COMPRESS_THRESHOLD (64)
+// Decompressed messages longer than this are rejected
+#define COMPRESS_MAX_LENGTH (1 << 24)
+
+// The first byte of each message says how the rest is encoded
+#define COMPRESS_METHOD_NONE (0x00)
+#define COMPRESS_METHOD_DEFLATE (0x01)
+
+// Structure definitions
+
+typedef struct _Compress Compress;
+
+// Function prototypes
+
+Compress * compress_new();
+void compress_delete(Compress * compress);
+
+GBytes * compress_encode(Compress * compress, guchar const * data, gsize length);
+GBytes * compress_decode(Compress * compress, guchar const * data, gsize length);
+gsize compress_get_bytes_in(Compress * compress);
+gsize compress_get_bytes_out(Compress * compress);
+
+// Function definitions
+
+#endif
+
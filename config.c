@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "config.h"
+#include "asynclog.h"
+
+// Defines
+
+// Limits from the ATT protocol; see Vol 3, Part F of the Core Bluetooth
+// Specification version 5. Chunks can't be smaller than a notification at
+// the default MTU of 23 bytes
+#define CONFIG_MAX_VALUE_LENGTH (512)
+#define CONFIG_MIN_SEND_SIZE (20)
+
+// Structure definitions
+
+// Function prototypes
+
+static bool config_load_integer(GKeyFile * keyfile, char const * key, gint * value, GError ** error);
+static void config_load_string(GKeyFile * keyfile, char const * key, gchar ** value);
+static void config_override(Config * config, Config const * overrides);
+
+// Function definitions
+
+/**
+ * Create a configuration holding the default settings.
+ *
+ * @return the new configuration
+ */
+Config * config_new() {
+	Config * config;
+
+	config = g_new0(Config, 1);
+
+	config->characteristiclength = CONFIG_DEFAULT_CHARACTERISTIC_LENGTH;
+	config->maxsendsize = CONFIG_DEFAULT_MAX_SEND_SIZE;
+	config->sendwindow = CONFIG_DEFAULT_SEND_WINDOW;
+	config->cycleinterval = CONFIG_DEFAULT_CYCLE_INTERVAL;
+	config->cyclebackoffmax = CONFIG_DEFAULT_CYCLE_BACKOFF_MAX;
+	config->cyclejitter = CONFIG_DEFAULT_CYCLE_JITTER;
+	config->maxsessions = CONFIG_DEFAULT_MAX_SESSIONS;
+	config->advertisingprofile = g_strdup(CONFIG_DEFAULT_ADVERTISING_PROFILE);
+	config->advertisingmode = g_strdup(CONFIG_DEFAULT_ADVERTISING_MODE);
+	config->advertisingname = g_strdup(CONFIG_DEFAULT_ADVERTISING_NAME);
+	config->secondaryinterval = CONFIG_DEFAULT_SECONDARY_INTERVAL;
+	config->bufferkeep = CONFIG_DEFAULT_BUFFER_KEEP;
+	config->tracefile = g_strdup(CONFIG_DEFAULT_TRACE_FILE);
+
+	return config;
+}
+
+void config_delete(Config * config) {
+	if (config != NULL) {
+		g_free(config->advertisingprofile);
+		g_free(config->advertisingmode);
+		g_free(config->advertisingname);
+		g_free(config->tracefile);
+		g_free(config);
+	}
+}
+
+/**
+ * Set up the configuration from the command line, and from the key file it
+ * names (or CONFIG_FILE_DEFAULT if it's there). Settings on the command line
+ * take precedence over those in the file. Recognised options are removed from
+ * argv.
+ *
+ * @param config the configuration to set up
+ * @param argc pointer to the number of arguments
+ * @param argv pointer to the array of arguments
+ * @param error return location for an error, or NULL
+ * @return true if the options and key file were read and the result is
+ *         valid, false o/w
+ */
+bool config_parse(Config * config, gint * argc, gchar *** argv, GError ** error) {
+	GOptionContext * context;
+	Config overrides;
+	gchar * filename;
+	GError * loaderror;
+	bool result;
+
+	// Anything left at G_MININT or NULL wasn't given
+	overrides.characteristiclength = G_MININT;
+	overrides.maxsendsize = G_MININT;
+	overrides.sendwindow = G_MININT;
+	overrides.cycleinterval = G_MININT;
+	overrides.cyclebackoffmax = G_MININT;
+	overrides.cyclejitter = G_MININT;
+	overrides.maxsessions = G_MININT;
+	overrides.advertisingprofile = NULL;
+	overrides.advertisingmode = NULL;
+	overrides.advertisingname = NULL;
+	overrides.secondaryinterval = G_MININT;
+	overrides.bufferkeep = G_MININT;
+	overrides.tracefile = NULL;
+	filename = NULL;
+
+	GOptionEntry entries[] = {
+		{"config", 'f', 0, G_OPTION_ARG_FILENAME, &filename, "Key file to read settings from, in place of " CONFIG_FILE_DEFAULT, "FILE"},
+		{"characteristic-length", 0, 0, G_OPTION_ARG_INT, &overrides.characteristiclength, "Bytes returned by each read until the MTU is known", "BYTES"},
+		{"max-send-size", 0, 0, G_OPTION_ARG_INT, &overrides.maxsendsize, "Size of each notification until the MTU is known", "BYTES"},
+		{"send-window", 0, 0, G_OPTION_ARG_INT, &overrides.sendwindow, "Number of chunks that can await a flush to the bus", "N"},
+		{"cycle-interval", 0, 0, G_OPTION_ARG_INT, &overrides.cycleinterval, "Time between checks on whether advertising needs restarting", "MS"},
+		{"cycle-backoff-max", 0, 0, G_OPTION_ARG_INT, &overrides.cyclebackoffmax, "Longest time between restarts while bluetoothd reports errors", "MS"},
+		{"cycle-jitter", 0, 0, G_OPTION_ARG_INT, &overrides.cyclejitter, "Random spread of the cycle timings", "PERCENT"},
+		{"max-sessions", 0, 0, G_OPTION_ARG_INT, &overrides.maxsessions, "Number of centrals to keep session state for", "N"},
+		{"advertising-profile", 0, 0, G_OPTION_ARG_STRING, &overrides.advertisingprofile, "Advertising intervals over time, such as " CONFIG_DEFAULT_ADVERTISING_PROFILE, "PROFILE"},
+		{"advertising-mode", 0, 0, G_OPTION_ARG_STRING, &overrides.advertisingmode, "Advertise through bluetoothd (legacy) or our own advertising sets (extended)", "MODE"},
+		{"secondary-interval", 0, 0, G_OPTION_ARG_INT, &overrides.secondaryinterval, "Interval of the extended advertising set for the other commitment, or 0 for none", "MS"},
+		{"advertising-name", 0, 0, G_OPTION_ARG_STRING, &overrides.advertisingname, "Name sent in the scan response, or empty for none", "NAME"},
+		{"buffer-keep", 0, 0, G_OPTION_ARG_INT, &overrides.bufferkeep, "Bytes of buffers each session keeps between messages", "BYTES"},
+		{"trace-file", 0, 0, G_OPTION_ARG_FILENAME, &overrides.tracefile, "Trace latency, writing the trace here on SIGUSR1 or DumpTrace", "FILE"},
+		{NULL}
+	};
+
+	context = g_option_context_new("- Pico Bluetooth LE service");
+	g_option_context_set_summary(context, "Settings are read from the key file group [" CONFIG_GROUP "] using the long\noption names as keys; options given here take precedence.");
+	g_option_context_add_main_entries(context, entries, NULL);
+	result = g_option_context_parse(context, argc, argv, error);
+	g_option_context_free(context);
+
+	if (result == TRUE) {
+		loaderror = NULL;
+		result = config_load(config, filename ? filename : CONFIG_FILE_DEFAULT, &loaderror);
+		// The default file is optional
+		if ((result == FALSE) && (filename == NULL) && g_error_matches(loaderror, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+			g_error_free(loaderror);
+			result = TRUE;
+		}
+		else if (result == FALSE) {
+			g_propagate_error(error, loaderror);
+		}
+	}
+
+	if (result == TRUE) {
+		config_override(config, &overrides);
+		result = config_validate(config, error);
+	}
+
+	g_free(overrides.advertisingprofile);
+	g_free(overrides.advertisingmode);
+	g_free(overrides.advertisingname);
+	g_free(overrides.tracefile);
+	g_free(filename);
+
+	return result;
+}
+
+/**
+ * Read settings from a key file. Settings missing from the file are left as
+ * they are.
+ *
+ * @param config the configuration to update
+ * @param filename the key file to read
+ * @param error return location for an error, or NULL
+ * @return true if the file was read, false o/w
+ */
+bool config_load(Config * config, char const * filename, GError ** error) {
+	GKeyFile * keyfile;
+	bool result;
+
+	keyfile = g_key_file_new();
+
+	result = g_key_file_load_from_file(keyfile, filename, G_KEY_FILE_NONE, error);
+	if (result == TRUE) {
+		ASYNCLOG(LOG_INFO, "Reading settings from %s\n", filename);
+
+		result = config_load_integer(keyfile, "characteristic-length", &config->characteristiclength, error)
+			&& config_load_integer(keyfile, "max-send-size", &config->maxsendsize, error)
+			&& config_load_integer(keyfile, "send-window", &config->sendwindow, error)
+			&& config_load_integer(keyfile, "cycle-interval", &config->cycleinterval, error)
+			&& config_load_integer(keyfile, "cycle-backoff-max", &config->cyclebackoffmax, error)
+			&& config_load_integer(keyfile, "cycle-jitter", &config->cyclejitter, error)
+			&& config_load_integer(keyfile, "max-sessions", &config->maxsessions, error)
+			&& config_load_integer(keyfile, "secondary-interval", &config->secondaryinterval, error)
+			&& config_load_integer(keyfile, "buffer-keep", &config->bufferkeep, error);
+	}
+
+	if (result == TRUE) {
+		config_load_string(keyfile, "advertising-profile", &config->advertisingprofile);
+		config_load_string(keyfile, "advertising-mode", &config->advertisingmode);
+		config_load_string(keyfile, "advertising-name", &config->advertisingname);
+		config_load_string(keyfile, "trace-file", &config->tracefile);
+	}
+
+	g_key_file_free(keyfile);
+
+	return result;
+}
+
+/**
+ * Check that the settings make sense together.
+ *
+ * @param config the configuration to check
+ * @param error return location for an error, or NULL
+ * @return true if the settings can be used, false o/w
+ */
+bool config_validate(Config * config, GError ** error) {
+	char const * problem;
+
+	problem = NULL;
+
+	if ((config->characteristiclength < 1) || (config->characteristiclength > CONFIG_MAX_VALUE_LENGTH)) {
+		problem = "characteristic-length must be between 1 and 512";
+	}
+	else if ((config->maxsendsize < CONFIG_MIN_SEND_SIZE) || (config->maxsendsize > config->characteristiclength)) {
+		problem = "max-send-size must be at least 20 and no larger than characteristic-length";
+	}
+	else if (config->sendwindow < 1) {
+		problem = "send-window must be at least 1";
+	}
+	else if (config->cycleinterval < 1) {
+		problem = "cycle-interval must be at least 1";
+	}
+	else if (config->cyclebackoffmax < config->cycleinterval) {
+		problem = "cycle-backoff-max must be at least cycle-interval";
+	}
+	else if ((config->cyclejitter < 0) || (config->cyclejitter > 50)) {
+		problem = "cycle-jitter must be between 0 and 50";
+	}
+	else if (config->maxsessions < 1) {
+		problem = "max-sessions must be at least 1";
+	}
+	else if ((g_strcmp0(config->advertisingmode, "legacy") != 0) && (g_strcmp0(config->advertisingmode, "extended") != 0)) {
+		problem = "advertising-mode must be legacy or extended";
+	}
+	else if (config->secondaryinterval < 0) {
+		problem = "secondary-interval can't be negative";
+	}
+	else if (config->bufferkeep < 0) {
+		problem = "buffer-keep can't be negative";
+	}
+
+	if (problem != NULL) {
+		g_set_error_literal(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, problem);
+	}
+
+	return (problem == NULL);
+}
+
+/**
+ * Log the settings in use.
+ *
+ * @param config the configuration to log
+ */
+void config_log(Config const * config) {
+	ASYNCLOG(LOG_INFO, "Settings: characteristic-length %d, max-send-size %d, send-window %d, cycle-interval %d, cycle-backoff-max %d, cycle-jitter %d, max-sessions %d, advertising-profile %s, advertising-mode %s, secondary-interval %d, advertising-name %s, buffer-keep %d, trace-file %s\n", config->characteristiclength, config->maxsendsize, config->sendwindow, config->cycleinterval, config->cyclebackoffmax, config->cyclejitter, config->maxsessions, config->advertisingprofile, config->advertisingmode, config->secondaryinterval, config->advertisingname, config->bufferkeep, config->tracefile);
+}
+
+/**
+ * Read a single integer setting. A missing key isn't an error, but a value
+ * that isn't an integer is.
+ */
+static bool config_load_integer(GKeyFile * keyfile, char const * key, gint * value, GError ** error) {
+	GError * localerror;
+	gint read;
+	bool result;
+
+	localerror = NULL;
+	read = g_key_file_get_integer(keyfile, CONFIG_GROUP, key, &localerror);
+	result = TRUE;
+
+	if (localerror == NULL) {
+		*value = read;
+	}
+	else if (g_error_matches(localerror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) || g_error_matches(localerror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		g_error_free(localerror);
+	}
+	else {
+		g_propagate_error(error, localerror);
+		result = FALSE;
+	}
+
+	return result;
+}
+
+/**
+ * Read a single string setting, leaving the value as it is if the key is
+ * missing.
+ */
+static void config_load_string(GKeyFile * keyfile, char const * key, gchar ** value) {
+	gchar * read;
+
+	read = g_key_file_get_string(keyfile, CONFIG_GROUP, key, NULL);
+	if (read != NULL) {
+		g_free(*value);
+		*value = read;
+	}
+}
+
+/**
+ * Replace settings with those given on the command line.
+ */
+static void config_override(Config * config, Config const * overrides) {
+	if (overrides->characteristiclength != G_MININT) {
+		config->characteristiclength = overrides->characteristiclength;
+	}
+	if (overrides->maxsendsize != G_MININT) {
+		config->maxsendsize = overrides->maxsendsize;
+	}
+	if (overrides->sendwindow != G_MININT) {
+		config->sendwindow = overrides->sendwindow;
+	}
+	if (overrides->cycleinterval != G_MININT) {
+		config->cycleinterval = overrides->cycleinterval;
+	}
+	if (overrides->cyclebackoffmax != G_MININT) {
+		config->cyclebackoffmax = overrides->cyclebackoffmax;
+	}
+	if (overrides->cyclejitter != G_MININT) {
+		config->cyclejitter = overrides->cyclejitter;
+	}
+	if (overrides->maxsessions != G_MININT) {
+		config->maxsessions = overrides->maxsessions;
+	}
+	if (overrides->advertisingprofile != NULL) {
+		g_free(config->advertisingprofile);
+		config->advertisingprofile = g_strdup(overrides->advertisingprofile);
+	}
+	if (overrides->advertisingmode != NULL) {
+		g_free(config->advertisingmode);
+		config->advertisingmode = g_strdup(overrides->advertisingmode);
+	}
+	if (overrides->advertisingname != NULL) {
+		g_free(config->advertisingname);
+		config->advertisingname = g_strdup(overrides->advertisingname);
+	}
+	if (overrides->secondaryinterval != G_MININT) {
+		config->secondaryinterval = overrides->secondaryinterval;
+	}
+	if (overrides->bufferkeep != G_MININT) {
+		config->bufferkeep = overrides->bufferkeep;
+	}
+	if (overrides->tracefile != NULL) {
+		g_free(config->tracefile);
+		config->tracefile = g_strdup(overrides->tracefile);
+	}
+}
+
@@ -0,0 +1,83 @@
+#ifndef __CONFIG_H
+#define __CONFIG_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Defines
+
+// Read from the working directory if it's there, unless --config says otherwise
+#define CONFIG_FILE_DEFAULT "service.conf"
+// All of the settings live in a single key file group
+#define CONFIG_GROUP "Service"
+
+// The values used when neither the key file nor the command line set them
+#define CONFIG_DEFAULT_CHARACTERISTIC_LENGTH (208)
+#define CONFIG_DEFAULT_MAX_SEND_SIZE (128)
+#define CONFIG_DEFAULT_SEND_WINDOW (4)
+#define CONFIG_DEFAULT_CYCLE_INTERVAL (10000)
+#define CONFIG_DEFAULT_CYCLE_BACKOFF_MAX (120000)
+#define CONFIG_DEFAULT_CYCLE_JITTER (10)
+#define CONFIG_DEFAULT_MAX_SESSIONS (8)
+// Advertise every 20-30 ms for the first 30 seconds, then every 100-109 ms
+#define CONFIG_DEFAULT_ADVERTISING_PROFILE "20-30:30,100-109:0"
+// The name sent in the scan response
+#define CONFIG_DEFAULT_ADVERTISING_NAME "Pico"
+// Use bluetoothd's advert unless extended advertising sets are asked for
+#define CONFIG_DEFAULT_ADVERTISING_MODE "legacy"
+// With extended advertising, advertise the other commitment every second
+#define CONFIG_DEFAULT_SECONDARY_INTERVAL (1000)
+// Each session holds on to this many bytes of buffers between messages
+#define CONFIG_DEFAULT_BUFFER_KEEP (16384)
+// Tracing is off unless a file to dump the trace to is given
+#define CONFIG_DEFAULT_TRACE_FILE ""
+
+// Structure definitions
+
+/**
+ * The performance-related settings of the service. Each is taken from the
+ * command line if given there, then from the key file, and otherwise from
+ * its CONFIG_DEFAULT_ value.
+ *
+ * characteristiclength and maxsendsize are the read and notify sizes used
+ * until the MTU is known, cycleinterval is the time in milliseconds between
+ * checks on whether advertising needs restarting, cyclebackoffmax caps the
+ * delay between restarts while bluetoothd keeps failing, cyclejitter is the
+ * percentage by which each delay is randomly spread. advertisingmode is
+ * "legacy" or "extended", secondaryinterval is the interval in milliseconds
+ * of the extended advertising set for the other commitment, or zero to leave
+ * it out, and an empty advertisingname leaves the name out of the scan
+ * response.
+ * bufferkeep is the number of bytes of buffers each session holds on to
+ * between messages; anything more is given back once a message is done.
+ * If tracefile is set, latency tracing is on and the trace is written there
+ * when asked for.
+ */
+typedef struct _Config {
+	gint characteristiclength;
+	gint maxsendsize;
+	gint sendwindow;
+	gint cycleinterval;
+	gint cyclebackoffmax;
+	gint cyclejitter;
+	gint maxsessions;
+	gchar * advertisingprofile;
+	gchar * advertisingmode;
+	gchar * advertisingname;
+	gint secondaryinterval;
+	gint bufferkeep;
+	gchar * tracefile;
+} Config;
+
+// Function prototypes
+
+Config * config_new();
+void config_delete(Config * config);
+
+bool config_parse(Config * config, gint * argc, gchar *** argv, GError ** error);
+bool config_load(Config * config, char const * filename, GError ** error);
+bool config_validate(Config * config, GError ** error);
+void config_log(Config const * config);
+
+#endif
+
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <signal.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+
+#include "control.h"
+#include "asynclog.h"
+
+// Defines
+
+// Structure definitions
+
+/**
+ * Remote control of the service, taking the place of the keyboard when
+ * there's no display: methods on a small D-Bus interface, and the usual
+ * signals for a daemon.
+ */
+struct _Control {
+	ControlFunc func;
+	gpointer user_data;
+	GDBusNodeInfo * introspection;
+	guint ownerid;
+	guint registrationid;
+	GDBusConnection * connection;
+	guint sigtermid;
+	guint sigintid;
+	guint sighupid;
+	guint sigusr1id;
+};
+
+// Static variables
+
+static gchar const control_introspection[] =
+	"<node>"
+	"	<interface name='" CONTROL_INTERFACE "'>"
+	"		<method name='Start'/>"
+	"		<method name='Stop'/>"
+	"		<method name='Reload'/>"
+	"		<method name='Quit'/>"
+	"		<method name='DumpTrace'/>"
+	"	</interface>"
+	"</node>";
+
+// The method names, in CONTROLCOMMAND order
+static gchar const * const control_methods[CONTROLCOMMAND_NUM] = {"Start", "Stop", "Reload", "Quit", "DumpTrace"};
+
+// Function prototypes
+
+static void control_on_bus_acquired(GDBusConnection * connection, gchar const * name, gpointer user_data);
+static void control_on_name_acquired(GDBusConnection * connection, gchar const * name, gpointer user_data);
+static void control_on_name_lost(GDBusConnection * connection, gchar const * name, gpointer user_data);
+static void control_method_call(GDBusConnection * connection, gchar const * sender, gchar const * object_path, gchar const * interface_name, gchar const * method_name, GVariant * parameters, GDBusMethodInvocation * invocation, gpointer user_data);
+static gboolean control_on_sigterm(gpointer user_data);
+static gboolean control_on_sighup(gpointer user_data);
+static gboolean control_on_sigusr1(gpointer user_data);
+
+// Function definitions
+
+/**
+ * Create the remote control. Nothing is received until control_start() is
+ * called.
+ *
+ * @param func the function to call for each command
+ * @param user_data data to pass to the function
+ * @return the new remote control
+ */
+Control * control_new(ControlFunc func, gpointer user_data) {
+	Control * control;
+
+	control = g_new0(Control, 1);
+
+	control->func = func;
+	control->user_data = user_data;
+	control->introspection = g_dbus_node_info_new_for_xml(control_introspection, NULL);
+	control->ownerid = 0;
+	control->registrationid = 0;
+	control->connection = NULL;
+	control->sigtermid = 0;
+	control->sigintid = 0;
+	control->sighupid = 0;
+	control->sigusr1id = 0;
+
+	return control;
+}
+
+void control_delete(Control * control) {
+	if (control != NULL) {
+		control_stop(control);
+
+		if (control->introspection) {
+			g_dbus_node_info_unref(control->introspection);
+			control->introspection = NULL;
+		}
+
+		g_free(control);
+	}
+}
+
+/**
+ * Start taking commands: SIGTERM and SIGINT quit, SIGHUP reloads, SIGUSR1
+ * dumps the trace, and the D-Bus interface is exported once the bus name has
+ * been requested.
+ *
+ * @param control the remote control to start
+ */
+void control_start(Control * control) {
+	if (control->sigtermid == 0) {
+		control->sigtermid = g_unix_signal_add(SIGTERM, control_on_sigterm, control);
+		control->sigintid = g_unix_signal_add(SIGINT, control_on_sigterm, control);
+		control->sighupid = g_unix_signal_add(SIGHUP, control_on_sighup, control);
+		control->sigusr1id = g_unix_signal_add(SIGUSR1, control_on_sigusr1, control);
+	}
+
+	if (control->ownerid == 0) {
+		control->ownerid = g_bus_own_name(G_BUS_TYPE_SYSTEM, CONTROL_BUS_NAME, G_BUS_NAME_OWNER_FLAGS_NONE, control_on_bus_acquired, control_on_name_acquired, control_on_name_lost, control, NULL);
+	}
+}
+
+/**
+ * Stop taking commands.
+ *
+ * @param control the remote control to stop
+ */
+void control_stop(Control * control) {
+	if (control->registrationid != 0) {
+		g_dbus_connection_unregister_object(control->connection, control->registrationid);
+		control->registrationid = 0;
+	}
+
+	if (control->ownerid != 0) {
+		g_bus_unown_name(control->ownerid);
+		control->ownerid = 0;
+	}
+
+	if (control->connection) {
+		g_object_unref(control->connection);
+		control->connection = NULL;
+	}
+
+	if (control->sigtermid != 0) {
+		g_source_remove(control->sigtermid);
+		g_source_remove(control->sigintid);
+		g_source_remove(control->sighupid);
+		g_source_remove(control->sigusr1id);
+		control->sigtermid = 0;
+		control->sigintid = 0;
+		control->sighupid = 0;
+		control->sigusr1id = 0;
+	}
+}
+
+/**
+ * Export the interface as soon as we're connected, so that it's there by the
+ * time the name is ours.
+ */
+static void control_on_bus_acquired(GDBusConnection * connection, gchar const * name, gpointer user_data) {
+	Control * control = (Control *)user_data;
+	GError * error;
+	static GDBusInterfaceVTable const vtable = {control_method_call, NULL, NULL};
+
+	if ((control->introspection == NULL) || (control->registrationid != 0)) {
+		return;
+	}
+
+	error = NULL;
+	control->connection = g_object_ref(connection);
+	control->registrationid = g_dbus_connection_register_object(connection, CONTROL_OBJECT_PATH, control->introspection->interfaces[0], &vtable, control, NULL, &error);
+	if (control->registrationid == 0) {
+		ASYNCLOG(LOG_ERR, "Error exporting control interface: %s\n", error->message);
+		g_error_free(error);
+	}
+}
+
+static void control_on_name_acquired(GDBusConnection * connection, gchar const * name, gpointer user_data) {
+	ASYNCLOG(LOG_INFO, "Control interface available as %s\n", name);
+}
+
+/**
+ * Without the name, the interface can still be reached through our unique
+ * name; the usual reason is a missing bus policy.
+ */
+static void control_on_name_lost(GDBusConnection * connection, gchar const * name, gpointer user_data) {
+	ASYNCLOG(LOG_ERR, "Couldn't own %s; check the bus policy\n", name);
+}
+
+static void control_method_call(GDBusConnection * connection, gchar const * sender, gchar const * object_path, gchar const * interface_name, gchar const * method_name, GVariant * parameters, GDBusMethodInvocation * invocation, gpointer user_data) {
+	Control * control = (Control *)user_data;
+	CONTROLCOMMAND command;
+
+	command = 0;
+	while ((command < CONTROLCOMMAND_NUM) && (g_strcmp0(method_name, control_methods[command]) != 0)) {
+		command++;
+	}
+
+	if (command >= CONTROLCOMMAND_NUM) {
+		g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD, "Unknown method %s", method_name);
+		return;
+	}
+
+	ASYNCLOG(LOG_INFO, "Control: %s from %s\n", method_name, sender);
+
+	// Reply first, since quitting may take the connection with it
+	g_dbus_method_invocation_return_value(invocation, NULL);
+	control->func(command, control->user_data);
+}
+
+static gboolean control_on_sigterm(gpointer user_data) {
+	Control * control = (Control *)user_data;
+
+	ASYNCLOG(LOG_INFO, "Control: quitting on signal\n");
+	control->func(CONTROLCOMMAND_QUIT, control->user_data);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean control_on_sighup(gpointer user_data) {
+	Control * control = (Control *)user_data;
+
+	ASYNCLOG(LOG_INFO, "Control: reloading on SIGHUP\n");
+	control->func(CONTROLCOMMAND_RELOAD, control->user_data);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean control_on_sigusr1(gpointer user_data) {
+	Control * control = (Control *)user_data;
+
+	ASYNCLOG(LOG_INFO, "Control: dumping trace on SIGUSR1\n");
+	control->func(CONTROLCOMMAND_DUMPTRACE, control->user_data);
+
+	return G_SOURCE_CONTINUE;
+}
+
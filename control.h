@@ -0,0 +1,46 @@
+#ifndef __CONTROL_H
+#define __CONTROL_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Defines
+
+// The service takes this name on the system bus; see control.conf for the
+// policy that allows it
+#define CONTROL_BUS_NAME "org.mypico.BleService"
+#define CONTROL_OBJECT_PATH "/org/mypico/BleService"
+#define CONTROL_INTERFACE "org.mypico.BleService1"
+
+// Structure definitions
+
+typedef enum _CONTROLCOMMAND {
+	CONTROLCOMMAND_INVALID = -1,
+
+	CONTROLCOMMAND_START,
+	CONTROLCOMMAND_STOP,
+	CONTROLCOMMAND_RELOAD,
+	CONTROLCOMMAND_QUIT,
+	CONTROLCOMMAND_DUMPTRACE,
+
+	CONTROLCOMMAND_NUM
+} CONTROLCOMMAND;
+
+/**
+ * Called on the main context for each command received, whether through a
+ * D-Bus method call or a signal.
+ */
+typedef void (*ControlFunc)(CONTROLCOMMAND command, gpointer user_data);
+
+typedef struct _Control Control;
+
+// Function prototypes
+
+Control * control_new(ControlFunc func, gpointer user_data);
+void control_delete(Control * control);
+
+void control_start(Control * control);
+void control_stop(Control * control);
+
+#endif
+
@@ -2,56 +2,119 @@
 #include <stdlib.h>
 #include <syslog.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include <dbus/dbus.h>
 #include <glib.h>
+#ifdef SERVICEBLE_GUI
 #include <gtk/gtk.h>
+#endif
 
 #include <gdbus-generated.h>
 
+#include "reassembly.h"
+#include "framing.h"
+#include "compress.h"
+#include "config.h"
+#include "control.h"
+#include "hcicontroller.h"
+#include "asynclog.h"
+#include "worker.h"
+#include "uuid.h"
+#include "trace.h"
+
 #include "pico/pico.h"
 #include "pico/debug.h"
-#include "pico/log.h"
 #include "pico/buffer.h"
 #include "pico/base64.h"
 #include "pico/keypair.h"
 #include "pico/cryptosupport.h"
 #include "pico/fsmservice.h"
 
-#include "bluetooth/bluetooth.h"
-#include "bluetooth/hci.h"
-#include "bluetooth/hci_lib.h"
-
 // Defines
 
+// Build with -DSERVICEBLE_ECHO to return each received message to the
+// central instead of running the Pico protocol; used for benchmarking the
+// data path against the mock BlueZ in mock-bluez.c
+
+// Build with -DSERVICEBLE_GUI, and link GTK, to control the service with the
+// s, f and q keys in a window. Without it the service runs headless, taking
+// the same commands through the D-Bus interface in control.h
+
 #define BLUEZ_SERVICE_NAME "org.bluez"
-#define BLUEZ_OBJECT_PATH "/org/bluez"
-#define BLUEZ_ADVERT_PATH "/org/bluez/hci0/advert1"
-#define BLUEZ_DEVICE_PATH "/org/bluez/hci0"
+#define BLUEZ_ROOT_PATH "/"
+#define BLUEZ_ADAPTER_INTERFACE "org.bluez.Adapter1"
+#define BLUEZ_DEVICE_INTERFACE "org.bluez.Device1"
+#define BLUEZ_LEADVERTISING_MANAGER_INTERFACE "org.bluez.LEAdvertisingManager1"
+#define BLUEZ_GATT_MANAGER_INTERFACE "org.bluez.GattManager1"
+#define BLUEZ_GATT_CHARACTERISTIC_INTERFACE "org.bluez.GattCharacteristic1"
+#define DBUS_PROPERTIES_INTERFACE "org.freedesktop.DBus.Properties"
 #define SERVICE_UUID "68F9A6EE-0000-1000-8000-00805F9B34FB"
 //#define CHARACTERISTIC_UUID "68F9A6EF-0000-1000-8000-00805F9B34FB"
 
 #define CHARACTERISTIC_UUID_INCOMING "56add98a-0e8a-4113-85bf-6dc97b58a9c1"
 #define CHARACTERISTIC_UUID_OUTGOING "56add98a-0e8a-4113-85bf-6dc97b58a9c2"
 
+// The reasons for recycling the advert; when none are set the cycle check
+// leaves advertising alone
+#define RECYCLE_KEYS (1 << 0)
+#define RECYCLE_ADVERT_LOST (1 << 1)
+#define RECYCLE_ERROR (1 << 2)
+// How long to wait after a problem is noticed before recycling, to let
+// bluetoothd settle, in milliseconds
+#define RECYCLE_REQUEST_DELAY (250)
+
 //#define SERVICE_UUID "aaaaaaaa-aaaa-aaaa-aaaa-aaaaaaaaaaa0"
 //#define CHARACTERISTIC_UUID_INCOMING "aaaaaaaa-aaaa-aaaa-aaaa-aaaaaaaaaaa1"
 //#define CHARACTERISTIC_UUID_OUTGOING "aaaaaaaa-aaaa-aaaa-aaaa-aaaaaaaaaaa2"
 
 
 #define CHARACTERISTIC_VALUE "012"
-#define CHARACTERISTIC_LENGTH (208)
-#define MAX_SEND_SIZE (128)
-
-#if (MAX_SEND_SIZE > CHARACTERISTIC_LENGTH)
-#error "The maximum length to send can't be larger than the characteristic size"
-#endif
 
-#define BLUEZ_GATT_OBJECT_PATH "/org/bluez/gatt"
-#define BLUEZ_GATT_SERVICE_PATH "/org/bluez/gatt/service0"
-#define BLUEZ_GATT_CHARACTERISTIC_PATH_OUTGOING "/org/bluez/gatt/service0/char0"
-#define BLUEZ_GATT_CHARACTERISTIC_PATH_INCOMING "/org/bluez/gatt/service0/char1"
+// ATT sizes used to derive chunk sizes from the negotiated MTU
+// See Vol 3, Part F of the Core Bluetooth Specification version 5
+#define ATT_MTU_DEFAULT (23)
+#define ATT_HEADER_NOTIFY (3)
+#define ATT_HEADER_READ (1)
+#define ATT_MAX_VALUE_LENGTH (512)
+#define MIN_SEND_SIZE (ATT_MTU_DEFAULT - ATT_HEADER_NOTIFY)
+
+// How long to wait for a version 2 message to be acknowledged before sending
+// its last chunk again, in milliseconds, and how many times to resend parts
+// of a message before giving up on it
+#define FRAMING_ACK_TIMEOUT (500)
+#define FRAMING_RETRIES (8)
+// The capabilities we accept when a central asks for them in its hello
+#define FRAMING_CAPABILITIES (FRAMING_CAPABILITY_COMPRESSION | FRAMING_CAPABILITY_ADDRESSED)
+
+// The advert's manufacturer data carries a discovery record, under the
+// company identifier the Bluetooth SIG reserves for testing, so centrals can
+// choose their framing and chunk sizes before connecting. The record is the
+// record version and highest framing version packed in a byte, the framing
+// capabilities, the ADVERT_FLAG_ flags and the big-endian characteristic
+// length; it's kept small enough to share a legacy advert with a 128-bit UUID
+#define ADVERT_COMPANY_ID (0xffff)
+#define ADVERT_RECORD_VERSION (1)
+#define ADVERT_RECORD_SIZE (5)
+#define ADVERT_FLAG_CONTINUOUS (0x01)
+
+// Session key for centrals whose device path BlueZ didn't pass to us
+#define SESSION_DEVICE_UNKNOWN ""
+
+#define KEY_FILE_PUBLIC "pico_pub_key.der"
+#define KEY_FILE_PRIVATE "pico_priv_key.der"
+
+// The objects we export for each adapter, formatted with the adapter's path
+// so that each adapter's advert and application are distinct
+#define BLUEZ_ADVERT_PATH "%s/advert1"
+#define BLUEZ_GATT_OBJECT_PATH "%s/gatt"
+#define BLUEZ_GATT_SERVICE_PATH "%s/gatt/service0"
+#define BLUEZ_GATT_CHARACTERISTIC_PATH_OUTGOING "%s/gatt/service0/char0"
+#define BLUEZ_GATT_CHARACTERISTIC_PATH_INCOMING "%s/gatt/service0/char1"
 
 // Structure definitions
 
@@ -73,10 +136,32 @@ typedef enum _SERVICESTATE {
 } SERVICESTATE;
 
 typedef struct _ServiceBle {
-	GMainLoop * loop;
-	FsmService * fsmservice;
-	guint timeoutid;
+	gchar * adapter;
+	gchar * advertpath;
+	gchar * gattpath;
+	gchar * gattservicepath;
+	gchar * gattcharpath_outgoing;
+	gchar * gattcharpath_incoming;
+	bool removed;
+	bool deleting;
+	guint deleteid;
+	void (*removedfunc)(struct _ServiceBle * serviceble, gpointer user_data);
+	gpointer removeddata;
+	guint refs;
+	GHashTable * sessions;
+	Shared * shared;
+	Users * users;
+	Buffer * extradata;
 	guint cycletimeoutid;
+	guint cycleinterval;
+	guint cyclebackoffmax;
+	guint cyclejitter;
+	guint secondaryinterval;
+	gsize bufferkeep;
+	gchar * advertname;
+	guint maxsessions;
+	size_t maxsendsize;
+	int charlength;
 
 	LEAdvertisement1 * leadvertisement;
 	LEAdvertisingManager1 * leadvertisingmanager;
@@ -84,77 +169,389 @@ typedef struct _ServiceBle {
 	GattService1 * gattservice;
 	GattCharacteristic1 * gattcharacteristic_outgoing;
 	GattCharacteristic1 * gattcharacteristic_incoming;
-	unsigned char characteristic_outgoing[CHARACTERISTIC_LENGTH];
-	unsigned char characteristic_incoming[CHARACTERISTIC_LENGTH];
-	int charlength;
-	size_t remaining_write;
-	Buffer * buffer_write;
-	Buffer * buffer_read;
-	bool connected;
+	unsigned char characteristic_incoming[ATT_MAX_VALUE_LENGTH];
+	GVariant * emptyvalue;
 	SERVICESTATE state;
 	bool cycling;
-	size_t maxsendsize;
+	bool warmcycle;
+	gint64 recyclestart;
+	guint recyclecount;
+	gint64 recyclegaptotal;
+	gint64 recyclegapmax;
+	GHashTable * connecttimes;
+	GHashTable * linked;
+	guint firstwritecount;
+	gint64 firstwritetotal;
+	guint recyclereasons;
+	guint recycleskipped;
+	guint recyclebackoff;
+	GQueue * sendsessions;
+	struct _Session * sendingsession;
+	struct _SendItem * sending;
 	size_t sendpos;
+	guint sendidleid;
+	guint sendinflight;
+	guint sendwindow;
+	GIOChannel * writechannel;
+	guint writewatchid;
+	struct _Session * writesession;
+	GIOChannel * notifychannel;
+	guint notifywatchid;
+	guint notifywritableid;
+	GDBusMessage * notifytemplate;
+	GVariant * notifyinterface;
+	GVariant * notifyproperty;
+	GVariant * notifyinvalidated;
 	GDBusObjectManagerServer * object_manager_advert;
 	GDBusConnection * connection;
 	GDBusObjectManagerServer * object_manager_gatt;
 	ObjectSkeleton * object_gatt_service;
 	ObjectSkeleton * object_gatt_characteristic_outgoing;
 	ObjectSkeleton * object_gatt_characteristic_incoming;
+	ObjectSkeleton * object_advert;
 	bool finalise;
+	Buffer * uuid_discontinuous;
+	Buffer * uuid_continuous;
+	bool uuidsvalid;
+	struct stat keystat[2];
+	HciController * hcicontroller;
+	bool advertsets;
+	Worker * worker;
+	guint fsminflight;
+	guint64 traceadvert;
 } ServiceBle;
 
+// Called once a removed service instance is ready to be deleted
+typedef void (*ServiceBleRemovedFunc)(ServiceBle * serviceble, gpointer user_data);
+
+/**
+ * The state of our conversation with a single central, identified by the
+ * device object path BlueZ passes in the method options. Each session has
+ * its own reassembly buffer, send queue and protocol state machine, and the
+ * sessions of centrals that have gone away are kept for when they return.
+ * Everything we send goes out on the one outgoing characteristic, which
+ * bluetoothd notifies to every subscribed central, so several centrals are
+ * only served at once if they've all asked for addressed framing; a central
+ * that hasn't is served alone.
+ */
+typedef struct _Session {
+	ServiceBle * serviceble;
+	gchar * device;
+	FsmService * fsmservice;
+	guint timeoutid;
+	bool connected;
+	size_t remaining_write;
+	Buffer * buffer_write;
+	guint16 mtu;
+	size_t maxsendsize;
+	int charlength;
+	GQueue * sendqueue;
+	guint messagessent;
+	GQueue * fsmjobs;
+	bool fsmbusy;
+	guint8 framing;
+	guint8 capabilities;
+	guint8 address;
+	Compress * compress;
+	FramingReceive * framingreceive;
+	guint8 sendmsgid;
+	struct _SendItem * unacked;
+	guint acktimeoutid;
+	guint ackretries;
+	guint traceid;
+	guint64 tracereceive;
+	gint64 connectedat;
+} Session;
+
+/**
+ * Something waiting to be sent to a central, sliced into chunks from start
+ * to end. Version 1 messages and control chunks are sent as they are, while
+ * version 2 messages have a header added to each chunk as it's sent, so that
+ * any part of them can be sent again if the central asks for it.
+ */
+typedef struct _SendItem {
+	GBytes * bytes;
+	gsize start;
+	gsize end;
+	bool headers;
+	bool retransmit;
+	guint8 msgid;
+	guint32 crc;
+	gsize messagesize;
+	guint64 tracequeued;
+} SendItem;
+
+/**
+ * The calls we make into a session's protocol state machine. These are run
+ * on the worker's thread, one at a time and in the order they were made, so
+ * that the key agreement and signatures don't hold up the main loop.
+ */
+typedef enum _FSMJOB {
+	FSMJOB_INVALID = -1,
+
+	FSMJOB_START,
+	FSMJOB_CONNECTED,
+	FSMJOB_READ,
+	FSMJOB_DISCONNECTED,
+	FSMJOB_TIMEOUT,
+
+	FSMJOB_NUM
+} FSMJOB;
+
+typedef struct _FsmJob {
+	Session * session;
+	FSMJOB type;
+	Buffer * data;
+	guint64 tracequeued;
+} FsmJob;
+
+/**
+ * The callbacks made by a session's protocol state machine, passed back from
+ * the worker thread to be acted on in the main loop. FSMEVENT_DONE follows
+ * the callbacks from each job, once the state machine has returned.
+ */
+typedef enum _FSMEVENT {
+	FSMEVENT_INVALID = -1,
+
+	FSMEVENT_WRITE,
+	FSMEVENT_SET_TIMEOUT,
+	FSMEVENT_ERROR,
+	FSMEVENT_LISTEN,
+	FSMEVENT_DISCONNECT,
+	FSMEVENT_AUTHENTICATED,
+	FSMEVENT_ENDED,
+	FSMEVENT_STATUS_UPDATED,
+	FSMEVENT_DONE,
+
+	FSMEVENT_NUM
+} FSMEVENT;
+
+typedef struct _FsmEvent {
+	Session * session;
+	FSMEVENT type;
+	int value;
+	Buffer * data;
+} FsmEvent;
+
+typedef struct _SessionRef {
+	ServiceBle * serviceble;
+	gchar * device;
+} SessionRef;
+
+/**
+ * The service instances, one for each Bluetooth adapter, keyed by the
+ * adapter's object path. Adapters are discovered through the BlueZ object
+ * manager, so that instances come and go as adapters are added and removed.
+ */
+typedef struct _Adapters {
+	GMainLoop * loop;
+	GDBusConnection * connection;
+	GDBusObjectManager * bluez;
+	GHashTable * services;
+	GHashTable * removing;
+	Shared * shared;
+	Users * users;
+	Buffer * extradata;
+	Worker * worker;
+	Config * config;
+	gchar ** args;
+	Control * control;
+} Adapters;
+
 // Function prototypes
 
+ServiceBle * serviceble_new(char const * adapter);
+void service_delete(ServiceBle * serviceble);
 void serviceble_start(ServiceBle * serviceble);
 void serviceble_stop(ServiceBle * serviceble);
-
-static void serviceble_write(char const * data, size_t length, void * user_data);
-static void serviceble_set_timeout(int timeout, void * user_data);
-static void serviceble_error(void * user_data);
-static void serviceble_listen(void * user_data);
-static void serviceble_disconnect(void * user_data);
-static void serviceble_authenticated(int status, void * user_data);
-static void serviceble_session_ended(void * user_data);
-static void serviceble_status_updated(int state, void * user_data);
-static gboolean serviceble_timeout(gpointer user_data);
+void serviceble_set_send_window(ServiceBle * serviceble, guint window);
+void serviceble_set_warm_cycle(ServiceBle * serviceble, bool warmcycle);
+bool serviceble_set_advertising_profile(ServiceBle * serviceble, char const * profile);
+void serviceble_set_session_data(ServiceBle * serviceble, Shared * shared, Users * users, Buffer * extradata);
+void serviceble_set_worker(ServiceBle * serviceble, Worker * worker);
+void serviceble_set_config(ServiceBle * serviceble, Config const * config);
+void serviceble_device_connected(ServiceBle * serviceble, gchar const * device, bool connected);
+
+static Session * session_new(ServiceBle * serviceble, gchar const * device);
+static void session_delete(Session * session);
+static Session * session_get(ServiceBle * serviceble, GVariant * options);
+static Session * session_claim(ServiceBle * serviceble, GDBusMethodInvocation * invocation, GVariant * options, guchar const * data, gsize length);
+static gchar const * session_device(GVariant * options);
+static bool session_shared(ServiceBle * serviceble, gchar const * device);
+static bool session_may_join(ServiceBle * serviceble, gchar const * device, guchar const * data, gsize length);
+static bool session_address_used(ServiceBle * serviceble, Session * session, guint8 address);
+static bool session_addressed(Session * session);
+static gsize session_chunk_size(Session * session);
+static Session * session_lookup(ServiceBle * serviceble, gchar const * device);
+static bool session_evict(ServiceBle * serviceble);
+static void session_connected(Session * session);
+static void session_disconnected(Session * session);
+static void session_trim(Session * session);
+static void on_device_disconnect(GDBusConnection * connection, GAsyncResult * res, gpointer user_data);
+static SessionRef * session_ref_new(Session * session);
+static Session * session_ref_get(SessionRef * ref);
+static void session_ref_delete(SessionRef * ref);
+static guint sessions_connected(ServiceBle * serviceble);
+static void session_write(char const * data, size_t length, void * user_data);
+static void session_set_timeout(int timeout, void * user_data);
+static void session_error(void * user_data);
+static void session_listen(void * user_data);
+static void session_disconnect(void * user_data);
+static void session_authenticated(int status, void * user_data);
+static void session_ended(void * user_data);
+static void session_status_updated(int state, void * user_data);
+static gboolean session_timeout(gpointer user_data);
+static void session_fsm(Session * session, FSMJOB type, char const * data, size_t length);
+static void session_fsm_next(Session * session);
+static void session_fsm_run(gpointer data);
+static void fsm_job_delete(FsmJob * job);
+static void session_post(Session * session, FSMEVENT type, int value, char const * data, size_t length);
+static void session_event(gpointer data);
+static void fsm_event_delete(FsmEvent * event);
+static void session_post_write(char const * data, size_t length, void * user_data);
+static void session_post_set_timeout(int timeout, void * user_data);
+static void session_post_error(void * user_data);
+static void session_post_listen(void * user_data);
+static void session_post_disconnect(void * user_data);
+static void session_post_authenticated(int status, void * user_data);
+static void session_post_ended(void * user_data);
+static void session_post_status_updated(int state, void * user_data);
 
 void advertising_start(ServiceBle * serviceble, bool continuous);
 void advertising_stop(ServiceBle * serviceble, bool finalise);
 
 static void finalise(ServiceBle * serviceble);
-static void set_advertising_frequency();
-static void appendbytes(char unsigned const * bytes, int num, Buffer * out);
-static void create_uuid(KeyPair * keypair, bool continuous, Buffer * uuid);
+static void skeletons_new(ServiceBle * serviceble);
+static void skeletons_delete(ServiceBle * serviceble);
+static bool create_uuids(KeyPair * keypair, Buffer * uuid, Buffer * uuid_continuous);
+static bool uuid_cache_stale(ServiceBle * serviceble);
+static bool key_stat_changed(struct stat const * now, struct stat const * cached);
+static void uuid_cache_refresh(ServiceBle * serviceble);
 static gboolean handle_release(LEAdvertisement1 * object, GDBusMethodInvocation * invocation, gpointer user_data);
 static gboolean handle_read_value(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, GVariant *arg_options, gpointer user_data);
-static void send_data(ServiceBle * serviceble, char const * data, size_t size);
+static void update_mtu(Session * session, GVariant * options);
+static void reset_mtu(Session * session);
+static void send_data(Session * session, char const * data, size_t size);
+static SendItem * frame_message(Session * session, char const * data, size_t size);
+static SendItem * send_item_new(GBytes * bytes, gsize start, gsize end, bool headers);
+static void send_item_delete(SendItem * item);
+static void send_control(Session * session, GBytes * chunk);
+static bool send_ready(Session * session);
+static void send_queue_session(Session * session);
+static void send_retransmit(Session * session, gsize offset, gsize length);
+static void send_acknowledged(Session * session, guint8 msgid);
+static void send_release(Session * session);
+static void send_nacked(Session * session, guchar const * data, gsize length);
+static gboolean on_ack_timeout(gpointer user_data);
+static void receive_chunk_framed(Session * session, guchar const * data, gsize length);
+static void receive_message(Session * session, guchar const * data, gsize length);
+static void send_schedule(ServiceBle * serviceble);
+static gboolean send_next_chunk(gpointer user_data);
+static gboolean send_chunk_socket(ServiceBle * serviceble, GBytes * chunk);
+static void send_chunk_notify(ServiceBle * serviceble, GBytes * chunk);
+static gboolean on_notify_writable(GIOChannel * channel, GIOCondition condition, gpointer user_data);
+static void on_send_flushed(GDBusConnection * connection, GAsyncResult *res, gpointer user_data);
+static void send_complete(Session * session, gsize size);
+static void send_clear(Session * session);
+static void receive_chunk(Session * session, guchar const * data, gsize length);
+static GIOChannel * acquire_socket(GDBusMethodInvocation * invocation, GUnixFDList ** fdlist);
+static guint16 acquired_mtu(Session * session);
+static gboolean handle_acquire_write(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, GUnixFDList * fd_list, GVariant *arg_options, gpointer user_data);
+static gboolean handle_acquire_notify(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, GUnixFDList * fd_list, GVariant *arg_options, gpointer user_data);
+static gboolean on_write_socket(GIOChannel * channel, GIOCondition condition, gpointer user_data);
+static gboolean on_notify_socket(GIOChannel * channel, GIOCondition condition, gpointer user_data);
+static void release_write(ServiceBle * serviceble);
+static void release_notify(ServiceBle * serviceble);
 static gboolean handle_write_value(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, GVariant *arg_value, GVariant *arg_options, gpointer user_data);
 static gboolean handle_start_notify(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, gpointer user_data);
 static gboolean handle_stop_notify(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, gpointer user_data);
 static void report_error(GError ** error, char const * hint);
 static void on_register_advert(LEAdvertisingManager1 *proxy, GAsyncResult *res, gpointer user_data);
+static void advert_register(ServiceBle * serviceble, gchar const * const * uuids, bool continuous);
+static void advert_sets_start(ServiceBle * serviceble, bool continuous, char const * uuid);
+static void advert_registered(ServiceBle * serviceble, bool result);
+static void advert_unregistered(ServiceBle * serviceble);
 static void on_register_application(GattManager1 *proxy, GAsyncResult *res, gpointer user_data);
 static void on_unregister_advert(LEAdvertisingManager1 *proxy, GAsyncResult *res, gpointer user_data);
+#ifdef SERVICEBLE_GUI
 static gboolean key_event(GtkWidget *widget, GdkEventKey *event, gpointer user_data);
-static void generate_uuid(ServiceBle * serviceble, bool continuous, Buffer * uuid);
+#endif
+static char const * generate_uuid(ServiceBle * serviceble, bool continuous);
 static void on_g_bus_get (GObject *source_object, GAsyncResult *res, gpointer user_data);
 static void on_leadvertising_manager1_proxy_new(GDBusConnection * connection, GAsyncResult *res, gpointer user_data);
 static void on_gatt_manager1_proxy_new(GDBusConnection * connection, GAsyncResult *res, gpointer user_data);
 static void on_gatt_manager1_call_unregister_application(GattManager1 * gattmanager, GAsyncResult *res, gpointer user_data);
 static gboolean cycle_timeout(gpointer user_data);
+static void cycle_schedule(ServiceBle * serviceble, guint delay);
+static void cycle_request(ServiceBle * serviceble, guint reason);
+static void report_recycle_gap(ServiceBle * serviceble);
+static void report_first_write(Session * session);
+static void advert_record(ServiceBle * serviceble, bool continuous, guchar * record);
 static void set_state(ServiceBle * serviceble, SERVICESTATE state);
+static void serviceble_remove(ServiceBle * serviceble, ServiceBleRemovedFunc removedfunc, gpointer user_data);
+static void serviceble_delete_later(ServiceBle * serviceble);
+static void serviceble_delete_check(ServiceBle * serviceble);
+static gboolean serviceble_delete_idle(gpointer user_data);
+
+static Adapters * adapters_new();
+static void adapters_delete(Adapters * adapters);
+static void adapters_start(Adapters * adapters);
+static void adapters_stop(Adapters * adapters);
+static void adapters_command(CONTROLCOMMAND command, gpointer user_data);
+static void adapters_reload(Adapters * adapters);
+static void adapters_set_trace(Adapters * adapters);
+static void adapters_dump_trace(Adapters * adapters);
+static void on_adapters_bus_get(GObject * source_object, GAsyncResult * res, gpointer user_data);
+static void on_adapters_manager_new(GObject * source_object, GAsyncResult * res, gpointer user_data);
+static void on_adapter_object_added(GDBusObjectManager * manager, GDBusObject * object, gpointer user_data);
+static void on_adapter_object_removed(GDBusObjectManager * manager, GDBusObject * object, gpointer user_data);
+static void on_adapter_interface_changed(GDBusObjectManager * manager, GDBusObject * object, GDBusInterface * interface, gpointer user_data);
+static void adapter_check(Adapters * adapters, GDBusObject * object);
+static void adapter_remove(Adapters * adapters, gchar const * path);
+static void adapter_removed(ServiceBle * serviceble, gpointer user_data);
+static void on_device_properties_changed(GDBusObjectManagerClient * manager, GDBusObjectProxy * object_proxy, GDBusProxy * interface_proxy, GVariant * changed_properties, GStrv invalidated_properties, gpointer user_data);
+static void device_check(Adapters * adapters, GDBusObject * object);
+static void device_connected(Adapters * adapters, gchar const * path, bool connected);
 
 
-ServiceBle * serviceble_new() {
+/**
+ * Create a service instance for an adapter.
+ *
+ * @param adapter the object path of the adapter, such as /org/bluez/hci0
+ * @return the new service instance
+ */
+ServiceBle * serviceble_new(char const * adapter) {
 	ServiceBle * serviceble;
+	gchar * name;
 
 	serviceble = CALLOC(sizeof(ServiceBle), 1);
 
-	serviceble->loop = NULL;
-	serviceble->fsmservice = fsmservice_new();
-	serviceble->timeoutid = 0;
+	serviceble->adapter = g_strdup(adapter);
+	serviceble->advertpath = g_strdup_printf(BLUEZ_ADVERT_PATH, adapter);
+	serviceble->gattpath = g_strdup_printf(BLUEZ_GATT_OBJECT_PATH, adapter);
+	serviceble->gattservicepath = g_strdup_printf(BLUEZ_GATT_SERVICE_PATH, adapter);
+	serviceble->gattcharpath_outgoing = g_strdup_printf(BLUEZ_GATT_CHARACTERISTIC_PATH_OUTGOING, adapter);
+	serviceble->gattcharpath_incoming = g_strdup_printf(BLUEZ_GATT_CHARACTERISTIC_PATH_INCOMING, adapter);
+	serviceble->removed = FALSE;
+	serviceble->deleting = FALSE;
+	serviceble->deleteid = 0;
+	serviceble->removedfunc = NULL;
+	serviceble->removeddata = NULL;
+	serviceble->refs = 0;
+	serviceble->sessions = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)session_delete);
+	serviceble->shared = NULL;
+	serviceble->users = NULL;
+	serviceble->extradata = NULL;
 	serviceble->cycletimeoutid = 0;
+	serviceble->cycleinterval = CONFIG_DEFAULT_CYCLE_INTERVAL;
+	serviceble->cyclebackoffmax = CONFIG_DEFAULT_CYCLE_BACKOFF_MAX;
+	serviceble->cyclejitter = CONFIG_DEFAULT_CYCLE_JITTER;
+	serviceble->secondaryinterval = CONFIG_DEFAULT_SECONDARY_INTERVAL;
+	serviceble->bufferkeep = CONFIG_DEFAULT_BUFFER_KEEP;
+	serviceble->advertname = g_strdup(CONFIG_DEFAULT_ADVERTISING_NAME);
+	serviceble->maxsessions = CONFIG_DEFAULT_MAX_SESSIONS;
+	serviceble->maxsendsize = CONFIG_DEFAULT_MAX_SEND_SIZE;
+	serviceble->charlength = CONFIG_DEFAULT_CHARACTERISTIC_LENGTH;
 
 	serviceble->leadvertisement = NULL;
 	serviceble->leadvertisingmanager = NULL;
@@ -162,26 +559,65 @@ ServiceBle * serviceble_new() {
 	serviceble->gattservice = NULL;
 	serviceble->gattcharacteristic_outgoing = NULL;
 	serviceble->gattcharacteristic_incoming = NULL;
-	serviceble->charlength = 0;
-	serviceble->remaining_write = 0;
-	serviceble->buffer_write = buffer_new(0);
-	serviceble->buffer_read = buffer_new(0);
-	serviceble->connected = FALSE;
+	serviceble->emptyvalue = NULL;
 	serviceble->state = SERVICESTATEBLE_INVALID;
 	serviceble->cycling = FALSE;
-	serviceble->maxsendsize = MAX_SEND_SIZE;
+	serviceble->warmcycle = TRUE;
+	serviceble->recyclestart = 0;
+	serviceble->recyclecount = 0;
+	serviceble->recyclegaptotal = 0;
+	serviceble->recyclegapmax = 0;
+	// Connection times of centrals that don't have a session yet
+	serviceble->connecttimes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	// Devices connected to the adapter, whether or not we're serving them
+	serviceble->linked = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	serviceble->firstwritecount = 0;
+	serviceble->firstwritetotal = 0;
+	serviceble->recyclereasons = 0;
+	serviceble->recycleskipped = 0;
+	serviceble->recyclebackoff = 0;
+	serviceble->sendsessions = g_queue_new();
+	serviceble->sendingsession = NULL;
+	serviceble->sending = NULL;
 	serviceble->sendpos = 0;
+	serviceble->sendidleid = 0;
+	serviceble->sendinflight = 0;
+	serviceble->sendwindow = CONFIG_DEFAULT_SEND_WINDOW;
+	serviceble->writechannel = NULL;
+	serviceble->writewatchid = 0;
+	serviceble->writesession = NULL;
+	serviceble->notifychannel = NULL;
+	serviceble->notifywatchid = 0;
+	serviceble->notifywritableid = 0;
+	// Everything about a notification but the value is the same each time
+	serviceble->notifytemplate = g_dbus_message_new_signal(serviceble->gattcharpath_outgoing, DBUS_PROPERTIES_INTERFACE, "PropertiesChanged");
+	serviceble->notifyinterface = g_variant_ref_sink(g_variant_new_string(BLUEZ_GATT_CHARACTERISTIC_INTERFACE));
+	serviceble->notifyproperty = g_variant_ref_sink(g_variant_new_string("Value"));
+	serviceble->notifyinvalidated = g_variant_ref_sink(g_variant_new_strv(NULL, 0));
 	serviceble->object_manager_advert = NULL;
 	serviceble->connection = NULL;
 	serviceble->object_manager_gatt = NULL;
 	serviceble->object_gatt_service = NULL;
 	serviceble->object_gatt_characteristic_outgoing = NULL;
 	serviceble->object_gatt_characteristic_incoming = NULL;
+	serviceble->object_advert = NULL;
 	serviceble->finalise = FALSE;
-
-	fsmservice_set_functions(serviceble->fsmservice, serviceble_write, serviceble_set_timeout, serviceble_error, serviceble_listen, serviceble_disconnect, serviceble_authenticated, serviceble_session_ended, serviceble_status_updated);
-	fsmservice_set_userdata(serviceble->fsmservice, serviceble);
-	fsmservice_set_continuous(serviceble->fsmservice, TRUE);
+	serviceble->uuid_discontinuous = buffer_new(0);
+	serviceble->uuid_continuous = buffer_new(0);
+	serviceble->uuidsvalid = FALSE;
+	// The adapter's HCI device has the same name as the last part of its path
+	name = g_path_get_basename(adapter);
+	serviceble->hcicontroller = hcicontroller_new(hcicontroller_dev_id(name));
+	g_free(name);
+	hcicontroller_set_profile_string(serviceble->hcicontroller, CONFIG_DEFAULT_ADVERTISING_PROFILE);
+	hcicontroller_set_mode_string(serviceble->hcicontroller, CONFIG_DEFAULT_ADVERTISING_MODE);
+	hcicontroller_set_name(serviceble->hcicontroller, CONFIG_DEFAULT_ADVERTISING_NAME);
+	serviceble->advertsets = FALSE;
+	serviceble->worker = NULL;
+	serviceble->fsminflight = 0;
+	serviceble->traceadvert = 0;
+
+	skeletons_new(serviceble);
 
 	return serviceble;
 }
@@ -192,953 +628,3824 @@ ServiceBle * serviceble_new() {
 
 void service_delete(ServiceBle * serviceble) {
 	if (serviceble != NULL) {
-		if (serviceble->fsmservice != NULL) {
-			fsmservice_set_functions(serviceble->fsmservice, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
-			fsmservice_set_userdata(serviceble->fsmservice, NULL);
-			fsmservice_delete(serviceble->fsmservice);
-			serviceble->fsmservice = NULL;
+		if (serviceble->deleteid != 0) {
+			g_source_remove(serviceble->deleteid);
+			serviceble->deleteid = 0;
 		}
 
-		if (serviceble->buffer_write) {
-			buffer_delete(serviceble->buffer_write);
-			serviceble->buffer_write = NULL;
+		if (serviceble->sendidleid != 0) {
+			g_source_remove(serviceble->sendidleid);
+			serviceble->sendidleid = 0;
 		}
 
-		if (serviceble->buffer_read) {
-			buffer_delete(serviceble->buffer_read);
-			serviceble->buffer_read = NULL;
+		if (serviceble->cycletimeoutid != 0) {
+			g_source_remove(serviceble->cycletimeoutid);
+			serviceble->cycletimeoutid = 0;
 		}
 
-		FREE(serviceble);
-		serviceble = NULL;
-	}
-}
+		release_write(serviceble);
+		release_notify(serviceble);
 
-static void set_advertising_frequency() {
-	int result;
-	int dd;
-	int dev_id;
-	char bytes_disable[] = {0x00};
-	char bytes_interval[] = {0xA0, 0x00, 0xAF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0x00};
-	char bytes_enable[] = {0x01};
+		if (serviceble->sessions) {
+			g_hash_table_destroy(serviceble->sessions);
+			serviceble->sessions = NULL;
+		}
 
-	dev_id = hci_get_route(NULL);
+		if (serviceble->sendsessions) {
+			g_queue_free(serviceble->sendsessions);
+			serviceble->sendsessions = NULL;
+		}
 
-	// Open device and return device descriptor
-	dd = hci_open_dev(dev_id);
-	if (dd < 0) {
-		printf("Device open failed");
-	}
+		if (serviceble->connecttimes) {
+			g_hash_table_destroy(serviceble->connecttimes);
+			serviceble->connecttimes = NULL;
+		}
 
-	// LE Set Advertising Enable Command
-	// See section 7.8.9 of the Core Bluetooth Specification version 5
-	// Parameters:
-	// - Advertising_Enable (0 = disable; 1 = enable)
-	result = hci_send_cmd(dd, 0x08, 0x000a, sizeof(bytes_disable), bytes_disable);
-	if (result < 0) {
-		printf("Error sending HCI command: disable");
-	}
+		if (serviceble->linked) {
+			g_hash_table_destroy(serviceble->linked);
+			serviceble->linked = NULL;
+		}
 
-	// LE Set Advertising Parameters Command
-	// See section 7.8.5 of the Core Bluetooth Specification version 5
-	// Parameters:
-	//  - Advertising_Interval_Min (0x000020 to 0xFFFFFF; Time = N * 0.625 ms)
-	//  - Advertising_Interval_Max (0x000020 to 0xFFFFFF; Time = N * 0.625 ms)
-	//  - Advertising_Type (0 = Connectable and scannable undirected advertising)
-	//  - Own_Address_Type (0 = Public, 1 = Random)
-	//  - Peer_Address_Type (0 = Public, 1 = Random)
-	//  - Peer_Address (0xXXXXXXXXXXXX)
-	//  - Advertising_Channel_Map (xxxxxxx1b = Chan 37, xxxxxx1xb = Chan 38, xxxxx1xxb = Chan 39, 00000111b = All)
-	//  - Advertising_Filter_Policy (0 = No white list)
-	result = hci_send_cmd(dd, 0x08, 0x0006, sizeof(bytes_interval), bytes_interval);
-	if (result < 0) {
-		printf("Error sending HCI command: disable");
-	}
+		g_free(serviceble->advertname);
+		serviceble->advertname = NULL;
 
-	// LE Set Advertising Enable Command
-	// See section 7.8.9 of the Core Bluetooth Specification version 5
-	// Parameters:
-	// - Advertising_Enable (0 = disable; 1 = enable)
-	result = hci_send_cmd(dd, 0x08, 0x000a, sizeof(bytes_enable), bytes_enable);
-	if (result < 0) {
-		printf("Error sending HCI command: disable");
-	}
+		skeletons_delete(serviceble);
+
+		if (serviceble->notifytemplate) {
+			g_object_unref(serviceble->notifytemplate);
+			serviceble->notifytemplate = NULL;
+			g_variant_unref(serviceble->notifyinterface);
+			serviceble->notifyinterface = NULL;
+			g_variant_unref(serviceble->notifyproperty);
+			serviceble->notifyproperty = NULL;
+			g_variant_unref(serviceble->notifyinvalidated);
+			serviceble->notifyinvalidated = NULL;
+		}
+
+		if (serviceble->hcicontroller) {
+			hcicontroller_delete(serviceble->hcicontroller);
+			serviceble->hcicontroller = NULL;
+		}
+
+		if (serviceble->uuid_discontinuous) {
+			buffer_delete(serviceble->uuid_discontinuous);
+			serviceble->uuid_discontinuous = NULL;
+		}
+
+		if (serviceble->uuid_continuous) {
+			buffer_delete(serviceble->uuid_continuous);
+			serviceble->uuid_continuous = NULL;
+		}
+
+		g_free(serviceble->adapter);
+		g_free(serviceble->advertpath);
+		g_free(serviceble->gattpath);
+		g_free(serviceble->gattservicepath);
+		g_free(serviceble->gattcharpath_outgoing);
+		g_free(serviceble->gattcharpath_incoming);
 
-	hci_close_dev(dd);
+		FREE(serviceble);
+		serviceble = NULL;
+	}
 }
 
 /**
- * Handle the advertisement release signal.
+ * Set the keys, users and extra data that each session's protocol state
+ * machine is started with. These remain owned by the caller, and must
+ * outlive the service. The state machines of every session share them,
+ * which is safe because they're only ever called from the worker's one
+ * thread.
  *
- * @param object the advertisement object being released
- * @param invocation the message invocation details
- * @param user_data the user data passed to the signal connect
+ * @param serviceble the service to set the data for
+ * @param shared the service's keys
+ * @param users the users authorised to authenticate
+ * @param extradata extra data to send to each authenticating phone
  */
-static gboolean handle_release(LEAdvertisement1 * object, GDBusMethodInvocation * invocation, gpointer user_data) {
-	printf("Advert released\n");
-
-	leadvertisement1_complete_release(object, invocation);
-	
-	return TRUE;
+void serviceble_set_session_data(ServiceBle * serviceble, Shared * shared, Users * users, Buffer * extradata) {
+	serviceble->shared = shared;
+	serviceble->users = users;
+	serviceble->extradata = extradata;
 }
 
-static gboolean handle_read_value(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, GVariant *arg_options, gpointer user_data) {
-	ServiceBle * serviceble;
+/**
+ * Set the worker that runs the sessions' protocol state machines. This
+ * remains owned by the caller, and must outlive the service. Without a
+ * worker the state machines are run directly in the main loop.
+ *
+ * @param serviceble the service to set the worker for
+ * @param worker the worker to use, or NULL to run everything in the main loop
+ */
+void serviceble_set_worker(ServiceBle * serviceble, Worker * worker) {
+	serviceble->worker = worker;
+}
 
-	serviceble = (ServiceBle *)user_data;
+/**
+ * Apply the runtime settings to the service. Chunk sizes apply to sessions
+ * created from now on, the cycle timings from the next cycle check, and the
+ * advertising mode from the next time advertising starts.
+ *
+ * @param serviceble the service to configure
+ * @param config the settings to use
+ */
+void serviceble_set_config(ServiceBle * serviceble, Config const * config) {
+	serviceble->cycleinterval = config->cycleinterval;
+	serviceble->cyclebackoffmax = config->cyclebackoffmax;
+	serviceble->cyclejitter = config->cyclejitter;
+	serviceble->secondaryinterval = config->secondaryinterval;
+	serviceble->bufferkeep = config->bufferkeep;
+	g_free(serviceble->advertname);
+	serviceble->advertname = g_strdup(config->advertisingname);
+	hcicontroller_set_name(serviceble->hcicontroller, config->advertisingname);
+	serviceble->maxsessions = config->maxsessions;
+	serviceble->maxsendsize = config->maxsendsize;
+	serviceble->charlength = config->characteristiclength;
+	serviceble_set_send_window(serviceble, config->sendwindow);
+	if (serviceble_set_advertising_profile(serviceble, config->advertisingprofile) == FALSE) {
+		ASYNCLOG(LOG_ERR, "Invalid advertising profile %s, using the default\n", config->advertisingprofile);
+	}
+	if (hcicontroller_set_mode_string(serviceble->hcicontroller, config->advertisingmode) == FALSE) {
+		ASYNCLOG(LOG_ERR, "Invalid advertising mode %s, using the default\n", config->advertisingmode);
+	}
+}
 
-	GVariant * variant;
+/**
+ * Create the state for talking to a central, including its protocol state
+ * machine, which is started straight away.
+ *
+ * @param serviceble the service the session belongs to
+ * @param device the device object path of the central
+ * @return the new session
+ */
+static Session * session_new(ServiceBle * serviceble, gchar const * device) {
+	Session * session;
+	gint64 * connecttime;
+
+	session = CALLOC(sizeof(Session), 1);
+
+	session->serviceble = serviceble;
+	session->device = g_strdup(device);
+	session->fsmservice = fsmservice_new();
+	session->timeoutid = 0;
+	session->connected = FALSE;
+	session->remaining_write = 0;
+	session->buffer_write = buffer_new(0);
+	session->sendqueue = g_queue_new();
+	session->messagessent = 0;
+	session->fsmjobs = g_queue_new();
+	session->fsmbusy = FALSE;
+	session->framing = FRAMING_VERSION_1;
+	session->capabilities = 0;
+	session->address = 0;
+	session->compress = compress_new();
+	session->framingreceive = framing_receive_new();
+	session->sendmsgid = 0;
+	session->unacked = NULL;
+	session->acktimeoutid = 0;
+	session->ackretries = 0;
+	session->traceid = trace_session(device);
+	session->tracereceive = 0;
+	session->connectedat = 0;
+	reset_mtu(session);
+
+	// Carry over when the central connected, if we saw it
+	connecttime = g_hash_table_lookup(serviceble->connecttimes, device);
+	if (connecttime != NULL) {
+		session->connectedat = *connecttime;
+		g_hash_table_remove(serviceble->connecttimes, device);
+	}
 
-	printf("Read value: %s\n", serviceble->characteristic_incoming);
+	// The state machine calls these on the worker thread
+	fsmservice_set_functions(session->fsmservice, session_post_write, session_post_set_timeout, session_post_error, session_post_listen, session_post_disconnect, session_post_authenticated, session_post_ended, session_post_status_updated);
+	fsmservice_set_userdata(session->fsmservice, session);
+	fsmservice_set_continuous(session->fsmservice, TRUE);
 
-	variant = g_variant_new_from_data (G_VARIANT_TYPE("ay"), serviceble->characteristic_incoming, serviceble->charlength, TRUE, NULL, NULL);
+#ifndef SERVICEBLE_ECHO
+	session_fsm(session, FSMJOB_START, NULL, 0);
+#endif
 
-	gatt_characteristic1_complete_read_value(object, invocation, variant);
-	
-	return TRUE;
+	return session;
 }
 
+/**
+ * Free a session. Called by the session table when the session is removed,
+ * which mustn't happen while its state machine is running on the worker.
+ *
+ * @param session the session to free
+ */
+static void session_delete(Session * session) {
+	if (session != NULL) {
+		if (session->serviceble->writesession == session) {
+			release_write(session->serviceble);
+		}
 
+		if (session->timeoutid != 0) {
+			g_source_remove(session->timeoutid);
+			session->timeoutid = 0;
+		}
 
-static void send_data(ServiceBle * serviceble, char const * data, size_t size) {
-	GVariant * variant;
-	size_t sendsize;
-	size_t buffersize;
-	char * sendstart;
-	//GVariant * variant2;
-
-	// Store the data to send
-	buffer_append_lengthprepend(serviceble->buffer_read, data, size);
-
-	// Send in chunks
-	buffersize = buffer_get_pos(serviceble->buffer_read);
+		if (session->acktimeoutid != 0) {
+			g_source_remove(session->acktimeoutid);
+			session->acktimeoutid = 0;
+		}
 
-	while (buffersize > 0) {
-		sendsize = buffersize - serviceble->sendpos;
-		sendstart = buffer_get_buffer(serviceble->buffer_read) + serviceble->sendpos;
-		if (sendsize > serviceble->maxsendsize) {
-			sendsize = serviceble->maxsendsize;
+		if (session->fsmjobs) {
+			g_queue_free_full(session->fsmjobs, (GDestroyNotify)fsm_job_delete);
+			session->fsmjobs = NULL;
 		}
 
-		if (sendsize > 0) {
-			printf("Sending chunk size %lu\n", sendsize);
-			variant = g_variant_new_from_data (G_VARIANT_TYPE("ay"), sendstart, sendsize, TRUE, NULL, NULL);
+		if (session->fsmservice != NULL) {
+			fsmservice_set_functions(session->fsmservice, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+			fsmservice_set_userdata(session->fsmservice, NULL);
+			fsmservice_delete(session->fsmservice);
+			session->fsmservice = NULL;
+		}
 
-			gatt_characteristic1_set_value (serviceble->gattcharacteristic_outgoing, variant);
-			g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(serviceble->gattcharacteristic_outgoing));
+		if (session->sendqueue) {
+			send_clear(session);
+			g_queue_free(session->sendqueue);
+			session->sendqueue = NULL;
+		}
 
-			serviceble->sendpos += sendsize;
-			if (serviceble->sendpos >= buffersize) {
-				buffer_clear(serviceble->buffer_read);
-				serviceble->sendpos = 0;
-				buffersize = 0;
-			}
+		if (session->buffer_write) {
+			buffer_delete(session->buffer_write);
+			session->buffer_write = NULL;
 		}
-		else {
-			printf("WARNING: send data size must be greater than zero\n");
+
+		if (session->framingreceive) {
+			framing_receive_delete(session->framingreceive);
+			session->framingreceive = NULL;
 		}
-	}
 
+		if (session->compress) {
+			compress_delete(session->compress);
+			session->compress = NULL;
+		}
 
-	//variant1 = g_variant_new_from_data (G_VARIANT_TYPE("ay"), "", 0, TRUE, NULL, NULL);
+		g_free(session->device);
+		session->device = NULL;
 
-	//gatt_characteristic1_set_value (gattcharacteristic_outgoing, variant2);
-	//g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(gattcharacteristic_outgoing));
+		FREE(session);
+		session = NULL;
+	}
 }
 
-static gboolean handle_write_value(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, GVariant *arg_value, GVariant *arg_options, gpointer user_data) {
-	ServiceBle * serviceble = (ServiceBle *)user_data;
+/**
+ * Find the session for the central making a method call, creating one if
+ * this is the first we've heard from it. Centrals are identified by the
+ * device path in the method options; older versions of BlueZ don't pass
+ * this, in which case all calls share a single session.
+ *
+ * @param serviceble the service being called
+ * @param options the a{sv} options dictionary passed with the method call
+ * @return the session, or NULL if there's no room for another one
+ */
+static Session * session_get(ServiceBle * serviceble, GVariant * options) {
+	gchar const * device;
+	Session * session;
 
-	GVariantIter * iter;
-	guchar data;
+	device = session_device(options);
+	session = session_lookup(serviceble, device);
 
-	if (serviceble->connected == FALSE) {
-		serviceble->connected = TRUE;
-		set_state(serviceble, SERVICESTATEBLE_CONNECTED);
-		fsmservice_connected(serviceble->fsmservice);
+	if ((session == NULL) && ((g_hash_table_size(serviceble->sessions) < serviceble->maxsessions) || (session_evict(serviceble) == TRUE))) {
+		ASYNCLOG(LOG_INFO, "New session for %s\n", device);
+		session = session_new(serviceble, device);
+		g_hash_table_insert(serviceble->sessions, session->device, session);
 	}
 
-	g_variant_get(arg_value, "ay", &iter);
-
-	serviceble->charlength = 0;
-	while ((g_variant_iter_loop(iter, "y", &data) && (serviceble->charlength < (CHARACTERISTIC_LENGTH - 1)))) {
-		serviceble->characteristic_outgoing[serviceble->charlength] = data;
-		serviceble->charlength++;
+	if (session != NULL) {
+		update_mtu(session, options);
 	}
-	g_variant_iter_free(iter);
-
-	serviceble->characteristic_outgoing[serviceble->charlength] = 0;
 
-	if ((serviceble->remaining_write == 0) && (serviceble->charlength > 5)) {
-		buffer_clear(serviceble->buffer_write);
-
-		// We can read off the length
-		serviceble->remaining_write = 0;
-		serviceble->remaining_write |= ((unsigned char)serviceble->characteristic_outgoing[1]) << 24;
-		serviceble->remaining_write |= ((unsigned char)serviceble->characteristic_outgoing[2]) << 16;
-		serviceble->remaining_write |= ((unsigned char)serviceble->characteristic_outgoing[3]) << 8;
-		serviceble->remaining_write |= ((unsigned char)serviceble->characteristic_outgoing[4]) << 0;
-		printf("Receiving length: %ld\n", serviceble->remaining_write);
+	return session;
+}
 
-		printf("Received chunk: %d\n", serviceble->characteristic_outgoing[0]);
-		//printf("Write value: %s\n", characteristic_outgoing + 5);
+/**
+ * Find the session for a central that wants to exchange data with us,
+ * refusing it if it can't be served alongside the centrals already
+ * connected. The refused central isn't given a session, so it doesn't take
+ * up one of the slots either.
+ *
+ * @param serviceble the service being called
+ * @param invocation the method call, which is returned an error if refused
+ * @param options the a{sv} options dictionary passed with the method call
+ * @param data the chunk being written, or NULL for an acquire
+ * @param length the number of bytes of data
+ * @return the session, or NULL if the call has been refused
+ */
+static Session * session_claim(ServiceBle * serviceble, GDBusMethodInvocation * invocation, GVariant * options, guchar const * data, gsize length) {
+	gchar const * device;
+	Session * session;
 
-		buffer_append(serviceble->buffer_write, serviceble->characteristic_outgoing + 5, serviceble->charlength - 5);
+	device = session_device(options);
+	session = NULL;
 
-		serviceble->remaining_write -= serviceble->charlength - 5;
+	if (session_may_join(serviceble, device, data, length) == FALSE) {
+		ASYNCLOG(LOG_INFO, "Refusing %s while serving %u other devices\n", device, sessions_connected(serviceble));
+		g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.InProgress", "Serving another device");
 	}
 	else {
-		if ((serviceble->charlength - 1) > serviceble->remaining_write) {
-			printf("Error, received too many bytes (%d out of %lu)\n", serviceble->charlength - 1, serviceble->remaining_write);
+		session = session_get(serviceble, options);
+		if (session == NULL) {
+			ASYNCLOG(LOG_ERR, "No room for another session\n");
+			g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.Failed", "Too many devices");
 		}
-		else {
-			printf("Received chunk: %d\n", serviceble->characteristic_outgoing[0]);
-			//printf("Write value: %s\n", characteristic_outgoing + 1);
+	}
+
+	return session;
+}
+
+/**
+ * Get the device a method call comes from.
+ *
+ * @param options the a{sv} options dictionary passed with the method call
+ * @return the device object path, or SESSION_DEVICE_UNKNOWN if BlueZ
+ *         didn't pass one
+ */
+static gchar const * session_device(GVariant * options) {
+	gchar const * device;
+
+	if ((options == NULL) || (g_variant_lookup(options, "device", "&o", &device) == FALSE)) {
+		device = SESSION_DEVICE_UNKNOWN;
+	}
+
+	return device;
+}
+
+/**
+ * Check whether any central other than the given one is being served.
+ *
+ * @param serviceble the service to check
+ * @param device the device object path of the central
+ * @return TRUE if another central's session is connected, FALSE o/w
+ */
+static bool session_shared(ServiceBle * serviceble, gchar const * device) {
+	GHashTableIter iter;
+	Session * session;
+	bool shared;
+
+	shared = FALSE;
+	g_hash_table_iter_init(&iter, serviceble->sessions);
+	while ((shared == FALSE) && g_hash_table_iter_next(&iter, NULL, (gpointer *)&session)) {
+		shared = (session->connected == TRUE) && (g_strcmp0(session->device, device) != 0);
+	}
+
+	return shared;
+}
 
-			buffer_append(serviceble->buffer_write, serviceble->characteristic_outgoing + 1, serviceble->charlength - 1);
+/**
+ * Check whether a central can be served alongside those already connected.
+ * Notifications go to every subscribed central, so sharing is only possible
+ * when each central can pick out its own chunks by their address: every
+ * central already being served must be addressed, and a new one must join
+ * with a hello asking to be addressed by an address not yet in use. A
+ * central that's already being served carries on.
+ *
+ * @param serviceble the service being called
+ * @param device the device object path of the central
+ * @param data the chunk being written, or NULL for an acquire
+ * @param length the number of bytes of data
+ * @return TRUE if the central can be served, FALSE o/w
+ */
+static bool session_may_join(ServiceBle * serviceble, gchar const * device, guchar const * data, gsize length) {
+	GHashTableIter iter;
+	Session * session;
+	bool join;
+	guint8 address;
+
+	session = session_lookup(serviceble, device);
+	if ((session_shared(serviceble, device) == FALSE) || ((session != NULL) && (session->connected == TRUE))) {
+		return TRUE;
+	}
 
-			serviceble->remaining_write -= serviceble->charlength - 1;
+	join = TRUE;
+	g_hash_table_iter_init(&iter, serviceble->sessions);
+	while ((join == TRUE) && g_hash_table_iter_next(&iter, NULL, (gpointer *)&session)) {
+		if ((session->connected == TRUE) && (session_addressed(session) == FALSE)) {
+			join = FALSE;
 		}
 	}
-	
-	if (serviceble->remaining_write == 0) {
-		printf("Received: ");
-		buffer_print(serviceble->buffer_write);
 
-		fsmservice_read(serviceble->fsmservice, buffer_get_buffer(serviceble->buffer_write), buffer_get_pos(serviceble->buffer_write));
+	if ((join == TRUE) && (data != NULL)) {
+		// Only a hello asking to be addressed can start a shared session
+		join = (length >= REASSEMBLY_HEADER) && (framing_hello_version(data + REASSEMBLY_HEADER, length - REASSEMBLY_HEADER) >= FRAMING_VERSION_2) && framing_hello_address(data + REASSEMBLY_HEADER, length - REASSEMBLY_HEADER, &address) && (session_address_used(serviceble, NULL, address) == FALSE);
 	}
 
-	gatt_characteristic1_complete_write_value(object, invocation);
+	return join;
+}
 
-	return TRUE;
+/**
+ * Check whether a connected central other than the given one is already
+ * addressed by an address.
+ *
+ * @param serviceble the service to check
+ * @param session the session asking for the address, or NULL if it has none
+ * @param address the address asked for
+ * @return TRUE if the address is taken, FALSE o/w
+ */
+static bool session_address_used(ServiceBle * serviceble, Session * session, guint8 address) {
+	GHashTableIter iter;
+	Session * other;
+	bool used;
+
+	used = FALSE;
+	g_hash_table_iter_init(&iter, serviceble->sessions);
+	while ((used == FALSE) && g_hash_table_iter_next(&iter, NULL, (gpointer *)&other)) {
+		used = (other != session) && (other->connected == TRUE) && session_addressed(other) && (other->address == address);
+	}
+
+	return used;
 }
 
-static gboolean handle_start_notify(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, gpointer user_data) {
-	printf("Start notify\n");
+/**
+ * Check whether everything sent to a session's central carries its address.
+ *
+ * @param session the session to check
+ * @return TRUE if the session uses addressed framing, FALSE o/w
+ */
+static bool session_addressed(Session * session) {
+	return (session->framing == FRAMING_VERSION_2) && ((session->capabilities & FRAMING_CAPABILITY_ADDRESSED) != 0);
+}
 
-	gatt_characteristic1_complete_start_notify(object, invocation);
-	
-	return TRUE;
+/**
+ * Get the size of the chunks sent to a session's central, leaving room for
+ * its address if it has one.
+ *
+ * @param session the session to check
+ * @return the maximum number of bytes per chunk, excluding any address
+ */
+static gsize session_chunk_size(Session * session) {
+	return session_addressed(session) ? (session->maxsendsize - FRAMING_ADDRESS_SIZE) : session->maxsendsize;
 }
 
-static gboolean handle_stop_notify(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, gpointer user_data) {
-	printf("Stop notify\n");
+/**
+ * Find an existing session.
+ *
+ * @param serviceble the service to search
+ * @param device the device object path of the central
+ * @return the session, or NULL if there isn't one for the device
+ */
+static Session * session_lookup(ServiceBle * serviceble, gchar const * device) {
+	return (Session *)g_hash_table_lookup(serviceble->sessions, device);
+}
 
-	gatt_characteristic1_complete_stop_notify(object, invocation);
-	
-	return TRUE;
+/**
+ * Make room for a new session by removing one whose central is no longer
+ * connected and whose state machine isn't running.
+ *
+ * @param serviceble the service to remove a session from
+ * @return TRUE if a session was removed, FALSE if they're all in use
+ */
+static bool session_evict(ServiceBle * serviceble) {
+	GHashTableIter iter;
+	Session * session;
+	bool evicted;
+
+	evicted = FALSE;
+	g_hash_table_iter_init(&iter, serviceble->sessions);
+	while ((evicted == FALSE) && g_hash_table_iter_next(&iter, NULL, (gpointer *)&session)) {
+		if ((session->connected == FALSE) && (serviceble->sendingsession != session) && (session->fsmbusy == FALSE)) {
+			ASYNCLOG(LOG_INFO, "Removing idle session for %s\n", session->device);
+			g_hash_table_iter_remove(&iter);
+			evicted = TRUE;
+		}
+	}
+
+	return evicted;
 }
 
 /**
- * Deal with errors by printing them to stderr if there is one, then freeing 
- * and clearning the error structure.
+ * Note that a session's central is connected, telling its state machine.
  *
- * @param error the error structure to check and report if it exists
- * @param hint a human-readable hint that will be output alongside the error
+ * @param session the session that's been connected
  */
-static void report_error(GError ** error, char const * hint) {
-	if (*error) {
-		fprintf(stderr, "Error %s: %s\n", hint, (*error)->message);
-		g_error_free(*error);
-		*error = NULL;
+static void session_connected(Session * session) {
+	if (session->connected == FALSE) {
+		session->connected = TRUE;
+		set_state(session->serviceble, SERVICESTATEBLE_CONNECTED);
+#ifndef SERVICEBLE_ECHO
+		session_fsm(session, FSMJOB_CONNECTED, NULL, 0);
+#endif
 	}
 }
 
 /**
- * Advertisement registration callback
+ * Tidy up after a central has gone away, leaving the session's state
+ * machine listening for it to come back.
  *
- * @param proxy the advertisement manager proxy object
- * @param res the result of the operation
- * @param user_data the user data passed to the async callback
+ * @param session the session that's been disconnected
  */
-static void on_register_advert(LEAdvertisingManager1 *proxy, GAsyncResult *res, gpointer user_data) {
-	gboolean result;
-	GError *error;
+static void session_disconnected(Session * session) {
+	ServiceBle * serviceble = session->serviceble;
+
+	if (session->connected == TRUE) {
+		ASYNCLOG(LOG_INFO, "Setting %s as disconnected\n", session->device);
+		session->connected = FALSE;
+		session->remaining_write = 0;
+		buffer_clear(session->buffer_write);
+		send_clear(session);
+		reset_mtu(session);
+
+		if (session->capabilities & FRAMING_CAPABILITY_COMPRESSION) {
+			ASYNCLOG(LOG_INFO, "Compression for %s: %lu bytes sent as %lu\n", session->device, compress_get_bytes_in(session->compress), compress_get_bytes_out(session->compress));
+		}
 
-	error = NULL;
+		// The central has to ask for version 2 framing again when it returns
+		session->framing = FRAMING_VERSION_1;
+		session->capabilities = 0;
+		session->address = 0;
+		framing_receive_reset(session->framingreceive);
+		session->sendmsgid = 0;
+		session_trim(session);
 
-	result = leadvertising_manager1_call_unregister_advertisement_finish(proxy, res, &error);
-	report_error(&error, "registering advert callback");
+		if (serviceble->writesession == session) {
+			release_write(serviceble);
+		}
 
-	printf("Registered advert with result %d\n", result);
+		if ((serviceble->state == SERVICESTATEBLE_CONNECTED) && (sessions_connected(serviceble) == 0)) {
+			set_state(serviceble, SERVICESTATEBLE_ADVERTISING);
+		}
 
-	printf("Setting advertising frequency\n");
-	set_advertising_frequency();
-	printf("Advertising frequency set\n");
+#ifndef SERVICEBLE_ECHO
+		session_fsm(session, FSMJOB_DISCONNECTED, NULL, 0);
+#endif
+	}
 }
 
-static void on_register_application(GattManager1 *proxy, GAsyncResult *res, gpointer user_data) {
-	gboolean result;
-	GError *error;
-
-	error = NULL;
+/**
+ * Give back memory the session has finished with. Receive buffers grown
+ * beyond the keep size by an unusually large message are freed once it's
+ * been received, so that a long-lived session doesn't hold on to them.
+ *
+ * @param session the session to trim
+ */
+static void session_trim(Session * session) {
+	ServiceBle * serviceble = session->serviceble;
 
-	result = gatt_manager1_call_register_application_finish(proxy, res, &error);
-	report_error(&error, "registering application callback");
+	if ((session->remaining_write == 0) && (buffer_get_size(session->buffer_write) > serviceble->bufferkeep)) {
+		ASYNCLOG(LOG_DEBUG, "Freeing %lu byte receive buffer for %s\n", buffer_get_size(session->buffer_write), session->device);
+		buffer_delete(session->buffer_write);
+		session->buffer_write = buffer_new(0);
+	}
 
-	printf("Registered application with result %d\n", result);
+	framing_receive_trim(session->framingreceive, serviceble->bufferkeep);
 }
 
 /**
- * Advertisement unregistration callback
+ * Device disconnection callback
  *
- * @param proxy the advertisement manager proxy object
+ * @param connection the bus connection
  * @param res the result of the operation
- * @param user_data the user data passed to the async callback
+ * @param user_data reference to the session being disconnected
  */
-static void on_unregister_advert(LEAdvertisingManager1 *proxy, GAsyncResult *res, gpointer user_data) {
-	ServiceBle * serviceble = (ServiceBle *)user_data;
-	gboolean result;
-	GError *error;
+static void on_device_disconnect(GDBusConnection * connection, GAsyncResult * res, gpointer user_data) {
+	SessionRef * ref = (SessionRef *)user_data;
+	Session * session;
+	GError * error;
+	GVariant * result;
 
 	error = NULL;
 
-	result = leadvertising_manager1_call_unregister_advertisement_finish(proxy, res, &error);
-	report_error(&error, "unregistering advert callback");
-
-	printf("Unregistered advert with result %d\n", result);
-
-	set_state(serviceble, SERVICESTATEBLE_UNADVERTISED);
-
-	// All stopped
-	if (serviceble->connected == TRUE) {
-		printf("Setting as disconnected\n");
-		serviceble->connected = FALSE;
-		fsmservice_disconnected(serviceble->fsmservice);
+	result = g_dbus_connection_call_finish(connection, res, &error);
+	report_error(&error, "disconnecting device");
+	if (result != NULL) {
+		g_variant_unref(result);
 	}
 
-	if (serviceble->finalise == TRUE) {
-		finalise(serviceble);
+	session = session_ref_get(ref);
+	if (session != NULL) {
+		session_disconnected(session);
 	}
-}
 
-static gboolean key_event(GtkWidget *widget, GdkEventKey *event, gpointer user_data) {
-	ServiceBle * serviceble = (ServiceBle *)user_data;
+	session_ref_delete(ref);
+}
 
+/**
+ * Act on BlueZ reporting that a device has connected to or disconnected from
+ * the service's adapter, so that a central dropping out is noticed straight
+ * away rather than when the state machine times out. Sessions still start
+ * with a central's first write, since the adapter's other connections are
+ * reported here too.
+ *
+ * @param serviceble the service on the device's adapter
+ * @param device the device object path
+ * @param connected whether the device is now connected
+ */
+void serviceble_device_connected(ServiceBle * serviceble, gchar const * device, bool connected) {
+	Session * session;
+	gint64 * connecttime;
+
+	session = session_lookup(serviceble, device);
+
+	// Note when each central connects, to time how long it takes to write
+	if ((connected == TRUE) && (session != NULL) && (session->connected == FALSE)) {
+		session->connectedat = g_get_monotonic_time();
+	}
+	else if ((connected == TRUE) && (session == NULL) && (g_hash_table_contains(serviceble->connecttimes, device) == FALSE)) {
+		connecttime = g_new(gint64, 1);
+		*connecttime = g_get_monotonic_time();
+		g_hash_table_insert(serviceble->connecttimes, g_strdup(device), connecttime);
+	}
+	else if (connected == FALSE) {
+		g_hash_table_remove(serviceble->connecttimes, device);
+	}
+
+	if (connected == TRUE) {
+		g_hash_table_add(serviceble->linked, g_strdup(device));
+	}
+	else {
+		g_hash_table_remove(serviceble->linked, device);
+	}
+
+	if ((connected == TRUE) && (serviceble->writesession != NULL) && (g_strcmp0(serviceble->writesession->device, device) != 0)) {
+		// Its writes would arrive on the socket as if they were from the
+		// central that acquired it, so go back to WriteValue, which says who
+		// each write is from
+		ASYNCLOG(LOG_INFO, "Releasing write socket now %s has connected\n", device);
+		release_write(serviceble);
+	}
+
+	if ((session == NULL) || (session->connected == connected)) {
+		// The controller stops our connectable set when any central connects
+		// through it, including those that never wrote to us or were refused
+		if ((connected == FALSE) && (serviceble->advertsets == TRUE) && (serviceble->state == SERVICESTATEBLE_ADVERTISING) && (serviceble->cycling == FALSE)) {
+			ASYNCLOG(LOG_INFO, "Enabling advertising sets again after %s\n", device);
+			hcicontroller_profile_apply(serviceble->hcicontroller);
+		}
+		return;
+	}
+
+	if (connected == TRUE) {
+		ASYNCLOG(LOG_INFO, "Device %s connected\n", device);
+		trace_instant("device connected", session->traceid, 0);
+		if (session_shared(serviceble, device) == FALSE) {
+			session_connected(session);
+		}
+		else {
+			// It has to join with an addressed hello, like any other central
+			ASYNCLOG(LOG_INFO, "Waiting for %s to ask to be addressed while serving %u other devices\n", device, sessions_connected(serviceble));
+		}
+	}
+	else {
+		ASYNCLOG(LOG_INFO, "Device %s disconnected\n", device);
+		trace_instant("device disconnected", session->traceid, 0);
+		session_disconnected(session);
+
+		if ((serviceble->state == SERVICESTATEBLE_ADVERTISING) && (serviceble->cycling == FALSE)) {
+			// The controller stopped advertising when the central connected, so
+			// enable it again now, from the fastest step of the profile
+			ASYNCLOG(LOG_INFO, "Advertising again\n");
+			hcicontroller_profile_start(serviceble->hcicontroller);
+		}
+	}
+}
+
+/**
+ * Refer to a session from an asynchronous callback. The session may have
+ * been removed by the time the callback happens, so it's looked up again by
+ * its device path rather than held directly.
+ *
+ * @param session the session to refer to
+ * @return the reference, to be freed with session_ref_delete()
+ */
+static SessionRef * session_ref_new(Session * session) {
+	SessionRef * ref;
+
+	ref = g_new0(SessionRef, 1);
+	ref->serviceble = session->serviceble;
+	ref->device = g_strdup(session->device);
+	ref->serviceble->refs++;
+
+	return ref;
+}
+
+/**
+ * Get the session a reference refers to.
+ *
+ * @param ref the reference
+ * @return the session, or NULL if it's since been removed
+ */
+static Session * session_ref_get(SessionRef * ref) {
+	return session_lookup(ref->serviceble, ref->device);
+}
+
+static void session_ref_delete(SessionRef * ref) {
+	ref->serviceble->refs--;
+	serviceble_delete_check(ref->serviceble);
+	g_free(ref->device);
+	g_free(ref);
+}
+
+/**
+ * Count the sessions whose centrals are currently connected.
+ *
+ * @param serviceble the service to count the sessions of
+ * @return the number of connected sessions
+ */
+static guint sessions_connected(ServiceBle * serviceble) {
+	GHashTableIter iter;
+	Session * session;
+	guint count;
+
+	count = 0;
+	g_hash_table_iter_init(&iter, serviceble->sessions);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&session)) {
+		if (session->connected == TRUE) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Handle the advertisement release signal.
+ *
+ * @param object the advertisement object being released
+ * @param invocation the message invocation details
+ * @param user_data the user data passed to the signal connect
+ */
+static gboolean handle_release(LEAdvertisement1 * object, GDBusMethodInvocation * invocation, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+
+	ASYNCLOG(LOG_INFO, "Advert released\n");
+
+	// We didn't unregister it, so bluetoothd has dropped it and it needs
+	// registering again
+	if ((serviceble->cycling == FALSE) && (serviceble->finalise == FALSE) && ((serviceble->state == SERVICESTATEBLE_ADVERTISING) || (serviceble->state == SERVICESTATEBLE_ADVERTISINGCONTINUOUS))) {
+		cycle_request(serviceble, RECYCLE_ADVERT_LOST);
+	}
+
+	leadvertisement1_complete_release(object, invocation);
+	
+	return TRUE;
+}
+
+static gboolean handle_read_value(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, GVariant *arg_options, gpointer user_data) {
+	ServiceBle * serviceble;
+	Session * session;
+	int charlength;
+
+	serviceble = (ServiceBle *)user_data;
+
+	GVariant * variant;
+
+	// Only look the session up, since a read alone shouldn't take up a slot
+	session = session_lookup(serviceble, session_device(arg_options));
+	if (session != NULL) {
+		update_mtu(session, arg_options);
+	}
+	charlength = (session != NULL) ? session->charlength : serviceble->charlength;
+
+	ASYNCLOG_HEX(LOG_DEBUG, "Read value: ", serviceble->characteristic_incoming, charlength);
+
+	variant = g_variant_new_from_data (G_VARIANT_TYPE("ay"), serviceble->characteristic_incoming, charlength, TRUE, NULL, NULL);
+
+	gatt_characteristic1_complete_read_value(object, invocation, variant);
+	
+	return TRUE;
+}
+
+/**
+ * Size the outgoing chunks and the read value from the ATT MTU negotiated
+ * with the central, as passed by BlueZ in the method options.
+ *
+ * @param session the session to update
+ * @param options the a{sv} options dictionary passed with the method call
+ */
+static void update_mtu(Session * session, GVariant * options) {
+	guint16 mtu;
+
+	if (options == NULL) {
+		return;
+	}
+
+	if (g_variant_lookup(options, "mtu", "q", &mtu) && (mtu != session->mtu)) {
+		session->mtu = mtu;
+		session->maxsendsize = CLAMP((int)mtu - ATT_HEADER_NOTIFY, MIN_SEND_SIZE, ATT_MAX_VALUE_LENGTH);
+		session->charlength = CLAMP((int)mtu - ATT_HEADER_READ, 0, ATT_MAX_VALUE_LENGTH);
+
+		ASYNCLOG(LOG_INFO, "MTU %u negotiated with %s, sending chunks of %lu\n", mtu, session->device, session->maxsendsize);
+	}
+}
+
+/**
+ * Return to the configured chunk sizes, for use until BlueZ tells us the MTU
+ * of the central's next connection.
+ *
+ * @param session the session to reset
+ */
+static void reset_mtu(Session * session) {
+	session->mtu = 0;
+	session->maxsendsize = session->serviceble->maxsendsize;
+	session->charlength = session->serviceble->charlength;
+}
+
+
+/**
+ * Chunk flush details, passed to the flush callback so that it can tell
+ * whether the chunk was the last of its message.
+ */
+typedef struct _SendFlush {
+	ServiceBle * serviceble;
+	SessionRef * ref;
+	gsize messagesize;
+} SendFlush;
+
+/**
+ * Queue data to be sent to a central. With version 1 framing the data is
+ * framed with a four-byte big-endian length prefix (the same format as
+ * buffer_append_lengthprepend()) and then sent out in chunks; with version 2
+ * each chunk carries a header giving its place in the message, and the
+ * message is kept until the central acknowledges it. Chunks are sent one per
+ * main loop dispatch, with at most sendwindow chunks awaiting a flush to the
+ * bus at any one time.
+ *
+ * Notifications go to every subscribed central, so sessions take it in turns
+ * to send, a whole message at a time, and each chunk for an addressed
+ * session is prefixed with its address.
+ *
+ * @param session the session to send the data to
+ * @param data the data to send
+ * @param size the number of bytes of data to send
+ */
+static void send_data(Session * session, char const * data, size_t size) {
+	SendItem * item;
+
+	item = frame_message(session, data, size);
+	item->tracequeued = trace_now();
+	g_queue_push_tail(session->sendqueue, item);
+
+	send_queue_session(session);
+	send_schedule(session->serviceble);
+}
+
+/**
+ * Frame a message ready for sending. The result references a single
+ * allocation that the chunks are then sliced from; only version 2 chunks,
+ * which need their own headers, are copied again.
+ *
+ * @param session the session the message is for
+ * @param data the message data to frame
+ * @param size the number of bytes of message data
+ * @return the message ready to queue, to be freed with send_item_delete()
+ */
+static SendItem * frame_message(Session * session, char const * data, size_t size) {
+	SendItem * item;
+	GBytes * bytes;
+
+	if (session->framing == FRAMING_VERSION_2) {
+		if (session->capabilities & FRAMING_CAPABILITY_COMPRESSION) {
+			bytes = compress_encode(session->compress, (guchar const *)data, size);
+			ASYNCLOG(LOG_DEBUG, "Compressed %lu bytes to %lu for %s\n", size, g_bytes_get_size(bytes), session->device);
+		}
+		else {
+			bytes = g_bytes_new(data, size);
+		}
+
+		item = send_item_new(bytes, 0, g_bytes_get_size(bytes), TRUE);
+		item->msgid = session->sendmsgid++;
+		item->crc = framing_crc32(g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes));
+	}
+	else {
+		bytes = framing_prefix_length((guchar const *)data, size);
+		item = send_item_new(bytes, 0, g_bytes_get_size(bytes), FALSE);
+	}
+	item->messagesize = size;
+
+	return item;
+}
+
+/**
+ * Create an item to be sent.
+ *
+ * @param bytes the data to slice chunks from, which the item takes ownership of
+ * @param start the position to start sending from
+ * @param end the position to stop sending at
+ * @param headers TRUE to add a version 2 header to each chunk
+ * @return the item, to be freed with send_item_delete()
+ */
+static SendItem * send_item_new(GBytes * bytes, gsize start, gsize end, bool headers) {
+	SendItem * item;
+
+	item = g_new0(SendItem, 1);
+	item->bytes = bytes;
+	item->start = start;
+	item->end = end;
+	item->headers = headers;
+	item->retransmit = FALSE;
+	item->msgid = 0;
+	item->crc = 0;
+	item->messagesize = 0;
+	item->tracequeued = 0;
+
+	return item;
+}
+
+static void send_item_delete(SendItem * item) {
+	if (item != NULL) {
+		g_bytes_unref(item->bytes);
+		g_free(item);
+	}
+}
+
+/**
+ * Queue a control chunk, such as an ACK or NACK, to go ahead of anything
+ * else waiting to be sent to the central.
+ *
+ * @param session the session to send the chunk to
+ * @param chunk the chunk, which is taken ownership of
+ */
+static void send_control(Session * session, GBytes * chunk) {
+	g_queue_push_head(session->sendqueue, send_item_new(chunk, 0, g_bytes_get_size(chunk), FALSE));
+
+	send_queue_session(session);
+	send_schedule(session->serviceble);
+}
+
+/**
+ * Check whether a session has something it can send now. A new version 2
+ * message has to wait until the previous one has been acknowledged, but
+ * control chunks and parts being sent again can always go.
+ *
+ * @param session the session to check
+ * @return TRUE if the next item in the session's queue can be sent
+ */
+static bool send_ready(Session * session) {
+	SendItem * item;
+
+	item = (SendItem *)g_queue_peek_head(session->sendqueue);
+
+	return (item != NULL) && ((session->unacked == NULL) || (item->headers == FALSE) || (item->retransmit == TRUE));
+}
+
+/**
+ * Put a session in line to send, if it has something to send and isn't
+ * already in line or sending.
+ *
+ * @param session the session to queue
+ */
+static void send_queue_session(Session * session) {
+	ServiceBle * serviceble = session->serviceble;
+
+	if ((serviceble->sendingsession != session) && (g_queue_find(serviceble->sendsessions, session) == NULL) && send_ready(session)) {
+		// Join the back of the queue of sessions waiting their turn
+		g_queue_push_tail(serviceble->sendsessions, session);
+	}
+}
+
+/**
+ * Arrange for the next chunk to be sent, as long as there's something to
+ * send and the in-flight window isn't already full.
+ *
+ * @param serviceble the service to schedule sending for
+ */
+static void send_schedule(ServiceBle * serviceble) {
+	if ((serviceble->sendidleid == 0) && (serviceble->notifywritableid == 0) && (serviceble->sendinflight < serviceble->sendwindow)) {
+		if ((serviceble->sending != NULL) || (g_queue_is_empty(serviceble->sendsessions) == FALSE)) {
+			serviceble->sendidleid = g_idle_add(send_next_chunk, serviceble);
+		}
+	}
+}
+
+/**
+ * Main loop callback that sends a single chunk of the current message. If
+ * bluetoothd has acquired the notify socket the chunk is written to it
+ * directly, otherwise it's emitted as a change to the characteristic value.
+ *
+ * @param user_data the service sending the data
+ * @return TRUE if the callback should be called again, FALSE o/w
+ */
+static gboolean send_next_chunk(gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+	Session * session;
+	SendItem * item;
+	GBytes * chunk;
+	gsize sendsize;
+	SendFlush * flush;
+	gboolean sent;
+	guint64 tracestart;
+
+	while ((serviceble->sending == NULL) && (g_queue_is_empty(serviceble->sendsessions) == FALSE)) {
+		// Start the next item from the next session in line that can send
+		serviceble->sendingsession = g_queue_pop_head(serviceble->sendsessions);
+		if (send_ready(serviceble->sendingsession)) {
+			serviceble->sending = g_queue_pop_head(serviceble->sendingsession->sendqueue);
+			serviceble->sendpos = serviceble->sending->start;
+		}
+		else {
+			serviceble->sendingsession = NULL;
+		}
+	}
+
+	session = serviceble->sendingsession;
+	item = serviceble->sending;
+
+	if ((item == NULL) || (serviceble->gattcharacteristic_outgoing == NULL)) {
+		// Nothing to send, or nowhere to send it
+		serviceble->sendidleid = 0;
+		return FALSE;
+	}
+
+	tracestart = trace_now();
+
+	if (item->headers == TRUE) {
+		chunk = framing_chunk_new(item->bytes, item->msgid, item->crc, serviceble->sendpos, item->end, session_chunk_size(session), &sendsize);
+	}
+	else {
+		// The chunk references the framed message rather than copying it
+		sendsize = MIN(item->end - serviceble->sendpos, session_chunk_size(session));
+		chunk = g_bytes_new_from_bytes(item->bytes, serviceble->sendpos, sendsize);
+	}
+
+	if (session_addressed(session)) {
+		chunk = framing_address(chunk, session->address);
+	}
+
+	ASYNCLOG(LOG_DEBUG, "Sending chunk size %lu to %s\n", g_bytes_get_size(chunk), session->device);
+
+	flush = NULL;
+	if (serviceble->notifychannel != NULL) {
+		sent = send_chunk_socket(serviceble, chunk);
+		g_bytes_unref(chunk);
+
+		if (sent == FALSE) {
+			// Either the socket is full and we'll be called back when it drains,
+			// or it's been released and the next attempt will go over D-Bus
+			serviceble->sendidleid = 0;
+			send_schedule(serviceble);
+			return FALSE;
+		}
+	}
+	else {
+		send_chunk_notify(serviceble, chunk);
+		g_bytes_unref(chunk);
+
+		if (serviceble->connection != NULL) {
+			flush = g_new0(SendFlush, 1);
+			flush->serviceble = serviceble;
+			flush->ref = NULL;
+			flush->messagesize = 0;
+		}
+	}
+
+	serviceble->sendpos += sendsize;
+	trace_span("send chunk", session->traceid, tracestart, sendsize);
+
+	if (serviceble->sendpos >= item->end) {
+		// This was the last chunk of the item
+		trace_span("send message", session->traceid, item->tracequeued, item->messagesize);
+		serviceble->sending = NULL;
+		serviceble->sendpos = 0;
+		serviceble->sendingsession = NULL;
+
+		if (item->headers == TRUE) {
+			if (item->retransmit == FALSE) {
+				// Keep the message in case the central asks for parts of it again
+				session->unacked = item;
+				item = NULL;
+			}
+
+			// The acknowledgement, rather than the flush, completes the message
+			if (session->acktimeoutid != 0) {
+				g_source_remove(session->acktimeoutid);
+			}
+			session->acktimeoutid = g_timeout_add(FRAMING_ACK_TIMEOUT, on_ack_timeout, session);
+		}
+		else if (item->messagesize > 0) {
+			if (flush != NULL) {
+				// Report completion once the chunk has been flushed to the bus
+				flush->ref = session_ref_new(session);
+				flush->messagesize = item->messagesize;
+			}
+			else {
+				send_complete(session, item->messagesize);
+			}
+		}
+
+		send_item_delete(item);
+
+		// Give the other sessions a turn before sending the next message
+		send_queue_session(session);
+	}
+
+	if (flush != NULL) {
+		serviceble->sendinflight++;
+		g_dbus_connection_flush(serviceble->connection, NULL, (GAsyncReadyCallback)(&on_send_flushed), flush);
+	}
+
+	if ((serviceble->sendinflight >= serviceble->sendwindow) || ((serviceble->sending == NULL) && g_queue_is_empty(serviceble->sendsessions))) {
+		// Wait for a flush to complete, or for more data to send
+		serviceble->sendidleid = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Queue part of the unacknowledged version 2 message to be sent again.
+ *
+ * @param session the session the message was sent to
+ * @param offset the start of the part to send
+ * @param length the length of the part, or zero for the rest of the message
+ */
+static void send_retransmit(Session * session, gsize offset, gsize length) {
+	SendItem * item;
+	GList * link;
+	gsize size;
+
+	size = g_bytes_get_size(session->unacked->bytes);
+	if ((length == 0) || (offset + length > size)) {
+		length = (offset < size) ? (size - offset) : 0;
+	}
+
+	if ((length > 0) || (size == 0)) {
+		item = send_item_new(g_bytes_ref(session->unacked->bytes), offset, offset + length, TRUE);
+		item->retransmit = TRUE;
+		item->msgid = session->unacked->msgid;
+		item->crc = session->unacked->crc;
+
+		// Queued behind control chunks and other parts, but ahead of new messages
+		link = session->sendqueue->head;
+		while ((link != NULL) && ((((SendItem *)link->data)->headers == FALSE) || (((SendItem *)link->data)->retransmit == TRUE))) {
+			link = link->next;
+		}
+
+		if (link != NULL) {
+			g_queue_insert_before(session->sendqueue, link, item);
+		}
+		else {
+			g_queue_push_tail(session->sendqueue, item);
+		}
+	}
+}
+
+/**
+ * Write a chunk to the acquired notify socket. Each chunk is sent as a
+ * single packet, which bluetoothd forwards as a single notification. The
+ * socket buffer provides the flow control: if it's full, sending resumes
+ * once it becomes writable again.
+ *
+ * @param serviceble the service sending the data
+ * @param chunk the chunk to send
+ * @return TRUE if the chunk was sent, FALSE o/w
+ */
+static gboolean send_chunk_socket(ServiceBle * serviceble, GBytes * chunk) {
+	gconstpointer data;
+	gsize size;
+	ssize_t written;
+
+	data = g_bytes_get_data(chunk, &size);
+	written = send(g_io_channel_unix_get_fd(serviceble->notifychannel), data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+	if (written < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+			serviceble->notifywritableid = g_io_add_watch(serviceble->notifychannel, G_IO_OUT, on_notify_writable, serviceble);
+		}
+		else {
+			ASYNCLOG(LOG_ERR, "Error writing to notify socket: %s\n", strerror(errno));
+			release_notify(serviceble);
+		}
+	}
+
+	return (written >= 0);
+}
+
+/**
+ * Emit a chunk as a PropertiesChanged signal for the outgoing
+ * characteristic's value, which bluetoothd turns into a notification. The
+ * signal is built from a copy of a template message and sent straight on
+ * the connection, rather than having the skeleton compare, queue and emit
+ * it. The skeleton's Value property isn't annotated to emit changes, so
+ * setting it just keeps it up to date for anyone reading the property.
+ *
+ * @param serviceble the service sending the data
+ * @param chunk the chunk to send
+ */
+static void send_chunk_notify(ServiceBle * serviceble, GBytes * chunk) {
+	GDBusMessage * message;
+	GVariant * value;
+	GVariant * changed;
+	GVariant * body[3];
+	GError * error;
+
+	error = NULL;
+
+	value = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE("ay"), chunk, TRUE));
+	gatt_characteristic1_set_value(serviceble->gattcharacteristic_outgoing, value);
+
+	if (serviceble->connection != NULL) {
+		changed = g_variant_new_dict_entry(serviceble->notifyproperty, g_variant_new_variant(value));
+		body[0] = serviceble->notifyinterface;
+		body[1] = g_variant_new_array(G_VARIANT_TYPE("{sv}"), &changed, 1);
+		body[2] = serviceble->notifyinvalidated;
+
+		message = g_dbus_message_copy(serviceble->notifytemplate, &error);
+		report_error(&error, "copying notification");
+		if (message != NULL) {
+			g_dbus_message_set_body(message, g_variant_new_tuple(body, 3));
+			g_dbus_connection_send_message(serviceble->connection, message, G_DBUS_SEND_MESSAGE_FLAGS_NONE, NULL, &error);
+			report_error(&error, "emitting notification");
+			g_object_unref(message);
+		}
+	}
+
+	g_variant_unref(value);
+}
+
+/**
+ * Notify socket callback for when a full socket has space again.
+ *
+ * @param channel the notify socket channel
+ * @param condition the condition that triggered the callback
+ * @param user_data the service sending the data
+ * @return FALSE to remove the watch
+ */
+static gboolean on_notify_writable(GIOChannel * channel, GIOCondition condition, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+
+	serviceble->notifywritableid = 0;
+	send_schedule(serviceble);
+
+	return FALSE;
+}
+
+/**
+ * Chunk flush callback. Opens up the in-flight window for the next chunk and
+ * reports when the last chunk of a message has gone out.
+ *
+ * @param connection the connection that was flushed
+ * @param res the result of the operation
+ * @param user_data the SendFlush details for the chunk
+ */
+static void on_send_flushed(GDBusConnection * connection, GAsyncResult *res, gpointer user_data) {
+	SendFlush * flush = (SendFlush *)user_data;
+	ServiceBle * serviceble = flush->serviceble;
+	Session * session;
+	GError *error;
+
+	error = NULL;
+
+	g_dbus_connection_flush_finish(connection, res, &error);
+	report_error(&error, "flushing sent chunk");
+
+	if (serviceble->sendinflight > 0) {
+		serviceble->sendinflight--;
+		serviceble_delete_check(serviceble);
+	}
+
+	if (flush->ref != NULL) {
+		session = session_ref_get(flush->ref);
+		if (session != NULL) {
+			send_complete(session, flush->messagesize);
+		}
+		session_ref_delete(flush->ref);
+	}
+
+	g_free(flush);
+
+	send_schedule(serviceble);
+}
+
+/**
+ * Report that the last chunk of a message has gone out.
+ *
+ * @param session the session the message was sent to
+ * @param size the size of the message, excluding framing
+ */
+static void send_complete(Session * session, gsize size) {
+	session->messagessent++;
+	ASYNCLOG(LOG_DEBUG, "Message sent to %s, size %lu (%u sent in total)\n", session->device, size, session->messagessent);
+}
+
+/**
+ * Discard any data still waiting to be sent to a central, for example on
+ * disconnection.
+ *
+ * @param session the session to clear the send queue for
+ */
+static void send_clear(Session * session) {
+	ServiceBle * serviceble = session->serviceble;
+
+	if (serviceble->sendingsession == session) {
+		// The rest of the current message will never be wanted
+		send_item_delete(serviceble->sending);
+		serviceble->sending = NULL;
+		serviceble->sendpos = 0;
+		serviceble->sendingsession = NULL;
+	}
+
+	g_queue_remove(serviceble->sendsessions, session);
+
+	g_queue_free_full(session->sendqueue, (GDestroyNotify)send_item_delete);
+	session->sendqueue = g_queue_new();
+
+	if (session->acktimeoutid != 0) {
+		g_source_remove(session->acktimeoutid);
+		session->acktimeoutid = 0;
+	}
+
+	send_item_delete(session->unacked);
+	session->unacked = NULL;
+	session->ackretries = 0;
+}
+
+/**
+ * The central has received a version 2 message intact, so the next one can
+ * be sent.
+ *
+ * @param session the session the message was sent to
+ * @param msgid the id of the message acknowledged
+ */
+static void send_acknowledged(Session * session, guint8 msgid) {
+	if ((session->unacked != NULL) && (session->unacked->msgid == msgid)) {
+		trace_instant("acknowledged", session->traceid, msgid);
+		send_complete(session, session->unacked->messagesize);
+		send_release(session);
+	}
+}
+
+/**
+ * Discard the unacknowledged version 2 message, whether it's been received
+ * or we've given up on it, and move on to the next.
+ *
+ * @param session the session the message was sent to
+ */
+static void send_release(Session * session) {
+	if (session->acktimeoutid != 0) {
+		g_source_remove(session->acktimeoutid);
+		session->acktimeoutid = 0;
+	}
+
+	send_item_delete(session->unacked);
+	session->unacked = NULL;
+	session->ackretries = 0;
+
+	send_queue_session(session);
+	send_schedule(session->serviceble);
+}
+
+/**
+ * The central is missing parts of a version 2 message, so send just those
+ * parts again.
+ *
+ * @param session the session the message was sent to
+ * @param data the NACK chunk
+ * @param length the number of bytes in the chunk
+ */
+static void send_nacked(Session * session, guchar const * data, gsize length) {
+	GArray * ranges;
+	FramingRange * range;
+	guint8 msgid;
+	guint index;
+
+	ranges = g_array_new(FALSE, FALSE, sizeof(FramingRange));
+
+	if (framing_nack_parse(data, length, &msgid, ranges) == FALSE) {
+		ASYNCLOG(LOG_ERR, "Invalid NACK from %s\n", session->device);
+	}
+	else if ((session->unacked != NULL) && (session->unacked->msgid == msgid)) {
+		if (session->ackretries >= FRAMING_RETRIES) {
+			ASYNCLOG(LOG_ERR, "Giving up on message %u to %s\n", msgid, session->device);
+			send_release(session);
+		}
+		else {
+			session->ackretries++;
+			for (index = 0; index < ranges->len; index++) {
+				range = &g_array_index(ranges, FramingRange, index);
+				ASYNCLOG(LOG_DEBUG, "Resending %u bytes at %u to %s\n", range->length, range->offset, session->device);
+				send_retransmit(session, range->offset, range->length);
+			}
+
+			send_queue_session(session);
+			send_schedule(session->serviceble);
+		}
+	}
+
+	g_array_unref(ranges);
+}
+
+/**
+ * Timeout callback for when a version 2 message hasn't been acknowledged.
+ * Either the end of the message or the central's reply went missing, so the
+ * last chunk is sent again to prompt the central to ACK or NACK.
+ *
+ * @param user_data the session the message was sent to
+ * @return FALSE to remove the timeout
+ */
+static gboolean on_ack_timeout(gpointer user_data) {
+	Session * session = (Session *)user_data;
+	gsize size;
+	gsize payload;
+
+	session->acktimeoutid = 0;
+
+	if (session->unacked != NULL) {
+		trace_instant("ack timeout", session->traceid, session->ackretries);
+		if (session->ackretries >= FRAMING_RETRIES) {
+			// The protocol's own timeout will recover from here
+			ASYNCLOG(LOG_ERR, "Giving up on message %u to %s\n", session->unacked->msgid, session->device);
+			send_release(session);
+		}
+		else {
+			session->ackretries++;
+			size = g_bytes_get_size(session->unacked->bytes);
+			payload = session_chunk_size(session) - FRAMING_HEADER;
+			send_retransmit(session, (size > payload) ? (size - payload) : 0, 0);
+
+			send_queue_session(session);
+			send_schedule(session->serviceble);
+		}
+	}
+
+	return FALSE;
+}
+
+/**
+ * Set the number of chunks that can be awaiting a flush to the bus before
+ * sending pauses.
+ *
+ * @param serviceble the service to set the window for
+ * @param window the number of chunks allowed in flight; must be at least one
+ */
+void serviceble_set_send_window(ServiceBle * serviceble, guint window) {
+	if (window < 1) {
+		window = 1;
+	}
+
+	serviceble->sendwindow = window;
+
+	send_schedule(serviceble);
+}
+
+static gboolean handle_write_value(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, GVariant *arg_value, GVariant *arg_options, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+	Session * session;
+	guchar const * data;
+	gsize length;
+	guint64 tracestart;
+
+	tracestart = trace_now();
+
+	// Access the payload in place rather than iterating over it
+	data = g_variant_get_fixed_array(arg_value, &length, sizeof(guchar));
+
+	session = session_claim(serviceble, invocation, arg_options, data, length);
+	if (session == NULL) {
+		return TRUE;
+	}
+
+	receive_chunk(session, data, length);
+	trace_span("WriteValue", session->traceid, tracestart, length);
+
+	gatt_characteristic1_complete_write_value(object, invocation);
+
+	return TRUE;
+}
+
+/**
+ * Process a chunk written by the central, whether it arrived through
+ * WriteValue or on the acquired write socket. Once a whole message has been
+ * reassembled it's passed on to the protocol state machine. A version 1
+ * hello from the central switches the session to version 2 framing.
+ *
+ * @param session the session of the central that sent the chunk
+ * @param data the chunk, including its header
+ * @param length the number of bytes in the chunk
+ */
+static void receive_chunk(Session * session, guchar const * data, gsize length) {
+	REASSEMBLY result;
+	bool starting;
+
+	if (session->connectedat != 0) {
+		report_first_write(session);
+	}
+
+	if (session->connected == FALSE) {
+		trace_instant("first write", session->traceid, length);
+		session_connected(session);
+	}
+
+	if (length > 0) {
+		ASYNCLOG(LOG_DEBUG, "Received chunk from %s: %d\n", session->device, data[0]);
+	}
+
+	if (session->framing == FRAMING_VERSION_2) {
+		receive_chunk_framed(session, data, length);
+		return;
+	}
+
+	starting = (session->remaining_write == 0);
+
+	if ((starting == TRUE) && (length >= REASSEMBLY_HEADER) && (framing_hello_version(data + REASSEMBLY_HEADER, length - REASSEMBLY_HEADER) >= FRAMING_VERSION_2)) {
+		session->framing = FRAMING_VERSION_2;
+		session->capabilities = framing_hello_capabilities(data + REASSEMBLY_HEADER, length - REASSEMBLY_HEADER) & FRAMING_CAPABILITIES;
+		if ((framing_hello_address(data + REASSEMBLY_HEADER, length - REASSEMBLY_HEADER, &session->address) == FALSE) || session_address_used(session->serviceble, session, session->address)) {
+			session->capabilities &= ~FRAMING_CAPABILITY_ADDRESSED;
+			session->address = 0;
+		}
+		ASYNCLOG(LOG_INFO, "Using version 2 framing with %s, capabilities %02x, address %02x\n", session->device, session->capabilities, session->address);
+		send_control(session, framing_hello_new(FRAMING_VERSION_2, session->capabilities));
+		return;
+	}
+
+	if (session->tracereceive == 0) {
+		session->tracereceive = trace_now();
+	}
+
+	result = reassembly_append(session->buffer_write, &session->remaining_write, data, length);
+
+	if ((starting == TRUE) && (result != REASSEMBLY_ERROR)) {
+		ASYNCLOG(LOG_DEBUG, "Receiving length: %ld\n", buffer_get_pos(session->buffer_write) + session->remaining_write);
+	}
+
+	if (result == REASSEMBLY_COMPLETE) {
+		receive_message(session, (guchar const *)buffer_get_buffer(session->buffer_write), buffer_get_pos(session->buffer_write));
+		session_trim(session);
+	}
+}
+
+/**
+ * Process a version 2 chunk from the central. Data chunks are reassembled,
+ * with each complete message acknowledged once it's been decoded and anything
+ * found to be missing asked for again. A message that can't be decoded isn't
+ * acknowledged, and the central is disconnected. ACKs and NACKs refer to
+ * messages we've sent.
+ *
+ * @param session the session of the central that sent the chunk
+ * @param data the chunk, including its header
+ * @param length the number of bytes in the chunk
+ */
+static void receive_chunk_framed(Session * session, guchar const * data, gsize length) {
+	FRAMINGRX result;
+	guchar const * message;
+	gsize messagesize;
+	GBytes * nack;
+	GBytes * decoded;
+	guint8 msgid;
+
+	switch (framing_kind(data, length)) {
+		case FRAMING_KIND_DATA:
+			if (session->tracereceive == 0) {
+				session->tracereceive = trace_now();
+			}
+			result = framing_receive_data(session->framingreceive, data, length);
+			switch (result) {
+				case FRAMINGRX_COMPLETE:
+					message = framing_receive_message(session->framingreceive, &messagesize);
+					if (session->capabilities & FRAMING_CAPABILITY_COMPRESSION) {
+						decoded = compress_decode(session->compress, message, messagesize);
+						if (decoded != NULL) {
+							send_control(session, framing_ack_new(framing_receive_msgid(session->framingreceive)));
+							receive_message(session, g_bytes_get_data(decoded, NULL), g_bytes_get_size(decoded));
+							g_bytes_unref(decoded);
+						}
+						else {
+							// Sending it again won't help, and without an ACK the
+							// central would be left waiting, so start afresh
+							ASYNCLOG(LOG_ERR, "Error, can't decode message %u from %s\n", framing_receive_msgid(session->framingreceive), session->device);
+							session_disconnect(session);
+						}
+					}
+					else {
+						send_control(session, framing_ack_new(framing_receive_msgid(session->framingreceive)));
+						receive_message(session, message, messagesize);
+					}
+					session_trim(session);
+					break;
+				case FRAMINGRX_DUPLICATE:
+					// Our ACK went missing
+					send_control(session, framing_ack_new(framing_receive_msgid(session->framingreceive)));
+					break;
+				case FRAMINGRX_MISSING:
+					nack = framing_receive_nack(session->framingreceive, session_chunk_size(session));
+					if (nack != NULL) {
+						ASYNCLOG(LOG_DEBUG, "Asking %s to resend parts of message %u\n", session->device, framing_receive_msgid(session->framingreceive));
+						send_control(session, nack);
+					}
+					break;
+				default:
+					break;
+			}
+			break;
+		case FRAMING_KIND_ACK:
+			if (framing_ack_parse(data, length, &msgid) == TRUE) {
+				send_acknowledged(session, msgid);
+			}
+			break;
+		case FRAMING_KIND_NACK:
+			send_nacked(session, data, length);
+			break;
+		default:
+			ASYNCLOG(LOG_ERR, "Error, unknown chunk kind from %s\n", session->device);
+			break;
+	}
+}
+
+/**
+ * Pass a complete message from the central on to the protocol state machine.
+ *
+ * @param session the session of the central that sent the message
+ * @param data the message, which is copied
+ * @param length the number of bytes in the message
+ */
+static void receive_message(Session * session, guchar const * data, gsize length) {
+	ASYNCLOG_HEX(LOG_DEBUG, "Received: ", data, length);
+
+	// From the first chunk of the message to here
+	trace_span("receive message", session->traceid, session->tracereceive, length);
+	session->tracereceive = 0;
+
+#ifdef SERVICEBLE_ECHO
+	send_data(session, (char const *)data, length);
+#else
+	session_fsm(session, FSMJOB_READ, (char const *)data, length);
+#endif
+}
+
+/**
+ * Create the socket pair for an acquired characteristic. One end is returned
+ * to bluetoothd in the method reply, the other is kept by us. On failure an
+ * error is returned to the caller.
+ *
+ * @param invocation the AcquireWrite or AcquireNotify method invocation
+ * @param fdlist returns the list holding bluetoothd's end of the pair
+ * @return the channel for our end of the pair, or NULL on failure
+ */
+static GIOChannel * acquire_socket(GDBusMethodInvocation * invocation, GUnixFDList ** fdlist) {
+	int fds[2];
+	GIOChannel * channel;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+		ASYNCLOG(LOG_ERR, "Error creating socket pair: %s\n", strerror(errno));
+		g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.Failed", strerror(errno));
+		*fdlist = NULL;
+		return NULL;
+	}
+
+	// The list takes ownership of the descriptor
+	*fdlist = g_unix_fd_list_new_from_array(&fds[1], 1);
+
+	channel = g_io_channel_unix_new(fds[0]);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+	g_io_channel_set_encoding(channel, NULL, NULL);
+	g_io_channel_set_buffered(channel, FALSE);
+
+	return channel;
+}
+
+/**
+ * The MTU to return when a characteristic is acquired, which mustn't be
+ * larger than the MTU negotiated with the central.
+ *
+ * @param session the session of the central acquiring the characteristic
+ * @return the MTU to return to bluetoothd
+ */
+static guint16 acquired_mtu(Session * session) {
+	return ((session != NULL) && (session->mtu > 0)) ? session->mtu : ATT_MTU_DEFAULT;
+}
+
+/**
+ * Handle bluetoothd acquiring the incoming characteristic for writing. From
+ * then on chunks arrive on a socket rather than as WriteValue calls. The
+ * socket doesn't say which central each chunk came from, so everything
+ * arriving on it goes to the session of the central that caused it to be
+ * acquired.
+ *
+ * @param object the characteristic being acquired
+ * @param invocation the message invocation details
+ * @param fd_list the fds passed with the call (unused)
+ * @param arg_options the options, including the device and MTU
+ * @param user_data the service being acquired
+ */
+static gboolean handle_acquire_write(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, GUnixFDList * fd_list, GVariant *arg_options, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+	Session * session;
+	GUnixFDList * fdlist;
+	GIOChannel * channel;
+	guint linked;
+
+	ASYNCLOG(LOG_INFO, "Acquire write\n");
+
+	linked = g_hash_table_size(serviceble->linked);
+	if (g_hash_table_contains(serviceble->linked, session_device(arg_options)) == TRUE) {
+		linked--;
+	}
+
+	if ((linked > 0) || (session_shared(serviceble, session_device(arg_options)) == TRUE)) {
+		// The socket would carry every central's writes as if they were this
+		// one's, so bluetoothd has to keep using WriteValue
+		ASYNCLOG(LOG_INFO, "Refusing write socket while %u other devices are connected\n", linked);
+		g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.NotPermitted", "Serving other devices");
+		return TRUE;
+	}
+
+	session = session_claim(serviceble, invocation, arg_options, NULL, 0);
+	if (session == NULL) {
+		return TRUE;
+	}
+
+	channel = acquire_socket(invocation, &fdlist);
+	if (channel != NULL) {
+		release_write(serviceble);
+
+		serviceble->writechannel = channel;
+		serviceble->writewatchid = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, on_write_socket, serviceble);
+		serviceble->writesession = session;
+		gatt_characteristic1_set_write_acquired(object, TRUE);
+
+		gatt_characteristic1_complete_acquire_write(object, invocation, fdlist, 0, acquired_mtu(session));
+		g_object_unref(fdlist);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Handle bluetoothd acquiring the outgoing characteristic for notifying.
+ * From then on chunks are written to a socket rather than sent as
+ * PropertiesChanged signals.
+ *
+ * @param object the characteristic being acquired
+ * @param invocation the message invocation details
+ * @param fd_list the fds passed with the call (unused)
+ * @param arg_options the options, including the device and MTU
+ * @param user_data the service being acquired
+ */
+static gboolean handle_acquire_notify(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, GUnixFDList * fd_list, GVariant *arg_options, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+	Session * session;
+	GUnixFDList * fdlist;
+	GIOChannel * channel;
+
+	ASYNCLOG(LOG_INFO, "Acquire notify\n");
+
+	session = session_claim(serviceble, invocation, arg_options, NULL, 0);
+	if (session == NULL) {
+		return TRUE;
+	}
+
+	channel = acquire_socket(invocation, &fdlist);
+	if (channel != NULL) {
+		release_notify(serviceble);
+
+		serviceble->notifychannel = channel;
+		// We only write, so we're just watching for bluetoothd releasing it
+		serviceble->notifywatchid = g_io_add_watch(channel, G_IO_HUP | G_IO_ERR, on_notify_socket, serviceble);
+		gatt_characteristic1_set_notify_acquired(object, TRUE);
+		gatt_characteristic1_set_notifying(object, TRUE);
+
+		gatt_characteristic1_complete_acquire_notify(object, invocation, fdlist, 0, acquired_mtu(session));
+		g_object_unref(fdlist);
+
+		send_schedule(serviceble);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Write socket callback. Each packet on the socket is one chunk written by
+ * the central.
+ *
+ * @param channel the write socket channel
+ * @param condition the condition that triggered the callback
+ * @param user_data the service receiving the data
+ * @return TRUE to keep watching the socket, FALSE o/w
+ */
+static gboolean on_write_socket(GIOChannel * channel, GIOCondition condition, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+	guchar data[ATT_MAX_VALUE_LENGTH];
+	ssize_t length;
+	gboolean keep;
+
+	keep = TRUE;
+
+	if (condition & G_IO_IN) {
+		length = recv(g_io_channel_unix_get_fd(channel), data, sizeof(data), MSG_DONTWAIT);
+		if ((length > 0) && (serviceble->writesession != NULL)) {
+			receive_chunk(serviceble->writesession, data, length);
+		}
+		else if ((length == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+			keep = FALSE;
+		}
+	}
+
+	if (condition & (G_IO_HUP | G_IO_ERR)) {
+		keep = FALSE;
+	}
+
+	if (keep == FALSE) {
+		ASYNCLOG(LOG_INFO, "Write socket released\n");
+		// Returning FALSE removes the watch
+		serviceble->writewatchid = 0;
+		release_write(serviceble);
+	}
+
+	return keep;
+}
+
+/**
+ * Notify socket callback for when bluetoothd releases the socket, for
+ * example because the central has unsubscribed or disconnected.
+ *
+ * @param channel the notify socket channel
+ * @param condition the condition that triggered the callback
+ * @param user_data the service sending the data
+ * @return FALSE to remove the watch
+ */
+static gboolean on_notify_socket(GIOChannel * channel, GIOCondition condition, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+
+	ASYNCLOG(LOG_INFO, "Notify socket released\n");
+
+	// Returning FALSE removes the watch
+	serviceble->notifywatchid = 0;
+	release_notify(serviceble);
+
+	return FALSE;
+}
+
+/**
+ * Close our end of the acquired write socket, if there is one, returning to
+ * WriteValue for incoming chunks.
+ *
+ * @param serviceble the service to release the socket for
+ */
+static void release_write(ServiceBle * serviceble) {
+	if (serviceble->writewatchid != 0) {
+		g_source_remove(serviceble->writewatchid);
+		serviceble->writewatchid = 0;
+	}
+
+	serviceble->writesession = NULL;
+
+	if (serviceble->writechannel != NULL) {
+		g_io_channel_unref(serviceble->writechannel);
+		serviceble->writechannel = NULL;
+
+		if (serviceble->gattcharacteristic_incoming != NULL) {
+			gatt_characteristic1_set_write_acquired(serviceble->gattcharacteristic_incoming, FALSE);
+		}
+	}
+}
+
+/**
+ * Close our end of the acquired notify socket, if there is one, returning to
+ * PropertiesChanged signals for outgoing chunks.
+ *
+ * @param serviceble the service to release the socket for
+ */
+static void release_notify(ServiceBle * serviceble) {
+	if (serviceble->notifywatchid != 0) {
+		g_source_remove(serviceble->notifywatchid);
+		serviceble->notifywatchid = 0;
+	}
+
+	if (serviceble->notifywritableid != 0) {
+		g_source_remove(serviceble->notifywritableid);
+		serviceble->notifywritableid = 0;
+	}
+
+	if (serviceble->notifychannel != NULL) {
+		g_io_channel_unref(serviceble->notifychannel);
+		serviceble->notifychannel = NULL;
+
+		if (serviceble->gattcharacteristic_outgoing != NULL) {
+			gatt_characteristic1_set_notify_acquired(serviceble->gattcharacteristic_outgoing, FALSE);
+			gatt_characteristic1_set_notifying(serviceble->gattcharacteristic_outgoing, FALSE);
+		}
+	}
+}
+
+static gboolean handle_start_notify(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, gpointer user_data) {
+	ASYNCLOG(LOG_INFO, "Start notify\n");
+
+	gatt_characteristic1_complete_start_notify(object, invocation);
+	
+	return TRUE;
+}
+
+static gboolean handle_stop_notify(GattCharacteristic1 * object, GDBusMethodInvocation * invocation, gpointer user_data) {
+	ASYNCLOG(LOG_INFO, "Stop notify\n");
+
+	gatt_characteristic1_complete_stop_notify(object, invocation);
+	
+	return TRUE;
+}
+
+/**
+ * Deal with errors by printing them to stderr if there is one, then freeing 
+ * and clearning the error structure.
+ *
+ * @param error the error structure to check and report if it exists
+ * @param hint a human-readable hint that will be output alongside the error
+ */
+static void report_error(GError ** error, char const * hint) {
+	if (*error) {
+		ASYNCLOG(LOG_ERR, "Error %s: %s\n", hint, (*error)->message);
+		g_error_free(*error);
+		*error = NULL;
+	}
+}
+
+/**
+ * Advertisement registration callback
+ *
+ * @param proxy the advertisement manager proxy object
+ * @param res the result of the operation
+ * @param user_data the user data passed to the async callback
+ */
+static void on_register_advert(LEAdvertisingManager1 *proxy, GAsyncResult *res, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+	gboolean result;
+	GError *error;
+
+	error = NULL;
+
+	result = leadvertising_manager1_call_register_advertisement_finish(proxy, res, &error);
+	report_error(&error, "registering advert callback");
+
+	ASYNCLOG(LOG_INFO, "Registered advert with result %d\n", result);
+
+	advert_registered(serviceble, result);
+}
+
+/**
+ * Carry on once the advert has been registered with bluetoothd, or our
+ * advertising sets have been set up, by applying the advertising profile.
+ * Failures bring the next recycle forward.
+ *
+ * @param serviceble the service that's now advertising
+ * @param result whether the advert was registered or set up
+ */
+static void advert_registered(ServiceBle * serviceble, bool result) {
+	bool recycled;
+	bool applied;
+
+	trace_span("register advert", TRACE_SERVICE, serviceble->traceadvert, result);
+	serviceble->traceadvert = 0;
+
+	recycled = (serviceble->recyclestart != 0);
+	report_recycle_gap(serviceble);
+
+	// Registration resets the interval, so it needs setting again
+	if (recycled == TRUE) {
+		ASYNCLOG(LOG_INFO, "Continuing advertising profile\n");
+		applied = hcicontroller_profile_apply(serviceble->hcicontroller);
+	}
+	else {
+		ASYNCLOG(LOG_INFO, "Starting advertising profile\n");
+		applied = hcicontroller_profile_start(serviceble->hcicontroller);
+	}
+
+	// Our own advertising sets are only enabled by the profile, so if that
+	// failed nothing is being advertised
+	if ((result == FALSE) || ((serviceble->advertsets == TRUE) && (applied == FALSE))) {
+		cycle_request(serviceble, RECYCLE_ERROR);
+	}
+	else {
+		serviceble->recyclebackoff = 0;
+	}
+}
+
+static void on_register_application(GattManager1 *proxy, GAsyncResult *res, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+	gboolean result;
+	GError *error;
+
+	error = NULL;
+
+	result = gatt_manager1_call_register_application_finish(proxy, res, &error);
+	report_error(&error, "registering application callback");
+
+	ASYNCLOG(LOG_INFO, "Registered application with result %d\n", result);
+
+	if (result == FALSE) {
+		cycle_request(serviceble, RECYCLE_ERROR);
+	}
+}
+
+/**
+ * Advertisement unregistration callback
+ *
+ * @param proxy the advertisement manager proxy object
+ * @param res the result of the operation
+ * @param user_data the user data passed to the async callback
+ */
+static void on_unregister_advert(LEAdvertisingManager1 *proxy, GAsyncResult *res, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+	gboolean result;
+	GError *error;
+
+	error = NULL;
+
+	result = leadvertising_manager1_call_unregister_advertisement_finish(proxy, res, &error);
+	report_error(&error, "unregistering advert callback");
+
+	ASYNCLOG(LOG_INFO, "Unregistered advert with result %d\n", result);
+
+	advert_unregistered(serviceble);
+}
+
+/**
+ * Carry on once advertising has stopped, by finalising or, for a warm
+ * recycle, advertising again.
+ *
+ * @param serviceble the service that's stopped advertising
+ */
+static void advert_unregistered(ServiceBle * serviceble) {
+	GHashTableIter iter;
+	Session * session;
+
+	set_state(serviceble, SERVICESTATEBLE_UNADVERTISED);
+
+	// bluetoothd has let go of the advert, so it can be taken off the bus
+	// until it's next registered
+	g_dbus_object_manager_server_unexport(serviceble->object_manager_advert, serviceble->advertpath);
+
+	// All stopped
+	g_hash_table_iter_init(&iter, serviceble->sessions);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&session)) {
+		session_disconnected(session);
+	}
+
+	if ((serviceble->finalise == TRUE) || (serviceble->removed == TRUE)) {
+		finalise(serviceble);
+	}
+	else if (serviceble->cycling == TRUE) {
+		// This is a warm recycle, so advertise again straight away
+		serviceble->cycling = FALSE;
+		advertising_start(serviceble, FALSE);
+	}
+}
+
+#ifdef SERVICEBLE_GUI
+static gboolean key_event(GtkWidget *widget, GdkEventKey *event, gpointer user_data) {
 	g_printerr("%s\n", gdk_keyval_name (event->keyval));
-	if (event->keyval == 's') {
-		serviceble_start(serviceble);
+	switch (event->keyval) {
+		case 's':
+			adapters_command(CONTROLCOMMAND_START, user_data);
+			break;
+		case 'f':
+			adapters_command(CONTROLCOMMAND_STOP, user_data);
+			break;
+		case 'q':
+			adapters_command(CONTROLCOMMAND_QUIT, user_data);
+			break;
+		default:
+			break;
+	}
+
+	return FALSE;
+}
+#endif
+
+/**
+ * Get the advertising UUID, derived from the commitment of the service's
+ * public key. The UUIDs are cached, and are only recalculated if the key
+ * files have changed on disk since they were last generated.
+ *
+ * @param serviceble the service to get the UUID for
+ * @param continuous whether to get the UUID for continuous authentication
+ * @return the UUID string, owned by the service, or NULL if the keys
+ *         couldn't be loaded
+ */
+static char const * generate_uuid(ServiceBle * serviceble, bool continuous) {
+	if (uuid_cache_stale(serviceble) == TRUE) {
+		uuid_cache_refresh(serviceble);
+	}
+
+	if (serviceble->uuidsvalid == FALSE) {
+		return NULL;
+	}
+
+	return buffer_get_buffer(continuous ? serviceble->uuid_continuous : serviceble->uuid_discontinuous);
+}
+
+/**
+ * Check whether the cached UUIDs need regenerating, either because they've
+ * never been generated or because the key files have changed.
+ *
+ * @param serviceble the service holding the cache
+ * @return TRUE if the cache needs refreshing, FALSE o/w
+ */
+static bool uuid_cache_stale(ServiceBle * serviceble) {
+	struct stat keystat[2];
+	bool stale;
+
+	stale = (serviceble->uuidsvalid == FALSE);
+
+	if ((stat(KEY_FILE_PUBLIC, &keystat[0]) != 0) || (stat(KEY_FILE_PRIVATE, &keystat[1]) != 0)) {
+		// Let the refresh report the failure
+		stale = TRUE;
+	}
+	else if ((key_stat_changed(&keystat[0], &serviceble->keystat[0]) == TRUE) || (key_stat_changed(&keystat[1], &serviceble->keystat[1]) == TRUE)) {
+		stale = TRUE;
+	}
+
+	return stale;
+}
+
+/**
+ * Compare two stats of a key file. Keys are a fixed size and are often
+ * regenerated within a second of each other, so the file identity and the
+ * full nanosecond timestamps are compared as well as the size.
+ *
+ * @param now the file as it is now
+ * @param cached the file as it was when the UUIDs were generated
+ * @return TRUE if the file may have changed, FALSE o/w
+ */
+static bool key_stat_changed(struct stat const * now, struct stat const * cached) {
+	return (now->st_dev != cached->st_dev)
+		|| (now->st_ino != cached->st_ino)
+		|| (now->st_size != cached->st_size)
+		|| (now->st_mtim.tv_sec != cached->st_mtim.tv_sec)
+		|| (now->st_mtim.tv_nsec != cached->st_mtim.tv_nsec)
+		|| (now->st_ctim.tv_sec != cached->st_ctim.tv_sec)
+		|| (now->st_ctim.tv_nsec != cached->st_ctim.tv_nsec);
+}
+
+/**
+ * Load the keys and regenerate both the continuous and non-continuous UUIDs.
+ *
+ * @param serviceble the service holding the cache
+ */
+static void uuid_cache_refresh(ServiceBle * serviceble) {
+	KeyPair * keypair;
+	gboolean result;
+
+	ASYNCLOG(LOG_INFO, "Generating UUIDs from keys\n");
+
+	serviceble->uuidsvalid = FALSE;
+
+	if ((stat(KEY_FILE_PUBLIC, &serviceble->keystat[0]) != 0) || (stat(KEY_FILE_PRIVATE, &serviceble->keystat[1]) != 0)) {
+		ASYNCLOG(LOG_ERR, "Failed to find keys\n");
+	}
+	else {
+		keypair = keypair_new();
+
+		result = keypair_import(keypair, KEY_FILE_PUBLIC, KEY_FILE_PRIVATE);
+		if (result == FALSE) {
+			ASYNCLOG(LOG_ERR, "Failed to load keys\n");
+		}
+		else {
+			// "NdzdISywn1akt21lD/68HRlL6SHNguPSI2ULXXcHjzM="
+			serviceble->uuidsvalid = create_uuids(keypair, serviceble->uuid_discontinuous, serviceble->uuid_continuous);
+		}
+
+		keypair_delete(keypair);
+	}
+}
+
+static bool create_uuids(KeyPair * keypair, Buffer * uuid, Buffer * uuid_continuous) {
+	Buffer * commitment;
+	char unsigned const * commitmentbytes;
+	EC_KEY * publickey;
+	gboolean result;
+
+	commitment = buffer_new(0);
+	publickey = keypair_getpublickey(keypair);
+
+	result = cryptosupport_generate_commitment(publickey, commitment);
+	if (result == FALSE) {
+		ASYNCLOG(LOG_ERR, "Failed to generate commitment\n");
+	}
+	else {
+		ASYNCLOG_HEX(LOG_DEBUG, "Commitment: ", buffer_get_buffer(commitment), buffer_get_pos(commitment));
+
+		if (buffer_get_pos(commitment) != UUID_COMMITMENT_LENGTH) {
+			ASYNCLOG(LOG_ERR, "Incorrect commitment length\n");
+			result = FALSE;
+		}
+		else {
+			commitmentbytes = (char unsigned const *)buffer_get_buffer(commitment);
+			uuid_from_commitment(commitmentbytes, FALSE, uuid);
+			uuid_from_commitment(commitmentbytes, TRUE, uuid_continuous);
+		}
+	}
+
+	buffer_delete(commitment);
+
+	return result;
+}
+
+void serviceble_stop(ServiceBle * serviceble) {
+	advertising_stop(serviceble, TRUE);
+}
+
+void serviceble_start(ServiceBle * serviceble) {
+	set_state(serviceble, SERVICESTATEBLE_INITIALISING);
+
+	ASYNCLOG(LOG_INFO, "Creating object manager server\n");
+
+	serviceble->object_manager_advert = g_dbus_object_manager_server_new(serviceble->adapter);
+
+	///////////////////////////////////////////////////////
+
+	ASYNCLOG(LOG_INFO, "Getting bus\n");
+
+	// This is an asynchronous call, so initialisation continuous in the callback
+	g_bus_get(G_BUS_TYPE_SYSTEM, NULL, (GAsyncReadyCallback)(&on_g_bus_get), serviceble);
+
+	// Set up to periodically check whether advertising needs restarting
+	cycle_schedule(serviceble, (serviceble->recyclebackoff != 0) ? serviceble->recyclebackoff : serviceble->cycleinterval);
+
+	///////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////
+}
+
+/**
+ * Check whether the advert needs recycling, and recycle it if so. Recycling
+ * interrupts advertising, so while we're advertising it's only done when
+ * there's a reason: the keys have changed, bluetoothd has dropped the advert,
+ * or bluetoothd has reported an error. Otherwise the check is counted as
+ * skipped. When no advert is registered there's nothing to interrupt, so the
+ * service always starts advertising again.
+ *
+ * @param user_data the service to check
+ * @return FALSE, since the check is scheduled again as needed
+ */
+static gboolean cycle_timeout(gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+	bool recycle;
+	bool cyclenow;
+	guint delay;
+
+	ASYNCLOG(LOG_DEBUG, "Cycle check\n");
+
+	// This timeout fires only once, and is added again below if needed
+	serviceble->cycletimeoutid = 0;
+	recycle = TRUE;
+	cyclenow = FALSE;
+	delay = serviceble->cycleinterval;
+
+	switch (serviceble->state) {
+		case SERVICESTATEBLE_INITIALISING:
+		case SERVICESTATEBLE_UNADVERTISING:
+		case SERVICESTATEBLE_FINALISING:
+		case SERVICESTATEBLE_CONNECTED:
+		case SERVICESTATEBLE_ADVERTISINGCONTINUOUS:
+			// Do nothing, wait again
+			break;
+		case SERVICESTATEBLE_ADVERTISING:
+		case SERVICESTATEBLE_INITIALISED:
+		case SERVICESTATEBLE_UNADVERTISED:
+			cyclenow = TRUE;
+			break;
+		case SERVICESTATEBLE_FINALISED:
+			recycle = FALSE;
+			break;
+		case SERVICESTATEBLE_DORMANT:
+		case SERVICESTATEBLE_INVALID:
+		case SERVICESTATEBLE_NUM:
+		default:
+			ASYNCLOG(LOG_ERR, "Cycle during invalid state\n");
+			break;
+	}
+
+	if ((cyclenow == TRUE) && (uuid_cache_stale(serviceble) == TRUE)) {
+		// New keys mean a new commitment to advertise; missing keys are
+		// retried, but with the same backoff as other errors
+		serviceble->recyclereasons |= (serviceble->uuidsvalid == TRUE) ? RECYCLE_KEYS : RECYCLE_ERROR;
+	}
+
+	if ((cyclenow == TRUE) && (serviceble->state == SERVICESTATEBLE_ADVERTISING) && (serviceble->recyclereasons == 0)) {
+		// The advert is still registered, so leave it running undisturbed
+		serviceble->recycleskipped++;
+		ASYNCLOG(LOG_DEBUG, "Recycle skipped (%u skipped, %u recycled)\n", serviceble->recycleskipped, serviceble->recyclecount);
+	}
+	else if ((cyclenow == TRUE) && (serviceble->cycling == FALSE) && (serviceble->removed == FALSE)) {
+		ASYNCLOG(LOG_INFO, "Recycling for reasons 0x%02x\n", serviceble->recyclereasons);
+		trace_instant("recycle", TRACE_SERVICE, serviceble->recyclereasons);
+
+		if ((serviceble->recyclereasons & RECYCLE_ERROR) != 0) {
+			// Back off while bluetoothd keeps failing, until a registration succeeds
+			serviceble->recyclebackoff = CLAMP(serviceble->recyclebackoff * 2, serviceble->cycleinterval, serviceble->cyclebackoffmax);
+			delay = serviceble->recyclebackoff;
+		}
+		serviceble->recyclereasons = 0;
+		serviceble->cycling = TRUE;
+
+		if (serviceble->warmcycle == TRUE) {
+			// Keep the bus, proxies and object managers; just re-register
+			ASYNCLOG(LOG_DEBUG, "Warm recycle\n");
+			if ((serviceble->state == SERVICESTATEBLE_UNADVERTISED) || (serviceble->state == SERVICESTATEBLE_INITIALISED)) {
+				// No advert is registered, so there's nothing to take down
+				serviceble->cycling = FALSE;
+				serviceble->recyclestart = g_get_monotonic_time();
+				advertising_start(serviceble, FALSE);
+			}
+			else {
+				advertising_stop(serviceble, FALSE);
+			}
+		}
+		else {
+			ASYNCLOG(LOG_DEBUG, "Cold recycle\n");
+			// Starting again schedules the next check
+			recycle = FALSE;
+			serviceble_stop(serviceble);
+		}
 	}
-	if (event->keyval == 'f') {
-		serviceble_stop(serviceble);
+	else {
+		ASYNCLOG(LOG_DEBUG, "Recycle check ignored in state %d\n", serviceble->state);
 	}
-	if (event->keyval == 'q') {
-		g_main_loop_quit(serviceble->loop);
+
+	if ((recycle == TRUE) && (serviceble->cycletimeoutid == 0)) {
+		cycle_schedule(serviceble, delay);
 	}
 
 	return FALSE;
 }
 
-static void generate_uuid(ServiceBle * serviceble, bool continuous, Buffer * uuid) {
-	KeyPair * keypair;
-	gboolean result;
+/**
+ * Schedule the next cycle check, replacing any already scheduled. The delay
+ * is spread randomly by the configured jitter, so that several services
+ * don't recycle in step.
+ *
+ * @param serviceble the service to check
+ * @param delay the time until the check in milliseconds, before jitter
+ */
+static void cycle_schedule(ServiceBle * serviceble, guint delay) {
+	guint spread;
 
-	serviceble->charlength = CHARACTERISTIC_LENGTH;
+	if (serviceble->cycletimeoutid != 0) {
+		g_source_remove(serviceble->cycletimeoutid);
+	}
 
-	keypair = keypair_new();
+	spread = (guint)(((guint64)delay * serviceble->cyclejitter) / 100);
+	if (spread > 0) {
+		delay = delay - spread + (guint)g_random_int_range(0, (gint32)(2 * spread) + 1);
+	}
 
-	result = keypair_import(keypair, "pico_pub_key.der", "pico_priv_key.der");
-	if (result == FALSE) {
-		printf("Failed to load keys\n");
+	serviceble->cycletimeoutid = g_timeout_add(delay, cycle_timeout, serviceble);
+}
+
+/**
+ * Record a reason for recycling the advert and bring the next cycle check
+ * forward, unless the service is backing off after errors or isn't running.
+ *
+ * @param serviceble the service to recycle
+ * @param reason one of the RECYCLE_ flags
+ */
+static void cycle_request(ServiceBle * serviceble, guint reason) {
+	serviceble->recyclereasons |= reason;
+
+	if ((serviceble->cycletimeoutid != 0) && (serviceble->recyclebackoff == 0)) {
+		cycle_schedule(serviceble, RECYCLE_REQUEST_DELAY);
+	}
+}
+
+/**
+ * Report how long we went without an advert registered during a recycle,
+ * measured from the request to unregister the old advert until the new one
+ * has been registered.
+ *
+ * @param serviceble the service that's been recycled
+ */
+static void report_recycle_gap(ServiceBle * serviceble) {
+	gint64 gap;
+
+	if (serviceble->recyclestart != 0) {
+		gap = g_get_monotonic_time() - serviceble->recyclestart;
+		serviceble->recyclestart = 0;
+
+		serviceble->recyclecount++;
+		serviceble->recyclegaptotal += gap;
+		if (gap > serviceble->recyclegapmax) {
+			serviceble->recyclegapmax = gap;
+		}
+
+		ASYNCLOG(LOG_INFO, "Re-advertise gap %.1f ms (mean %.1f ms, max %.1f ms over %u cycles, %u skipped)\n", gap / 1000.0, (serviceble->recyclegaptotal / 1000.0) / serviceble->recyclecount, serviceble->recyclegapmax / 1000.0, serviceble->recyclecount, serviceble->recycleskipped);
 	}
+}
+
+/**
+ * Report how long a central took from connecting to its first write, which
+ * covers its service discovery and any reads it made before writing.
+ *
+ * @param session the session of the central that's written
+ */
+static void report_first_write(Session * session) {
+	ServiceBle * serviceble = session->serviceble;
+	gint64 delay;
 
-	// "NdzdISywn1akt21lD/68HRlL6SHNguPSI2ULXXcHjzM="
-	create_uuid(keypair, continuous, uuid);
-	//strcpy(uuid, SERVICE_UUID);
-	//printf("UUID: %s\n", uuid);
+	delay = g_get_monotonic_time() - session->connectedat;
+	session->connectedat = 0;
 
-	keypair_delete(keypair);
+	serviceble->firstwritecount++;
+	serviceble->firstwritetotal += delay;
+
+	trace_instant("connect to first write", session->traceid, delay);
+	ASYNCLOG(LOG_INFO, "First write from %s %.1f ms after connecting (mean %.1f ms over %u connections)\n", session->device, delay / 1000.0, (serviceble->firstwritetotal / 1000.0) / serviceble->firstwritecount, serviceble->firstwritecount);
+}
+
+/**
+ * Choose between a warm recycle, which keeps the bus connection, proxies and
+ * object managers and only re-registers the advert and GATT application,
+ * and a cold recycle, which tears everything down and rebuilds it.
+ *
+ * @param serviceble the service to set the recycle mode for
+ * @param warmcycle TRUE for a warm recycle, FALSE for a cold recycle
+ */
+void serviceble_set_warm_cycle(ServiceBle * serviceble, bool warmcycle) {
+	serviceble->warmcycle = warmcycle;
+}
+
+/**
+ * Set the advertising interval profile, as a comma-separated list of steps
+ * of the form intervalmin-intervalmax:duration (see
+ * hcicontroller_set_profile_string()). The profile takes effect the next time
+ * advertising starts.
+ *
+ * @param serviceble the service to set the profile for
+ * @param profile the profile string
+ * @return TRUE if the profile was valid and has been set, FALSE o/w
+ */
+bool serviceble_set_advertising_profile(ServiceBle * serviceble, char const * profile) {
+	return hcicontroller_set_profile_string(serviceble->hcicontroller, profile);
 }
 
-static void appendbytes(char unsigned const * bytes, int num, Buffer * out) {
-	int pos;
-	char letters[3];
 
-	for (pos = 0; pos < num; pos++) {
-		snprintf(letters, 3, "%02X", bytes[pos]);
-		buffer_append(out, letters, 2);
+
+
+static void on_g_bus_get (GObject *source_object, GAsyncResult *res, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+	GError *error;
+
+	error = NULL;
+
+	serviceble->connection = g_bus_get_finish(res, & error);
+	report_error(&error, "getting bus");
+
+	if (serviceble->connection != NULL) {
+		ASYNCLOG(LOG_INFO, "Creating advertising manager\n");
+
+		// Obtain a proxy for the LEAdvertisementMAanager1 interface
+		// This is an asynchronous call, so initialisation continuous in the callback
+		leadvertising_manager1_proxy_new(serviceble->connection, G_DBUS_PROXY_FLAGS_NONE, BLUEZ_SERVICE_NAME, serviceble->adapter, NULL, (GAsyncReadyCallback)(&on_leadvertising_manager1_proxy_new), serviceble);
 	}
 }
 
-static void create_uuid(KeyPair * keypair, bool continuous, Buffer * uuid) {
-	unsigned char a[4];
-	unsigned char b[2];
-	unsigned char c[2];
-	unsigned char d[8];
-	unsigned int pos;
-	Buffer * commitment;
-	char const * commitmentbytes;
-	EC_KEY * publickey;
-	gboolean result;
+static void on_leadvertising_manager1_proxy_new(GDBusConnection * connection, GAsyncResult *res, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+	GError *error;
 
-	commitment = buffer_new(0);
-	publickey = keypair_getpublickey(keypair);
+	error = NULL;
+
+	serviceble->leadvertisingmanager = leadvertising_manager1_proxy_new_finish(res, &error);
+	report_error(&error, "creating advertising manager");
+
+	if (serviceble->leadvertisingmanager != NULL) {
+		ASYNCLOG(LOG_INFO, "Creating Gatt manager\n");
+
+		// Obtain a proxy for the Gattmanager1 interface
+		// This is an asynchronous call, so initialisation continuous in the callback
+		gatt_manager1_proxy_new(serviceble->connection, G_DBUS_PROXY_FLAGS_NONE, BLUEZ_SERVICE_NAME, serviceble->adapter, NULL, (GAsyncReadyCallback)(&on_gatt_manager1_proxy_new), serviceble);
+	}
+}
+
+static void on_gatt_manager1_proxy_new(GDBusConnection * connection, GAsyncResult *res, gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
+	GError *error;
+
+	error = NULL;
+
+	serviceble->gattmanager = gatt_manager1_proxy_new_finish (res, &error);
+	report_error(&error, "creating gatt manager");
+
+	if (serviceble->gattmanager != NULL) {
+		///////////////////////////////////////////////////////
+
+		ASYNCLOG(LOG_INFO, "Creating object manager server\n");
+
+		serviceble->object_manager_gatt = g_dbus_object_manager_server_new(serviceble->gattpath);
+
+		ASYNCLOG(LOG_INFO, "Service established\n");
+		set_state(serviceble, SERVICESTATEBLE_INITIALISED);
+
+		if (serviceble->removed == TRUE) {
+			// The adapter went away while we were setting up
+			finalise(serviceble);
+		}
+		else {
+			// Initialisation is complete, now start advertising
+			advertising_start(serviceble, FALSE);
+		}
+	}
+}
+
+
+static void finalise(ServiceBle * serviceble) {
+	set_state(serviceble, SERVICESTATEBLE_FINALISING);
+
+	///////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////
+
+	ASYNCLOG(LOG_INFO, "Releasing object manager server\n");
+
+	g_object_unref(serviceble->object_manager_advert);
+	serviceble->object_manager_advert = NULL;
+
+	///////////////////////////////////////////////////////
+
+	ASYNCLOG(LOG_INFO, "Releasing bus\n");
+
+	g_object_unref(serviceble->connection);
+	serviceble->connection = NULL;
+
+	///////////////////////////////////////////////////////
+
+	ASYNCLOG(LOG_INFO, "Releasing advertising manager\n");
+
+	g_object_unref(serviceble->leadvertisingmanager);
+	serviceble->leadvertisingmanager = NULL;
+
+	///////////////////////////////////////////////////////
+
+	ASYNCLOG(LOG_INFO, "Releasing Gatt manager\n");
+
+	g_object_unref(serviceble->gattmanager);
+	serviceble->gattmanager = NULL;
+
+	///////////////////////////////////////////////////////
+
+	ASYNCLOG(LOG_INFO, "Releasing object manager server\n");
+	g_object_unref(serviceble->object_manager_gatt);
+	serviceble->object_manager_gatt = NULL;
+
+	///////////////////////////////////////////////////////
+
+	set_state(serviceble, SERVICESTATEBLE_FINALISED);
+
+	// Remove the timeout
+	if (serviceble->cycletimeoutid != 0) {
+		g_source_remove(serviceble->cycletimeoutid);
+		serviceble->cycletimeoutid = 0;
+	}
+
+	if (serviceble->removed == TRUE) {
+		// The adapter has gone, so this instance has nothing left to do
+		serviceble->cycling = FALSE;
+		serviceble_delete_later(serviceble);
+	}
+	else if (serviceble->cycling == TRUE) {
+		// This is a recycle stop, so we need to start again
+		serviceble->cycling = FALSE;
+		serviceble_start(serviceble);
+	}
+}
+
+/**
+ * Build the advert and GATT object tree. It's built once for the life of the
+ * service and only exported and unexported as advertising starts and stops,
+ * so that a recycle has nothing but the UUIDs to change.
+ *
+ * @param serviceble the service to build the objects for
+ */
+static void skeletons_new(ServiceBle * serviceble) {
+	const gchar * const charflags_outgoing[] = {"notify", NULL};
+	const gchar * const charflags_incoming[] = {"write", "write-without-response", NULL};
+
+	// The value both characteristics start out with
+	serviceble->emptyvalue = g_variant_ref_sink(g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, NULL, 0, sizeof(guchar)));
+
+	///////////////////////////////////////////////////////
+
+	serviceble->leadvertisement = leadvertisement1_skeleton_new();
+	leadvertisement1_set_type_(serviceble->leadvertisement, "peripheral");
+	g_signal_connect(serviceble->leadvertisement, "handle-release", G_CALLBACK(&handle_release), serviceble);
+
+	serviceble->object_advert = object_skeleton_new(serviceble->advertpath);
+	object_skeleton_set_leadvertisement1(serviceble->object_advert, serviceble->leadvertisement);
+
+	///////////////////////////////////////////////////////
+
+	serviceble->gattservice = gatt_service1_skeleton_new();
+	gatt_service1_set_uuid(serviceble->gattservice, SERVICE_UUID);
+	gatt_service1_set_primary(serviceble->gattservice, TRUE);
+
+	serviceble->object_gatt_service = object_skeleton_new(serviceble->gattservicepath);
+	object_skeleton_set_gatt_service1(serviceble->object_gatt_service, serviceble->gattservice);
+
+	///////////////////////////////////////////////////////
+
+	serviceble->gattcharacteristic_outgoing = gatt_characteristic1_skeleton_new();
+	gatt_characteristic1_set_value(serviceble->gattcharacteristic_outgoing, serviceble->emptyvalue);
+	gatt_characteristic1_set_uuid(serviceble->gattcharacteristic_outgoing, CHARACTERISTIC_UUID_OUTGOING);
+	gatt_characteristic1_set_service(serviceble->gattcharacteristic_outgoing, serviceble->gattservicepath);
+	gatt_characteristic1_set_notifying(serviceble->gattcharacteristic_outgoing, FALSE);
+	gatt_characteristic1_set_flags(serviceble->gattcharacteristic_outgoing, charflags_outgoing);
+	gatt_characteristic1_set_notify_acquired(serviceble->gattcharacteristic_outgoing, FALSE);
+
+	serviceble->object_gatt_characteristic_outgoing = object_skeleton_new(serviceble->gattcharpath_outgoing);
+	object_skeleton_set_gatt_characteristic1(serviceble->object_gatt_characteristic_outgoing, serviceble->gattcharacteristic_outgoing);
+
+	g_signal_connect(serviceble->gattcharacteristic_outgoing, "handle-read-value", G_CALLBACK(&handle_read_value), serviceble);
+	g_signal_connect(serviceble->gattcharacteristic_outgoing, "handle-write-value", G_CALLBACK(&handle_write_value), serviceble);
+	g_signal_connect(serviceble->gattcharacteristic_outgoing, "handle-start-notify", G_CALLBACK(&handle_start_notify), NULL);
+	g_signal_connect(serviceble->gattcharacteristic_outgoing, "handle-stop-notify", G_CALLBACK(&handle_stop_notify), NULL);
+	g_signal_connect(serviceble->gattcharacteristic_outgoing, "handle-acquire-notify", G_CALLBACK(&handle_acquire_notify), serviceble);
+
+	///////////////////////////////////////////////////////
+
+	serviceble->gattcharacteristic_incoming = gatt_characteristic1_skeleton_new();
+	gatt_characteristic1_set_value(serviceble->gattcharacteristic_incoming, serviceble->emptyvalue);
+	gatt_characteristic1_set_uuid(serviceble->gattcharacteristic_incoming, CHARACTERISTIC_UUID_INCOMING);
+	gatt_characteristic1_set_service(serviceble->gattcharacteristic_incoming, serviceble->gattservicepath);
+	gatt_characteristic1_set_flags(serviceble->gattcharacteristic_incoming, charflags_incoming);
+	gatt_characteristic1_set_write_acquired(serviceble->gattcharacteristic_incoming, FALSE);
+
+	serviceble->object_gatt_characteristic_incoming = object_skeleton_new(serviceble->gattcharpath_incoming);
+	object_skeleton_set_gatt_characteristic1(serviceble->object_gatt_characteristic_incoming, serviceble->gattcharacteristic_incoming);
+
+	g_signal_connect(serviceble->gattcharacteristic_incoming, "handle-read-value", G_CALLBACK(&handle_read_value), serviceble);
+	g_signal_connect(serviceble->gattcharacteristic_incoming, "handle-write-value", G_CALLBACK(&handle_write_value), serviceble);
+	g_signal_connect(serviceble->gattcharacteristic_incoming, "handle-start-notify", G_CALLBACK(&handle_start_notify), NULL);
+	g_signal_connect(serviceble->gattcharacteristic_incoming, "handle-stop-notify", G_CALLBACK(&handle_stop_notify), NULL);
+	g_signal_connect(serviceble->gattcharacteristic_incoming, "handle-acquire-write", G_CALLBACK(&handle_acquire_write), serviceble);
+}
+
+/**
+ * Release the advert and GATT object tree. By now the object managers it was
+ * exported with have gone, so ours are the last references.
+ *
+ * @param serviceble the service to release the objects of
+ */
+static void skeletons_delete(ServiceBle * serviceble) {
+	guint matchedsignals;
+
+	matchedsignals = 0;
+	if (serviceble->leadvertisement != NULL) {
+		matchedsignals += g_signal_handlers_disconnect_matched(serviceble->leadvertisement, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, serviceble);
+		g_object_unref(serviceble->object_advert);
+		serviceble->object_advert = NULL;
+		g_object_unref(serviceble->leadvertisement);
+		serviceble->leadvertisement = NULL;
+	}
+
+	if (serviceble->gattservice != NULL) {
+		g_object_unref(serviceble->object_gatt_service);
+		serviceble->object_gatt_service = NULL;
+		g_object_unref(serviceble->gattservice);
+		serviceble->gattservice = NULL;
+	}
+
+	if (serviceble->gattcharacteristic_outgoing != NULL) {
+		matchedsignals += g_signal_handlers_disconnect_matched(serviceble->gattcharacteristic_outgoing, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, serviceble);
+		g_object_unref(serviceble->object_gatt_characteristic_outgoing);
+		serviceble->object_gatt_characteristic_outgoing = NULL;
+		g_object_unref(serviceble->gattcharacteristic_outgoing);
+		serviceble->gattcharacteristic_outgoing = NULL;
+	}
+
+	if (serviceble->gattcharacteristic_incoming != NULL) {
+		matchedsignals += g_signal_handlers_disconnect_matched(serviceble->gattcharacteristic_incoming, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, serviceble);
+		g_object_unref(serviceble->object_gatt_characteristic_incoming);
+		serviceble->object_gatt_characteristic_incoming = NULL;
+		g_object_unref(serviceble->gattcharacteristic_incoming);
+		serviceble->gattcharacteristic_incoming = NULL;
+	}
+
+	ASYNCLOG(LOG_INFO, "Removed %u signals\n", matchedsignals);
+
+	if (serviceble->emptyvalue != NULL) {
+		g_variant_unref(serviceble->emptyvalue);
+		serviceble->emptyvalue = NULL;
+	}
+}
+
+void advertising_start(ServiceBle * serviceble, bool continuous) {
+	gchar const * uuids[] = {SERVICE_UUID, NULL};
+	char const * uuid;
+	GVariantDict dict_options;
+	GVariant * arg_options;
+
+	uuid = generate_uuid(serviceble, continuous);
+	if (uuid != NULL) {
+		uuids[0] = uuid;
+	}
+
+	// Either bluetoothd advertises for us, or we run the advertising sets
+	// ourselves once the GATT application is on its way
+	serviceble->advertsets = hcicontroller_extended(serviceble->hcicontroller);
+	if (serviceble->advertsets == FALSE) {
+		advert_register(serviceble, uuids, continuous);
+	}
+
+	///////////////////////////////////////////////////////
+
+	ASYNCLOG(LOG_INFO, "Updating Gatt service\n");
+
+	// The objects are kept from one cycle to the next, so only the UUID
+	// changes, and the characteristics start out as they were created
+	gatt_service1_set_uuid(serviceble->gattservice, uuids[0]);
+
+	gatt_characteristic1_set_value(serviceble->gattcharacteristic_outgoing, serviceble->emptyvalue);
+	gatt_characteristic1_set_notifying(serviceble->gattcharacteristic_outgoing, FALSE);
+	gatt_characteristic1_set_notify_acquired(serviceble->gattcharacteristic_outgoing, FALSE);
 
-	result = cryptosupport_generate_commitment(publickey, commitment);
-	if (result == FALSE) {
-		printf("Failed to generate commitment\n");
-	}
+	gatt_characteristic1_set_value(serviceble->gattcharacteristic_incoming, serviceble->emptyvalue);
+	gatt_characteristic1_set_write_acquired(serviceble->gattcharacteristic_incoming, FALSE);
 
-	buffer_print_base64(commitment);
+	///////////////////////////////////////////////////////
 
-	if (buffer_get_pos(commitment) != 32) {
-		printf("Incorrect commitment length\n");
-	}
+	ASYNCLOG(LOG_INFO, "Exporting object manager server\n");
 
-	commitmentbytes = buffer_get_buffer(commitment);
-	for (pos = 0; pos < 4; pos++) {
-		a[pos] = commitmentbytes[16 + pos];
-	}
+	g_dbus_object_manager_server_export(serviceble->object_manager_gatt, G_DBUS_OBJECT_SKELETON(serviceble->object_gatt_service));
+	g_dbus_object_manager_server_export(serviceble->object_manager_gatt, G_DBUS_OBJECT_SKELETON(serviceble->object_gatt_characteristic_outgoing));
+	g_dbus_object_manager_server_export(serviceble->object_manager_gatt, G_DBUS_OBJECT_SKELETON(serviceble->object_gatt_characteristic_incoming));
+	g_dbus_object_manager_server_set_connection(serviceble->object_manager_gatt, serviceble->connection);
 
-	for (pos = 0; pos < 2; pos++) {
-		b[pos] = commitmentbytes[20 + pos];
-	}
+	///////////////////////////////////////////////////////
+	
+	ASYNCLOG(LOG_INFO, "Register gatt service\n");
 
-	for (pos = 0; pos < 2; pos++) {
-		c[pos] = commitmentbytes[22 + pos];
-	}
+	// Call the RegisterApplication method on the proxy
+	g_variant_dict_init(& dict_options, NULL);
+	arg_options = g_variant_dict_end(& dict_options);
 
-	for (pos = 0; pos < 8; pos++) {
-		d[pos] = commitmentbytes[24 + pos];
-	}
+	gatt_manager1_call_register_application(serviceble->gattmanager, serviceble->gattpath, arg_options, NULL, (GAsyncReadyCallback)(&on_register_application), serviceble);
 
 	if (continuous) {
-		d[7] |= 0x01;
+		set_state(serviceble, SERVICESTATEBLE_ADVERTISINGCONTINUOUS);
 	}
 	else {
-		d[7] &= 0xFE;
+		set_state(serviceble, SERVICESTATEBLE_ADVERTISING);
 	}
 
-	buffer_clear(uuid);
-	appendbytes(a, 4, uuid);
-	buffer_append_string(uuid, "-");
-	appendbytes(b, 2, uuid);
-	buffer_append_string(uuid, "-");
-	appendbytes(c, 2, uuid);
-	buffer_append_string(uuid, "-");
-	appendbytes(d, 2, uuid);
-	buffer_append_string(uuid, "-");
-	appendbytes(d + 2, 6, uuid);
+	if (serviceble->advertsets == TRUE) {
+		advert_sets_start(serviceble, continuous, uuids[0]);
+	}
 
-	buffer_delete(commitment);
+	// All started
+	//if (serviceble->connected == FALSE) {
+	//	serviceble->connected = TRUE;
+	//	fsmservice_connected(serviceble->fsmservice);
+	//}
 }
 
-void serviceble_stop(ServiceBle * serviceble) {
-	advertising_stop(serviceble, TRUE);
-}
+/**
+ * Publish the advertisement and register it with bluetoothd, which carries
+ * on in the registration callback. Along with the UUID the advert carries
+ * the discovery record, and the name goes in the scan response.
+ *
+ * @param serviceble the service to advertise
+ * @param uuids the service UUIDs to advertise
+ * @param continuous whether the advert is for continuous authentication
+ */
+static void advert_register(ServiceBle * serviceble, gchar const * const * uuids, bool continuous) {
+	GVariantDict dict_options;
+	GVariant * arg_options;
+	GVariantBuilder builder;
+	guchar record[ADVERT_RECORD_SIZE];
 
-void serviceble_start(ServiceBle * serviceble) {
-	set_state(serviceble, SERVICESTATEBLE_INITIALISING);
+	ASYNCLOG(LOG_INFO, "Updating advertisement\n");
 
-	printf("Creating object manager server\n");
+	// Set the advertisement properties
+	leadvertisement1_set_service_uuids(serviceble->leadvertisement, uuids);
 
-	serviceble->object_manager_advert = g_dbus_object_manager_server_new(BLUEZ_OBJECT_PATH);
+	advert_record(serviceble, continuous, record);
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{qv}"));
+	g_variant_builder_add(&builder, "{qv}", (guint16)ADVERT_COMPANY_ID, g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, record, ADVERT_RECORD_SIZE, sizeof(guchar)));
+	leadvertisement1_set_manufacturer_data(serviceble->leadvertisement, g_variant_builder_end(&builder));
+	leadvertisement1_set_local_name(serviceble->leadvertisement, (serviceble->advertname[0] != '\0') ? serviceble->advertname : NULL);
 
 	///////////////////////////////////////////////////////
 
-	printf("Getting bus\n");
-
-	// This is an asynchronous call, so initialisation continuous in the callback
-	g_bus_get(G_BUS_TYPE_SYSTEM, NULL, (GAsyncReadyCallback)(&on_g_bus_get), serviceble);
+	ASYNCLOG(LOG_INFO, "Exporting object manager server\n");
 
-	// Set up to periodically restart
-	serviceble->cycletimeoutid = g_timeout_add(10000, cycle_timeout, serviceble);
+	g_dbus_object_manager_server_export(serviceble->object_manager_advert, G_DBUS_OBJECT_SKELETON(serviceble->object_advert));
+	g_dbus_object_manager_server_set_connection(serviceble->object_manager_advert, serviceble->connection);
 
 	///////////////////////////////////////////////////////
-	///////////////////////////////////////////////////////
-	///////////////////////////////////////////////////////
-	///////////////////////////////////////////////////////
-}
+	
+	ASYNCLOG(LOG_INFO, "Register advertisement\n");
 
-static gboolean cycle_timeout(gpointer user_data) {
-	ServiceBle * serviceble = (ServiceBle *)user_data;
-	bool recycle;
+	// Call the RegisterAdvertisement method on the proxy
+	g_variant_dict_init(& dict_options, NULL);
+	arg_options = g_variant_dict_end(& dict_options);
 
-	printf("\n\nXXXXXXXXXXXXXXXXXX CYCLE\n");
+	serviceble->traceadvert = trace_now();
+	leadvertising_manager1_call_register_advertisement(serviceble->leadvertisingmanager, serviceble->advertpath, arg_options, NULL, (GAsyncReadyCallback)(&on_register_advert), serviceble);
+}
 
-	recycle = TRUE;
+/**
+ * Advertise through our own extended advertising sets rather than an advert
+ * registered with bluetoothd. The primary set is connectable, carries the
+ * same UUID as the GATT service and follows the profile. If there's a
+ * secondary interval, the secondary set carries the other commitment at
+ * that slower interval.
+ *
+ * @param serviceble the service to advertise
+ * @param continuous whether the primary set is for continuous authentication
+ * @param uuid the UUID for the primary set
+ */
+static void advert_sets_start(ServiceBle * serviceble, bool continuous, char const * uuid) {
+	char const * other;
+	guchar record[ADVERT_RECORD_SIZE];
+	bool result;
 
-	switch (serviceble->state) {
-		case SERVICESTATEBLE_INITIALISING:
-		case SERVICESTATEBLE_UNADVERTISING:
-		case SERVICESTATEBLE_FINALISING:
-		case SERVICESTATEBLE_CONNECTED:
-		case SERVICESTATEBLE_ADVERTISINGCONTINUOUS:
-			// Do nothing, wait again
-			break;
-		case SERVICESTATEBLE_ADVERTISING:
-		case SERVICESTATEBLE_INITIALISED:
-		case SERVICESTATEBLE_UNADVERTISED:
-			serviceble->cycling = TRUE;
-			break;
-		case SERVICESTATEBLE_FINALISED:
-			recycle = FALSE;
-			break;
-		case SERVICESTATEBLE_DORMANT:
-		case SERVICESTATEBLE_INVALID:
-		case SERVICESTATEBLE_NUM:
-		default:
-			printf("XXXXXXXXXXXXXXXXXX ERROR\n\n\n");
-			printf("Cycle during invalid state\n");
-			break;
-	}
+	ASYNCLOG(LOG_INFO, "Setting up advertising sets\n");
 
-	if (serviceble->cycling == TRUE) {
-		printf("XXXXXXXXXXXXXXXXXX RECYCLE\n\n\n");
-		recycle = FALSE;
-		serviceble_stop(serviceble);
-	}
-	else {
-		printf("XXXXXXXXXXXXXXXXXX IGNORE\n\n\n");
-	}
+	serviceble->traceadvert = trace_now();
+	advert_record(serviceble, continuous, record);
+	result = hcicontroller_set_advert(serviceble->hcicontroller, HCICONTROLLER_SET_PRIMARY, uuid, TRUE, 0, 0) && hcicontroller_set_manufacturer_data(serviceble->hcicontroller, HCICONTROLLER_SET_PRIMARY, ADVERT_COMPANY_ID, record, ADVERT_RECORD_SIZE);
 
-	if (recycle == FALSE) {
-		// This timeout fires only once
-		serviceble->cycletimeoutid = 0;
+	other = generate_uuid(serviceble, !continuous);
+	advert_record(serviceble, !continuous, record);
+	if ((other == NULL) || (serviceble->secondaryinterval == 0) || (hcicontroller_set_advert(serviceble->hcicontroller, HCICONTROLLER_SET_SECONDARY, other, FALSE, serviceble->secondaryinterval, serviceble->secondaryinterval) == FALSE) || (hcicontroller_set_manufacturer_data(serviceble->hcicontroller, HCICONTROLLER_SET_SECONDARY, ADVERT_COMPANY_ID, record, ADVERT_RECORD_SIZE) == FALSE)) {
+		hcicontroller_clear_advert(serviceble->hcicontroller, HCICONTROLLER_SET_SECONDARY);
 	}
 
-	return recycle;
+	advert_registered(serviceble, result);
 }
 
+/**
+ * Fill in the discovery record carried in the advert's manufacturer data,
+ * so that a central knows which framing and chunk sizes to use before it
+ * connects, rather than finding out through a hello and exploratory reads.
+ *
+ * @param serviceble the service being advertised
+ * @param continuous whether the advert is for continuous authentication
+ * @param record buffer for the ADVERT_RECORD_SIZE bytes of the record
+ */
+static void advert_record(ServiceBle * serviceble, bool continuous, guchar * record) {
+	record[0] = (ADVERT_RECORD_VERSION << 4) | FRAMING_VERSION_2;
+	record[1] = FRAMING_CAPABILITIES;
+	record[2] = continuous ? ADVERT_FLAG_CONTINUOUS : 0x00;
+	record[3] = (serviceble->charlength >> 8) & 0xff;
+	record[4] = serviceble->charlength & 0xff;
+}
 
+void advertising_stop(ServiceBle * serviceble, bool finalise) {
+	set_state(serviceble, SERVICESTATEBLE_UNADVERTISING);
 
+	hcicontroller_profile_stop(serviceble->hcicontroller);
 
-static void on_g_bus_get (GObject *source_object, GAsyncResult *res, gpointer user_data) {
-	ServiceBle * serviceble = (ServiceBle *)user_data;
-	GError *error;
-
-	error = NULL;
+	serviceble->finalise = finalise;
 
-	serviceble->connection = g_bus_get_finish(res, & error);
-	report_error(&error, "getting bus");
+	///////////////////////////////////////////////////////
 
-	if (serviceble->connection != NULL) {
-		printf("Creating advertising manager\n");
+	ASYNCLOG(LOG_INFO, "Unregister gatt service\n");
 
-		// Obtain a proxy for the LEAdvertisementMAanager1 interface
-		// This is an asynchronous call, so initialisation continuous in the callback
-		leadvertising_manager1_proxy_new(serviceble->connection, G_DBUS_PROXY_FLAGS_NONE, BLUEZ_SERVICE_NAME, BLUEZ_DEVICE_PATH, NULL, (GAsyncReadyCallback)(&on_leadvertising_manager1_proxy_new), serviceble);
-	}
+	// This is an asynchronous call, so advertisement stopping continuous in the callback
+	gatt_manager1_call_unregister_application(serviceble->gattmanager, serviceble->gattpath, NULL, (GAsyncReadyCallback)(&on_gatt_manager1_call_unregister_application), serviceble);
 }
 
-static void on_leadvertising_manager1_proxy_new(GDBusConnection * connection, GAsyncResult *res, gpointer user_data) {
+
+static void on_gatt_manager1_call_unregister_application(GattManager1 * gattmanager, GAsyncResult *res, gpointer user_data) {
 	ServiceBle * serviceble = (ServiceBle *)user_data;
 	GError *error;
+	gboolean result;
 
 	error = NULL;
 
-	serviceble->leadvertisingmanager = leadvertising_manager1_proxy_new_finish(res, &error);
-	report_error(&error, "creating advertising manager");
+	result = gatt_manager1_call_unregister_application_finish(gattmanager, res, &error);
+	report_error(&error, "unregistering gatt service");
+	if (result == FALSE) {
+		ASYNCLOG(LOG_ERR, "Gatt service failed to unregister\n");
+	}
 
-	if (serviceble->leadvertisingmanager != NULL) {
-		printf("Creating Gatt manager\n");
+	///////////////////////////////////////////////////////
 
-		// Obtain a proxy for the Gattmanager1 interface
-		// This is an asynchronous call, so initialisation continuous in the callback
-		gatt_manager1_proxy_new(serviceble->connection, G_DBUS_PROXY_FLAGS_NONE, BLUEZ_SERVICE_NAME, BLUEZ_DEVICE_PATH, NULL, (GAsyncReadyCallback)(&on_gatt_manager1_proxy_new), serviceble);
+	ASYNCLOG(LOG_INFO, "Unexporting object manager server\n");
+
+	g_dbus_object_manager_server_unexport (serviceble->object_manager_gatt, serviceble->gattservicepath);
+	g_dbus_object_manager_server_unexport (serviceble->object_manager_gatt, serviceble->gattcharpath_outgoing);
+	g_dbus_object_manager_server_unexport (serviceble->object_manager_gatt, serviceble->gattcharpath_incoming);
+
+	///////////////////////////////////////////////////////
+
+	ASYNCLOG(LOG_INFO, "Release acquired sockets\n");
+
+	release_write(serviceble);
+	release_notify(serviceble);
+
+	///////////////////////////////////////////////////////
+
+	ASYNCLOG(LOG_INFO, "Unregister advertisement\n");
+
+	if (serviceble->cycling == TRUE) {
+		// We're undiscoverable from here until the advert is registered again
+		serviceble->recyclestart = g_get_monotonic_time();
+	}
+
+	if (serviceble->advertsets == TRUE) {
+		// Our own sets stop straight away
+		hcicontroller_adverts_stop(serviceble->hcicontroller);
+		serviceble->advertsets = FALSE;
+		advert_unregistered(serviceble);
+	}
+	else {
+		leadvertising_manager1_call_unregister_advertisement (serviceble->leadvertisingmanager, serviceble->advertpath, NULL, (GAsyncReadyCallback)(&on_unregister_advert), serviceble);
 	}
 }
 
-static void on_gatt_manager1_proxy_new(GDBusConnection * connection, GAsyncResult *res, gpointer user_data) {
-	ServiceBle * serviceble = (ServiceBle *)user_data;
-	GError *error;
 
-	error = NULL;
 
-	serviceble->gattmanager = gatt_manager1_proxy_new_finish (res, &error);
-	report_error(&error, "creating gatt manager");
+static void session_write(char const * data, size_t length, void * user_data) {
+	Session * session = (Session *)user_data;
 
-	if (serviceble->gattmanager != NULL) {
-		///////////////////////////////////////////////////////
+	ASYNCLOG_HEX(LOG_DEBUG, "Sending data: ", data, length);
 
-		printf("Creating object manager server\n");
+	send_data(session, data, length);
+}
 
-		serviceble->object_manager_gatt = g_dbus_object_manager_server_new(BLUEZ_GATT_OBJECT_PATH);
+static void session_set_timeout(int timeout, void * user_data) {
+	Session * session = (Session *)user_data;
 
-		printf("Service established\n");
-		set_state(serviceble, SERVICESTATEBLE_INITIALISED);
+	ASYNCLOG(LOG_INFO, "Requesting timeout of %d for %s\n", timeout, session->device);
 
-		// Initialisation is complete, now start advertising
-		advertising_start(serviceble, FALSE);
+	// Remove any previous timeout
+	if (session->timeoutid != 0) {
+		g_source_remove(session->timeoutid);
+		session->timeoutid = 0;
 	}
+
+	session->timeoutid = g_timeout_add(timeout, session_timeout, session);
 }
 
+static void session_error(void * user_data) {
+	Session * session = (Session *)user_data;
 
-static void finalise(ServiceBle * serviceble) {
-	set_state(serviceble, SERVICESTATEBLE_FINALISING);
+	ASYNCLOG(LOG_INFO, "Error for %s\n", session->device);
+}
 
-	///////////////////////////////////////////////////////
-	///////////////////////////////////////////////////////
-	///////////////////////////////////////////////////////
-	///////////////////////////////////////////////////////
+/**
+ * The state machine is ready for a central to connect. Advertising carries
+ * on while other sessions are active, so it only needs restarting if it's
+ * been stopped, for example by a fallback disconnect.
+ *
+ * @param user_data the session that's listening
+ */
+static void session_listen(void * user_data) {
+	Session * session = (Session *)user_data;
+	ServiceBle * serviceble = session->serviceble;
 
-	printf("Releasing object manager server\n");
+	ASYNCLOG(LOG_INFO, "Requesting to listen for %s\n", session->device);
+	if ((session->connected == FALSE) && (serviceble->state == SERVICESTATEBLE_UNADVERTISED) && (serviceble->finalise == FALSE) && (serviceble->cycling == FALSE) && (serviceble->removed == FALSE)) {
+		ASYNCLOG(LOG_INFO, "Listening\n");
 
-	g_object_unref(serviceble->object_manager_advert);
-	serviceble->object_manager_advert = NULL;
+		advertising_start(serviceble, TRUE);
+	}
+}
 
-	///////////////////////////////////////////////////////
+/**
+ * The state machine wants to drop the central. We ask BlueZ to disconnect
+ * just that device, so that other sessions are unaffected. If we don't know
+ * the device we fall back to taking down the whole application.
+ *
+ * @param user_data the session to disconnect
+ */
+static void session_disconnect(void * user_data) {
+	Session * session = (Session *)user_data;
+	ServiceBle * serviceble = session->serviceble;
 
-	printf("Releasing bus\n");
+	ASYNCLOG(LOG_INFO, "Requesting disconnect of %s\n", session->device);
 
-	g_object_unref(serviceble->connection);
-	serviceble->connection = NULL;
+	if (session->connected == TRUE) {
+		if ((g_strcmp0(session->device, SESSION_DEVICE_UNKNOWN) != 0) && (serviceble->connection != NULL)) {
+			// This is an asynchronous call, so disconnection continues in the callback
+			g_dbus_connection_call(serviceble->connection, BLUEZ_SERVICE_NAME, session->device, BLUEZ_DEVICE_INTERFACE, "Disconnect", NULL, NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, (GAsyncReadyCallback)(&on_device_disconnect), session_ref_new(session));
+		}
+		else {
+			advertising_stop(serviceble, FALSE);
+		}
+	}
+}
 
-	///////////////////////////////////////////////////////
+static void session_authenticated(int status, void * user_data) {
+	Session * session = (Session *)user_data;
 
-	printf("Releasing advertising manager\n");
+	ASYNCLOG(LOG_INFO, "Authenticated status for %s: %d\n", session->device, status);
+	trace_instant("authenticated", session->traceid, status);
+}
 
-	g_object_unref(serviceble->leadvertisingmanager);
-	serviceble->leadvertisingmanager = NULL;
+static void session_ended(void * user_data) {
+	Session * session = (Session *)user_data;
 
-	///////////////////////////////////////////////////////
+	ASYNCLOG(LOG_INFO, "Session ended for %s\n", session->device);
+	trace_instant("session ended", session->traceid, 0);
+}
 
-	printf("Releasing Gatt manager\n");
+static void session_status_updated(int state, void * user_data) {
+	Session * session = (Session *)user_data;
 
-	g_object_unref(serviceble->gattmanager);
-	serviceble->gattmanager = NULL;
+	ASYNCLOG(LOG_INFO, "Update for %s, state: %d\n", session->device, state);
+}
 
-	///////////////////////////////////////////////////////
+static gboolean session_timeout(gpointer user_data) {
+	Session * session = (Session *)user_data;
 
-	printf("Releasing object manager server\n");
-	g_object_unref(serviceble->object_manager_gatt);
-	serviceble->object_manager_gatt = NULL;
+	// This timeout fires only once
+	session->timeoutid = 0;
+	trace_instant("timeout", session->traceid, 0);
 
-	///////////////////////////////////////////////////////
+	session_fsm(session, FSMJOB_TIMEOUT, NULL, 0);
 
-	set_state(serviceble, SERVICESTATEBLE_FINALISED);
+	return FALSE;
+}
 
-	// Remove the timeout
-	g_source_remove(serviceble->cycletimeoutid);
-	serviceble->cycletimeoutid = 0;
+/**
+ * Queue a call into a session's state machine. The call is run on the
+ * worker once any earlier calls for the same session have finished, so the
+ * state machine only ever runs on one thread at a time.
+ *
+ * @param session the session whose state machine is to be called
+ * @param type the call to make
+ * @param data data to pass with FSMJOB_READ, which is copied, or NULL
+ * @param length the number of bytes of data
+ */
+static void session_fsm(Session * session, FSMJOB type, char const * data, size_t length) {
+	FsmJob * job;
+
+	job = g_new0(FsmJob, 1);
+	job->session = session;
+	job->type = type;
+	job->tracequeued = trace_now();
+	job->data = NULL;
+	if (data != NULL) {
+		job->data = buffer_new(length);
+		buffer_append(job->data, data, length);
+	}
 
-	// This is a recycle stop, so we need to start again
-	if (serviceble->cycling == TRUE) {
-		serviceble->cycling = FALSE;
-		serviceble_start(serviceble);
+	g_queue_push_tail(session->fsmjobs, job);
+	session_fsm_next(session);
+}
+
+/**
+ * Hand the next queued call to the worker, if the session's state machine
+ * isn't already busy.
+ *
+ * @param session the session to run the next call for
+ */
+static void session_fsm_next(Session * session) {
+	FsmJob * job;
+
+	if (session->fsmbusy == FALSE) {
+		job = (FsmJob *)g_queue_pop_head(session->fsmjobs);
+		if (job != NULL) {
+			session->fsmbusy = TRUE;
+			session->serviceble->fsminflight++;
+			worker_push(session->serviceble->worker, session_fsm_run, job);
+		}
 	}
 }
 
-void advertising_start(ServiceBle * serviceble, bool continuous) {
-	gchar const * uuids[] = {SERVICE_UUID, NULL};
-	Buffer * uuid;
-	ObjectSkeleton * object_advert;
-	GVariantDict dict_options;
-	const gchar * const charflags_outgoing[] = {"notify", NULL};
-	const gchar * const charflags_incoming[] = {"write", "write-without-response", NULL};
-	GVariant * variant1;
-	GVariant * variant2;
-	GVariant * arg_options;
+/**
+ * Worker job; makes a single call into a session's state machine. Anything
+ * the state machine asks for is posted back to the main loop by the
+ * session_post_*() callbacks, followed by FSMEVENT_DONE.
+ *
+ * @param data the job to run
+ */
+static void session_fsm_run(gpointer data) {
+	FsmJob * job = (FsmJob *)data;
+	Session * session = job->session;
+	ServiceBle * serviceble = session->serviceble;
+	static char const * const tracenames[FSMJOB_NUM] = {"fsm start", "fsm connected", "fsm read", "fsm disconnected", "fsm timeout"};
+	guint64 tracestart;
+
+	// Time spent waiting for the worker thread, then in the state machine
+	trace_span("fsm queued", session->traceid, job->tracequeued, job->type);
+	tracestart = trace_now();
+
+	switch (job->type) {
+		case FSMJOB_START:
+			fsmservice_start(session->fsmservice, serviceble->shared, serviceble->users, serviceble->extradata);
+			break;
+		case FSMJOB_CONNECTED:
+			fsmservice_connected(session->fsmservice);
+			break;
+		case FSMJOB_READ:
+			fsmservice_read(session->fsmservice, buffer_get_buffer(job->data), buffer_get_pos(job->data));
+			break;
+		case FSMJOB_DISCONNECTED:
+			fsmservice_disconnected(session->fsmservice);
+			break;
+		case FSMJOB_TIMEOUT:
+			fsmservice_timeout(session->fsmservice);
+			break;
+		default:
+			ASYNCLOG(LOG_ERR, "Invalid state machine job: %d\n", job->type);
+			break;
+	}
+
+	if ((job->type > FSMJOB_INVALID) && (job->type < FSMJOB_NUM)) {
+		trace_span(tracenames[job->type], session->traceid, tracestart, (job->data != NULL) ? buffer_get_pos(job->data) : 0);
+	}
 
-	uuid = buffer_new(0);
-	generate_uuid(serviceble, continuous, uuid);
-	uuids[0] = buffer_get_buffer(uuid);
+	// Without a worker, posting the end of the job can start the next one
+	fsm_job_delete(job);
+	session_post(session, FSMEVENT_DONE, 0, NULL, 0);
+}
 
-	printf("Creating advertisement\n");
+static void fsm_job_delete(FsmJob * job) {
+	if (job->data != NULL) {
+		buffer_delete(job->data);
+	}
+	g_free(job);
+}
 
-	// Publish the advertisement interface
-	serviceble->leadvertisement = leadvertisement1_skeleton_new();
-	g_signal_connect(serviceble->leadvertisement, "handle-release", G_CALLBACK(&handle_release), NULL);
+/**
+ * Pass a callback from a session's state machine back to the main loop.
+ * Safe to call from the worker thread.
+ *
+ * @param session the session whose state machine made the callback
+ * @param type the callback made
+ * @param value the integer argument of the callback, if it has one
+ * @param data data to pass with FSMEVENT_WRITE, which is copied, or NULL
+ * @param length the number of bytes of data
+ */
+static void session_post(Session * session, FSMEVENT type, int value, char const * data, size_t length) {
+	FsmEvent * event;
+
+	event = g_new0(FsmEvent, 1);
+	event->session = session;
+	event->type = type;
+	event->value = value;
+	event->data = NULL;
+	if (data != NULL) {
+		event->data = buffer_new(length);
+		buffer_append(event->data, data, length);
+	}
 
-	// Set the advertisement properties
-	leadvertisement1_set_service_uuids(serviceble->leadvertisement, uuids);
-	leadvertisement1_set_type_(serviceble->leadvertisement, "peripheral");
+	worker_post(session->serviceble->worker, session_event, event, (GDestroyNotify)fsm_event_delete);
+}
 
-	object_advert = object_skeleton_new (BLUEZ_ADVERT_PATH);
-	object_skeleton_set_leadvertisement1(object_advert, serviceble->leadvertisement);
+/**
+ * Act on a callback from a session's state machine, in the main loop. The
+ * session can't have been removed since, because it stays busy until its
+ * FSMEVENT_DONE has been handled here.
+ *
+ * @param data the event posted by session_post()
+ */
+static void session_event(gpointer data) {
+	FsmEvent * event = (FsmEvent *)data;
+	Session * session = event->session;
 
-	///////////////////////////////////////////////////////
+	switch (event->type) {
+		case FSMEVENT_WRITE:
+			session_write(buffer_get_buffer(event->data), buffer_get_pos(event->data), session);
+			break;
+		case FSMEVENT_SET_TIMEOUT:
+			session_set_timeout(event->value, session);
+			break;
+		case FSMEVENT_ERROR:
+			session_error(session);
+			break;
+		case FSMEVENT_LISTEN:
+			session_listen(session);
+			break;
+		case FSMEVENT_DISCONNECT:
+			session_disconnect(session);
+			break;
+		case FSMEVENT_AUTHENTICATED:
+			session_authenticated(event->value, session);
+			break;
+		case FSMEVENT_ENDED:
+			session_ended(session);
+			break;
+		case FSMEVENT_STATUS_UPDATED:
+			session_status_updated(event->value, session);
+			break;
+		case FSMEVENT_DONE:
+			session->fsmbusy = FALSE;
+			session->serviceble->fsminflight--;
+			serviceble_delete_check(session->serviceble);
+			session_fsm_next(session);
+			break;
+		default:
+			ASYNCLOG(LOG_ERR, "Invalid state machine event: %d\n", event->type);
+			break;
+	}
 
-	printf("Exporting object manager server\n");
+	fsm_event_delete(event);
+}
 
-	g_dbus_object_manager_server_export(serviceble->object_manager_advert, G_DBUS_OBJECT_SKELETON(object_advert));
-	g_dbus_object_manager_server_set_connection(serviceble->object_manager_advert, serviceble->connection);
+static void fsm_event_delete(FsmEvent * event) {
+	if (event->data != NULL) {
+		buffer_delete(event->data);
+	}
+	g_free(event);
+}
 
-	///////////////////////////////////////////////////////
-	
-	printf("Register advertisement\n");
+static void session_post_write(char const * data, size_t length, void * user_data) {
+	session_post((Session *)user_data, FSMEVENT_WRITE, 0, data, length);
+}
 
-	// Call the RegisterAdvertisement method on the proxy
-	g_variant_dict_init(& dict_options, NULL);
-	arg_options = g_variant_dict_end(& dict_options);
+static void session_post_set_timeout(int timeout, void * user_data) {
+	session_post((Session *)user_data, FSMEVENT_SET_TIMEOUT, timeout, NULL, 0);
+}
 
-	leadvertising_manager1_call_register_advertisement(serviceble->leadvertisingmanager, BLUEZ_ADVERT_PATH, arg_options, NULL, (GAsyncReadyCallback)(&on_register_advert), NULL);
+static void session_post_error(void * user_data) {
+	session_post((Session *)user_data, FSMEVENT_ERROR, 0, NULL, 0);
+}
 
-	///////////////////////////////////////////////////////
+static void session_post_listen(void * user_data) {
+	session_post((Session *)user_data, FSMEVENT_LISTEN, 0, NULL, 0);
+}
 
-	printf("Creating Gatt service\n");
+static void session_post_disconnect(void * user_data) {
+	session_post((Session *)user_data, FSMEVENT_DISCONNECT, 0, NULL, 0);
+}
 
-	// Publish the gatt service interface
-	serviceble->gattservice = gatt_service1_skeleton_new();
+static void session_post_authenticated(int status, void * user_data) {
+	session_post((Session *)user_data, FSMEVENT_AUTHENTICATED, status, NULL, 0);
+}
 
-	// Set the gatt service properties
-	gatt_service1_set_uuid(serviceble->gattservice, buffer_get_buffer(uuid));
-	gatt_service1_set_primary(serviceble->gattservice, TRUE);
+static void session_post_ended(void * user_data) {
+	session_post((Session *)user_data, FSMEVENT_ENDED, 0, NULL, 0);
+}
 
-	serviceble->object_gatt_service = object_skeleton_new (BLUEZ_GATT_SERVICE_PATH);
-	object_skeleton_set_gatt_service1(serviceble->object_gatt_service, serviceble->gattservice);
+static void session_post_status_updated(int state, void * user_data) {
+	session_post((Session *)user_data, FSMEVENT_STATUS_UPDATED, state, NULL, 0);
+}
 
-	///////////////////////////////////////////////////////
 
-	printf("Creating Gatt characteristic outgoing\n");
+/**
+ * Take down a service instance whose adapter has gone, deleting it once
+ * everything it registered has been released. If it's part way through
+ * starting or stopping, it finishes off when that completes.
+ *
+ * @param serviceble the service instance to remove
+ * @param removedfunc called in place of deleting the instance when it's
+ *        ready to be deleted, or NULL to delete it there and then
+ * @param user_data passed to removedfunc
+ */
+static void serviceble_remove(ServiceBle * serviceble, ServiceBleRemovedFunc removedfunc, gpointer user_data) {
+	ASYNCLOG(LOG_INFO, "Removing service for %s\n", serviceble->adapter);
 
-	// Publish the gatt characteristic interface
-	serviceble->gattcharacteristic_outgoing = gatt_characteristic1_skeleton_new();
+	serviceble->removed = TRUE;
+	serviceble->removedfunc = removedfunc;
+	serviceble->removeddata = user_data;
+	hcicontroller_profile_stop(serviceble->hcicontroller);
 
-	// Initialise the characteristic value
-	buffer_clear(serviceble->buffer_read);
-	variant1 = g_variant_new_from_data (G_VARIANT_TYPE("ay"), buffer_get_buffer(serviceble->buffer_read), buffer_get_pos(serviceble->buffer_read), TRUE, NULL, NULL);
-	gatt_characteristic1_set_value (serviceble->gattcharacteristic_outgoing, variant1);
-	g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(serviceble->gattcharacteristic_outgoing));
+	switch (serviceble->state) {
+		case SERVICESTATEBLE_ADVERTISING:
+		case SERVICESTATEBLE_ADVERTISINGCONTINUOUS:
+		case SERVICESTATEBLE_CONNECTED:
+			serviceble_stop(serviceble);
+			break;
+		case SERVICESTATEBLE_INITIALISED:
+		case SERVICESTATEBLE_UNADVERTISED:
+			// Nothing is registered, so there's just our side to release
+			finalise(serviceble);
+			break;
+		case SERVICESTATEBLE_INITIALISING:
+		case SERVICESTATEBLE_UNADVERTISING:
+		case SERVICESTATEBLE_FINALISING:
+			// Picked up when the operation in progress completes
+			break;
+		case SERVICESTATEBLE_FINALISED:
+		case SERVICESTATEBLE_DORMANT:
+		case SERVICESTATEBLE_INVALID:
+		case SERVICESTATEBLE_NUM:
+		default:
+			serviceble_delete_later(serviceble);
+			break;
+	}
+}
 
-	// Set the gatt characteristic properties
-	gatt_characteristic1_set_uuid (serviceble->gattcharacteristic_outgoing, CHARACTERISTIC_UUID_OUTGOING);
-	gatt_characteristic1_set_service (serviceble->gattcharacteristic_outgoing, BLUEZ_GATT_SERVICE_PATH);
-	gatt_characteristic1_set_notifying (serviceble->gattcharacteristic_outgoing, FALSE);
-	gatt_characteristic1_set_flags (serviceble->gattcharacteristic_outgoing, charflags_outgoing);
+/**
+ * Delete a removed service instance once everything it registered has been
+ * released and no callbacks that refer to it are outstanding.
+ *
+ * @param serviceble the service instance to delete
+ */
+static void serviceble_delete_later(ServiceBle * serviceble) {
+	serviceble->deleting = TRUE;
+	serviceble_delete_check(serviceble);
+}
 
-	serviceble->object_gatt_characteristic_outgoing = object_skeleton_new (BLUEZ_GATT_CHARACTERISTIC_PATH_OUTGOING);
-	object_skeleton_set_gatt_characteristic1(serviceble->object_gatt_characteristic_outgoing, serviceble->gattcharacteristic_outgoing);
+/**
+ * Schedule the deletion of a service instance waiting to be deleted, if the
+ * last of its outstanding callbacks has completed. Called whenever one
+ * completes, so nothing has to poll for it.
+ *
+ * @param serviceble the service instance to check
+ */
+static void serviceble_delete_check(ServiceBle * serviceble) {
+	if ((serviceble->deleting == TRUE) && (serviceble->deleteid == 0) && (serviceble->sendinflight == 0) && (serviceble->refs == 0) && (serviceble->fsminflight == 0)) {
+		// Delete it from the main loop, since we may be inside its callbacks
+		serviceble->deleteid = g_idle_add(serviceble_delete_idle, serviceble);
+	}
+}
 
-	g_signal_connect(serviceble->gattcharacteristic_outgoing, "handle-read-value", G_CALLBACK(&handle_read_value), serviceble);
-	g_signal_connect(serviceble->gattcharacteristic_outgoing, "handle-write-value", G_CALLBACK(&handle_write_value), serviceble);
-	g_signal_connect(serviceble->gattcharacteristic_outgoing, "handle-start-notify", G_CALLBACK(&handle_start_notify), NULL);
-	g_signal_connect(serviceble->gattcharacteristic_outgoing, "handle-stop-notify", G_CALLBACK(&handle_stop_notify), NULL);
+/**
+ * Idle callback to delete a removed service instance.
+ *
+ * @param user_data the service instance to delete
+ * @return FALSE to remove the source
+ */
+static gboolean serviceble_delete_idle(gpointer user_data) {
+	ServiceBle * serviceble = (ServiceBle *)user_data;
 
-	///////////////////////////////////////////////////////
+	serviceble->deleteid = 0;
 
-	printf("Creating Gatt characteristic incoming\n");
+	// Something may have started since, in which case it checks again when done
+	if ((serviceble->sendinflight == 0) && (serviceble->refs == 0) && (serviceble->fsminflight == 0)) {
+		if (serviceble->removedfunc != NULL) {
+			serviceble->removedfunc(serviceble, serviceble->removeddata);
+		}
+		else {
+			ASYNCLOG(LOG_INFO, "Deleting service for %s\n", serviceble->adapter);
+			service_delete(serviceble);
+		}
+	}
 
-	// Publish the gatt characteristic interface
-	serviceble->gattcharacteristic_incoming = gatt_characteristic1_skeleton_new();
+	return FALSE;
+}
 
-	// Initialise the characteristic value
-	buffer_clear(serviceble->buffer_write);
-	variant2 = g_variant_new_from_data (G_VARIANT_TYPE("ay"), buffer_get_buffer(serviceble->buffer_write), buffer_get_pos(serviceble->buffer_write), TRUE, NULL, NULL);
-	gatt_characteristic1_set_value (serviceble->gattcharacteristic_incoming, variant2);
-	g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(serviceble->gattcharacteristic_incoming));
+///////////////////////////////////////////////////////
 
-	// Set the gatt characteristic properties
-	gatt_characteristic1_set_uuid (serviceble->gattcharacteristic_incoming, CHARACTERISTIC_UUID_INCOMING);
-	gatt_characteristic1_set_service (serviceble->gattcharacteristic_incoming, BLUEZ_GATT_SERVICE_PATH);
-	gatt_characteristic1_set_flags (serviceble->gattcharacteristic_incoming, charflags_incoming);
+/**
+ * Create the collection of per-adapter service instances. The collection is
+ * empty until adapters_start() is called.
+ *
+ * @return the new, empty, collection
+ */
+static Adapters * adapters_new() {
+	Adapters * adapters;
+
+	adapters = CALLOC(sizeof(Adapters), 1);
+
+	adapters->loop = NULL;
+	adapters->connection = NULL;
+	adapters->bluez = NULL;
+	adapters->services = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)service_delete);
+	adapters->removing = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)service_delete);
+	adapters->shared = NULL;
+	adapters->users = NULL;
+	adapters->extradata = NULL;
+	adapters->worker = NULL;
+	adapters->config = NULL;
+	adapters->args = NULL;
+	adapters->control = control_new(adapters_command, adapters);
+
+	return adapters;
+}
 
-	serviceble->object_gatt_characteristic_incoming = object_skeleton_new (BLUEZ_GATT_CHARACTERISTIC_PATH_INCOMING);
-	object_skeleton_set_gatt_characteristic1(serviceble->object_gatt_characteristic_incoming, serviceble->gattcharacteristic_incoming);
+/**
+ * Delete the collection and all of the service instances in it.
+ *
+ * @param adapters the collection to delete
+ */
+static void adapters_delete(Adapters * adapters) {
+	if (adapters != NULL) {
+		adapters_stop(adapters);
 
-	g_signal_connect(serviceble->gattcharacteristic_incoming, "handle-read-value", G_CALLBACK(&handle_read_value), serviceble);
-	g_signal_connect(serviceble->gattcharacteristic_incoming, "handle-write-value", G_CALLBACK(&handle_write_value), serviceble);
-	g_signal_connect(serviceble->gattcharacteristic_incoming, "handle-start-notify", G_CALLBACK(&handle_start_notify), NULL);
-	g_signal_connect(serviceble->gattcharacteristic_incoming, "handle-stop-notify", G_CALLBACK(&handle_stop_notify), NULL);
+		if (adapters->control) {
+			control_delete(adapters->control);
+			adapters->control = NULL;
+		}
 
-	///////////////////////////////////////////////////////
+		// Let the state machines finish before their sessions are deleted. The
+		// main loop has gone, so what they ask for is dropped rather than sent
+		if (adapters->worker) {
+			worker_delete(adapters->worker);
+			adapters->worker = NULL;
+		}
 
-	printf("Exporting object manager server\n");
+		if (adapters->services) {
+			g_hash_table_destroy(adapters->services);
+			adapters->services = NULL;
+		}
 
-	g_dbus_object_manager_server_export(serviceble->object_manager_gatt, G_DBUS_OBJECT_SKELETON(serviceble->object_gatt_service));
-	g_dbus_object_manager_server_export(serviceble->object_manager_gatt, G_DBUS_OBJECT_SKELETON(serviceble->object_gatt_characteristic_outgoing));
-	g_dbus_object_manager_server_export(serviceble->object_manager_gatt, G_DBUS_OBJECT_SKELETON(serviceble->object_gatt_characteristic_incoming));
-	g_dbus_object_manager_server_set_connection(serviceble->object_manager_gatt, serviceble->connection);
+		// Instances still releasing an adapter that's gone won't get any further
+		if (adapters->removing) {
+			g_hash_table_destroy(adapters->removing);
+			adapters->removing = NULL;
+		}
 
-	///////////////////////////////////////////////////////
-	
-	printf("Register gatt service\n");
+		if (adapters->connection) {
+			g_object_unref(adapters->connection);
+			adapters->connection = NULL;
+		}
 
-	// Call the RegisterApplication method on the proxy
-	g_variant_dict_init(& dict_options, NULL);
-	arg_options = g_variant_dict_end(& dict_options);
+		if (adapters->config) {
+			config_delete(adapters->config);
+			adapters->config = NULL;
+		}
 
-	gatt_manager1_call_register_application(serviceble->gattmanager, BLUEZ_GATT_OBJECT_PATH, arg_options, NULL, (GAsyncReadyCallback)(&on_register_application), NULL);
+		g_strfreev(adapters->args);
+		adapters->args = NULL;
 
-	if (continuous) {
-		set_state(serviceble, SERVICESTATEBLE_ADVERTISINGCONTINUOUS);
-	}
-	else {
-		set_state(serviceble, SERVICESTATEBLE_ADVERTISING);
+		FREE(adapters);
+		adapters = NULL;
 	}
-	// All started
-	//if (serviceble->connected == FALSE) {
-	//	serviceble->connected = TRUE;
-	//	fsmservice_connected(serviceble->fsmservice);
-	//}
-	
-	buffer_delete(uuid);
-	uuid = NULL;
 }
 
-void advertising_stop(ServiceBle * serviceble, bool finalise) {
-	set_state(serviceble, SERVICESTATEBLE_UNADVERTISING);
-
-	serviceble->finalise = finalise;
+/**
+ * Start watching for adapters. A service instance is started for each
+ * adapter that supports advertising and GATT, now or when it's plugged in.
+ *
+ * @param adapters the collection to start
+ */
+static void adapters_start(Adapters * adapters) {
+	// The protocol's crypto runs on a thread of its own, away from the main
+	// loop; if the thread can't be created it runs in the main loop
+	if (adapters->worker == NULL) {
+		adapters->worker = worker_new();
+	}
 
-	///////////////////////////////////////////////////////
+	// Take commands from D-Bus and signals
+	control_start(adapters->control);
 
-	printf("Unregister gatt service\n");
+	ASYNCLOG(LOG_INFO, "Getting bus for adapters\n");
 
-	// This is an asynchronous call, so advertisement stopping continuous in the callback
-	gatt_manager1_call_unregister_application(serviceble->gattmanager, BLUEZ_GATT_OBJECT_PATH, NULL, (GAsyncReadyCallback)(&on_gatt_manager1_call_unregister_application), serviceble);
+	// This is an asynchronous call, so initialisation continuous in the callback
+	g_bus_get(G_BUS_TYPE_SYSTEM, NULL, (GAsyncReadyCallback)(&on_adapters_bus_get), adapters);
 }
 
-
-static void on_gatt_manager1_call_unregister_application(GattManager1 * gattmanager, GAsyncResult *res, gpointer user_data) {
-	ServiceBle * serviceble = (ServiceBle *)user_data;
-	GError *error;
-	gboolean result;
-	guint matchedsignals;
-
-	error = NULL;
-
-	result = gatt_manager1_call_unregister_application_finish(gattmanager, res, &error);
-	report_error(&error, "unregistering gatt service");
-	if (result == FALSE) {
-		printf("Gatt service failed to unregister\n");
+/**
+ * Stop watching for adapters. The service instances are left as they are.
+ *
+ * @param adapters the collection to stop
+ */
+static void adapters_stop(Adapters * adapters) {
+	if (adapters->bluez != NULL) {
+		g_signal_handlers_disconnect_matched(adapters->bluez, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, adapters);
+		g_object_unref(adapters->bluez);
+		adapters->bluez = NULL;
 	}
+}
 
-	///////////////////////////////////////////////////////
-
-	printf("Unexporting object manager server\n");
+/**
+ * Carry out a command from the keyboard, the control interface or a signal,
+ * applying it to every service instance.
+ *
+ * @param command the command to carry out
+ * @param user_data the collection of service instances
+ */
+static void adapters_command(CONTROLCOMMAND command, gpointer user_data) {
+	Adapters * adapters = (Adapters *)user_data;
+	GHashTableIter iter;
+	ServiceBle * serviceble;
 
-	g_dbus_object_manager_server_unexport (serviceble->object_manager_gatt, BLUEZ_GATT_SERVICE_PATH);
-	g_dbus_object_manager_server_unexport (serviceble->object_manager_gatt, BLUEZ_GATT_CHARACTERISTIC_PATH_OUTGOING);
-	g_dbus_object_manager_server_unexport (serviceble->object_manager_gatt, BLUEZ_GATT_CHARACTERISTIC_PATH_INCOMING);
+	switch (command) {
+		case CONTROLCOMMAND_START:
+		case CONTROLCOMMAND_STOP:
+			g_hash_table_iter_init(&iter, adapters->services);
+			while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&serviceble)) {
+				if (command == CONTROLCOMMAND_START) {
+					serviceble_start(serviceble);
+				}
+				else {
+					serviceble_stop(serviceble);
+				}
+			}
+			break;
+		case CONTROLCOMMAND_RELOAD:
+			adapters_reload(adapters);
+			break;
+		case CONTROLCOMMAND_QUIT:
+			g_main_loop_quit(adapters->loop);
+			break;
+		case CONTROLCOMMAND_DUMPTRACE:
+			adapters_dump_trace(adapters);
+			break;
+		default:
+			break;
+	}
+}
 
-	///////////////////////////////////////////////////////
+/**
+ * Read the settings again, from the same key file and command line as at
+ * start-up, and apply them to every service instance. If they can't be read
+ * the current settings are kept.
+ *
+ * @param adapters the collection of service instances
+ */
+static void adapters_reload(Adapters * adapters) {
+	Config * config;
+	GError * error;
+	GHashTableIter iter;
+	ServiceBle * serviceble;
+	gchar ** argv;
+	gint argc;
+
+	// Option parsing removes entries from the array, so parse a shallow copy
+	// to leave the strings owned by adapters->args
+	argc = (adapters->args != NULL) ? g_strv_length(adapters->args) : 0;
+	argv = g_new0(gchar *, argc + 1);
+	if (argc > 0) {
+		memcpy(argv, adapters->args, argc * sizeof(gchar *));
+	}
 
-	printf("Disconnect signals\n");
+	error = NULL;
+	config = config_new();
+	if (config_parse(config, &argc, &argv, &error) == FALSE) {
+		report_error(&error, "reloading settings");
+		config_delete(config);
+	}
+	else {
+		config_log(config);
 
-	matchedsignals = 0;
+		config_delete(adapters->config);
+		adapters->config = config;
+		adapters_set_trace(adapters);
 
-	// Disconnect signals on outgoing characteristic
-	matchedsignals += g_signal_handlers_disconnect_matched (serviceble->gattcharacteristic_outgoing, (G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA), 0, 0, NULL, G_CALLBACK(&handle_read_value), serviceble);
+		g_hash_table_iter_init(&iter, adapters->services);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&serviceble)) {
+			serviceble_set_config(serviceble, config);
+		}
+	}
 
-	matchedsignals += g_signal_handlers_disconnect_matched (serviceble->gattcharacteristic_outgoing, (G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA), 0, 0, NULL, G_CALLBACK(&handle_write_value), serviceble);
+	g_free(argv);
+}
 
-	matchedsignals += g_signal_handlers_disconnect_matched (serviceble->gattcharacteristic_outgoing, (G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA), 0, 0, NULL, G_CALLBACK(&handle_start_notify), NULL);
+/**
+ * Start or stop latency tracing, depending on whether the settings say where
+ * to write the trace.
+ *
+ * @param adapters the collection of service instances
+ */
+static void adapters_set_trace(Adapters * adapters) {
+	if ((adapters->config != NULL) && (adapters->config->tracefile[0] != '\0')) {
+		trace_start();
+	}
+	else {
+		trace_stop();
+	}
+}
 
-	matchedsignals += g_signal_handlers_disconnect_matched (serviceble->gattcharacteristic_outgoing, (G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA), 0, 0, NULL, G_CALLBACK(&handle_stop_notify), NULL);
+/**
+ * Write out the latency trace to the file given in the settings, ready to
+ * load into a trace viewer.
+ *
+ * @param adapters the collection of service instances
+ */
+static void adapters_dump_trace(Adapters * adapters) {
+	GError * error;
 
-	// Disconnect signals on incoming characteristic
-	matchedsignals += g_signal_handlers_disconnect_matched (serviceble->gattcharacteristic_incoming, (G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA), 0, 0, NULL, G_CALLBACK(&handle_read_value), serviceble);
+	if ((adapters->config == NULL) || (adapters->config->tracefile[0] == '\0')) {
+		ASYNCLOG(LOG_INFO, "Tracing is off; set trace-file to turn it on\n");
+	}
+	else {
+		error = NULL;
+		if (trace_dump_file(adapters->config->tracefile, &error) == TRUE) {
+			ASYNCLOG(LOG_INFO, "Trace written to %s\n", adapters->config->tracefile);
+		}
+		report_error(&error, "writing trace");
+	}
+}
 
-	matchedsignals += g_signal_handlers_disconnect_matched (serviceble->gattcharacteristic_incoming, (G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA), 0, 0, NULL, G_CALLBACK(&handle_write_value), serviceble);
+static void on_adapters_bus_get(GObject * source_object, GAsyncResult * res, gpointer user_data) {
+	Adapters * adapters = (Adapters *)user_data;
+	GError * error;
 
-	matchedsignals += g_signal_handlers_disconnect_matched (serviceble->gattcharacteristic_incoming, (G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA), 0, 0, NULL, G_CALLBACK(&handle_start_notify), NULL);
+	error = NULL;
 
-	matchedsignals += g_signal_handlers_disconnect_matched (serviceble->gattcharacteristic_incoming, (G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA), 0, 0, NULL, G_CALLBACK(&handle_stop_notify), NULL);
+	adapters->connection = g_bus_get_finish(res, &error);
+	report_error(&error, "getting bus for adapters");
 
-	printf("Removed %u signals\n", matchedsignals);
+	if (adapters->connection != NULL) {
+		ASYNCLOG(LOG_INFO, "Watching for adapters\n");
 
-	///////////////////////////////////////////////////////
+		// This is an asynchronous call, so initialisation continuous in the callback
+		g_dbus_object_manager_client_new(adapters->connection, G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_NONE, BLUEZ_SERVICE_NAME, BLUEZ_ROOT_PATH, NULL, NULL, NULL, NULL, (GAsyncReadyCallback)(&on_adapters_manager_new), adapters);
+	}
+}
 
-	printf("Destroy server-side dbus objecs\n");
+static void on_adapters_manager_new(GObject * source_object, GAsyncResult * res, gpointer user_data) {
+	Adapters * adapters = (Adapters *)user_data;
+	GError * error;
+	GList * objects;
+	GList * item;
 
-	g_object_unref(serviceble->object_gatt_characteristic_incoming);
-	g_object_unref(serviceble->object_gatt_characteristic_outgoing);
-	g_object_unref(serviceble->object_gatt_service);
-	g_object_unref(serviceble->gattservice);
+	error = NULL;
 
-	///////////////////////////////////////////////////////
+	adapters->bluez = g_dbus_object_manager_client_new_finish(res, &error);
+	report_error(&error, "creating BlueZ object manager client");
 
-	printf("Unregister advertisement\n");
+	if (adapters->bluez != NULL) {
+		g_signal_connect(adapters->bluez, "object-added", G_CALLBACK(&on_adapter_object_added), adapters);
+		g_signal_connect(adapters->bluez, "object-removed", G_CALLBACK(&on_adapter_object_removed), adapters);
+		g_signal_connect(adapters->bluez, "interface-added", G_CALLBACK(&on_adapter_interface_changed), adapters);
+		g_signal_connect(adapters->bluez, "interface-removed", G_CALLBACK(&on_adapter_interface_changed), adapters);
+		g_signal_connect(adapters->bluez, "interface-proxy-properties-changed", G_CALLBACK(&on_device_properties_changed), adapters);
 
-	leadvertising_manager1_call_unregister_advertisement (serviceble->leadvertisingmanager, BLUEZ_ADVERT_PATH, NULL, (GAsyncReadyCallback)(&on_unregister_advert), serviceble);
+		// Pick up the adapters that are already there
+		objects = g_dbus_object_manager_get_objects(adapters->bluez);
+		for (item = objects; item != NULL; item = item->next) {
+			adapter_check(adapters, G_DBUS_OBJECT(item->data));
+		}
+		g_list_free_full(objects, g_object_unref);
 
-	///////////////////////////////////////////////////////
+		if (g_hash_table_size(adapters->services) == 0) {
+			ASYNCLOG(LOG_INFO, "No adapters yet, waiting for one to be added\n");
+		}
+	}
+}
 
-	printf("Release advertisement\n");
+static void on_adapter_object_added(GDBusObjectManager * manager, GDBusObject * object, gpointer user_data) {
+	Adapters * adapters = (Adapters *)user_data;
 
-	// Publish the advertisement interface
-	//g_object_unref(serviceble->leadvertisement);
+	adapter_check(adapters, object);
+	device_check(adapters, object);
 }
 
+static void on_adapter_object_removed(GDBusObjectManager * manager, GDBusObject * object, gpointer user_data) {
+	Adapters * adapters = (Adapters *)user_data;
+	gchar const * path;
 
+	path = g_dbus_object_get_object_path(object);
 
-static void serviceble_write(char const * data, size_t length, void * user_data) {
-	ServiceBle * serviceble = (ServiceBle *)user_data;
+	adapter_remove(adapters, path);
+	// A device that's gone is certainly no longer connected
+	device_connected(adapters, path, FALSE);
+}
 
-	printf("Sending data %s\n", data);
+/**
+ * An adapter's interfaces change as it's powered up or down and as its
+ * capabilities are discovered, so check again whether it can be used.
+ */
+static void on_adapter_interface_changed(GDBusObjectManager * manager, GDBusObject * object, GDBusInterface * interface, gpointer user_data) {
+	Adapters * adapters = (Adapters *)user_data;
 
-	send_data(serviceble, data, length);
+	adapter_check(adapters, object);
+	device_check(adapters, object);
 }
 
-static void serviceble_set_timeout(int timeout, void * user_data) {
-	ServiceBle * serviceble = (ServiceBle *)user_data;
+/**
+ * Start a service instance for an object if it's an adapter we can use and
+ * we don't have one for it already, or remove its instance if it's no
+ * longer usable.
+ *
+ * @param adapters the collection of service instances
+ * @param object the BlueZ object that's been added or changed
+ */
+static void adapter_check(Adapters * adapters, GDBusObject * object) {
+	gchar const * interfaces[] = {BLUEZ_ADAPTER_INTERFACE, BLUEZ_LEADVERTISING_MANAGER_INTERFACE, BLUEZ_GATT_MANAGER_INTERFACE};
+	GDBusInterface * interface;
+	gchar const * path;
+	ServiceBle * serviceble;
+	bool usable;
+	guint pos;
 
-	LOG(LOG_DEBUG, "Requesting timeout of %d", timeout);
-	printf("Requesting timeout of %d\n", timeout);
+	path = g_dbus_object_get_object_path(object);
 
-	// Remove any previous timeout
-	if (serviceble->timeoutid != 0) {
-		g_source_remove(serviceble->timeoutid);
-		serviceble->timeoutid = 0;
+	usable = TRUE;
+	for (pos = 0; pos < G_N_ELEMENTS(interfaces); pos++) {
+		interface = g_dbus_object_get_interface(object, interfaces[pos]);
+		if (interface != NULL) {
+			g_object_unref(interface);
+		}
+		else {
+			usable = FALSE;
+		}
 	}
 
-	serviceble->timeoutid = g_timeout_add(timeout, serviceble_timeout, serviceble);
-}
+	serviceble = g_hash_table_lookup(adapters->services, path);
 
-static void serviceble_error(void * user_data) {
-	//ServiceBle * serviceble = (ServiceBle *)user_data;
+	if ((usable == TRUE) && (serviceble == NULL) && (g_hash_table_contains(adapters->removing, path) == TRUE)) {
+		// Our objects for it are still exported, so wait for them to be released
+		ASYNCLOG(LOG_INFO, "Adapter %s back before its old service was released\n", path);
+	}
+	else if ((usable == TRUE) && (serviceble == NULL)) {
+		ASYNCLOG(LOG_INFO, "Adapter %s added\n", path);
+
+		serviceble = serviceble_new(path);
+		serviceble_set_session_data(serviceble, adapters->shared, adapters->users, adapters->extradata);
+		serviceble_set_worker(serviceble, adapters->worker);
+		if (adapters->config != NULL) {
+			serviceble_set_config(serviceble, adapters->config);
+		}
+		g_hash_table_insert(adapters->services, serviceble->adapter, serviceble);
 
-	LOG(LOG_DEBUG, "Error");
-	printf("Error\n");
+		serviceble_start(serviceble);
+	}
+	else if ((usable == FALSE) && (serviceble != NULL)) {
+		adapter_remove(adapters, path);
+	}
 }
 
-static void serviceble_listen(void * user_data) {
-	ServiceBle * serviceble = (ServiceBle *)user_data;
+/**
+ * Take down the service instance for an adapter that's been removed. The
+ * instance is kept with the others being removed until it's finished
+ * releasing everything, so that it can be deleted at shut down if it never
+ * does.
+ *
+ * @param adapters the collection of service instances
+ * @param path the object path of the adapter
+ */
+static void adapter_remove(Adapters * adapters, gchar const * path) {
+	ServiceBle * serviceble;
 
-	printf("Requesting to listen\n");
-	if (serviceble->connected == FALSE) {
-		LOG(LOG_DEBUG, "Listening");
-		printf("Listening\n");
+	serviceble = g_hash_table_lookup(adapters->services, path);
+	if (serviceble != NULL) {
+		ASYNCLOG(LOG_INFO, "Adapter %s removed\n", path);
 
-		advertising_start(serviceble, TRUE);
+		g_hash_table_steal(adapters->services, path);
+		g_hash_table_insert(adapters->removing, serviceble->adapter, serviceble);
+		serviceble_remove(serviceble, adapter_removed, adapters);
 	}
 }
 
-static void serviceble_disconnect(void * user_data) {
-	ServiceBle * serviceble = (ServiceBle *)user_data;
+/**
+ * Delete the service instance of a removed adapter once it's released
+ * everything. If the adapter came back in the meantime, a new instance is
+ * started for it now that the object paths are free again.
+ *
+ * @param serviceble the service instance that's ready to be deleted
+ * @param user_data the collection of service instances
+ */
+static void adapter_removed(ServiceBle * serviceble, gpointer user_data) {
+	Adapters * adapters = (Adapters *)user_data;
+	gchar * path;
+	GDBusObject * object;
 
-	LOG(LOG_DEBUG, "Requesting disconnect");
-	printf("Requesting disconnect\n");
+	path = g_strdup(serviceble->adapter);
 
-	if (serviceble->connected == TRUE) {
-		advertising_stop(serviceble, FALSE);
-	}
-}
+	ASYNCLOG(LOG_INFO, "Deleting service for %s\n", path);
+	g_hash_table_remove(adapters->removing, path);
 
-static void serviceble_authenticated(int status, void * user_data) {
-	//ServiceBle * serviceble = (ServiceBle *)user_data;
+	if (adapters->bluez != NULL) {
+		object = g_dbus_object_manager_get_object(adapters->bluez, path);
+		if (object != NULL) {
+			adapter_check(adapters, object);
+			g_object_unref(object);
+		}
+	}
 
-	LOG(LOG_DEBUG, "Authenticated");
-	printf("Authenticated status: %d\n", status);
+	g_free(path);
 }
 
-static void serviceble_session_ended(void * user_data) {
-	//ServiceBle * serviceble = (ServiceBle *)user_data;
+/**
+ * Follow changes to the Connected and ServicesResolved properties of
+ * devices, as BlueZ emits them.
+ */
+static void on_device_properties_changed(GDBusObjectManagerClient * manager, GDBusObjectProxy * object_proxy, GDBusProxy * interface_proxy, GVariant * changed_properties, GStrv invalidated_properties, gpointer user_data) {
+	Adapters * adapters = (Adapters *)user_data;
+	gboolean connected;
+	gboolean resolved;
+	gchar const * path;
+
+	if (g_strcmp0(g_dbus_proxy_get_interface_name(interface_proxy), BLUEZ_DEVICE_INTERFACE) != 0) {
+		return;
+	}
 
-	LOG(LOG_DEBUG, "Session ended");
-	printf("Session ended\n");
-}
+	path = g_dbus_proxy_get_object_path(interface_proxy);
 
-static void serviceble_status_updated(int state, void * user_data) {
-	//ServiceBle * serviceble = (ServiceBle *)user_data;
+	if (g_variant_lookup(changed_properties, "Connected", "b", &connected)) {
+		device_connected(adapters, path, connected);
+	}
 
-	LOG(LOG_DEBUG, "Update, state: %d", state);
-	printf("Update, state: %d\n", state);
+	if (g_variant_lookup(changed_properties, "ServicesResolved", "b", &resolved) && (resolved == TRUE)) {
+		device_connected(adapters, path, TRUE);
+	}
 }
 
-static gboolean serviceble_timeout(gpointer user_data) {
-	ServiceBle * serviceble = (ServiceBle *)user_data;
+/**
+ * Check the connection state of an object if it's a device, for when a
+ * device's interface is added.
+ *
+ * @param adapters the collection of service instances
+ * @param object the BlueZ object that's been added or changed
+ */
+static void device_check(Adapters * adapters, GDBusObject * object) {
+	GDBusInterface * interface;
+	GVariant * connected;
+
+	interface = g_dbus_object_get_interface(object, BLUEZ_DEVICE_INTERFACE);
+	if (interface != NULL) {
+		connected = g_dbus_proxy_get_cached_property(G_DBUS_PROXY(interface), "Connected");
+		if (connected != NULL) {
+			device_connected(adapters, g_dbus_object_get_object_path(object), g_variant_get_boolean(connected));
+			g_variant_unref(connected);
+		}
+		g_object_unref(interface);
+	}
+}
 
-	// This timeout fires only once
-	serviceble->timeoutid = 0;
+/**
+ * Pass a device's connection state on to the service on its adapter. Device
+ * objects are children of their adapter's object.
+ *
+ * @param adapters the collection of service instances
+ * @param path the device object path
+ * @param connected whether the device is connected
+ */
+static void device_connected(Adapters * adapters, gchar const * path, bool connected) {
+	ServiceBle * serviceble;
+	gchar * adapter;
 
-	LOG(LOG_DEBUG, "Calling timeout");
-	fsmservice_timeout(serviceble->fsmservice);
+	adapter = g_path_get_dirname(path);
+	serviceble = g_hash_table_lookup(adapters->services, adapter);
+	g_free(adapter);
 
-	return FALSE;
+	if (serviceble != NULL) {
+		serviceble_device_connected(serviceble, path, connected);
+	}
 }
 
+///////////////////////////////////////////////////////
 
 /**
  * Main; the entry point of the service.
@@ -1148,59 +4455,101 @@ static gboolean serviceble_timeout(gpointer user_data) {
  * @return value returned on service exit
  */
 gint main(gint argc, gchar * argv[]) {
-	ServiceBle * serviceble;
+	Adapters * adapters;
+#ifdef SERVICEBLE_GUI
 	GtkWidget * window;
+	gboolean display;
+#endif
 	Shared * shared;
 	Users * users;
 	USERFILE usersresult;
 	Buffer * extradata;
+	Config * config;
+	gchar ** args;
+	GError * error;
+
+#ifdef SERVICEBLE_GUI
+	// Keyboard control needs a display, but the service runs without one
+	display = gtk_init_check(&argc, &argv);
+#endif
 
-	gtk_init(&argc, &argv);
+	// Log output is written out by a background thread from here on
+	asynclog_start();
 
-	printf("Initialising\n");
-	serviceble = serviceble_new();
+	// Kept so that the settings can be read the same way again on reload
+	args = g_strdupv(argv);
 
-	serviceble->loop = g_main_loop_new(NULL, FALSE);
+	error = NULL;
+	config = config_new();
+	if (config_parse(config, &argc, &argv, &error) == FALSE) {
+		report_error(&error, "reading settings");
+		config_delete(config);
+		g_strfreev(args);
+		asynclog_stop();
+		return 1;
+	}
+	config_log(config);
 
-	serviceble_start(serviceble);
+	ASYNCLOG(LOG_INFO, "Initialising\n");
+	adapters = adapters_new();
+
+	adapters->loop = g_main_loop_new(NULL, FALSE);
 
 	shared = shared_new();
-	shared_load_or_generate_keys(shared, "pico_pub_key.der", "pico_priv_key.der");
+	shared_load_or_generate_keys(shared, KEY_FILE_PUBLIC, KEY_FILE_PRIVATE);
 
 	users = users_new();
 	usersresult = users_load(users, "users.txt");
 	if (usersresult != USERFILE_SUCCESS) {
-		printf("Failed to load user file\n");
+		ASYNCLOG(LOG_ERR, "Failed to load user file\n");
 	}
 
 	extradata = buffer_new(0);
 
-	fsmservice_start(serviceble->fsmservice, shared, users, extradata);
+	// Each central's state machine is started with these when it first connects
+	adapters->shared = shared;
+	adapters->users = users;
+	adapters->extradata = extradata;
+	// The collection owns these from here on
+	adapters->config = config;
+	adapters->args = args;
+	adapters_set_trace(adapters);
+
+	// Start a service instance on each adapter as it's found
+	adapters_start(adapters);
 
 	///////////////////////////////////////////////////////
 
-	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-	g_signal_connect(window, "key-release-event", G_CALLBACK(key_event), serviceble);
-	gtk_widget_show (window);
+#ifdef SERVICEBLE_GUI
+	if (display == TRUE) {
+		window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+		g_signal_connect(window, "key-release-event", G_CALLBACK(key_event), adapters);
+		gtk_widget_show (window);
+	}
+	else {
+		ASYNCLOG(LOG_INFO, "No display, keyboard control disabled\n");
+	}
+#endif
 
-	printf("Entering main loop\n");
-	g_main_loop_run(serviceble->loop);
+	ASYNCLOG(LOG_INFO, "Entering main loop\n");
+	g_main_loop_run(adapters->loop);
 
-	printf("Exited main loop\n");
-	g_main_loop_unref(serviceble->loop);
+	ASYNCLOG(LOG_INFO, "Exited main loop\n");
+	g_main_loop_unref(adapters->loop);
 
-	service_delete(serviceble);
+	adapters_delete(adapters);
 	shared_delete(shared);
 	users_delete(users);
 	buffer_delete(extradata);
 
-	printf("The End\n");
+	ASYNCLOG(LOG_INFO, "The End\n");
+	asynclog_stop();
 
 	return 0;
 }
 
 static void set_state(ServiceBle * serviceble, SERVICESTATE state) {
-	printf("State transition: %d -> %d\n", serviceble->state, state);
+	ASYNCLOG(LOG_INFO, "State transition: %d -> %d\n", serviceble->state, state);
 
 	serviceble->state = state;
 }
@@ -0,0 +1,700 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "framing.h"
+#include "asynclog.h"
+
+// Defines
+
+// The reflected IEEE 802.3 polynomial, as used by zlib
+#define FRAMING_CRC32_POLYNOMIAL (0xedb88320)
+
+// Structure definitions
+
+/**
+ * The message being reassembled from version 2 chunks. Chunks can arrive in
+ * any order, so the parts received so far are tracked as a sorted list of
+ * non-overlapping ranges, and anything between them is missing.
+ */
+struct _FramingReceive {
+	GByteArray * message;
+	gsize capacity;
+	GArray * received;
+	bool active;
+	guint8 msgid;
+	bool lengthknown;
+	guint32 length;
+	guint32 crc;
+	guint32 highest;
+	bool completed;
+	guint8 completedid;
+	guint8 lastid;
+};
+
+// Function prototypes
+
+static guint32 framing_read32(guchar const * data);
+static void framing_write32(guchar * data, guint32 value);
+static void framing_receive_add(FramingReceive * receive, guint32 offset, guint32 length);
+static bool framing_receive_covered(FramingReceive * receive, guint32 offset, guint32 length);
+static bool framing_receive_holes(FramingReceive * receive);
+static void framing_receive_start(FramingReceive * receive, bool active, guint8 msgid);
+
+// Function definitions
+
+/**
+ * Calculate the CRC-32 of a message, as used in the first version 2 chunk.
+ *
+ * @param data the data to calculate the CRC of
+ * @param length the number of bytes of data
+ * @return the CRC
+ */
+guint32 framing_crc32(guchar const * data, gsize length) {
+	static guint32 table[256];
+	static gsize initialised = 0;
+	guint32 crc;
+	guint32 entry;
+	gsize pos;
+	int bit;
+
+	if (g_once_init_enter(&initialised)) {
+		for (pos = 0; pos < 256; pos++) {
+			entry = (guint32)pos;
+			for (bit = 0; bit < 8; bit++) {
+				entry = (entry & 1) ? ((entry >> 1) ^ FRAMING_CRC32_POLYNOMIAL) : (entry >> 1);
+			}
+			table[pos] = entry;
+		}
+		g_once_init_leave(&initialised, 1);
+	}
+
+	crc = 0xffffffff;
+	for (pos = 0; pos < length; pos++) {
+		crc = table[(crc ^ data[pos]) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc ^ 0xffffffff;
+}
+
+/**
+ * Check whether a version 1 message is actually a hello asking for a later
+ * framing version.
+ *
+ * @param data the message, starting at its four-byte length prefix
+ * @param length the number of bytes of data
+ * @return the version asked for, or zero if this isn't a hello
+ */
+guint8 framing_hello_version(guchar const * data, gsize length) {
+	guint8 version;
+
+	version = 0;
+	if ((length >= FRAMING_HELLO_SIZE) && (framing_read32(data) == FRAMING_HELLO_LENGTH)) {
+		version = data[4];
+	}
+
+	return version;
+}
+
+/**
+ * Get the capabilities offered in a hello. A hello without a capability
+ * byte offers none.
+ *
+ * @param data the hello, starting at its four-byte length prefix
+ * @param length the number of bytes of data
+ * @return the FRAMING_CAPABILITY_ flags offered
+ */
+guint8 framing_hello_capabilities(guchar const * data, gsize length) {
+	guint8 capabilities;
+
+	capabilities = 0;
+	if ((framing_hello_version(data, length) != 0) && (length >= FRAMING_HELLO_SIZE_CAPABILITIES)) {
+		capabilities = data[5];
+	}
+
+	return capabilities;
+}
+
+/**
+ * Get the address a hello asks to be addressed by. The address is only
+ * present when the hello offers FRAMING_CAPABILITY_ADDRESSED.
+ *
+ * @param data the hello, starting at its four-byte length prefix
+ * @param length the number of bytes of data
+ * @param address returns the address chosen by the central
+ * @return true if the hello asks to be addressed, false o/w
+ */
+bool framing_hello_address(guchar const * data, gsize length, guint8 * address) {
+	bool addressed;
+
+	addressed = ((framing_hello_capabilities(data, length) & FRAMING_CAPABILITY_ADDRESSED) != 0) && (length >= FRAMING_HELLO_SIZE_ADDRESS);
+	if (addressed == TRUE) {
+		*address = data[6];
+	}
+
+	return addressed;
+}
+
+/**
+ * Create a hello, in version 1 framing, to ask for or confirm the framing
+ * version and capabilities that will be used from now on.
+ *
+ * @param version the version to be used
+ * @param capabilities the FRAMING_CAPABILITY_ flags to be used
+ * @return the hello, to be freed with g_bytes_unref()
+ */
+GBytes * framing_hello_new(guint8 version, guint8 capabilities) {
+	guchar hello[FRAMING_HELLO_SIZE_CAPABILITIES];
+
+	framing_write32(hello, FRAMING_HELLO_LENGTH);
+	hello[4] = version;
+	hello[5] = capabilities;
+
+	return g_bytes_new(hello, sizeof(hello));
+}
+
+/**
+ * Create a hello, in version 1 framing, asking for the framing version and
+ * capabilities and for chunks to be prefixed with the given address.
+ *
+ * @param version the version asked for
+ * @param capabilities the FRAMING_CAPABILITY_ flags asked for, to which
+ *        FRAMING_CAPABILITY_ADDRESSED is added
+ * @param address the address chosen by the central
+ * @return the hello, to be freed with g_bytes_unref()
+ */
+GBytes * framing_hello_address_new(guint8 version, guint8 capabilities, guint8 address) {
+	guchar hello[FRAMING_HELLO_SIZE_ADDRESS];
+
+	framing_write32(hello, FRAMING_HELLO_LENGTH);
+	hello[4] = version;
+	hello[5] = capabilities | FRAMING_CAPABILITY_ADDRESSED;
+	hello[6] = address;
+
+	return g_bytes_new(hello, sizeof(hello));
+}
+
+/**
+ * Prefix a chunk with the address of the central it's for.
+ *
+ * @param chunk the chunk, which is unreferenced
+ * @param address the address from the central's hello
+ * @return the addressed chunk, to be freed with g_bytes_unref()
+ */
+GBytes * framing_address(GBytes * chunk, guint8 address) {
+	guchar * data;
+	gsize size;
+
+	size = g_bytes_get_size(chunk);
+	data = g_malloc(FRAMING_ADDRESS_SIZE + size);
+	data[0] = address;
+	memcpy(data + FRAMING_ADDRESS_SIZE, g_bytes_get_data(chunk, NULL), size);
+	g_bytes_unref(chunk);
+
+	return g_bytes_new_take(data, FRAMING_ADDRESS_SIZE + size);
+}
+
+/**
+ * Get the size of the header of a version 2 data chunk.
+ *
+ * @param offset the offset of the chunk's payload within its message
+ * @return the number of bytes of header
+ */
+gsize framing_header_size(guint32 offset) {
+	return (offset == 0) ? FRAMING_HEADER_FIRST : FRAMING_HEADER;
+}
+
+/**
+ * Write the header of a version 2 data chunk. The chunk carrying the start of
+ * the message also carries the message length and CRC, so that they're sent
+ * again if that chunk is.
+ *
+ * @param header the buffer to write to, of at least framing_header_size()
+ * @param msgid the id of the message the chunk is part of
+ * @param offset the offset of the chunk's payload within the message
+ * @param length the length of the whole message
+ * @param crc the CRC-32 of the whole message
+ * @return the number of bytes written
+ */
+gsize framing_header(guchar * header, guint8 msgid, guint32 offset, guint32 length, guint32 crc) {
+	header[0] = FRAMING_KIND_DATA;
+	header[1] = msgid;
+	framing_write32(header + 2, offset);
+
+	if (offset == 0) {
+		framing_write32(header + 6, length);
+		framing_write32(header + 10, crc);
+	}
+
+	return framing_header_size(offset);
+}
+
+/**
+ * Frame a message for version 1: the message prefixed with its four-byte
+ * big-endian length, ready to be sliced into chunks as it stands.
+ *
+ * @param data the message
+ * @param length the number of bytes in the message
+ * @return the framed message, to be freed with g_bytes_unref()
+ */
+GBytes * framing_prefix_length(guchar const * data, gsize length) {
+	guchar * framed;
+
+	framed = g_malloc(length + 4);
+	framing_write32(framed, length);
+	memcpy(framed + 4, data, length);
+
+	return g_bytes_new_take(framed, length + 4);
+}
+
+/**
+ * Create a version 2 data chunk holding as much of a message, from the given
+ * offset, as fits along with its header.
+ *
+ * @param message the whole message
+ * @param msgid the id of the message
+ * @param crc the CRC-32 of the whole message
+ * @param offset the offset of the chunk's payload within the message
+ * @param end the offset to stop at, no further than the end of the message
+ * @param maxsize the maximum size of the chunk, header included
+ * @param payload return location for the number of message bytes in the chunk
+ * @return the chunk, to be freed with g_bytes_unref()
+ */
+GBytes * framing_chunk_new(GBytes * message, guint8 msgid, guint32 crc, gsize offset, gsize end, gsize maxsize, gsize * payload) {
+	guchar * chunk;
+	gsize header;
+	gsize size;
+
+	header = framing_header_size(offset);
+	size = MIN(end - offset, maxsize - header);
+
+	chunk = g_malloc(header + size);
+	framing_header(chunk, msgid, offset, g_bytes_get_size(message), crc);
+	memcpy(chunk + header, (guchar const *)g_bytes_get_data(message, NULL) + offset, size);
+
+	*payload = size;
+
+	return g_bytes_new_take(chunk, header + size);
+}
+
+/**
+ * Get the kind of a version 2 chunk.
+ *
+ * @param data the chunk
+ * @param length the number of bytes in the chunk
+ * @return one of the FRAMING_KIND_ values, or zero if the chunk is empty
+ */
+guchar framing_kind(guchar const * data, gsize length) {
+	return (length > 0) ? data[0] : 0;
+}
+
+/**
+ * Create an acknowledgement that a message was received intact.
+ *
+ * @param msgid the id of the message received
+ * @return the ACK chunk, to be freed with g_bytes_unref()
+ */
+GBytes * framing_ack_new(guint8 msgid) {
+	guchar ack[FRAMING_ACK_SIZE];
+
+	ack[0] = FRAMING_KIND_ACK;
+	ack[1] = msgid;
+
+	return g_bytes_new(ack, sizeof(ack));
+}
+
+/**
+ * Read an acknowledgement.
+ *
+ * @param data the ACK chunk
+ * @param length the number of bytes in the chunk
+ * @param msgid returns the id of the message acknowledged
+ * @return TRUE if the chunk was a valid ACK, FALSE o/w
+ */
+bool framing_ack_parse(guchar const * data, gsize length, guint8 * msgid) {
+	if ((length < FRAMING_ACK_SIZE) || (data[0] != FRAMING_KIND_ACK)) {
+		return FALSE;
+	}
+
+	*msgid = data[1];
+
+	return TRUE;
+}
+
+/**
+ * Read a request to resend parts of a message.
+ *
+ * @param data the NACK chunk
+ * @param length the number of bytes in the chunk
+ * @param msgid returns the id of the message with parts missing
+ * @param ranges an array of FramingRange that the missing ranges are
+ *        appended to
+ * @return TRUE if the chunk was a valid NACK, FALSE o/w
+ */
+bool framing_nack_parse(guchar const * data, gsize length, guint8 * msgid, GArray * ranges) {
+	FramingRange range;
+	gsize pos;
+
+	if ((length < FRAMING_NACK_HEADER) || (data[0] != FRAMING_KIND_NACK) || (((length - FRAMING_NACK_HEADER) % FRAMING_NACK_RANGE) != 0)) {
+		return FALSE;
+	}
+
+	*msgid = data[1];
+
+	for (pos = FRAMING_NACK_HEADER; pos < length; pos += FRAMING_NACK_RANGE) {
+		range.offset = framing_read32(data + pos);
+		range.length = framing_read32(data + pos + 4);
+		g_array_append_val(ranges, range);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Create the state for reassembling version 2 messages.
+ *
+ * @return the new reassembly state
+ */
+FramingReceive * framing_receive_new() {
+	FramingReceive * receive;
+
+	receive = g_new0(FramingReceive, 1);
+
+	receive->message = g_byte_array_new();
+	receive->capacity = 0;
+	receive->received = g_array_new(FALSE, FALSE, sizeof(FramingRange));
+	framing_receive_reset(receive);
+
+	return receive;
+}
+
+void framing_receive_delete(FramingReceive * receive) {
+	if (receive != NULL) {
+		g_byte_array_unref(receive->message);
+		g_array_unref(receive->received);
+		g_free(receive);
+	}
+}
+
+/**
+ * Forget everything received, for example when the sender disconnects, so
+ * that its message ids can start again from anywhere.
+ *
+ * @param receive the reassembly state
+ */
+void framing_receive_reset(FramingReceive * receive) {
+	framing_receive_start(receive, FALSE, 0);
+	receive->completed = FALSE;
+	receive->completedid = 0;
+	receive->lastid = 0;
+}
+
+/**
+ * Give back the memory used to reassemble an unusually large message, so that
+ * it isn't held for as long as the session lasts. Nothing is done while a
+ * message is being received, and the message returned by
+ * framing_receive_message() is no longer valid afterwards.
+ *
+ * @param receive the reassembly state
+ * @param keep the largest message buffer worth keeping, in bytes
+ * @return TRUE if the buffer was given back, FALSE o/w
+ */
+bool framing_receive_trim(FramingReceive * receive, gsize keep) {
+	bool trimmed;
+
+	trimmed = FALSE;
+	if ((receive->active == FALSE) && (receive->capacity > keep)) {
+		g_byte_array_unref(receive->message);
+		receive->message = g_byte_array_new();
+		receive->capacity = 0;
+		receive->length = 0;
+		trimmed = TRUE;
+	}
+
+	return trimmed;
+}
+
+/**
+ * Add a received version 2 data chunk to the message being reassembled. A
+ * chunk with a new message id abandons any message still incomplete, since
+ * the sender only moves on once it's given up on it.
+ *
+ * @param receive the reassembly state
+ * @param data the chunk as received, including its header
+ * @param length the number of bytes in the chunk
+ * @return FRAMINGRX_COMPLETE if the message is now complete and intact,
+ *         FRAMINGRX_PARTIAL if more chunks are expected, FRAMINGRX_MISSING if
+ *         parts of the message are known to be missing and should be asked
+ *         for again with framing_receive_nack(), FRAMINGRX_DUPLICATE if the
+ *         chunk belongs to a message already completed, whose ACK must have
+ *         been lost, or FRAMINGRX_ERROR if the chunk was malformed and has
+ *         been discarded
+ */
+FRAMINGRX framing_receive_data(FramingReceive * receive, guchar const * data, gsize length) {
+	guint8 msgid;
+	guint32 offset;
+	guint32 total;
+	gsize header;
+	gsize payload;
+	bool newhole;
+	bool repeat;
+	bool last;
+
+	if ((length < FRAMING_HEADER) || (data[0] != FRAMING_KIND_DATA)) {
+		ASYNCLOG(LOG_ERR, "Error, invalid data chunk (%lu bytes)\n", length);
+		return FRAMINGRX_ERROR;
+	}
+
+	msgid = data[1];
+	offset = framing_read32(data + 2);
+	header = framing_header_size(offset);
+	if (length < header) {
+		ASYNCLOG(LOG_ERR, "Error, first chunk too short for header (%lu bytes)\n", length);
+		return FRAMINGRX_ERROR;
+	}
+	payload = length - header;
+	receive->lastid = msgid;
+
+	if ((receive->completed == TRUE) && (msgid == receive->completedid) && ((receive->active == FALSE) || (msgid != receive->msgid))) {
+		return FRAMINGRX_DUPLICATE;
+	}
+
+	if ((receive->active == FALSE) || (msgid != receive->msgid)) {
+		framing_receive_start(receive, TRUE, msgid);
+	}
+
+	if (offset == 0) {
+		total = framing_read32(data + 6);
+		if ((total > FRAMING_MAX_LENGTH) || ((receive->lengthknown == TRUE) && (total != receive->length))) {
+			ASYNCLOG(LOG_ERR, "Error, invalid message length %u\n", total);
+			framing_receive_start(receive, FALSE, 0);
+			return FRAMINGRX_ERROR;
+		}
+		receive->lengthknown = TRUE;
+		receive->length = total;
+		receive->crc = framing_read32(data + 10);
+	}
+
+	if (((gsize)offset + payload > FRAMING_MAX_LENGTH) || ((receive->lengthknown == TRUE) && ((gsize)offset + payload > receive->length))) {
+		ASYNCLOG(LOG_ERR, "Error, received too many bytes (%lu at %u)\n", payload, offset);
+		return FRAMINGRX_ERROR;
+	}
+
+	newhole = (offset > receive->highest);
+	repeat = (payload > 0) && framing_receive_covered(receive, offset, payload);
+	last = (receive->lengthknown == TRUE) && ((gsize)offset + payload == receive->length);
+
+	if ((payload > 0) && (repeat == FALSE)) {
+		if (receive->message->len < offset + payload) {
+			g_byte_array_set_size(receive->message, offset + payload);
+			receive->capacity = MAX(receive->capacity, receive->message->len);
+		}
+		memcpy(receive->message->data + offset, data + header, payload);
+		framing_receive_add(receive, offset, payload);
+		receive->highest = MAX(receive->highest, offset + payload);
+	}
+
+	if ((receive->lengthknown == TRUE) && (framing_receive_covered(receive, 0, receive->length) || (receive->length == 0))) {
+		if (framing_crc32(receive->message->data, receive->length) != receive->crc) {
+			// Ask for the whole message again
+			ASYNCLOG(LOG_ERR, "Error, CRC mismatch for message %u\n", receive->msgid);
+			g_array_set_size(receive->received, 0);
+			receive->highest = 0;
+			return FRAMINGRX_MISSING;
+		}
+
+		receive->active = FALSE;
+		receive->completed = TRUE;
+		receive->completedid = receive->msgid;
+		return FRAMINGRX_COMPLETE;
+	}
+
+	// A chunk beyond a gap shows something was lost, and the last chunk or one
+	// we already have shows the sender is waiting for what's missing
+	if ((newhole == TRUE) || (((repeat == TRUE) || (last == TRUE)) && framing_receive_holes(receive))) {
+		return FRAMINGRX_MISSING;
+	}
+
+	return FRAMINGRX_PARTIAL;
+}
+
+/**
+ * Get the message completed by the last call to framing_receive_data(). It
+ * remains valid until the next chunk is added.
+ *
+ * @param receive the reassembly state
+ * @param length returns the length of the message
+ * @return the message data
+ */
+guchar const * framing_receive_message(FramingReceive * receive, gsize * length) {
+	*length = receive->length;
+
+	return receive->message->data;
+}
+
+/**
+ * Get the message id of the last data chunk added, for acknowledging it.
+ *
+ * @param receive the reassembly state
+ * @return the message id
+ */
+guint8 framing_receive_msgid(FramingReceive * receive) {
+	return receive->lastid;
+}
+
+/**
+ * Create a request for the parts of the current message that are missing,
+ * with as many ranges as fit in a single chunk.
+ *
+ * @param receive the reassembly state
+ * @param maxsize the maximum size of the NACK chunk
+ * @return the NACK chunk, to be freed with g_bytes_unref(), or NULL if
+ *         nothing is known to be missing
+ */
+GBytes * framing_receive_nack(FramingReceive * receive, gsize maxsize) {
+	GByteArray * nack;
+	FramingRange * range;
+	guchar entry[FRAMING_NACK_RANGE];
+	guint32 pos;
+	guint32 end;
+	guint index;
+
+	if (receive->active == FALSE) {
+		return NULL;
+	}
+
+	nack = g_byte_array_new();
+	entry[0] = FRAMING_KIND_NACK;
+	entry[1] = receive->msgid;
+	g_byte_array_append(nack, entry, FRAMING_NACK_HEADER);
+
+	pos = 0;
+	for (index = 0; index <= receive->received->len; index++) {
+		if (index < receive->received->len) {
+			range = &g_array_index(receive->received, FramingRange, index);
+			end = range->offset;
+		}
+		else {
+			// Anything after the last range is only known to be missing if
+			// we know where the message ends
+			range = NULL;
+			end = receive->lengthknown ? receive->length : receive->highest;
+		}
+
+		if ((end > pos) && (nack->len + FRAMING_NACK_RANGE <= maxsize)) {
+			framing_write32(entry, pos);
+			framing_write32(entry + 4, end - pos);
+			g_byte_array_append(nack, entry, FRAMING_NACK_RANGE);
+		}
+
+		if (range != NULL) {
+			pos = range->offset + range->length;
+		}
+	}
+
+	if (nack->len == FRAMING_NACK_HEADER) {
+		g_byte_array_unref(nack);
+		return NULL;
+	}
+
+	return g_byte_array_free_to_bytes(nack);
+}
+
+/**
+ * Record that a range of the message has been received, merging it with any
+ * ranges it touches.
+ *
+ * @param receive the reassembly state
+ * @param offset the start of the range received
+ * @param length the length of the range received
+ */
+static void framing_receive_add(FramingReceive * receive, guint32 offset, guint32 length) {
+	FramingRange * range;
+	FramingRange added;
+	guint index;
+	guint32 end;
+
+	added.offset = offset;
+	added.length = length;
+	end = offset + length;
+
+	index = 0;
+	while ((index < receive->received->len) && (g_array_index(receive->received, FramingRange, index).offset + g_array_index(receive->received, FramingRange, index).length < offset)) {
+		index++;
+	}
+
+	// Absorb any ranges that overlap or touch the new one
+	while (index < receive->received->len) {
+		range = &g_array_index(receive->received, FramingRange, index);
+		if (range->offset > end) {
+			break;
+		}
+		end = MAX(end, range->offset + range->length);
+		added.offset = MIN(added.offset, range->offset);
+		g_array_remove_index(receive->received, index);
+	}
+	added.length = end - added.offset;
+
+	g_array_insert_val(receive->received, index, added);
+}
+
+/**
+ * Check whether a range has already been received in full.
+ *
+ * @param receive the reassembly state
+ * @param offset the start of the range
+ * @param length the length of the range
+ * @return TRUE if every byte of the range has been received, FALSE o/w
+ */
+static bool framing_receive_covered(FramingReceive * receive, guint32 offset, guint32 length) {
+	FramingRange * range;
+	guint index;
+
+	for (index = 0; index < receive->received->len; index++) {
+		range = &g_array_index(receive->received, FramingRange, index);
+		if ((range->offset <= offset) && ((gsize)range->offset + range->length >= (gsize)offset + length)) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/**
+ * Check whether anything is missing below the furthest point received.
+ *
+ * @param receive the reassembly state
+ * @return TRUE if there are gaps, FALSE o/w
+ */
+static bool framing_receive_holes(FramingReceive * receive) {
+	return (receive->highest > 0) && (framing_receive_covered(receive, 0, receive->highest) == FALSE);
+}
+
+/**
+ * Discard any partly received message and get ready for the next one.
+ *
+ * @param receive the reassembly state
+ * @param active TRUE if a chunk of the next message has arrived
+ * @param msgid the id of the next message
+ */
+static void framing_receive_start(FramingReceive * receive, bool active, guint8 msgid) {
+	g_byte_array_set_size(receive->message, 0);
+	g_array_set_size(receive->received, 0);
+	receive->active = active;
+	receive->msgid = msgid;
+	receive->lengthknown = FALSE;
+	receive->length = 0;
+	receive->crc = 0;
+	receive->highest = 0;
+}
+
+static guint32 framing_read32(guchar const * data) {
+	return (((guint32)data[0]) << 24) | (((guint32)data[1]) << 16) | (((guint32)data[2]) << 8) | ((guint32)data[3]);
+}
+
+static void framing_write32(guchar * data, guint32 value) {
+	data[0] = (value >> 24) & 0xff;
+	data[1] = (value >> 16) & 0xff;
+	data[2] = (value >> 8) & 0xff;
+	data[3] = (value >> 0) & 0xff;
+}
+
@@ -0,0 +1,105 @@
+#ifndef __FRAMING_H
+#define __FRAMING_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Defines
+
+// The framing versions a session can use. Version 1 is a chunk counter and a
+// four-byte length prefix; version 2 is negotiated by a hello exchange
+#define FRAMING_VERSION_1 (1)
+#define FRAMING_VERSION_2 (2)
+
+// A version 1 message length that can never be sent, used to mark a hello.
+// The hello is this length followed by the version byte, and optionally a
+// byte of capability flags
+#define FRAMING_HELLO_LENGTH (0xffffffff)
+#define FRAMING_HELLO_SIZE (5)
+#define FRAMING_HELLO_SIZE_CAPABILITIES (6)
+// A hello asking to be addressed ends with the address the central chose
+#define FRAMING_HELLO_SIZE_ADDRESS (7)
+
+// Capability flags. Messages are prefixed with a compress.h method byte
+#define FRAMING_CAPABILITY_COMPRESSION (0x01)
+// Chunks sent to the central are prefixed with the address from its hello, so
+// that centrals sharing the notifications can pick out their own
+#define FRAMING_CAPABILITY_ADDRESSED (0x02)
+#define FRAMING_ADDRESS_SIZE (1)
+
+// The first byte of each version 2 chunk says what kind of chunk it is
+#define FRAMING_KIND_DATA (0x01)
+#define FRAMING_KIND_ACK (0x02)
+#define FRAMING_KIND_NACK (0x03)
+
+// Kind, message id and four-byte big-endian offset of the payload
+#define FRAMING_HEADER (6)
+// The first chunk also carries the message length and its CRC-32
+#define FRAMING_HEADER_FIRST (14)
+// Kind and message id
+#define FRAMING_ACK_SIZE (2)
+// Kind and message id, followed by ranges of offset and length
+#define FRAMING_NACK_HEADER (2)
+#define FRAMING_NACK_RANGE (8)
+
+// Messages longer than this are rejected rather than buffered
+#define FRAMING_MAX_LENGTH (1 << 24)
+
+// Structure definitions
+
+typedef enum _FRAMINGRX {
+	FRAMINGRX_INVALID = -1,
+
+	FRAMINGRX_PARTIAL,
+	FRAMINGRX_MISSING,
+	FRAMINGRX_COMPLETE,
+	FRAMINGRX_DUPLICATE,
+	FRAMINGRX_ERROR,
+
+	FRAMINGRX_NUM
+} FRAMINGRX;
+
+/**
+ * A range of bytes within a message. In a NACK a length of zero means
+ * everything from the offset to the end of the message.
+ */
+typedef struct _FramingRange {
+	guint32 offset;
+	guint32 length;
+} FramingRange;
+
+typedef struct _FramingReceive FramingReceive;
+
+// Function prototypes
+
+guint32 framing_crc32(guchar const * data, gsize length);
+
+guint8 framing_hello_version(guchar const * data, gsize length);
+guint8 framing_hello_capabilities(guchar const * data, gsize length);
+bool framing_hello_address(guchar const * data, gsize length, guint8 * address);
+GBytes * framing_hello_new(guint8 version, guint8 capabilities);
+GBytes * framing_hello_address_new(guint8 version, guint8 capabilities, guint8 address);
+GBytes * framing_address(GBytes * chunk, guint8 address);
+
+gsize framing_header_size(guint32 offset);
+gsize framing_header(guchar * header, guint8 msgid, guint32 offset, guint32 length, guint32 crc);
+GBytes * framing_prefix_length(guchar const * data, gsize length);
+GBytes * framing_chunk_new(GBytes * message, guint8 msgid, guint32 crc, gsize offset, gsize end, gsize maxsize, gsize * payload);
+guchar framing_kind(guchar const * data, gsize length);
+GBytes * framing_ack_new(guint8 msgid);
+bool framing_ack_parse(guchar const * data, gsize length, guint8 * msgid);
+bool framing_nack_parse(guchar const * data, gsize length, guint8 * msgid, GArray * ranges);
+
+FramingReceive * framing_receive_new();
+void framing_receive_delete(FramingReceive * receive);
+void framing_receive_reset(FramingReceive * receive);
+bool framing_receive_trim(FramingReceive * receive, gsize keep);
+FRAMINGRX framing_receive_data(FramingReceive * receive, guchar const * data, gsize length);
+guchar const * framing_receive_message(FramingReceive * receive, gsize * length);
+guint8 framing_receive_msgid(FramingReceive * receive);
+GBytes * framing_receive_nack(FramingReceive * receive, gsize maxsize);
+
+// Function definitions
+
+#endif
+
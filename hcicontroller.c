@@ -0,0 +1,1044 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "bluetooth/bluetooth.h"
+#include "bluetooth/hci.h"
+#include "bluetooth/hci_lib.h"
+
+#include "hcicontroller.h"
+#include "asynclog.h"
+
+// Defines
+
+// LE Controller Commands
+// See section 7.8 of the Core Bluetooth Specification version 5
+#define HCI_OGF_LE (0x08)
+#define HCI_OCF_LE_SET_ADVERTISING_PARAMETERS (0x0006)
+#define HCI_OCF_LE_SET_ADVERTISING_ENABLE (0x000a)
+#define HCI_OCF_LE_READ_LOCAL_SUPPORTED_FEATURES (0x0003)
+#define HCI_OCF_LE_SET_EXTENDED_ADVERTISING_PARAMETERS (0x0036)
+#define HCI_OCF_LE_SET_EXTENDED_ADVERTISING_DATA (0x0037)
+#define HCI_OCF_LE_SET_EXTENDED_SCAN_RESPONSE_DATA (0x0038)
+#define HCI_OCF_LE_SET_EXTENDED_ADVERTISING_ENABLE (0x0039)
+#define HCI_OCF_LE_READ_NUMBER_OF_SUPPORTED_ADVERTISING_SETS (0x003b)
+#define HCI_OCF_LE_REMOVE_ADVERTISING_SET (0x003c)
+
+// The LE Extended Advertising feature bit (bit 12 of the LE features)
+// See section 4.6 of Part B, Volume 6 of the Core Bluetooth Specification version 5
+#define HCI_LE_FEATURES_LENGTH (8)
+#define HCI_LE_FEATURE_EXTENDED_ADVERTISING_BYTE (1)
+#define HCI_LE_FEATURE_EXTENDED_ADVERTISING_MASK (0x10)
+
+// Our advertising set handles, kept well clear of the instance numbers
+// bluetoothd uses for its own sets
+#define HCI_ADVERTISING_HANDLE_BASE (0xe0)
+
+// Advertising event properties for sets using legacy PDUs, so that phones
+// which only scan for legacy adverts still see them
+#define HCI_EVENT_PROPERTIES_CONNECTABLE (0x0013)
+#define HCI_EVENT_PROPERTIES_NONCONNECTABLE (0x0010)
+
+// Legacy PDUs carry at most 31 bytes of advertising data
+#define HCI_LEGACY_DATA_LENGTH (HCICONTROLLER_DATA_LENGTH)
+#define HCI_UUID_LENGTH (HCICONTROLLER_UUID_LENGTH)
+// Advertising data types
+// See section 1 of Part A of the Core Specification Supplement
+#define HCI_AD_TYPE_FLAGS (0x01)
+#define HCI_AD_TYPE_UUID128_COMPLETE (0x07)
+#define HCI_AD_TYPE_NAME_SHORT (0x08)
+#define HCI_AD_TYPE_NAME_COMPLETE (0x09)
+#define HCI_AD_TYPE_TX_POWER (0x0a)
+#define HCI_AD_TYPE_MANUFACTURER_DATA (0xff)
+// LE General Discoverable Mode, BR/EDR Not Supported
+#define HCI_AD_FLAGS (0x06)
+
+// Advertising interval limits, in units of 0.625 ms
+#define HCI_ADVERTISING_INTERVAL_MIN (0x0020)
+#define HCI_ADVERTISING_INTERVAL_MAX (0x4000)
+
+// The interval used by the service before profiles were introduced
+#define HCI_DEFAULT_INTERVAL_MIN (100)
+#define HCI_DEFAULT_INTERVAL_MAX (109)
+
+// Structure definitions
+
+/**
+ * One of our extended advertising sets. A set is active once it's been
+ * given an advert, and created once the controller has its parameters,
+ * when it also tells us the transmit power it chose.
+ */
+typedef struct _HciAdvertSet {
+	bool active;
+	bool created;
+	bool connectable;
+	guint intervalmin;
+	guint intervalmax;
+	uint8_t data[HCI_LEGACY_DATA_LENGTH];
+	uint8_t length;
+	int8_t txpower;
+} HciAdvertSet;
+
+struct _HciController {
+	int dev_id;
+	int dd;
+	GArray * profile;
+	guint step;
+	guint steptimeoutid;
+	HCIADVERTMODE mode;
+	int extended;
+	guint sets;
+	bool extendedactive;
+	HciAdvertSet adverts[HCICONTROLLER_SETS];
+	gchar * name;
+};
+
+// Function prototypes
+
+static bool hcicontroller_open(HciController * hcicontroller);
+static void hcicontroller_close(HciController * hcicontroller);
+static bool hcicontroller_send(HciController * hcicontroller, uint16_t ocf, void * params, uint8_t length, char const * name);
+static bool hcicontroller_request(HciController * hcicontroller, uint16_t ocf, void * params, uint8_t length, uint8_t * response, uint8_t responselength, char const * name);
+static void hcicontroller_detect(HciController * hcicontroller);
+static bool hcicontroller_extended_apply(HciController * hcicontroller, guint intervalmin, guint intervalmax);
+static bool hcicontroller_extended_enable(HciController * hcicontroller, bool enable);
+static bool hcicontroller_extended_parameters(HciController * hcicontroller, guint set);
+static bool hcicontroller_extended_data(HciController * hcicontroller, guint set);
+static bool hcicontroller_extended_scan_response(HciController * hcicontroller, guint set);
+static uint16_t hcicontroller_interval_units(guint interval);
+static void hcicontroller_profile_schedule(HciController * hcicontroller);
+static gboolean hcicontroller_profile_next(gpointer user_data);
+
+/**
+ * Create a new controller object. The HCI device is opened lazily and then
+ * held open for the lifetime of the object.
+ *
+ * @param dev_id the HCI device id, or -1 to use the first available device
+ * @return the new controller object
+ */
+HciController * hcicontroller_new(int dev_id) {
+	HciController * hcicontroller;
+	HciProfileStep step;
+
+	hcicontroller = g_new0(HciController, 1);
+
+	hcicontroller->dev_id = dev_id;
+	hcicontroller->dd = -1;
+	hcicontroller->profile = g_array_new(FALSE, FALSE, sizeof(HciProfileStep));
+	hcicontroller->step = 0;
+	hcicontroller->steptimeoutid = 0;
+	hcicontroller->mode = HCIADVERTMODE_LEGACY;
+	hcicontroller->extended = -1;
+	hcicontroller->sets = 0;
+	hcicontroller->extendedactive = FALSE;
+	memset(hcicontroller->adverts, 0, sizeof(hcicontroller->adverts));
+	hcicontroller->name = NULL;
+
+	// By default use a single step at the original fixed interval
+	step.intervalmin = HCI_DEFAULT_INTERVAL_MIN;
+	step.intervalmax = HCI_DEFAULT_INTERVAL_MAX;
+	step.duration = 0;
+	g_array_append_val(hcicontroller->profile, step);
+
+	return hcicontroller;
+}
+
+/**
+ * Look up the HCI device id of an adapter, for passing to
+ * hcicontroller_new().
+ *
+ * @param name the name of the adapter, such as hci0
+ * @return the device id, or -1 if there's no adapter with that name
+ */
+int hcicontroller_dev_id(char const * name) {
+	return hci_devid(name);
+}
+
+/**
+ * Delete a controller object, closing the HCI device.
+ *
+ * @param hcicontroller the controller object to delete
+ */
+void hcicontroller_delete(HciController * hcicontroller) {
+	if (hcicontroller != NULL) {
+		hcicontroller_profile_stop(hcicontroller);
+		if (hcicontroller->extendedactive == TRUE) {
+			hcicontroller_adverts_stop(hcicontroller);
+		}
+		hcicontroller_close(hcicontroller);
+
+		g_array_unref(hcicontroller->profile);
+		hcicontroller->profile = NULL;
+
+		g_free(hcicontroller->name);
+		hcicontroller->name = NULL;
+
+		g_free(hcicontroller);
+	}
+}
+
+/**
+ * Open the HCI device if it isn't already open.
+ *
+ * @param hcicontroller the controller object
+ * @return TRUE if the device is open, FALSE o/w
+ */
+static bool hcicontroller_open(HciController * hcicontroller) {
+	int dev_id;
+
+	if (hcicontroller->dd < 0) {
+		dev_id = hcicontroller->dev_id;
+		if (dev_id < 0) {
+			dev_id = hci_get_route(NULL);
+		}
+
+		// Open device and return device descriptor
+		hcicontroller->dd = hci_open_dev(dev_id);
+		if (hcicontroller->dd < 0) {
+			ASYNCLOG(LOG_ERR, "Device open failed: %s\n", strerror(errno));
+		}
+	}
+
+	return (hcicontroller->dd >= 0);
+}
+
+/**
+ * Close the HCI device if it's open.
+ *
+ * @param hcicontroller the controller object
+ */
+static void hcicontroller_close(HciController * hcicontroller) {
+	if (hcicontroller->dd >= 0) {
+		hci_close_dev(hcicontroller->dd);
+		hcicontroller->dd = -1;
+	}
+}
+
+/**
+ * Send an LE controller command and wait for it to complete, checking the
+ * status returned by the controller.
+ *
+ * @param hcicontroller the controller object
+ * @param ocf the LE command opcode
+ * @param params the command parameters
+ * @param length the length of the command parameters
+ * @param name the name of the command, for reporting errors
+ * @return TRUE if the command completed successfully, FALSE o/w
+ */
+static bool hcicontroller_send(HciController * hcicontroller, uint16_t ocf, void * params, uint8_t length, char const * name) {
+	uint8_t status;
+
+	return hcicontroller_request(hcicontroller, ocf, params, length, &status, sizeof(status), name);
+}
+
+/**
+ * Send an LE controller command and wait for it to complete, returning the
+ * parameters of the command complete event.
+ *
+ * @param hcicontroller the controller object
+ * @param ocf the LE command opcode
+ * @param params the command parameters
+ * @param length the length of the command parameters
+ * @param response buffer for the returned parameters, starting with the
+ *        status
+ * @param responselength the number of returned parameter bytes expected
+ * @param name the name of the command, for reporting errors
+ * @return TRUE if the command completed successfully and returned all of
+ *         the expected parameters, FALSE o/w
+ */
+static bool hcicontroller_request(HciController * hcicontroller, uint16_t ocf, void * params, uint8_t length, uint8_t * response, uint8_t responselength, char const * name) {
+	struct hci_request request;
+	int result;
+
+	if (hcicontroller_open(hcicontroller) == FALSE) {
+		return FALSE;
+	}
+
+	memset(&request, 0, sizeof(request));
+	request.ogf = HCI_OGF_LE;
+	request.ocf = ocf;
+	request.cparam = params;
+	request.clen = length;
+	request.rparam = response;
+	request.rlen = responselength;
+	memset(response, 0xff, responselength);
+
+	result = hci_send_req(hcicontroller->dd, &request, HCICONTROLLER_TIMEOUT);
+	if (result < 0) {
+		ASYNCLOG(LOG_ERR, "Error sending HCI command %s: %s\n", name, strerror(errno));
+		if ((errno == ENODEV) || (errno == ENETDOWN) || (errno == EBADF)) {
+			// The adapter has gone away; reopen it next time
+			hcicontroller_close(hcicontroller);
+		}
+		return FALSE;
+	}
+
+	if (response[0] != 0x00) {
+		ASYNCLOG(LOG_ERR, "HCI command %s failed with status 0x%02X\n", name, response[0]);
+		return FALSE;
+	}
+
+	if (request.rlen < responselength) {
+		ASYNCLOG(LOG_ERR, "HCI command %s returned %d bytes, expected %u\n", name, request.rlen, responselength);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Convert an advertising interval in milliseconds into the controller's
+ * units of 0.625 ms, clamped to the range allowed for legacy advertising.
+ *
+ * @param interval the interval in milliseconds
+ * @return the interval in units of 0.625 ms
+ */
+static uint16_t hcicontroller_interval_units(guint interval) {
+	guint units;
+
+	units = (interval * 8) / 5;
+
+	return CLAMP(units, HCI_ADVERTISING_INTERVAL_MIN, HCI_ADVERTISING_INTERVAL_MAX);
+}
+
+/**
+ * Set the advertising interval of the controller, which requires advertising
+ * to be briefly disabled. With extended advertising this is the interval of
+ * the primary set.
+ *
+ * @param hcicontroller the controller object
+ * @param intervalmin the minimum advertising interval in milliseconds
+ * @param intervalmax the maximum advertising interval in milliseconds
+ * @return TRUE if all of the commands succeeded, FALSE o/w
+ */
+bool hcicontroller_set_advertising_interval(HciController * hcicontroller, guint intervalmin, guint intervalmax) {
+	uint8_t bytes_disable[] = {0x00};
+	uint8_t bytes_interval[] = {0xA0, 0x00, 0xAF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0x00};
+	uint8_t bytes_enable[] = {0x01};
+	uint16_t unitsmin;
+	uint16_t unitsmax;
+	bool result;
+
+	if (hcicontroller->extendedactive == TRUE) {
+		return hcicontroller_extended_apply(hcicontroller, intervalmin, intervalmax);
+	}
+
+	unitsmin = hcicontroller_interval_units(intervalmin);
+	unitsmax = hcicontroller_interval_units(intervalmax);
+	if (unitsmax < unitsmin) {
+		unitsmax = unitsmin;
+	}
+
+	bytes_interval[0] = unitsmin & 0xff;
+	bytes_interval[1] = (unitsmin >> 8) & 0xff;
+	bytes_interval[2] = unitsmax & 0xff;
+	bytes_interval[3] = (unitsmax >> 8) & 0xff;
+
+	// LE Set Advertising Enable Command
+	// See section 7.8.9 of the Core Bluetooth Specification version 5
+	// Parameters:
+	// - Advertising_Enable (0 = disable; 1 = enable)
+	result = hcicontroller_send(hcicontroller, HCI_OCF_LE_SET_ADVERTISING_ENABLE, bytes_disable, sizeof(bytes_disable), "disable advertising");
+
+	// LE Set Advertising Parameters Command
+	// See section 7.8.5 of the Core Bluetooth Specification version 5
+	// Parameters:
+	//  - Advertising_Interval_Min (0x0020 to 0x4000; Time = N * 0.625 ms)
+	//  - Advertising_Interval_Max (0x0020 to 0x4000; Time = N * 0.625 ms)
+	//  - Advertising_Type (0 = Connectable and scannable undirected advertising)
+	//  - Own_Address_Type (0 = Public, 1 = Random)
+	//  - Peer_Address_Type (0 = Public, 1 = Random)
+	//  - Peer_Address (0xXXXXXXXXXXXX)
+	//  - Advertising_Channel_Map (xxxxxxx1b = Chan 37, xxxxxx1xb = Chan 38, xxxxx1xxb = Chan 39, 00000111b = All)
+	//  - Advertising_Filter_Policy (0 = No white list)
+	if (result == TRUE) {
+		result = hcicontroller_send(hcicontroller, HCI_OCF_LE_SET_ADVERTISING_PARAMETERS, bytes_interval, sizeof(bytes_interval), "set advertising parameters");
+	}
+
+	// Re-enable advertising even if setting the parameters failed
+	// See section 7.8.9 of the Core Bluetooth Specification version 5
+	if (hcicontroller_send(hcicontroller, HCI_OCF_LE_SET_ADVERTISING_ENABLE, bytes_enable, sizeof(bytes_enable), "enable advertising") == FALSE) {
+		result = FALSE;
+	}
+
+	return result;
+}
+
+/**
+ * Choose how advertising is driven, from "legacy" or "extended". Whether the
+ * controller supports extended advertising is checked again the next time
+ * it's needed.
+ *
+ * @param hcicontroller the controller object
+ * @param mode the name of the mode
+ * @return TRUE if the mode was recognised and set, FALSE o/w
+ */
+bool hcicontroller_set_mode_string(HciController * hcicontroller, char const * mode) {
+	bool result;
+
+	result = TRUE;
+	if (g_strcmp0(mode, "legacy") == 0) {
+		hcicontroller->mode = HCIADVERTMODE_LEGACY;
+	}
+	else if (g_strcmp0(mode, "extended") == 0) {
+		hcicontroller->mode = HCIADVERTMODE_EXTENDED;
+	}
+	else {
+		result = FALSE;
+	}
+
+	if (result == TRUE) {
+		hcicontroller->extended = -1;
+	}
+
+	return result;
+}
+
+/**
+ * Check whether advertising should use our own extended advertising sets
+ * rather than an advert registered with bluetoothd. This is only the case if
+ * extended advertising has been chosen and the controller supports it.
+ *
+ * @param hcicontroller the controller object
+ * @return TRUE if extended advertising sets should be used, FALSE o/w
+ */
+bool hcicontroller_extended(HciController * hcicontroller) {
+	if ((hcicontroller->mode == HCIADVERTMODE_EXTENDED) && (hcicontroller->extended < 0)) {
+		hcicontroller_detect(hcicontroller);
+	}
+
+	return ((hcicontroller->mode == HCIADVERTMODE_EXTENDED) && (hcicontroller->extended > 0));
+}
+
+/**
+ * Ask the controller whether it supports extended advertising, and how many
+ * advertising sets it can run at once.
+ *
+ * @param hcicontroller the controller object
+ */
+static void hcicontroller_detect(HciController * hcicontroller) {
+	uint8_t features[1 + HCI_LE_FEATURES_LENGTH];
+	uint8_t sets[2];
+	bool result;
+
+	hcicontroller->extended = 0;
+	hcicontroller->sets = 0;
+
+	// LE Read Local Supported Features Command
+	// See section 7.8.3 of the Core Bluetooth Specification version 5
+	result = hcicontroller_request(hcicontroller, HCI_OCF_LE_READ_LOCAL_SUPPORTED_FEATURES, NULL, 0, features, sizeof(features), "read LE features");
+	if ((result == TRUE) && ((features[1 + HCI_LE_FEATURE_EXTENDED_ADVERTISING_BYTE] & HCI_LE_FEATURE_EXTENDED_ADVERTISING_MASK) == 0)) {
+		result = FALSE;
+	}
+
+	// LE Read Number of Supported Advertising Sets Command
+	// See section 7.8.58 of the Core Bluetooth Specification version 5
+	if (result == TRUE) {
+		result = hcicontroller_request(hcicontroller, HCI_OCF_LE_READ_NUMBER_OF_SUPPORTED_ADVERTISING_SETS, NULL, 0, sets, sizeof(sets), "read number of advertising sets");
+	}
+
+	if ((result == TRUE) && (sets[1] > 0)) {
+		hcicontroller->extended = 1;
+		hcicontroller->sets = MIN(sets[1], HCICONTROLLER_SETS);
+		ASYNCLOG(LOG_INFO, "Using extended advertising with %u of %u advertising sets\n", hcicontroller->sets, sets[1]);
+	}
+	else {
+		ASYNCLOG(LOG_INFO, "Extended advertising isn't supported, using legacy advertising\n");
+	}
+}
+
+/**
+ * Give one of our extended advertising sets an advert carrying a single
+ * 128-bit service UUID. The set starts advertising when the profile is next
+ * started or applied. The primary set takes its interval from the profile,
+ * so the interval given here only applies to the secondary set.
+ *
+ * @param hcicontroller the controller object
+ * @param set the set to use, such as HCICONTROLLER_SET_PRIMARY
+ * @param uuid the service UUID to advertise, as a string
+ * @param connectable whether centrals can connect through this set
+ * @param intervalmin the minimum advertising interval in milliseconds
+ * @param intervalmax the maximum advertising interval in milliseconds
+ * @return TRUE if the controller has the set and the UUID is valid, FALSE o/w
+ */
+bool hcicontroller_set_advert(HciController * hcicontroller, guint set, char const * uuid, bool connectable, guint intervalmin, guint intervalmax) {
+	HciAdvertSet * advert;
+	uint8_t data[HCI_LEGACY_DATA_LENGTH];
+	guint length;
+
+	if (set >= hcicontroller->sets) {
+		ASYNCLOG(LOG_INFO, "Controller has no advertising set %u\n", set);
+		return FALSE;
+	}
+
+	length = hcicontroller_advert_data(uuid, data);
+	if (length == 0) {
+		ASYNCLOG(LOG_ERR, "Invalid UUID to advertise: %s\n", uuid);
+		return FALSE;
+	}
+
+	advert = &hcicontroller->adverts[set];
+	advert->active = TRUE;
+	advert->connectable = connectable;
+	advert->intervalmin = intervalmin;
+	advert->intervalmax = intervalmax;
+	memcpy(advert->data, data, length);
+	advert->length = length;
+
+	hcicontroller->extendedactive = TRUE;
+
+	return TRUE;
+}
+
+/**
+ * Add manufacturer-specific data to the advert of one of our extended
+ * advertising sets, after its service UUID. Call this after
+ * hcicontroller_set_advert(), which clears it.
+ *
+ * @param hcicontroller the controller object
+ * @param set the set to add the data to
+ * @param company the company identifier the data is defined by
+ * @param data the data
+ * @param length the length of the data
+ * @return TRUE if the data fits in the advert, FALSE o/w
+ */
+bool hcicontroller_set_manufacturer_data(HciController * hcicontroller, guint set, guint16 company, guchar const * data, guint length) {
+	HciAdvertSet * advert;
+
+	if ((set >= HCICONTROLLER_SETS) || (hcicontroller->adverts[set].length + 4 + length > HCI_LEGACY_DATA_LENGTH)) {
+		ASYNCLOG(LOG_ERR, "Manufacturer data doesn't fit in the advert of set %u\n", set);
+		return FALSE;
+	}
+
+	advert = &hcicontroller->adverts[set];
+	advert->data[advert->length++] = 3 + length;
+	advert->data[advert->length++] = HCI_AD_TYPE_MANUFACTURER_DATA;
+	advert->data[advert->length++] = company & 0xff;
+	advert->data[advert->length++] = (company >> 8) & 0xff;
+	memcpy(advert->data + advert->length, data, length);
+	advert->length += length;
+
+	return TRUE;
+}
+
+/**
+ * Set the name given in the scan response of our connectable extended
+ * advertising sets, along with their transmit power. The name is shortened
+ * if it doesn't fit.
+ *
+ * @param hcicontroller the controller object
+ * @param name the name, or NULL or empty for none
+ */
+void hcicontroller_set_name(HciController * hcicontroller, char const * name) {
+	g_free(hcicontroller->name);
+	hcicontroller->name = ((name != NULL) && (name[0] != '\0')) ? g_strdup(name) : NULL;
+}
+
+/**
+ * Stop using one of our extended advertising sets. It's disabled the next
+ * time the profile is started or applied.
+ *
+ * @param hcicontroller the controller object
+ * @param set the set to stop using
+ */
+void hcicontroller_clear_advert(HciController * hcicontroller, guint set) {
+	if (set < HCICONTROLLER_SETS) {
+		hcicontroller->adverts[set].active = FALSE;
+	}
+}
+
+/**
+ * Stop all of our extended advertising sets and remove them from the
+ * controller, for example because the service is being stopped.
+ *
+ * @param hcicontroller the controller object
+ */
+void hcicontroller_adverts_stop(HciController * hcicontroller) {
+	uint8_t bytes_remove[1];
+	guint set;
+
+	hcicontroller_extended_enable(hcicontroller, FALSE);
+
+	for (set = 0; set < HCICONTROLLER_SETS; set++) {
+		// LE Remove Advertising Set Command
+		// See section 7.8.59 of the Core Bluetooth Specification version 5
+		if (hcicontroller->adverts[set].created == TRUE) {
+			bytes_remove[0] = HCI_ADVERTISING_HANDLE_BASE + set;
+			hcicontroller_send(hcicontroller, HCI_OCF_LE_REMOVE_ADVERTISING_SET, bytes_remove, sizeof(bytes_remove), "remove advertising set");
+		}
+		hcicontroller->adverts[set].created = FALSE;
+		hcicontroller->adverts[set].active = FALSE;
+	}
+
+	hcicontroller->extendedactive = FALSE;
+}
+
+/**
+ * Convert a UUID string into the order used in advertising data, least
+ * significant byte first.
+ *
+ * @param uuid the UUID string, with or without hyphens
+ * @param bytes buffer for the HCICONTROLLER_UUID_LENGTH bytes of the UUID
+ * @return TRUE if the string was a valid 128-bit UUID, FALSE o/w
+ */
+bool hcicontroller_uuid_bytes(char const * uuid, guchar * bytes) {
+	guint pos;
+	gint high;
+	gint low;
+
+	pos = HCI_UUID_LENGTH;
+	while (pos > 0) {
+		while (*uuid == '-') {
+			uuid++;
+		}
+		high = g_ascii_xdigit_value(uuid[0]);
+		low = (high >= 0) ? g_ascii_xdigit_value(uuid[1]) : -1;
+		if (low < 0) {
+			return FALSE;
+		}
+		pos--;
+		bytes[pos] = (uint8_t)((high << 4) | low);
+		uuid += 2;
+	}
+
+	return (*uuid == '\0');
+}
+
+/**
+ * Build the advertising data of one of our sets: the flags, then the
+ * complete list of 128-bit service UUIDs.
+ *
+ * @param uuid the service UUID to advertise, as a string
+ * @param data buffer for up to HCICONTROLLER_DATA_LENGTH bytes of data
+ * @return the length of the data, or zero if the UUID isn't valid
+ */
+guint hcicontroller_advert_data(char const * uuid, guchar * data) {
+	guint length;
+
+	length = 0;
+	data[length++] = 2;
+	data[length++] = HCI_AD_TYPE_FLAGS;
+	data[length++] = HCI_AD_FLAGS;
+	data[length++] = 1 + HCI_UUID_LENGTH;
+	data[length++] = HCI_AD_TYPE_UUID128_COMPLETE;
+	if (hcicontroller_uuid_bytes(uuid, data + length) == FALSE) {
+		return 0;
+	}
+	length += HCI_UUID_LENGTH;
+
+	return length;
+}
+
+/**
+ * Lay out the parameters of the LE Set Extended Advertising Parameters
+ * command for one of our sets.
+ *
+ * @param set the set the parameters are for
+ * @param connectable whether centrals can connect through the set
+ * @param intervalmin the minimum advertising interval in milliseconds
+ * @param intervalmax the maximum advertising interval in milliseconds
+ * @param bytes buffer for the HCICONTROLLER_PARAMETERS_LENGTH bytes
+ */
+void hcicontroller_parameters_bytes(guint set, bool connectable, guint intervalmin, guint intervalmax, guchar * bytes) {
+	uint8_t const bytes_parameters[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7f, 0x01, 0x00, 0x01, 0x00, 0x00};
+	uint16_t properties;
+	uint16_t unitsmin;
+	uint16_t unitsmax;
+
+	G_STATIC_ASSERT(sizeof(bytes_parameters) == HCICONTROLLER_PARAMETERS_LENGTH);
+
+	properties = (connectable == TRUE) ? HCI_EVENT_PROPERTIES_CONNECTABLE : HCI_EVENT_PROPERTIES_NONCONNECTABLE;
+	unitsmin = hcicontroller_interval_units(intervalmin);
+	unitsmax = hcicontroller_interval_units(intervalmax);
+	if (unitsmax < unitsmin) {
+		unitsmax = unitsmin;
+	}
+
+	// LE Set Extended Advertising Parameters Command
+	// See section 7.8.53 of the Core Bluetooth Specification version 5
+	// Parameters:
+	//  - Advertising_Handle
+	//  - Advertising_Event_Properties (bit 0 = connectable, bit 1 = scannable, bit 4 = legacy PDUs)
+	//  - Primary_Advertising_Interval_Min (3 bytes; Time = N * 0.625 ms)
+	//  - Primary_Advertising_Interval_Max (3 bytes; Time = N * 0.625 ms)
+	//  - Primary_Advertising_Channel_Map (00000111b = All)
+	//  - Own_Address_Type (0 = Public)
+	//  - Peer_Address_Type, Peer_Address (unused for undirected advertising)
+	//  - Advertising_Filter_Policy (0 = No white list)
+	//  - Advertising_TX_Power (0x7f = No preference)
+	//  - Primary_Advertising_PHY (1 = LE 1M)
+	//  - Secondary_Advertising_Max_Skip
+	//  - Secondary_Advertising_PHY (1 = LE 1M)
+	//  - Advertising_SID
+	//  - Scan_Request_Notification_Enable (0 = Disabled)
+	memcpy(bytes, bytes_parameters, sizeof(bytes_parameters));
+	bytes[0] = HCI_ADVERTISING_HANDLE_BASE + set;
+	bytes[1] = properties & 0xff;
+	bytes[2] = (properties >> 8) & 0xff;
+	bytes[3] = unitsmin & 0xff;
+	bytes[4] = (unitsmin >> 8) & 0xff;
+	bytes[6] = unitsmax & 0xff;
+	bytes[7] = (unitsmax >> 8) & 0xff;
+	bytes[23] = set;
+}
+
+/**
+ * Lay out the parameters of the LE Set Extended Advertising Data command,
+ * or the LE Set Extended Scan Response Data command, for one of our sets.
+ *
+ * @param set the set the data is for
+ * @param data the advertising data
+ * @param length the length of the data, up to HCICONTROLLER_DATA_LENGTH
+ * @param bytes buffer for 4 + HCICONTROLLER_DATA_LENGTH bytes
+ * @return the length of the parameters
+ */
+guint hcicontroller_data_bytes(guint set, guchar const * data, guint length, guchar * bytes) {
+	// LE Set Extended Advertising Data Command
+	// See section 7.8.54 of the Core Bluetooth Specification version 5
+	// Parameters:
+	//  - Advertising_Handle
+	//  - Operation (3 = Complete extended advertising data)
+	//  - Fragment_Preference (1 = The Controller should not fragment)
+	//  - Advertising_Data_Length
+	//  - Advertising_Data
+	bytes[0] = HCI_ADVERTISING_HANDLE_BASE + set;
+	bytes[1] = 0x03;
+	bytes[2] = 0x01;
+	bytes[3] = length;
+	memcpy(bytes + 4, data, length);
+
+	return 4 + length;
+}
+
+/**
+ * Set up and enable our extended advertising sets, which requires them to
+ * be briefly disabled.
+ *
+ * @param hcicontroller the controller object
+ * @param intervalmin the minimum interval of the primary set in milliseconds
+ * @param intervalmax the maximum interval of the primary set in milliseconds
+ * @return TRUE if all of the commands succeeded, FALSE o/w
+ */
+static bool hcicontroller_extended_apply(HciController * hcicontroller, guint intervalmin, guint intervalmax) {
+	HciAdvertSet * advert;
+	guint set;
+	bool result;
+
+	hcicontroller->adverts[HCICONTROLLER_SET_PRIMARY].intervalmin = intervalmin;
+	hcicontroller->adverts[HCICONTROLLER_SET_PRIMARY].intervalmax = intervalmax;
+
+	result = hcicontroller_extended_enable(hcicontroller, FALSE);
+
+	for (set = 0; (set < hcicontroller->sets) && (result == TRUE); set++) {
+		advert = &hcicontroller->adverts[set];
+		if (advert->active == TRUE) {
+			result = hcicontroller_extended_parameters(hcicontroller, set) && hcicontroller_extended_data(hcicontroller, set) && hcicontroller_extended_scan_response(hcicontroller, set);
+		}
+	}
+
+	// Re-enable advertising even if setting up a set failed
+	if (hcicontroller_extended_enable(hcicontroller, TRUE) == FALSE) {
+		result = FALSE;
+	}
+
+	return result;
+}
+
+/**
+ * Enable the active sets, or disable every set the controller has.
+ *
+ * @param hcicontroller the controller object
+ * @param enable TRUE to enable the active sets, FALSE to disable them all
+ * @return TRUE if the command succeeded or there were no sets, FALSE o/w
+ */
+static bool hcicontroller_extended_enable(HciController * hcicontroller, bool enable) {
+	uint8_t bytes_enable[2 + (4 * HCICONTROLLER_SETS)];
+	HciAdvertSet * advert;
+	guint set;
+	uint8_t count;
+	bool result;
+
+	// LE Set Extended Advertising Enable Command
+	// See section 7.8.56 of the Core Bluetooth Specification version 5
+	// Parameters:
+	//  - Enable (0 = disable; 1 = enable)
+	//  - Number_of_Sets
+	//  - Advertising_Handle[i]
+	//  - Duration[i] (0 = until disabled)
+	//  - Max_Extended_Advertising_Events[i] (0 = no maximum)
+	count = 0;
+	for (set = 0; set < HCICONTROLLER_SETS; set++) {
+		advert = &hcicontroller->adverts[set];
+		if ((enable == TRUE) ? ((advert->active == TRUE) && (advert->created == TRUE)) : (advert->created == TRUE)) {
+			bytes_enable[2 + (4 * count) + 0] = HCI_ADVERTISING_HANDLE_BASE + set;
+			bytes_enable[2 + (4 * count) + 1] = 0x00;
+			bytes_enable[2 + (4 * count) + 2] = 0x00;
+			bytes_enable[2 + (4 * count) + 3] = 0x00;
+			count++;
+		}
+	}
+	bytes_enable[0] = (enable == TRUE) ? 0x01 : 0x00;
+	bytes_enable[1] = count;
+
+	result = TRUE;
+	if (count > 0) {
+		result = hcicontroller_send(hcicontroller, HCI_OCF_LE_SET_EXTENDED_ADVERTISING_ENABLE, bytes_enable, 2 + (4 * count), (enable == TRUE) ? "enable advertising sets" : "disable advertising sets");
+	}
+
+	return result;
+}
+
+/**
+ * Send the parameters of one of our sets, creating it on the controller if
+ * it didn't already exist.
+ *
+ * @param hcicontroller the controller object
+ * @param set the set to send the parameters of
+ * @return TRUE if the command succeeded, FALSE o/w
+ */
+static bool hcicontroller_extended_parameters(HciController * hcicontroller, guint set) {
+	uint8_t bytes_parameters[HCICONTROLLER_PARAMETERS_LENGTH];
+	uint8_t response[2];
+	HciAdvertSet * advert;
+	bool result;
+
+	advert = &hcicontroller->adverts[set];
+	hcicontroller_parameters_bytes(set, advert->connectable, advert->intervalmin, advert->intervalmax, bytes_parameters);
+
+	// Returns the Selected_Tx_Power in dBm after the status
+	result = hcicontroller_request(hcicontroller, HCI_OCF_LE_SET_EXTENDED_ADVERTISING_PARAMETERS, bytes_parameters, sizeof(bytes_parameters), response, sizeof(response), "set advertising set parameters");
+	if (result == TRUE) {
+		advert->created = TRUE;
+		advert->txpower = (int8_t)response[1];
+	}
+
+	return result;
+}
+
+/**
+ * Send the advertising data of one of our sets.
+ *
+ * @param hcicontroller the controller object
+ * @param set the set to send the data of
+ * @return TRUE if the command succeeded, FALSE o/w
+ */
+static bool hcicontroller_extended_data(HciController * hcicontroller, guint set) {
+	uint8_t bytes_data[4 + HCI_LEGACY_DATA_LENGTH];
+	HciAdvertSet * advert;
+	guint length;
+
+	advert = &hcicontroller->adverts[set];
+	length = hcicontroller_data_bytes(set, advert->data, advert->length, bytes_data);
+
+	return hcicontroller_send(hcicontroller, HCI_OCF_LE_SET_EXTENDED_ADVERTISING_DATA, bytes_data, length, "set advertising set data");
+}
+
+/**
+ * Send the scan response of one of our sets, which for a connectable set is
+ * the name and the transmit power, so that a central can estimate its
+ * distance before connecting. Non-connectable sets aren't scannable.
+ *
+ * @param hcicontroller the controller object
+ * @param set the set to send the scan response of
+ * @return TRUE if the command succeeded or wasn't needed, FALSE o/w
+ */
+static bool hcicontroller_extended_scan_response(HciController * hcicontroller, guint set) {
+	uint8_t bytes_data[4 + HCI_LEGACY_DATA_LENGTH];
+	HciAdvertSet * advert;
+	size_t namelength;
+	uint8_t length;
+
+	advert = &hcicontroller->adverts[set];
+	if (advert->connectable == FALSE) {
+		return TRUE;
+	}
+
+	length = 0;
+	if (hcicontroller->name != NULL) {
+		// Leave room for the transmit power
+		namelength = MIN(strlen(hcicontroller->name), HCI_LEGACY_DATA_LENGTH - 5);
+		bytes_data[4 + length++] = 1 + namelength;
+		bytes_data[4 + length++] = (namelength < strlen(hcicontroller->name)) ? HCI_AD_TYPE_NAME_SHORT : HCI_AD_TYPE_NAME_COMPLETE;
+		memcpy(bytes_data + 4 + length, hcicontroller->name, namelength);
+		length += namelength;
+	}
+	bytes_data[4 + length++] = 2;
+	bytes_data[4 + length++] = HCI_AD_TYPE_TX_POWER;
+	bytes_data[4 + length++] = (uint8_t)advert->txpower;
+
+	// LE Set Extended Scan Response Data Command
+	// See section 7.8.55 of the Core Bluetooth Specification version 5
+	// Parameters as for LE Set Extended Advertising Data
+	bytes_data[0] = HCI_ADVERTISING_HANDLE_BASE + set;
+	bytes_data[1] = 0x03;
+	bytes_data[2] = 0x01;
+	bytes_data[3] = length;
+
+	return hcicontroller_send(hcicontroller, HCI_OCF_LE_SET_EXTENDED_SCAN_RESPONSE_DATA, bytes_data, 4 + length, "set advertising set scan response");
+}
+
+/**
+ * Set the advertising profile to follow. The profile takes effect the next
+ * time it's started or applied. A profile already running, for example when
+ * the settings are reloaded, is stopped and goes back to its first step, so
+ * that it never points beyond the end of a shorter profile.
+ *
+ * @param hcicontroller the controller object
+ * @param steps the steps of the profile
+ * @param count the number of steps; must be at least one
+ */
+void hcicontroller_set_profile(HciController * hcicontroller, HciProfileStep const * steps, guint count) {
+	if (count > 0) {
+		hcicontroller_profile_stop(hcicontroller);
+		g_array_set_size(hcicontroller->profile, 0);
+		g_array_append_vals(hcicontroller->profile, steps, count);
+		hcicontroller->step = 0;
+	}
+}
+
+/**
+ * Set the advertising profile from a string of comma-separated steps, each
+ * of the form interval:duration or intervalmin-intervalmax:duration, with
+ * the intervals in milliseconds and the duration in seconds. For example
+ * "20:30,100-109:0" advertises every 20 ms for 30 seconds, and then at
+ * around 100 ms from then on.
+ *
+ * @param hcicontroller the controller object
+ * @param profile the profile string
+ * @return TRUE if the profile was parsed and set, FALSE o/w
+ */
+bool hcicontroller_set_profile_string(HciController * hcicontroller, char const * profile) {
+	GArray * steps;
+	HciProfileStep step;
+	gchar ** parts;
+	guint pos;
+	int matched;
+	bool result;
+
+	steps = g_array_new(FALSE, FALSE, sizeof(HciProfileStep));
+	parts = g_strsplit(profile, ",", -1);
+	result = TRUE;
+
+	for (pos = 0; (parts[pos] != NULL) && (result == TRUE); pos++) {
+		matched = sscanf(parts[pos], " %u-%u:%u", &step.intervalmin, &step.intervalmax, &step.duration);
+		if (matched != 3) {
+			matched = sscanf(parts[pos], " %u:%u", &step.intervalmin, &step.duration);
+			step.intervalmax = step.intervalmin;
+			if (matched != 2) {
+				ASYNCLOG(LOG_ERR, "Invalid advertising profile step: %s\n", parts[pos]);
+				result = FALSE;
+			}
+		}
+		if (result == TRUE) {
+			g_array_append_val(steps, step);
+		}
+	}
+
+	if ((result == TRUE) && (steps->len > 0)) {
+		hcicontroller_set_profile(hcicontroller, (HciProfileStep const *)steps->data, steps->len);
+	}
+	else {
+		result = FALSE;
+	}
+
+	g_strfreev(parts);
+	g_array_unref(steps);
+
+	return result;
+}
+
+/**
+ * Start the profile again from its first step, for example because we've
+ * just started advertising for a new session.
+ *
+ * @param hcicontroller the controller object
+ * @return TRUE if the interval was set, FALSE o/w
+ */
+bool hcicontroller_profile_start(HciController * hcicontroller) {
+	hcicontroller_profile_stop(hcicontroller);
+	hcicontroller->step = 0;
+
+	return hcicontroller_profile_apply(hcicontroller);
+}
+
+/**
+ * Apply the current step of the profile again without restarting it. This
+ * is needed when advertising has been re-registered, since bluetoothd sets
+ * its own parameters on registration. If the profile was stopped, it
+ * continues on from the current step.
+ *
+ * @param hcicontroller the controller object
+ * @return TRUE if the interval was set, FALSE o/w
+ */
+bool hcicontroller_profile_apply(HciController * hcicontroller) {
+	HciProfileStep * step;
+	bool result;
+
+	if (hcicontroller->step >= hcicontroller->profile->len) {
+		hcicontroller->step = hcicontroller->profile->len - 1;
+	}
+	step = &g_array_index(hcicontroller->profile, HciProfileStep, hcicontroller->step);
+
+	result = hcicontroller_set_advertising_interval(hcicontroller, step->intervalmin, step->intervalmax);
+	ASYNCLOG(LOG_INFO, "Advertising interval %u-%u ms (profile step %u) set with result %d\n", step->intervalmin, step->intervalmax, hcicontroller->step, result);
+
+	if (hcicontroller->steptimeoutid == 0) {
+		hcicontroller_profile_schedule(hcicontroller);
+	}
+
+	return result;
+}
+
+/**
+ * Stop moving through the profile, leaving the current interval in place.
+ *
+ * @param hcicontroller the controller object
+ */
+void hcicontroller_profile_stop(HciController * hcicontroller) {
+	if (hcicontroller->steptimeoutid != 0) {
+		g_source_remove(hcicontroller->steptimeoutid);
+		hcicontroller->steptimeoutid = 0;
+	}
+}
+
+/**
+ * Arrange to move on to the next step of the profile once the current one
+ * has run its course.
+ *
+ * @param hcicontroller the controller object
+ */
+static void hcicontroller_profile_schedule(HciController * hcicontroller) {
+	HciProfileStep * step;
+
+	if (hcicontroller->step >= hcicontroller->profile->len) {
+		hcicontroller->step = hcicontroller->profile->len - 1;
+	}
+	step = &g_array_index(hcicontroller->profile, HciProfileStep, hcicontroller->step);
+
+	if ((step->duration > 0) && ((hcicontroller->step + 1) < hcicontroller->profile->len)) {
+		hcicontroller->steptimeoutid = g_timeout_add_seconds(step->duration, hcicontroller_profile_next, hcicontroller);
+	}
+}
+
+/**
+ * Timeout callback that moves the profile on to its next step.
+ *
+ * @param user_data the controller object
+ * @return FALSE, since the next step schedules its own timeout
+ */
+static gboolean hcicontroller_profile_next(gpointer user_data) {
+	HciController * hcicontroller = (HciController *)user_data;
+
+	// This timeout fires only once
+	hcicontroller->steptimeoutid = 0;
+
+	hcicontroller->step++;
+	hcicontroller_profile_apply(hcicontroller);
+
+	return FALSE;
+}
+
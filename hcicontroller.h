@@ -0,0 +1,85 @@
+#ifndef __HCICONTROLLER_H
+#define __HCICONTROLLER_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Defines
+
+// Time to wait for a command complete event, in milliseconds
+#define HCICONTROLLER_TIMEOUT (1000)
+
+// The advertising sets used with extended advertising. The primary set is
+// connectable and follows the profile; the secondary set has an interval of
+// its own
+#define HCICONTROLLER_SETS (2)
+#define HCICONTROLLER_SET_PRIMARY (0)
+#define HCICONTROLLER_SET_SECONDARY (1)
+
+// The length of the parameters of the LE Set Extended Advertising Parameters
+// command, and the most the advertising data of one of our sets can take
+#define HCICONTROLLER_PARAMETERS_LENGTH (25)
+#define HCICONTROLLER_DATA_LENGTH (31)
+#define HCICONTROLLER_UUID_LENGTH (16)
+
+// Structure definitions
+
+/**
+ * How advertising is driven. With legacy advertising bluetoothd registers a
+ * single advert and only its interval is set here. With extended
+ * advertising the advertising sets are run here directly, if the controller
+ * supports them; otherwise legacy advertising is used instead.
+ */
+typedef enum _HCIADVERTMODE {
+	HCIADVERTMODE_INVALID = -1,
+
+	HCIADVERTMODE_LEGACY,
+	HCIADVERTMODE_EXTENDED,
+
+	HCIADVERTMODE_NUM
+} HCIADVERTMODE;
+
+/**
+ * One step of an advertising profile. The controller advertises with an
+ * interval between intervalmin and intervalmax (in milliseconds) for
+ * duration seconds before moving on to the next step. A duration of zero
+ * means the step lasts until the profile is restarted.
+ */
+typedef struct _HciProfileStep {
+	guint intervalmin;
+	guint intervalmax;
+	guint duration;
+} HciProfileStep;
+
+typedef struct _HciController HciController;
+
+// Function prototypes
+
+HciController * hcicontroller_new(int dev_id);
+int hcicontroller_dev_id(char const * name);
+void hcicontroller_delete(HciController * hcicontroller);
+
+bool hcicontroller_set_advertising_interval(HciController * hcicontroller, guint intervalmin, guint intervalmax);
+
+bool hcicontroller_set_mode_string(HciController * hcicontroller, char const * mode);
+bool hcicontroller_extended(HciController * hcicontroller);
+bool hcicontroller_set_advert(HciController * hcicontroller, guint set, char const * uuid, bool connectable, guint intervalmin, guint intervalmax);
+bool hcicontroller_set_manufacturer_data(HciController * hcicontroller, guint set, guint16 company, guchar const * data, guint length);
+void hcicontroller_set_name(HciController * hcicontroller, char const * name);
+void hcicontroller_clear_advert(HciController * hcicontroller, guint set);
+void hcicontroller_adverts_stop(HciController * hcicontroller);
+
+void hcicontroller_set_profile(HciController * hcicontroller, HciProfileStep const * steps, guint count);
+bool hcicontroller_set_profile_string(HciController * hcicontroller, char const * profile);
+bool hcicontroller_profile_start(HciController * hcicontroller);
+bool hcicontroller_profile_apply(HciController * hcicontroller);
+void hcicontroller_profile_stop(HciController * hcicontroller);
+
+// The command layouts, which don't need a controller, so that they can be
+// checked on their own
+bool hcicontroller_uuid_bytes(char const * uuid, guchar * bytes);
+guint hcicontroller_advert_data(char const * uuid, guchar * data);
+void hcicontroller_parameters_bytes(guint set, bool connectable, guint intervalmin, guint intervalmax, guchar * bytes);
+guint hcicontroller_data_bytes(guint set, guchar const * data, guint length, guchar * bytes);
+
+#endif
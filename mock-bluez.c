@@ -0,0 +1,1369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+#include <glib.h>
+
+#include <gdbus-generated.h>
+
+#include "framing.h"
+#include "compress.h"
+
+// Defines
+
+#define BLUEZ_SERVICE_NAME "org.bluez"
+#define BLUEZ_ROOT_PATH "/"
+#define BLUEZ_DEVICE_PATH "/org/bluez/hci0"
+#define MOCK_CENTRAL_PATH "/org/bluez/hci0/dev_00_00_00_00_00_01"
+
+#define CHARACTERISTIC_UUID_INCOMING "56add98a-0e8a-4113-85bf-6dc97b58a9c1"
+#define CHARACTERISTIC_UUID_OUTGOING "56add98a-0e8a-4113-85bf-6dc97b58a9c2"
+
+#define GATT_CHARACTERISTIC_INTERFACE "org.bluez.GattCharacteristic1"
+
+#define DEFAULT_SERVICE "./dbus-test-echo"
+#define DEFAULT_CHUNK_SIZE (128)
+#define DEFAULT_MESSAGE_SIZE (1024)
+#define DEFAULT_MESSAGES (200)
+// Abandon the run if nothing comes back for this long, in milliseconds
+#define RESPONSE_TIMEOUT (10000)
+// With version 2 framing, send the last chunk again if a message hasn't been
+// acknowledged after this long, in milliseconds
+#define ACK_TIMEOUT (500)
+
+// Structure definitions
+
+/**
+ * A stand-in for bluetoothd, running on a private bus, that plays the part of
+ * a central writing framed messages to the service and timing how long the
+ * response takes to come back as notifications.
+ */
+typedef struct _MockBluez {
+	GMainLoop * loop;
+	GTestDBus * bus;
+	GDBusConnection * connection;
+	GDBusObjectManagerServer * object_manager;
+	Adapter1 * adapter;
+	LEAdvertisingManager1 * leadvertisingmanager;
+	GattManager1 * gattmanager;
+	guint nameid;
+	GPid servicepid;
+
+	// The service under test
+	gchar * sender;
+	gchar * application;
+	gchar * path_incoming;
+	gchar * path_outgoing;
+	guint subscriptionid;
+	guint adverts;
+
+	// Acquired sockets, used instead of D-Bus with --acquire
+	int fd_write;
+	int fd_notify;
+	guint notifywatchid;
+
+	// Start-up measurement, from spawning the service to its application
+	// being registered
+	gint64 spawntime;
+	gint64 startuptime;
+
+	// Driver parameters
+	gsize chunksize;
+	gsize messagesize;
+	guint messages;
+	gdouble rate;
+	guint mtu;
+	gboolean acquire;
+	gboolean framing2;
+	gdouble drop;
+	gboolean compress;
+	gint address;
+	gchar const * label;
+	gchar ** serviceoptions;
+	gboolean startuponly;
+
+	// Driver state
+	gboolean running;
+	guchar * message;
+	// The message as it goes over the air; the same as message unless it's
+	// compressed
+	guchar * wire;
+	gsize wiresize;
+	guint sent;
+	guint received;
+	guint pending;
+	gsize sendpos;
+	guchar counter;
+	gboolean sending;
+	guint ratetimeoutid;
+	guint responsetimeoutid;
+	gsize recvremaining;
+	GArray * starts;
+	guint startshead;
+	GArray * latencies;
+	gint64 runstart;
+	gint64 runend;
+	gint result;
+
+	// Version 2 framing state
+	gboolean hellosent;
+	gboolean negotiated;
+	gboolean addressed;
+	guint8 msgid;
+	guint32 crc;
+	gboolean awaitingack;
+	guint acktimeoutid;
+	guint dropped;
+	guint resent;
+	FramingReceive * framingreceive;
+
+	// Compression state, used once the service agrees to it
+	gboolean compressing;
+	Compress * compressor;
+	guint undecodable;
+} MockBluez;
+
+// Function prototypes
+
+static gboolean handle_register_advertisement(LEAdvertisingManager1 * object, GDBusMethodInvocation * invocation, gchar const * arg_advertisement, GVariant * arg_options, gpointer user_data);
+static gboolean handle_unregister_advertisement(LEAdvertisingManager1 * object, GDBusMethodInvocation * invocation, gchar const * arg_advertisement, gpointer user_data);
+static gboolean handle_register_application(GattManager1 * object, GDBusMethodInvocation * invocation, gchar const * arg_application, GVariant * arg_options, gpointer user_data);
+static gboolean handle_unregister_application(GattManager1 * object, GDBusMethodInvocation * invocation, gchar const * arg_application, gpointer user_data);
+static void on_name_acquired(GDBusConnection * connection, gchar const * name, gpointer user_data);
+static void on_name_lost(GDBusConnection * connection, gchar const * name, gpointer user_data);
+static void on_get_managed_objects(GDBusConnection * connection, GAsyncResult * res, gpointer user_data);
+static GVariant * mock_options(MockBluez * mock);
+static int acquire_finish(GDBusConnection * connection, GAsyncResult * res, guint16 * mtu);
+static void on_acquire_write(GDBusConnection * connection, GAsyncResult * res, gpointer user_data);
+static void on_acquire_notify(GDBusConnection * connection, GAsyncResult * res, gpointer user_data);
+static void acquire_done(MockBluez * mock);
+static void on_properties_changed(GDBusConnection * connection, gchar const * sender_name, gchar const * object_path, gchar const * interface_name, gchar const * signal_name, GVariant * parameters, gpointer user_data);
+static gboolean on_notify_socket(GIOChannel * channel, GIOCondition condition, gpointer user_data);
+static void driver_start(MockBluez * mock);
+static gboolean driver_rate_timeout(gpointer user_data);
+static void driver_fill_message(MockBluez * mock);
+static void driver_next_message(MockBluez * mock);
+static void driver_send_chunk(MockBluez * mock);
+static void driver_write(MockBluez * mock, guchar * chunk, gsize length, gboolean next, gboolean droppable);
+static void driver_write_bytes(MockBluez * mock, GBytes * bytes);
+static gboolean driver_send_chunk_idle(gpointer user_data);
+static void on_write_value(GDBusConnection * connection, GAsyncResult * res, gpointer user_data);
+static void on_write_control(GDBusConnection * connection, GAsyncResult * res, gpointer user_data);
+static void driver_message_sent(MockBluez * mock);
+static void driver_resend(MockBluez * mock, gsize offset, gsize length);
+static gboolean driver_ack_timeout(gpointer user_data);
+static void driver_receive_chunk(MockBluez * mock, guchar const * data, gsize length);
+static void driver_receive_framed(MockBluez * mock, guchar const * data, gsize length);
+static void driver_response(MockBluez * mock);
+static gboolean driver_response_timeout(gpointer user_data);
+static void driver_finish(MockBluez * mock, gint result);
+static void startup_report(MockBluez * mock);
+static guint service_memory(MockBluez * mock, char const * field);
+static gint compare_latency(gconstpointer a, gconstpointer b);
+static gdouble percentile(GArray * sorted, gdouble fraction);
+static void report_error(GError ** error, char const * hint);
+
+/**
+ * Deal with errors by printing them to stderr if there is one, then freeing
+ * and clearning the error structure.
+ *
+ * @param error the error structure to check and report if it exists
+ * @param hint a human-readable hint that will be output alongside the error
+ */
+static void report_error(GError ** error, char const * hint) {
+	if (*error) {
+		fprintf(stderr, "Error %s: %s\n", hint, (*error)->message);
+		g_error_free(*error);
+		*error = NULL;
+	}
+}
+
+static gboolean handle_register_advertisement(LEAdvertisingManager1 * object, GDBusMethodInvocation * invocation, gchar const * arg_advertisement, GVariant * arg_options, gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+
+	mock->adverts++;
+	printf("Mock: advert %s registered by %s\n", arg_advertisement, g_dbus_method_invocation_get_sender(invocation));
+
+	leadvertising_manager1_complete_register_advertisement(object, invocation);
+
+	return TRUE;
+}
+
+static gboolean handle_unregister_advertisement(LEAdvertisingManager1 * object, GDBusMethodInvocation * invocation, gchar const * arg_advertisement, gpointer user_data) {
+	printf("Mock: advert %s unregistered\n", arg_advertisement);
+
+	leadvertising_manager1_complete_unregister_advertisement(object, invocation);
+
+	return TRUE;
+}
+
+/**
+ * Handle the service registering its GATT application. Like bluetoothd, we
+ * then read the application's objects to find its characteristics.
+ *
+ * @param object the GATT manager object
+ * @param invocation the message invocation details
+ * @param arg_application the path of the application's object manager
+ * @param arg_options the registration options
+ * @param user_data the mock
+ */
+static gboolean handle_register_application(GattManager1 * object, GDBusMethodInvocation * invocation, gchar const * arg_application, GVariant * arg_options, gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+
+	printf("Mock: application %s registered by %s\n", arg_application, g_dbus_method_invocation_get_sender(invocation));
+
+	if ((mock->spawntime > 0) && (mock->startuptime == 0)) {
+		mock->startuptime = g_get_monotonic_time() - mock->spawntime;
+	}
+
+	g_free(mock->sender);
+	mock->sender = g_strdup(g_dbus_method_invocation_get_sender(invocation));
+	g_free(mock->application);
+	mock->application = g_strdup(arg_application);
+
+	gatt_manager1_complete_register_application(object, invocation);
+
+	if (mock->startuponly == TRUE) {
+		startup_report(mock);
+		driver_finish(mock, (mock->startuptime > 0) ? 0 : 1);
+		return TRUE;
+	}
+
+	g_dbus_connection_call(mock->connection, mock->sender, mock->application, "org.freedesktop.DBus.ObjectManager", "GetManagedObjects", NULL, G_VARIANT_TYPE("(a{oa{sa{sv}}})"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, (GAsyncReadyCallback)(&on_get_managed_objects), mock);
+
+	return TRUE;
+}
+
+static gboolean handle_unregister_application(GattManager1 * object, GDBusMethodInvocation * invocation, gchar const * arg_application, gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+
+	printf("Mock: application %s unregistered\n", arg_application);
+
+	gatt_manager1_complete_unregister_application(object, invocation);
+
+	if (mock->running == TRUE) {
+		printf("Mock: application went away during the run\n");
+		driver_finish(mock, 1);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Find the service's characteristics by UUID, then start the run, acquiring
+ * the sockets first if requested.
+ *
+ * @param connection the bus connection
+ * @param res the result of the operation
+ * @param user_data the mock
+ */
+static void on_get_managed_objects(GDBusConnection * connection, GAsyncResult * res, gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+	GError * error;
+	GVariant * result;
+	GVariantIter * objects;
+	gchar const * path;
+	GVariant * interfaces;
+	GVariant * properties;
+	gchar const * uuid;
+
+	error = NULL;
+
+	result = g_dbus_connection_call_finish(connection, res, &error);
+	report_error(&error, "getting managed objects");
+
+	if ((result == NULL) || (mock->running == TRUE)) {
+		if (result != NULL) {
+			g_variant_unref(result);
+		}
+		return;
+	}
+
+	g_variant_get(result, "(a{oa{sa{sv}}})", &objects);
+	while (g_variant_iter_loop(objects, "{&o@a{sa{sv}}}", &path, &interfaces)) {
+		properties = g_variant_lookup_value(interfaces, GATT_CHARACTERISTIC_INTERFACE, G_VARIANT_TYPE_VARDICT);
+		if (properties != NULL) {
+			if (g_variant_lookup(properties, "UUID", "&s", &uuid)) {
+				if (g_ascii_strcasecmp(uuid, CHARACTERISTIC_UUID_INCOMING) == 0) {
+					g_free(mock->path_incoming);
+					mock->path_incoming = g_strdup(path);
+				}
+				if (g_ascii_strcasecmp(uuid, CHARACTERISTIC_UUID_OUTGOING) == 0) {
+					g_free(mock->path_outgoing);
+					mock->path_outgoing = g_strdup(path);
+				}
+			}
+			g_variant_unref(properties);
+		}
+	}
+	g_variant_iter_free(objects);
+	g_variant_unref(result);
+
+	if ((mock->path_incoming == NULL) || (mock->path_outgoing == NULL)) {
+		printf("Mock: application is missing its characteristics\n");
+		return;
+	}
+
+	printf("Mock: incoming %s, outgoing %s\n", mock->path_incoming, mock->path_outgoing);
+
+	if (mock->acquire == TRUE) {
+		g_dbus_connection_call_with_unix_fd_list(mock->connection, mock->sender, mock->path_incoming, GATT_CHARACTERISTIC_INTERFACE, "AcquireWrite", g_variant_new("(@a{sv})", mock_options(mock)), G_VARIANT_TYPE("(hq)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, (GAsyncReadyCallback)(&on_acquire_write), mock);
+		g_dbus_connection_call_with_unix_fd_list(mock->connection, mock->sender, mock->path_outgoing, GATT_CHARACTERISTIC_INTERFACE, "AcquireNotify", g_variant_new("(@a{sv})", mock_options(mock)), G_VARIANT_TYPE("(hq)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, (GAsyncReadyCallback)(&on_acquire_notify), mock);
+	}
+	else {
+		mock->subscriptionid = g_dbus_connection_signal_subscribe(mock->connection, mock->sender, "org.freedesktop.DBus.Properties", "PropertiesChanged", mock->path_outgoing, GATT_CHARACTERISTIC_INTERFACE, G_DBUS_SIGNAL_FLAGS_NONE, on_properties_changed, mock, NULL);
+		driver_start(mock);
+	}
+}
+
+/**
+ * The options bluetoothd passes with characteristic method calls.
+ *
+ * @param mock the mock
+ * @return a floating a{sv} dictionary
+ */
+static GVariant * mock_options(MockBluez * mock) {
+	GVariantDict dict_options;
+
+	g_variant_dict_init(&dict_options, NULL);
+	g_variant_dict_insert(&dict_options, "device", "o", MOCK_CENTRAL_PATH);
+	if (mock->mtu > 0) {
+		g_variant_dict_insert(&dict_options, "mtu", "q", (guint16)mock->mtu);
+	}
+
+	return g_variant_dict_end(&dict_options);
+}
+
+/**
+ * Get the socket handed over in reply to AcquireWrite or AcquireNotify.
+ *
+ * @param connection the bus connection
+ * @param res the result of the operation
+ * @param mtu returns the MTU the socket was acquired with
+ * @return the socket, or -1 on failure
+ */
+static int acquire_finish(GDBusConnection * connection, GAsyncResult * res, guint16 * mtu) {
+	GError * error;
+	GVariant * result;
+	GUnixFDList * fdlist;
+	gint32 handle;
+	int fd;
+
+	error = NULL;
+	fdlist = NULL;
+	fd = -1;
+
+	result = g_dbus_connection_call_with_unix_fd_list_finish(connection, &fdlist, res, &error);
+	report_error(&error, "acquiring socket");
+
+	if (result != NULL) {
+		g_variant_get(result, "(hq)", &handle, mtu);
+		fd = g_unix_fd_list_get(fdlist, handle, &error);
+		report_error(&error, "getting acquired socket");
+		g_variant_unref(result);
+		g_object_unref(fdlist);
+	}
+
+	return fd;
+}
+
+/**
+ * AcquireWrite callback. Each call has a callback of its own, so that the
+ * sockets can't be mixed up whichever order the replies arrive in.
+ *
+ * @param connection the bus connection
+ * @param res the result of the operation
+ * @param user_data the mock
+ */
+static void on_acquire_write(GDBusConnection * connection, GAsyncResult * res, gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+	guint16 mtu;
+	int fd;
+
+	fd = acquire_finish(connection, res, &mtu);
+	if (fd < 0) {
+		driver_finish(mock, 1);
+	}
+	else {
+		printf("Mock: acquired write socket, MTU %u\n", mtu);
+		mock->fd_write = fd;
+		acquire_done(mock);
+	}
+}
+
+/**
+ * AcquireNotify callback. Notifications are read from the socket as they
+ * arrive.
+ *
+ * @param connection the bus connection
+ * @param res the result of the operation
+ * @param user_data the mock
+ */
+static void on_acquire_notify(GDBusConnection * connection, GAsyncResult * res, gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+	GIOChannel * channel;
+	guint16 mtu;
+	int fd;
+
+	fd = acquire_finish(connection, res, &mtu);
+	if (fd < 0) {
+		driver_finish(mock, 1);
+	}
+	else {
+		printf("Mock: acquired notify socket, MTU %u\n", mtu);
+		mock->fd_notify = fd;
+
+		channel = g_io_channel_unix_new(fd);
+		g_io_channel_set_encoding(channel, NULL, NULL);
+		mock->notifywatchid = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, on_notify_socket, mock);
+		g_io_channel_unref(channel);
+
+		acquire_done(mock);
+	}
+}
+
+/**
+ * Start the run once both sockets have been handed over.
+ *
+ * @param mock the mock
+ */
+static void acquire_done(MockBluez * mock) {
+	if ((mock->fd_write >= 0) && (mock->fd_notify >= 0)) {
+		driver_start(mock);
+	}
+}
+
+/**
+ * Receive a notification sent as a change to the outgoing characteristic's
+ * value.
+ */
+static void on_properties_changed(GDBusConnection * connection, gchar const * sender_name, gchar const * object_path, gchar const * interface_name, gchar const * signal_name, GVariant * parameters, gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+	GVariant * changed;
+	GVariant * value;
+	guchar const * data;
+	gsize length;
+
+	g_variant_get(parameters, "(&s@a{sv}@as)", NULL, &changed, NULL);
+
+	value = g_variant_lookup_value(changed, "Value", G_VARIANT_TYPE_BYTESTRING);
+	if (value != NULL) {
+		data = g_variant_get_fixed_array(value, &length, sizeof(guchar));
+		driver_receive_chunk(mock, data, length);
+		g_variant_unref(value);
+	}
+
+	g_variant_unref(changed);
+}
+
+/**
+ * Receive a notification written to the acquired notify socket.
+ */
+static gboolean on_notify_socket(GIOChannel * channel, GIOCondition condition, gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+	guchar data[512];
+	ssize_t length;
+
+	if (condition & G_IO_IN) {
+		length = recv(g_io_channel_unix_get_fd(channel), data, sizeof(data), MSG_DONTWAIT);
+		if (length > 0) {
+			driver_receive_chunk(mock, data, length);
+			return TRUE;
+		}
+		if ((length < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+			return TRUE;
+		}
+	}
+
+	printf("Mock: notify socket closed\n");
+	mock->notifywatchid = 0;
+	driver_finish(mock, 1);
+
+	return FALSE;
+}
+
+/**
+ * Start sending messages, either one after the other as each response
+ * arrives, or at a fixed rate.
+ *
+ * @param mock the mock
+ */
+static void driver_start(MockBluez * mock) {
+	GBytes * hello;
+	GBytes * encoded;
+	guchar * chunk;
+	gsize size;
+	gsize pos;
+
+	if (mock->running == TRUE) {
+		return;
+	}
+
+	if ((mock->framing2 == TRUE) && (mock->negotiated == FALSE)) {
+		// Ask for version 2 framing, and start once the service agrees
+		if (mock->hellosent == FALSE) {
+			printf("Mock: asking for version 2 framing%s%s\n", mock->compress ? " with compression" : "", (mock->address >= 0) ? " addressed" : "");
+			mock->hellosent = TRUE;
+			if (mock->address >= 0) {
+				hello = framing_hello_address_new(FRAMING_VERSION_2, mock->compress ? FRAMING_CAPABILITY_COMPRESSION : 0, mock->address);
+			}
+			else {
+				hello = framing_hello_new(FRAMING_VERSION_2, mock->compress ? FRAMING_CAPABILITY_COMPRESSION : 0);
+			}
+			size = g_bytes_get_size(hello);
+			chunk = g_malloc(size + 1);
+			chunk[0] = mock->counter++;
+			memcpy(chunk + 1, g_bytes_get_data(hello, NULL), size);
+			g_bytes_unref(hello);
+			driver_write(mock, chunk, size + 1, FALSE, FALSE);
+		}
+		return;
+	}
+
+	printf("Mock: starting run of %u messages of %lu bytes in chunks of %lu\n", mock->messages, mock->messagesize, mock->chunksize);
+
+	mock->message = g_malloc(mock->messagesize);
+	if (mock->compressing == TRUE) {
+		driver_fill_message(mock);
+		encoded = compress_encode(mock->compressor, mock->message, mock->messagesize);
+		mock->wire = g_bytes_unref_to_data(encoded, &mock->wiresize);
+		printf("Mock: messages compressed from %lu to %lu bytes\n", mock->messagesize, mock->wiresize);
+	}
+	else {
+		// Random content, so that consecutive chunks are never identical
+		for (pos = 0; pos < mock->messagesize; pos++) {
+			mock->message[pos] = g_random_int_range(0, 256);
+		}
+		mock->wire = mock->message;
+		mock->wiresize = mock->messagesize;
+	}
+	mock->crc = framing_crc32(mock->wire, mock->wiresize);
+
+	mock->running = TRUE;
+	mock->runstart = g_get_monotonic_time();
+	mock->responsetimeoutid = g_timeout_add(RESPONSE_TIMEOUT, driver_response_timeout, mock);
+
+	if (mock->rate > 0.0) {
+		mock->ratetimeoutid = g_timeout_add((guint)(1000.0 / mock->rate), driver_rate_timeout, mock);
+	}
+
+	driver_next_message(mock);
+}
+
+/**
+ * Fill the message with text shaped like a Pico protocol message: JSON with
+ * base64 values, the kind of content compression is meant for. Keys are
+ * included as they stand, values are random.
+ *
+ * @param mock the mock
+ */
+static void driver_fill_message(MockBluez * mock) {
+	static char const base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static char const * const fields[] = {"{\"sessionId\":0,\"iv\":\"", "\",\"encryptedData\":\"", "\",\"picoEphemeralPublicKey\":\"MFkwEwYHKoZIzj0CAQYIKoZIzj0DAQcDQgAE", "\",\"picoNonce\":\""};
+	gsize pos;
+	gsize field;
+	gsize length;
+	gsize count;
+
+	pos = 0;
+	field = 0;
+	while (pos < mock->messagesize) {
+		length = MIN(strlen(fields[field]), mock->messagesize - pos);
+		memcpy(mock->message + pos, fields[field], length);
+		pos += length;
+		field = (field + 1) % G_N_ELEMENTS(fields);
+
+		for (count = 0; (count < 88) && (pos < mock->messagesize); count++) {
+			mock->message[pos++] = base64[g_random_int_range(0, 64)];
+		}
+	}
+}
+
+/**
+ * Fixed rate timer; queues another message to be sent.
+ */
+static gboolean driver_rate_timeout(gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+
+	if ((mock->sent + mock->pending) >= mock->messages) {
+		mock->ratetimeoutid = 0;
+		return FALSE;
+	}
+
+	driver_next_message(mock);
+
+	return TRUE;
+}
+
+/**
+ * Queue a message to be sent, starting it straight away if nothing else is
+ * being sent.
+ *
+ * @param mock the mock
+ */
+static void driver_next_message(MockBluez * mock) {
+	mock->pending++;
+
+	if (mock->sending == FALSE) {
+		mock->sending = TRUE;
+		mock->sendpos = 0;
+		driver_send_chunk(mock);
+	}
+}
+
+/**
+ * Send the next chunk of the current message, framed the way the phone
+ * frames it: a chunk counter on every chunk, followed on the first chunk by
+ * the four-byte big-endian message length. With version 2 framing each chunk
+ * carries a header from framing_header() instead.
+ *
+ * @param mock the mock
+ */
+static void driver_send_chunk(MockBluez * mock) {
+	guchar * chunk;
+	gsize header;
+	gsize payload;
+	gint64 now;
+
+	chunk = g_malloc(mock->chunksize);
+
+	if (mock->sendpos == 0) {
+		now = g_get_monotonic_time();
+		g_array_append_val(mock->starts, now);
+	}
+
+	if (mock->framing2 == TRUE) {
+		header = framing_header(chunk, mock->msgid, mock->sendpos, mock->wiresize, mock->crc);
+	}
+	else {
+		chunk[0] = mock->counter++;
+		header = 1;
+
+		if (mock->sendpos == 0) {
+			chunk[1] = (mock->wiresize >> 24) & 0xff;
+			chunk[2] = (mock->wiresize >> 16) & 0xff;
+			chunk[3] = (mock->wiresize >> 8) & 0xff;
+			chunk[4] = (mock->wiresize >> 0) & 0xff;
+			header = 5;
+		}
+	}
+
+	payload = MIN(mock->chunksize - header, mock->wiresize - mock->sendpos);
+	memcpy(chunk + header, mock->wire + mock->sendpos, payload);
+	mock->sendpos += payload;
+
+	driver_write(mock, chunk, header + payload, TRUE, mock->framing2);
+}
+
+/**
+ * Write a chunk to the service, over the write socket if it's been acquired
+ * or with WriteValue otherwise.
+ *
+ * @param mock the mock
+ * @param chunk the chunk, which is freed once written
+ * @param length the number of bytes in the chunk
+ * @param next TRUE to carry on with the current message once it's written
+ * @param droppable TRUE if the chunk can be dropped to simulate lost packets
+ */
+static void driver_write(MockBluez * mock, guchar * chunk, gsize length, gboolean next, gboolean droppable) {
+	ssize_t written;
+
+	if ((droppable == TRUE) && (mock->drop > 0.0) && (g_random_double_range(0.0, 100.0) < mock->drop)) {
+		mock->dropped++;
+		g_free(chunk);
+		if (next == TRUE) {
+			g_idle_add(driver_send_chunk_idle, mock);
+		}
+	}
+	else if (mock->fd_write >= 0) {
+		written = send(mock->fd_write, chunk, length, MSG_NOSIGNAL);
+		g_free(chunk);
+		if (written < 0) {
+			printf("Mock: error writing chunk: %s\n", strerror(errno));
+			driver_finish(mock, 1);
+		}
+		else if (next == TRUE) {
+			g_idle_add(driver_send_chunk_idle, mock);
+		}
+	}
+	else {
+		g_dbus_connection_call(mock->connection, mock->sender, mock->path_incoming, GATT_CHARACTERISTIC_INTERFACE, "WriteValue", g_variant_new("(@ay@a{sv})", g_variant_new_from_data(G_VARIANT_TYPE_BYTESTRING, chunk, length, TRUE, g_free, chunk), mock_options(mock)), NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, (GAsyncReadyCallback)(next ? &on_write_value : &on_write_control), mock);
+	}
+}
+
+/**
+ * Write a control chunk, such as an ACK or NACK, to the service.
+ *
+ * @param mock the mock
+ * @param bytes the chunk, which is taken ownership of
+ */
+static void driver_write_bytes(MockBluez * mock, GBytes * bytes) {
+	guchar * chunk;
+	gsize length;
+
+	chunk = g_bytes_unref_to_data(bytes, &length);
+	driver_write(mock, chunk, length, FALSE, FALSE);
+}
+
+/**
+ * Idle callback to carry on sending over the write socket, giving the main
+ * loop a chance to process notifications between chunks.
+ */
+static gboolean driver_send_chunk_idle(gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+
+	on_write_value(NULL, NULL, mock);
+
+	return FALSE;
+}
+
+/**
+ * WriteValue callback. Sends the next chunk, or the next message if there's
+ * one waiting.
+ */
+static void on_write_value(GDBusConnection * connection, GAsyncResult * res, gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+	GError * error;
+	GVariant * result;
+
+	if (res != NULL) {
+		error = NULL;
+		result = g_dbus_connection_call_finish(connection, res, &error);
+		if (result == NULL) {
+			report_error(&error, "writing value");
+			driver_finish(mock, 1);
+			return;
+		}
+		g_variant_unref(result);
+	}
+
+	if (mock->running == FALSE) {
+		return;
+	}
+
+	if (mock->sendpos < mock->wiresize) {
+		driver_send_chunk(mock);
+	}
+	else if (mock->framing2 == TRUE) {
+		// The next message waits until the service acknowledges this one
+		mock->awaitingack = TRUE;
+		mock->acktimeoutid = g_timeout_add(ACK_TIMEOUT, driver_ack_timeout, mock);
+	}
+	else {
+		driver_message_sent(mock);
+	}
+}
+
+/**
+ * WriteValue callback for chunks sent outside the current message.
+ */
+static void on_write_control(GDBusConnection * connection, GAsyncResult * res, gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+	GError * error;
+	GVariant * result;
+
+	error = NULL;
+	result = g_dbus_connection_call_finish(connection, res, &error);
+	if (result == NULL) {
+		report_error(&error, "writing value");
+		driver_finish(mock, 1);
+		return;
+	}
+	g_variant_unref(result);
+}
+
+/**
+ * The current message has gone; move on to the next one if there's one
+ * waiting.
+ *
+ * @param mock the mock
+ */
+static void driver_message_sent(MockBluez * mock) {
+	mock->sent++;
+	mock->pending--;
+	mock->sendpos = 0;
+	mock->msgid++;
+
+	if ((mock->pending > 0) && (mock->sent < mock->messages)) {
+		driver_send_chunk(mock);
+	}
+	else {
+		mock->sending = FALSE;
+	}
+}
+
+/**
+ * Send part of the current message again, as asked for by the service.
+ *
+ * @param mock the mock
+ * @param offset the start of the part to send
+ * @param length the length of the part, or zero for the rest of the message
+ */
+static void driver_resend(MockBluez * mock, gsize offset, gsize length) {
+	guchar * chunk;
+	gsize end;
+	gsize header;
+	gsize payload;
+
+	end = ((length == 0) || (offset + length > mock->wiresize)) ? mock->wiresize : (offset + length);
+
+	do {
+		chunk = g_malloc(mock->chunksize);
+		header = framing_header(chunk, mock->msgid, offset, mock->wiresize, mock->crc);
+		payload = MIN(mock->chunksize - header, end - offset);
+		memcpy(chunk + header, mock->wire + offset, payload);
+		offset += payload;
+
+		mock->resent++;
+		driver_write(mock, chunk, header + payload, FALSE, TRUE);
+	} while (offset < end);
+}
+
+/**
+ * Version 2 acknowledgement timer; sends the last chunk again so that the
+ * service either acknowledges the message or says what's missing.
+ */
+static gboolean driver_ack_timeout(gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+	gsize payload;
+
+	payload = mock->chunksize - FRAMING_HEADER;
+	driver_resend(mock, (mock->wiresize > payload) ? (mock->wiresize - payload) : 0, 0);
+
+	return TRUE;
+}
+
+/**
+ * Process a chunk of a response. The first chunk of each response starts
+ * with the four-byte big-endian length of the message. Once the service has
+ * agreed to address us, chunks without our address are for other centrals.
+ *
+ * @param mock the mock
+ * @param data the chunk
+ * @param length the length of the chunk
+ */
+static void driver_receive_chunk(MockBluez * mock, guchar const * data, gsize length) {
+	gsize total;
+
+	if ((mock->framing2 == TRUE) && (mock->negotiated == FALSE) && (mock->address >= 0) && (length > FRAMING_ADDRESS_SIZE) && (data[0] == mock->address) && (framing_hello_version(data + FRAMING_ADDRESS_SIZE, length - FRAMING_ADDRESS_SIZE) == FRAMING_VERSION_2)) {
+		// The service agreed, since its reply carries our address
+		mock->addressed = TRUE;
+	}
+	else if ((mock->addressed == TRUE) && ((length < FRAMING_ADDRESS_SIZE) || (data[0] != mock->address))) {
+		// It's for another central
+		return;
+	}
+
+	if (mock->addressed == TRUE) {
+		data += FRAMING_ADDRESS_SIZE;
+		length -= FRAMING_ADDRESS_SIZE;
+	}
+
+	if ((mock->framing2 == TRUE) && (mock->negotiated == FALSE) && (framing_hello_version(data, length) == FRAMING_VERSION_2)) {
+		mock->compressing = mock->compress && (framing_hello_capabilities(data, length) & FRAMING_CAPABILITY_COMPRESSION);
+		printf("Mock: using version 2 framing%s%s\n", mock->compressing ? " with compression" : "", mock->addressed ? " addressed" : "");
+		mock->negotiated = TRUE;
+		driver_start(mock);
+		return;
+	}
+
+	if ((mock->running == FALSE) || (length == 0)) {
+		return;
+	}
+
+	if (mock->framing2 == TRUE) {
+		driver_receive_framed(mock, data, length);
+		return;
+	}
+
+	if (mock->recvremaining == 0) {
+		if (length < 4) {
+			printf("Mock: response chunk too short\n");
+			return;
+		}
+		total = ((gsize)data[0] << 24) | ((gsize)data[1] << 16) | ((gsize)data[2] << 8) | ((gsize)data[3] << 0);
+		mock->recvremaining = total + 4;
+	}
+
+	mock->recvremaining -= MIN(length, mock->recvremaining);
+
+	if (mock->recvremaining == 0) {
+		driver_response(mock);
+	}
+}
+
+/**
+ * Process a version 2 chunk from the service: part of a response, which is
+ * acknowledged once it's complete, or an ACK or NACK for our own message.
+ *
+ * @param mock the mock
+ * @param data the chunk
+ * @param length the length of the chunk
+ */
+static void driver_receive_framed(MockBluez * mock, guchar const * data, gsize length) {
+	GArray * ranges;
+	FramingRange * range;
+	GBytes * nack;
+	GBytes * decoded;
+	guchar const * message;
+	gsize messagesize;
+	guint8 msgid;
+	guint index;
+
+	switch (framing_kind(data, length)) {
+		case FRAMING_KIND_DATA:
+			switch (framing_receive_data(mock->framingreceive, data, length)) {
+				case FRAMINGRX_COMPLETE:
+					driver_write_bytes(mock, framing_ack_new(framing_receive_msgid(mock->framingreceive)));
+					if (mock->compressing == TRUE) {
+						// Decoding is part of the round trip being timed
+						message = framing_receive_message(mock->framingreceive, &messagesize);
+						decoded = compress_decode(mock->compressor, message, messagesize);
+						if ((decoded == NULL) || (g_bytes_get_size(decoded) != mock->messagesize)) {
+							mock->undecodable++;
+						}
+						if (decoded != NULL) {
+							g_bytes_unref(decoded);
+						}
+					}
+					driver_response(mock);
+					break;
+				case FRAMINGRX_DUPLICATE:
+					driver_write_bytes(mock, framing_ack_new(framing_receive_msgid(mock->framingreceive)));
+					break;
+				case FRAMINGRX_MISSING:
+					nack = framing_receive_nack(mock->framingreceive, mock->chunksize);
+					if (nack != NULL) {
+						driver_write_bytes(mock, nack);
+					}
+					break;
+				default:
+					break;
+			}
+			break;
+		case FRAMING_KIND_ACK:
+			if ((framing_ack_parse(data, length, &msgid) == TRUE) && (mock->awaitingack == TRUE) && (msgid == mock->msgid)) {
+				mock->awaitingack = FALSE;
+				g_source_remove(mock->acktimeoutid);
+				mock->acktimeoutid = 0;
+				driver_message_sent(mock);
+			}
+			break;
+		case FRAMING_KIND_NACK:
+			ranges = g_array_new(FALSE, FALSE, sizeof(FramingRange));
+			if ((framing_nack_parse(data, length, &msgid, ranges) == TRUE) && (msgid == mock->msgid)) {
+				for (index = 0; index < ranges->len; index++) {
+					range = &g_array_index(ranges, FramingRange, index);
+					driver_resend(mock, range->offset, range->length);
+				}
+			}
+			g_array_unref(ranges);
+			break;
+		default:
+			printf("Mock: unknown chunk kind\n");
+			break;
+	}
+}
+
+/**
+ * A whole response has arrived; record its latency and send the next message
+ * if we're sending them one after the other.
+ *
+ * @param mock the mock
+ */
+static void driver_response(MockBluez * mock) {
+	gint64 latency;
+
+	if (mock->startshead < mock->starts->len) {
+		latency = g_get_monotonic_time() - g_array_index(mock->starts, gint64, mock->startshead);
+		mock->startshead++;
+		g_array_append_val(mock->latencies, latency);
+	}
+	mock->received++;
+
+	// Reset the timeout since we're still making progress
+	g_source_remove(mock->responsetimeoutid);
+	mock->responsetimeoutid = g_timeout_add(RESPONSE_TIMEOUT, driver_response_timeout, mock);
+
+	if (mock->received >= mock->messages) {
+		driver_finish(mock, 0);
+	}
+	else if (mock->rate <= 0.0) {
+		driver_next_message(mock);
+	}
+}
+
+static gboolean driver_response_timeout(gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+
+	printf("Mock: timed out waiting for a response\n");
+
+	mock->responsetimeoutid = 0;
+	driver_finish(mock, 1);
+
+	return FALSE;
+}
+
+/**
+ * Print how long the service took to start and how much memory it's using.
+ *
+ * @param mock the mock
+ */
+static void startup_report(MockBluez * mock) {
+	gdouble startup;
+	guint rss;
+	guint peak;
+
+	startup = mock->startuptime / 1000.0;
+	rss = service_memory(mock, "VmRSS:");
+	peak = service_memory(mock, "VmHWM:");
+
+	printf("\n");
+	printf("Build:        %s\n", mock->label);
+	printf("Start-up:     %.3f ms to register the application\n", startup);
+	printf("Memory:       %u kB resident, %u kB peak\n", rss, peak);
+	printf("RESULT label=%s startup_ms=%.3f rss_kb=%u peak_rss_kb=%u\n", mock->label, startup, rss, peak);
+}
+
+/**
+ * Read a memory figure for the service from /proc.
+ *
+ * @param mock the mock
+ * @param field the field to read from the status file, such as "VmRSS:"
+ * @return the figure in kB, or zero if it couldn't be read
+ */
+static guint service_memory(MockBluez * mock, char const * field) {
+	gchar * filename;
+	gchar * contents;
+	gchar * line;
+	guint value;
+
+	value = 0;
+	if (mock->servicepid > 0) {
+		filename = g_strdup_printf("/proc/%d/status", mock->servicepid);
+		if (g_file_get_contents(filename, &contents, NULL, NULL) == TRUE) {
+			line = strstr(contents, field);
+			if (line != NULL) {
+				value = (guint)g_ascii_strtoull(line + strlen(field), NULL, 10);
+			}
+			g_free(contents);
+		}
+		g_free(filename);
+	}
+
+	return value;
+}
+
+static gint compare_latency(gconstpointer a, gconstpointer b) {
+	gint64 first = *(gint64 const *)a;
+	gint64 second = *(gint64 const *)b;
+
+	return (first > second) - (first < second);
+}
+
+/**
+ * Pick a percentile from a sorted array of latencies, in milliseconds.
+ */
+static gdouble percentile(GArray * sorted, gdouble fraction) {
+	guint index;
+
+	if (sorted->len == 0) {
+		return 0.0;
+	}
+
+	index = (guint)(fraction * (sorted->len - 1) + 0.5);
+
+	return g_array_index(sorted, gint64, index) / 1000.0;
+}
+
+/**
+ * End the run, print the results and leave the main loop.
+ *
+ * @param mock the mock
+ * @param result the exit code to return
+ */
+static void driver_finish(MockBluez * mock, gint result) {
+	gdouble seconds;
+
+	if (mock->running == FALSE) {
+		mock->result = result;
+		g_main_loop_quit(mock->loop);
+		return;
+	}
+
+	mock->running = FALSE;
+	mock->runend = g_get_monotonic_time();
+	mock->result = result;
+
+	if (mock->ratetimeoutid != 0) {
+		g_source_remove(mock->ratetimeoutid);
+		mock->ratetimeoutid = 0;
+	}
+	if (mock->responsetimeoutid != 0) {
+		g_source_remove(mock->responsetimeoutid);
+		mock->responsetimeoutid = 0;
+	}
+	if (mock->acktimeoutid != 0) {
+		g_source_remove(mock->acktimeoutid);
+		mock->acktimeoutid = 0;
+	}
+
+	seconds = (mock->runend - mock->runstart) / (gdouble)G_USEC_PER_SEC;
+	g_array_sort(mock->latencies, compare_latency);
+
+	printf("\n");
+	printf("Build:        %s\n", mock->label);
+	printf("Transport:    %s\n", mock->acquire ? "acquired sockets" : "D-Bus");
+	printf("Framing:      version %d\n", mock->framing2 ? FRAMING_VERSION_2 : FRAMING_VERSION_1);
+	if (mock->framing2 == TRUE) {
+		printf("Dropped:      %u chunks, %u chunks resent\n", mock->dropped, mock->resent);
+	}
+	if (mock->compressing == TRUE) {
+		printf("Compression:  %lu bytes sent as %lu, %u responses undecodable\n", mock->messagesize, mock->wiresize, mock->undecodable);
+	}
+	printf("Messages:     %u of %u in %.3f s\n", mock->received, mock->messages, seconds);
+	printf("Messages/s:   %.1f\n", (seconds > 0.0) ? mock->received / seconds : 0.0);
+	printf("Bytes/s:      %.0f\n", (seconds > 0.0) ? (mock->received * mock->messagesize) / seconds : 0.0);
+	printf("Latency p50:  %.3f ms\n", percentile(mock->latencies, 0.50));
+	printf("Latency p99:  %.3f ms\n", percentile(mock->latencies, 0.99));
+	printf("RESULT label=%s transport=%s framing=%d compress=%d wire=%lu drop=%.1f dropped=%u resent=%u chunk=%lu message=%lu messages=%u seconds=%.3f msgs_per_s=%.1f bytes_per_s=%.0f p50_ms=%.3f p99_ms=%.3f\n", mock->label, mock->acquire ? "socket" : "dbus", mock->framing2 ? FRAMING_VERSION_2 : FRAMING_VERSION_1, mock->compressing ? 1 : 0, mock->wiresize, mock->drop, mock->dropped, mock->resent, mock->chunksize, mock->messagesize, mock->received, seconds, (seconds > 0.0) ? mock->received / seconds : 0.0, (seconds > 0.0) ? (mock->received * mock->messagesize) / seconds : 0.0, percentile(mock->latencies, 0.50), percentile(mock->latencies, 0.99));
+
+	g_main_loop_quit(mock->loop);
+}
+
+static void on_name_acquired(GDBusConnection * connection, gchar const * name, gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+	GError * error;
+	gchar ** envp;
+	GPtrArray * argv;
+	guint pos;
+
+	printf("Mock: acquired %s\n", name);
+
+	if (mock->servicepid == 0) {
+		return;
+	}
+
+	// The service connects to the system bus, so point that at our bus
+	error = NULL;
+	envp = g_get_environ();
+	envp = g_environ_setenv(envp, "DBUS_SYSTEM_BUS_ADDRESS", g_test_dbus_get_bus_address(mock->bus), TRUE);
+	argv = g_ptr_array_new();
+	g_ptr_array_add(argv, (gpointer)(g_getenv("MOCK_BLUEZ_SERVICE") ? g_getenv("MOCK_BLUEZ_SERVICE") : DEFAULT_SERVICE));
+	for (pos = 0; (mock->serviceoptions != NULL) && (mock->serviceoptions[pos] != NULL); pos++) {
+		g_ptr_array_add(argv, mock->serviceoptions[pos]);
+	}
+	g_ptr_array_add(argv, NULL);
+
+	mock->spawntime = g_get_monotonic_time();
+	if (g_spawn_async(NULL, (gchar **)argv->pdata, envp, G_SPAWN_DEFAULT, NULL, NULL, &mock->servicepid, &error) == FALSE) {
+		report_error(&error, "starting service");
+		mock->servicepid = 0;
+		driver_finish(mock, 1);
+	}
+	else {
+		printf("Mock: started %s\n", (gchar *)argv->pdata[0]);
+	}
+
+	g_ptr_array_free(argv, TRUE);
+	g_strfreev(envp);
+}
+
+static void on_name_lost(GDBusConnection * connection, gchar const * name, gpointer user_data) {
+	MockBluez * mock = (MockBluez *)user_data;
+
+	printf("Mock: failed to own %s\n", name);
+	driver_finish(mock, 1);
+}
+
+/**
+ * Main; the entry point of the mock and benchmark driver.
+ *
+ * @param argc the number of arguments passed in
+ * @param argv array of arguments passed in
+ * @return zero if the run completed, non-zero o/w
+ */
+gint main(gint argc, gchar * argv[]) {
+	MockBluez * mock;
+	GError * error;
+	GOptionContext * context;
+	ObjectSkeleton * object;
+	gint chunksize;
+	gint messagesize;
+	gint messages;
+	gint mtu;
+	gboolean nospawn;
+	gchar * label;
+	gint result;
+
+	chunksize = DEFAULT_CHUNK_SIZE;
+	messagesize = DEFAULT_MESSAGE_SIZE;
+	messages = DEFAULT_MESSAGES;
+	mtu = 0;
+	nospawn = FALSE;
+	label = NULL;
+
+	mock = g_new0(MockBluez, 1);
+	mock->rate = 0.0;
+	mock->acquire = FALSE;
+	mock->framing2 = FALSE;
+	mock->drop = 0.0;
+	mock->compress = FALSE;
+	mock->address = -1;
+
+	GOptionEntry entries[] = {
+		{"chunk-size", 'c', 0, G_OPTION_ARG_INT, &chunksize, "Size of each WriteValue chunk, including its header", "BYTES"},
+		{"message-size", 's', 0, G_OPTION_ARG_INT, &messagesize, "Size of each message", "BYTES"},
+		{"messages", 'n', 0, G_OPTION_ARG_INT, &messages, "Number of messages to send", "N"},
+		{"rate", 'r', 0, G_OPTION_ARG_DOUBLE, &mock->rate, "Messages per second to send, or 0 to send each once the last has returned", "N"},
+		{"mtu", 'm', 0, G_OPTION_ARG_INT, &mtu, "MTU to pass in the method options", "BYTES"},
+		{"acquire", 'a', 0, G_OPTION_ARG_NONE, &mock->acquire, "Use AcquireWrite/AcquireNotify sockets rather than D-Bus", NULL},
+		{"framing2", '2', 0, G_OPTION_ARG_NONE, &mock->framing2, "Ask for version 2 framing, with acknowledgements and resending of lost chunks", NULL},
+		{"drop", 'd', 0, G_OPTION_ARG_DOUBLE, &mock->drop, "Percentage of version 2 data chunks to drop, to simulate packet loss", "PERCENT"},
+		{"compress", 'z', 0, G_OPTION_ARG_NONE, &mock->compress, "Ask for compression, which implies version 2 framing, and send Pico-like text messages", NULL},
+		{"address", 0, 0, G_OPTION_ARG_INT, &mock->address, "Ask to be addressed by this address, from 0 to 255, which implies version 2 framing", "N"},
+		{"no-spawn", 0, 0, G_OPTION_ARG_NONE, &nospawn, "Don't start the service; wait for one to connect to the printed bus address", NULL},
+		{"label", 'l', 0, G_OPTION_ARG_STRING, &label, "Label for the build being measured", "NAME"},
+		{"startup", 0, 0, G_OPTION_ARG_NONE, &mock->startuponly, "Only measure how long the service takes to start, and its memory use", NULL},
+		{"service-option", 'o', 0, G_OPTION_ARG_STRING_ARRAY, &mock->serviceoptions, "Option to pass to the service, such as --send-window=8; may be repeated", "OPTION"},
+		{NULL}
+	};
+
+	error = NULL;
+	context = g_option_context_new("- mock BlueZ data path benchmark");
+	g_option_context_set_summary(context, "Runs a stand-in for bluetoothd on a private bus, starts the service under test\n(" DEFAULT_SERVICE ", or $MOCK_BLUEZ_SERVICE) against it and measures the round trip of echoed messages.");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (g_option_context_parse(context, &argc, &argv, &error) == FALSE) {
+		report_error(&error, "parsing options");
+		return 1;
+	}
+	g_option_context_free(context);
+
+	if ((chunksize < 6) || (chunksize > 512) || (messagesize < 1) || (messages < 1)) {
+		printf("Chunk size must be 6 to 512 bytes, and there must be at least one message\n");
+		return 1;
+	}
+
+	if (mock->address > 255) {
+		printf("Address must be from 0 to 255\n");
+		return 1;
+	}
+
+	if ((mock->compress == TRUE) || (mock->address >= 0)) {
+		mock->framing2 = TRUE;
+	}
+
+	if ((mock->framing2 == TRUE) && (chunksize <= FRAMING_HEADER_FIRST)) {
+		printf("Chunk size must be more than %d bytes with version 2 framing\n", FRAMING_HEADER_FIRST);
+		return 1;
+	}
+
+	mock->chunksize = chunksize;
+	mock->messagesize = messagesize;
+	mock->messages = messages;
+	mock->mtu = mtu;
+	mock->label = label ? label : "unlabelled";
+	mock->fd_write = -1;
+	mock->fd_notify = -1;
+	mock->servicepid = nospawn ? 0 : -1;
+	mock->starts = g_array_new(FALSE, FALSE, sizeof(gint64));
+	mock->latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+	mock->framingreceive = framing_receive_new();
+	mock->compressor = compress_new();
+	mock->loop = g_main_loop_new(NULL, FALSE);
+
+	// Start a private bus to stand in for the system bus
+	mock->bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+	g_test_dbus_up(mock->bus);
+	printf("Mock: bus address %s\n", g_test_dbus_get_bus_address(mock->bus));
+
+	mock->connection = g_dbus_connection_new_for_address_sync(g_test_dbus_get_bus_address(mock->bus), G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, NULL, NULL, &error);
+	report_error(&error, "connecting to bus");
+	if (mock->connection == NULL) {
+		g_test_dbus_down(mock->bus);
+		return 1;
+	}
+
+	// Export an adapter with its managers
+	mock->adapter = adapter1_skeleton_new();
+	adapter1_set_address(mock->adapter, "00:00:00:00:00:00");
+	adapter1_set_name(mock->adapter, "mock");
+	adapter1_set_powered(mock->adapter, TRUE);
+
+	mock->leadvertisingmanager = leadvertising_manager1_skeleton_new();
+	g_signal_connect(mock->leadvertisingmanager, "handle-register-advertisement", G_CALLBACK(&handle_register_advertisement), mock);
+	g_signal_connect(mock->leadvertisingmanager, "handle-unregister-advertisement", G_CALLBACK(&handle_unregister_advertisement), mock);
+
+	mock->gattmanager = gatt_manager1_skeleton_new();
+	g_signal_connect(mock->gattmanager, "handle-register-application", G_CALLBACK(&handle_register_application), mock);
+	g_signal_connect(mock->gattmanager, "handle-unregister-application", G_CALLBACK(&handle_unregister_application), mock);
+
+	object = object_skeleton_new(BLUEZ_DEVICE_PATH);
+	object_skeleton_set_adapter1(object, mock->adapter);
+	object_skeleton_set_leadvertising_manager1(object, mock->leadvertisingmanager);
+	object_skeleton_set_gatt_manager1(object, mock->gattmanager);
+
+	mock->object_manager = g_dbus_object_manager_server_new(BLUEZ_ROOT_PATH);
+	g_dbus_object_manager_server_export(mock->object_manager, G_DBUS_OBJECT_SKELETON(object));
+	g_dbus_object_manager_server_set_connection(mock->object_manager, mock->connection);
+	g_object_unref(object);
+
+	mock->nameid = g_bus_own_name_on_connection(mock->connection, BLUEZ_SERVICE_NAME, G_BUS_NAME_OWNER_FLAGS_NONE, on_name_acquired, on_name_lost, mock, NULL);
+
+	g_main_loop_run(mock->loop);
+
+	result = mock->result;
+
+	if (mock->servicepid > 0) {
+		kill(mock->servicepid, SIGTERM);
+		g_spawn_close_pid(mock->servicepid);
+	}
+
+	if (mock->subscriptionid != 0) {
+		g_dbus_connection_signal_unsubscribe(mock->connection, mock->subscriptionid);
+	}
+	if (mock->notifywatchid != 0) {
+		g_source_remove(mock->notifywatchid);
+	}
+	if (mock->fd_write >= 0) {
+		close(mock->fd_write);
+	}
+	if (mock->fd_notify >= 0) {
+		close(mock->fd_notify);
+	}
+
+	g_bus_unown_name(mock->nameid);
+	g_object_unref(mock->object_manager);
+	g_object_unref(mock->adapter);
+	g_object_unref(mock->leadvertisingmanager);
+	g_object_unref(mock->gattmanager);
+	g_object_unref(mock->connection);
+	g_test_dbus_down(mock->bus);
+	g_object_unref(mock->bus);
+	g_main_loop_unref(mock->loop);
+
+	g_array_unref(mock->starts);
+	g_array_unref(mock->latencies);
+	framing_receive_delete(mock->framingreceive);
+	compress_delete(mock->compressor);
+	if (mock->wire != mock->message) {
+		g_free(mock->wire);
+	}
+	g_free(mock->message);
+	g_free(mock->sender);
+	g_free(mock->application);
+	g_free(mock->path_incoming);
+	g_free(mock->path_outgoing);
+	g_free(label);
+	g_strfreev(mock->serviceoptions);
+	g_free(mock);
+
+	return result;
+}
+
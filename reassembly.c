@@ -0,0 +1,73 @@
+#include <stdio.h>
+
+#include "reassembly.h"
+#include "asynclog.h"
+
+/**
+ * Add a received chunk to the message being reassembled. The header is
+ * checked in place and the payload copied straight into the reassembly
+ * buffer, which is sized up front from the length prefix in the first
+ * chunk. This is the only copy the payload undergoes.
+ *
+ * @param buffer the reassembly buffer
+ * @param remaining the number of bytes still expected; zero if the next
+ *        chunk starts a new message
+ * @param data the chunk as received, including its header
+ * @param length the number of bytes in the chunk
+ * @return REASSEMBLY_COMPLETE if the message is now complete,
+ *         REASSEMBLY_PARTIAL if more chunks are expected, REASSEMBLY_ERROR if
+ *         the chunk was malformed and has been discarded
+ */
+REASSEMBLY reassembly_append(Buffer * buffer, size_t * remaining, guchar const * data, gsize length) {
+	size_t payload;
+
+	if (*remaining == 0) {
+		if (length < REASSEMBLY_HEADER_FIRST) {
+			ASYNCLOG(LOG_ERR, "Error, first chunk too short for header (%lu bytes)\n", length);
+			return REASSEMBLY_ERROR;
+		}
+
+		// We can read off the length
+		*remaining = 0;
+		*remaining |= ((size_t)data[1]) << 24;
+		*remaining |= ((size_t)data[2]) << 16;
+		*remaining |= ((size_t)data[3]) << 8;
+		*remaining |= ((size_t)data[4]) << 0;
+
+		if (*remaining > REASSEMBLY_MAX_LENGTH) {
+			ASYNCLOG(LOG_ERR, "Error, message too long (%lu bytes)\n", *remaining);
+			*remaining = 0;
+			return REASSEMBLY_ERROR;
+		}
+
+		payload = length - REASSEMBLY_HEADER_FIRST;
+		if (payload > *remaining) {
+			ASYNCLOG(LOG_ERR, "Error, received too many bytes (%lu out of %lu)\n", payload, *remaining);
+			*remaining = 0;
+			return REASSEMBLY_ERROR;
+		}
+
+		buffer_clear(buffer);
+		buffer_set_min_size(buffer, *remaining);
+		buffer_append(buffer, data + REASSEMBLY_HEADER_FIRST, payload);
+	}
+	else {
+		if (length < REASSEMBLY_HEADER) {
+			ASYNCLOG(LOG_ERR, "Error, empty chunk\n");
+			return REASSEMBLY_ERROR;
+		}
+
+		payload = length - REASSEMBLY_HEADER;
+		if (payload > *remaining) {
+			ASYNCLOG(LOG_ERR, "Error, received too many bytes (%lu out of %lu)\n", payload, *remaining);
+			return REASSEMBLY_ERROR;
+		}
+
+		buffer_append(buffer, data + REASSEMBLY_HEADER, payload);
+	}
+
+	*remaining -= payload;
+
+	return (*remaining == 0) ? REASSEMBLY_COMPLETE : REASSEMBLY_PARTIAL;
+}
+
@@ -0,0 +1,36 @@
+#ifndef __REASSEMBLY_H
+#define __REASSEMBLY_H
+
+#include <glib.h>
+
+#include "pico/buffer.h"
+
+#include "framing.h"
+
+// Defines
+
+// Chunk counter byte plus the four-byte big-endian message length
+#define REASSEMBLY_HEADER_FIRST (5)
+// Chunk counter byte only
+#define REASSEMBLY_HEADER (1)
+// Messages longer than this are rejected before anything is allocated for
+// them, the same limit as for version 2 framing
+#define REASSEMBLY_MAX_LENGTH (FRAMING_MAX_LENGTH)
+
+// Structure definitions
+
+typedef enum _REASSEMBLY {
+	REASSEMBLY_INVALID = -1,
+
+	REASSEMBLY_PARTIAL,
+	REASSEMBLY_COMPLETE,
+	REASSEMBLY_ERROR,
+
+	REASSEMBLY_NUM
+} REASSEMBLY;
+
+// Function prototypes
+
+REASSEMBLY reassembly_append(Buffer * buffer, size_t * remaining, guchar const * data, gsize length);
+
+#endif
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Run bench-throughput over a grid of chunk sizes, cycle intervals and send
+# windows, and print the throughput and latency of each combination followed
+# by the frontier: the combinations that no other beats on both throughput
+# and p99 latency.
+#
+# Set CHUNKS, CYCLES, WINDOWS or MESSAGES to change the grid; any arguments
+# are passed on to each bench-throughput run, e.g. ./sweep.sh --framing2
+
+CHUNKS=${CHUNKS:-"64 128 182 244"}
+CYCLES=${CYCLES:-"2000 10000"}
+WINDOWS=${WINDOWS:-"1 2 4 8"}
+MESSAGES=${MESSAGES:-100}
+BENCH=${BENCH:-./bench-throughput}
+
+RESULTS=$(mktemp)
+trap 'rm -f "$RESULTS"' EXIT
+
+for chunk in $CHUNKS; do
+	for cycle in $CYCLES; do
+		for window in $WINDOWS; do
+			# The MTU makes the service notify in chunks of the same size
+			line=$("$BENCH" --label "sweep" --chunk-size "$chunk" --mtu $((chunk + 3)) --messages "$MESSAGES" \
+				--service-option="--cycle-interval=$cycle" --service-option="--send-window=$window" "$@" 2>/dev/null | grep '^RESULT ')
+			if [ -z "$line" ]; then
+				echo "chunk=$chunk cycle=$cycle window=$window failed" >&2
+				continue
+			fi
+			echo "$chunk $cycle $window $line" >> "$RESULTS"
+		done
+	done
+done
+
+awk '
+function field(name,    i, kv) {
+	for (i = 5; i <= NF; i++) {
+		split($i, kv, "=")
+		if (kv[1] == name) {
+			return kv[2]
+		}
+	}
+	return ""
+}
+{
+	n++
+	chunk[n] = $1; cycle[n] = $2; window[n] = $3
+	rate[n] = field("bytes_per_s") + 0
+	msgs[n] = field("msgs_per_s") + 0
+	p50[n] = field("p50_ms") + 0
+	p99[n] = field("p99_ms") + 0
+}
+END {
+	printf "%6s %7s %6s %10s %12s %9s %9s\n", "chunk", "cycle", "window", "msgs/s", "bytes/s", "p50 ms", "p99 ms"
+	for (i = 1; i <= n; i++) {
+		printf "%6d %7d %6d %10.1f %12.0f %9.3f %9.3f\n", chunk[i], cycle[i], window[i], msgs[i], rate[i], p50[i], p99[i]
+	}
+
+	print ""
+	print "Frontier (highest throughput for its p99 latency):"
+	for (i = 1; i <= n; i++) {
+		dominated = 0
+		for (j = 1; j <= n; j++) {
+			if ((j != i) && (rate[j] >= rate[i]) && (p99[j] <= p99[i]) && ((rate[j] > rate[i]) || (p99[j] < p99[i]))) {
+				dominated = 1
+				break
+			}
+		}
+		if (!dominated) {
+			printf "FRONTIER chunk=%d cycle=%d window=%d bytes_per_s=%.0f p99_ms=%.3f\n", chunk[i], cycle[i], window[i], rate[i], p99[i]
+		}
+	}
+}' "$RESULTS"
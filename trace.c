@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "trace.h"
+
+// Defines
+
+#if (TRACE_EVENTS & (TRACE_EVENTS - 1))
+#error "The number of trace events must be a power of two"
+#endif
+
+// Structure definitions
+
+/**
+ * The kinds of event, using the phase letters of the Chrome trace-event
+ * format: a span with a duration, a single point in time, and the name of a
+ * session's track.
+ */
+typedef enum _TRACEPHASE {
+	TRACEPHASE_INVALID = -1,
+
+	TRACEPHASE_SPAN,
+	TRACEPHASE_INSTANT,
+	TRACEPHASE_SESSION,
+
+	TRACEPHASE_NUM
+} TRACEPHASE;
+
+/**
+ * A slot in the ring buffer. Names must be string literals, since only the
+ * pointer is kept; session labels are copied.
+ */
+typedef struct _TraceEvent {
+	TRACEPHASE phase;
+	char const * name;
+	guint session;
+	guint64 start;
+	guint64 duration;
+	gint64 value;
+	char label[TRACE_LABEL_SIZE];
+} TraceEvent;
+
+// Function prototypes
+
+static guint64 trace_clock();
+static TraceEvent * trace_reserve(TRACEPHASE phase, char const * name, guint session);
+static void trace_append_string(GString * json, char const * string);
+
+// Static variables
+
+static TraceEvent trace_ring[TRACE_EVENTS];
+static guint64 trace_count = 0;
+static guint64 trace_epoch = 0;
+static gint trace_enabled = 0;
+static gint trace_sessions = TRACE_SERVICE;
+// Zeroed static mutexes need no initialisation
+static GMutex trace_lock;
+
+// Function definitions
+
+/**
+ * Start recording events, discarding any recorded before. Until this is
+ * called, and after trace_stop(), recording costs no more than a check.
+ */
+void trace_start() {
+	g_mutex_lock(&trace_lock);
+	if (g_atomic_int_get(&trace_enabled) == 0) {
+		trace_count = 0;
+		trace_epoch = trace_clock();
+		g_atomic_int_set(&trace_enabled, 1);
+	}
+	g_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Stop recording events. Those already recorded can still be dumped.
+ */
+void trace_stop() {
+	g_atomic_int_set(&trace_enabled, 0);
+}
+
+bool trace_running() {
+	return (g_atomic_int_get(&trace_enabled) != 0);
+}
+
+/**
+ * Read the monotonic clock, for the start of a span. Safe to call from any
+ * thread.
+ *
+ * @return the time in nanoseconds, or zero if tracing isn't running
+ */
+guint64 trace_now() {
+	return (g_atomic_int_get(&trace_enabled) != 0) ? trace_clock() : 0;
+}
+
+/**
+ * Number a new session, so that its events appear together on their own
+ * track, labelled with the given name.
+ *
+ * @param label the name for the session's track, such as the device path
+ * @return the session number to record events with
+ */
+guint trace_session(char const * label) {
+	TraceEvent * event;
+	guint session;
+
+	session = (guint)g_atomic_int_add(&trace_sessions, 1) + 1;
+
+	if (g_atomic_int_get(&trace_enabled) != 0) {
+		g_mutex_lock(&trace_lock);
+		event = trace_reserve(TRACEPHASE_SESSION, "thread_name", session);
+		g_strlcpy(event->label, label, sizeof(event->label));
+		g_mutex_unlock(&trace_lock);
+	}
+
+	return session;
+}
+
+/**
+ * Record a span from the given start time until now. Safe to call from any
+ * thread.
+ *
+ * @param name what the span covers, which must be a string literal
+ * @param session the session number, or TRACE_SERVICE
+ * @param start the time returned by trace_now() at the start of the span;
+ *        if it's zero, because tracing wasn't running then, nothing is
+ *        recorded
+ * @param value a number to record with the span, such as a size in bytes
+ */
+void trace_span(char const * name, guint session, guint64 start, gint64 value) {
+	TraceEvent * event;
+	guint64 end;
+
+	end = trace_now();
+	if ((start != 0) && (end != 0)) {
+		g_mutex_lock(&trace_lock);
+		event = trace_reserve(TRACEPHASE_SPAN, name, session);
+		event->start = start;
+		event->duration = (end > start) ? (end - start) : 0;
+		event->value = value;
+		g_mutex_unlock(&trace_lock);
+	}
+}
+
+/**
+ * Record a point in time. Safe to call from any thread.
+ *
+ * @param name what happened, which must be a string literal
+ * @param session the session number, or TRACE_SERVICE
+ * @param value a number to record with the event, such as a status
+ */
+void trace_instant(char const * name, guint session, gint64 value) {
+	TraceEvent * event;
+	guint64 now;
+
+	now = trace_now();
+	if (now != 0) {
+		g_mutex_lock(&trace_lock);
+		event = trace_reserve(TRACEPHASE_INSTANT, name, session);
+		event->start = now;
+		event->value = value;
+		g_mutex_unlock(&trace_lock);
+	}
+}
+
+static guint64 trace_clock() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((guint64)now.tv_sec * 1000000000ull) + now.tv_nsec;
+}
+
+/**
+ * Take the next slot in the ring buffer, overwriting the oldest event if
+ * it's full. Must be called with the lock held.
+ */
+static TraceEvent * trace_reserve(TRACEPHASE phase, char const * name, guint session) {
+	TraceEvent * event;
+
+	event = &trace_ring[trace_count & (TRACE_EVENTS - 1)];
+	trace_count++;
+
+	event->phase = phase;
+	event->name = name;
+	event->session = session;
+	event->start = 0;
+	event->duration = 0;
+	event->value = 0;
+	event->label[0] = '\0';
+
+	return event;
+}
+
+/**
+ * Write out the recorded events in the Chrome trace-event JSON format, as
+ * read by chrome://tracing and Perfetto. Each session is shown as a thread
+ * of its own, with the service's own events on thread zero; times are in
+ * microseconds from when tracing started.
+ *
+ * @return the JSON, to be freed with g_free()
+ */
+gchar * trace_dump() {
+	GString * json;
+	TraceEvent const * event;
+	guint64 first;
+	guint64 pos;
+	guint64 start;
+
+	json = g_string_new("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	g_string_append_printf(json, "{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":\"service\"}}", TRACE_SERVICE);
+
+	g_mutex_lock(&trace_lock);
+	first = (trace_count > TRACE_EVENTS) ? (trace_count - TRACE_EVENTS) : 0;
+	for (pos = first; pos < trace_count; pos++) {
+		event = &trace_ring[pos & (TRACE_EVENTS - 1)];
+		start = (event->start > trace_epoch) ? (event->start - trace_epoch) : 0;
+		switch (event->phase) {
+			case TRACEPHASE_SPAN:
+				g_string_append_printf(json, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%" G_GUINT64_FORMAT ".%03u,\"dur\":%" G_GUINT64_FORMAT ".%03u,\"name\":", event->session, start / 1000, (guint)(start % 1000), event->duration / 1000, (guint)(event->duration % 1000));
+				trace_append_string(json, event->name);
+				g_string_append_printf(json, ",\"args\":{\"value\":%" G_GINT64_FORMAT "}}", event->value);
+				break;
+			case TRACEPHASE_INSTANT:
+				g_string_append_printf(json, ",\n{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%" G_GUINT64_FORMAT ".%03u,\"name\":", event->session, start / 1000, (guint)(start % 1000));
+				trace_append_string(json, event->name);
+				g_string_append_printf(json, ",\"args\":{\"value\":%" G_GINT64_FORMAT "}}", event->value);
+				break;
+			case TRACEPHASE_SESSION:
+				g_string_append_printf(json, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":", event->session);
+				trace_append_string(json, event->label);
+				g_string_append(json, "}}");
+				break;
+			default:
+				break;
+		}
+	}
+	g_mutex_unlock(&trace_lock);
+
+	g_string_append(json, "\n]}\n");
+
+	return g_string_free(json, FALSE);
+}
+
+/**
+ * Write out the recorded events to a file, as for trace_dump().
+ *
+ * @param filename the file to write, which is replaced
+ * @param error return location for an error, or NULL
+ * @return true if the file was written, false o/w
+ */
+bool trace_dump_file(char const * filename, GError ** error) {
+	gchar * json;
+	bool result;
+
+	json = trace_dump();
+	result = g_file_set_contents(filename, json, -1, error);
+	g_free(json);
+
+	return result;
+}
+
+/**
+ * Append a string to the JSON as a quoted and escaped string value.
+ */
+static void trace_append_string(GString * json, char const * string) {
+	g_string_append_c(json, '"');
+	while (*string != '\0') {
+		if ((*string == '"') || (*string == '\\')) {
+			g_string_append_c(json, '\\');
+			g_string_append_c(json, *string);
+		}
+		else if ((guchar)*string < 0x20) {
+			g_string_append_printf(json, "\\u%04x", (guchar)*string);
+		}
+		else {
+			g_string_append_c(json, *string);
+		}
+		string++;
+	}
+	g_string_append_c(json, '"');
+}
+
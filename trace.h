@@ -0,0 +1,34 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Defines
+
+// Number of events the ring buffer holds, after which the oldest are
+// overwritten; must be a power of two
+#define TRACE_EVENTS (4096)
+// Maximum length of a session's name, including the terminator
+#define TRACE_LABEL_SIZE (48)
+// The session number for events belonging to the service as a whole
+#define TRACE_SERVICE (0)
+
+// Structure definitions
+
+// Function prototypes
+
+void trace_start();
+void trace_stop();
+bool trace_running();
+
+guint64 trace_now();
+guint trace_session(char const * label);
+void trace_span(char const * name, guint session, guint64 start, gint64 value);
+void trace_instant(char const * name, guint session, gint64 value);
+
+gchar * trace_dump();
+bool trace_dump_file(char const * filename, GError ** error);
+
+#endif
+
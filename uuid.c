@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "pico/buffer.h"
+
+#include "uuid.h"
+
+// Defines
+
+// Structure definitions
+
+// Function prototypes
+
+// Function definitions
+
+/**
+ * Append bytes to a buffer as upper case hex digits, two for each byte.
+ *
+ * @param bytes the bytes to append
+ * @param length the number of bytes
+ * @param out the buffer to append the digits to
+ */
+void uuid_append_hex(guchar const * bytes, gsize length, Buffer * out) {
+	static char const hex[] = "0123456789ABCDEF";
+	char letters[32];
+	gsize pos;
+	gsize count;
+
+	while (length > 0) {
+		count = MIN(length, sizeof(letters) / 2);
+		for (pos = 0; pos < count; pos++) {
+			letters[(pos * 2)] = hex[bytes[pos] >> 4];
+			letters[(pos * 2) + 1] = hex[bytes[pos] & 0x0f];
+		}
+		buffer_append(out, letters, count * 2);
+		bytes += count;
+		length -= count;
+	}
+}
+
+/**
+ * Derive the advertising UUID from the second half of the commitment. The
+ * lowest bit of the last byte says whether the service is advertising for
+ * continuous authentication.
+ *
+ * @param commitment the UUID_COMMITMENT_LENGTH bytes of the commitment
+ * @param continuous whether to derive the UUID for continuous authentication
+ * @param uuid buffer to hold the UUID string, which is cleared first
+ */
+void uuid_from_commitment(guchar const * commitment, bool continuous, Buffer * uuid) {
+	unsigned char d[8];
+
+	memcpy(d, commitment + 24, sizeof(d));
+
+	if (continuous) {
+		d[7] |= 0x01;
+	}
+	else {
+		d[7] &= 0xFE;
+	}
+
+	buffer_clear(uuid);
+	uuid_append_hex(commitment + 16, 4, uuid);
+	buffer_append_string(uuid, "-");
+	uuid_append_hex(commitment + 20, 2, uuid);
+	buffer_append_string(uuid, "-");
+	uuid_append_hex(commitment + 22, 2, uuid);
+	buffer_append_string(uuid, "-");
+	uuid_append_hex(d, 2, uuid);
+	buffer_append_string(uuid, "-");
+	uuid_append_hex(d + 2, 6, uuid);
+}
+
@@ -0,0 +1,22 @@
+#ifndef __UUID_H
+#define __UUID_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+#include "pico/buffer.h"
+
+// Defines
+
+// The commitment is the SHA-256 hash of the service's public key
+#define UUID_COMMITMENT_LENGTH (32)
+
+// Structure definitions
+
+// Function prototypes
+
+void uuid_append_hex(guchar const * bytes, gsize length, Buffer * out);
+void uuid_from_commitment(guchar const * commitment, bool continuous, Buffer * uuid);
+
+#endif
+
@@ -0,0 +1,197 @@
+#include <stdio.h>
+
+#include <glib.h>
+
+#include "worker.h"
+#include "asynclog.h"
+
+// Defines
+
+// Structure definitions
+
+/**
+ * Runs slow work on a thread of its own, and passes the results back to be
+ * handled in order on the main context.
+ */
+struct _Worker {
+	GThread * thread;
+	GAsyncQueue * jobs;
+	GAsyncQueue * results;
+	gint scheduled;
+};
+
+typedef struct _WorkerTask {
+	WorkerFunc func;
+	gpointer data;
+	GDestroyNotify discard;
+} WorkerTask;
+
+// Function prototypes
+
+static gpointer worker_run(gpointer user_data);
+static gboolean worker_dispatch(gpointer user_data);
+
+// Function definitions
+
+/**
+ * Create a new worker, with its thread.
+ *
+ * @return the new worker, or NULL if the thread couldn't be created
+ */
+Worker * worker_new() {
+	Worker * worker;
+	GError * error;
+
+	worker = g_new0(Worker, 1);
+	worker->jobs = g_async_queue_new();
+
+	error = NULL;
+	worker->thread = g_thread_try_new("worker", worker_run, worker, &error);
+	if (worker->thread == NULL) {
+		ASYNCLOG(LOG_ERR, "Error creating worker thread: %s\n", error->message);
+		g_error_free(error);
+		g_async_queue_unref(worker->jobs);
+		g_free(worker);
+		return NULL;
+	}
+
+	worker->results = g_async_queue_new();
+	worker->scheduled = 0;
+
+	return worker;
+}
+
+/**
+ * Delete a worker. Jobs already pushed are finished before this returns, but
+ * the results they post are discarded rather than handled, since by now the
+ * main context that would have handled them has gone.
+ *
+ * @param worker the worker to delete
+ */
+void worker_delete(Worker * worker) {
+	WorkerTask * task;
+
+	if (worker != NULL) {
+		// A job without a function tells the thread to stop
+		task = g_new0(WorkerTask, 1);
+		g_async_queue_push(worker->jobs, task);
+		g_thread_join(worker->thread);
+		worker->thread = NULL;
+
+		g_async_queue_unref(worker->jobs);
+		worker->jobs = NULL;
+
+		g_source_remove_by_user_data(worker);
+		while ((task = g_async_queue_try_pop(worker->results)) != NULL) {
+			if (task->discard != NULL) {
+				task->discard(task->data);
+			}
+			g_free(task);
+		}
+
+		g_async_queue_unref(worker->results);
+		worker->results = NULL;
+
+		g_free(worker);
+	}
+}
+
+/**
+ * Run a job on the worker's thread. Jobs run one at a time, in the order
+ * they're pushed. With no worker the job is run straight away.
+ *
+ * @param worker the worker to run the job, or NULL to run it directly
+ * @param func the job to run
+ * @param data data to pass to the job
+ */
+void worker_push(Worker * worker, WorkerFunc func, gpointer data) {
+	WorkerTask * task;
+
+	if ((worker == NULL) || (worker->thread == NULL)) {
+		func(data);
+	}
+	else {
+		task = g_new(WorkerTask, 1);
+		task->func = func;
+		task->data = data;
+		task->discard = NULL;
+		g_async_queue_push(worker->jobs, task);
+	}
+}
+
+/**
+ * Pass a result from a job back to the main context. Results are handled in
+ * the order they're posted. With no worker the result is handled straight
+ * away.
+ *
+ * @param worker the worker running the job, or NULL if there isn't one
+ * @param func the function to handle the result, called on the main context
+ * @param data data to pass to the function
+ * @param discard called with the data instead if the worker is deleted
+ *        before the result is handled, or NULL
+ */
+void worker_post(Worker * worker, WorkerFunc func, gpointer data, GDestroyNotify discard) {
+	WorkerTask * task;
+
+	if ((worker == NULL) || (worker->thread == NULL)) {
+		func(data);
+	}
+	else {
+		task = g_new(WorkerTask, 1);
+		task->func = func;
+		task->data = data;
+		task->discard = discard;
+		g_async_queue_push(worker->results, task);
+
+		// Only wake the main context if it isn't already due to look
+		if (g_atomic_int_compare_and_exchange(&worker->scheduled, 0, 1)) {
+			g_idle_add(worker_dispatch, worker);
+		}
+	}
+}
+
+/**
+ * Worker thread function; runs each job in turn until told to stop.
+ *
+ * @param user_data the worker
+ * @return NULL
+ */
+static gpointer worker_run(gpointer user_data) {
+	Worker * worker = (Worker *)user_data;
+	WorkerTask * task;
+	gboolean stop;
+
+	stop = FALSE;
+	while (stop == FALSE) {
+		task = g_async_queue_pop(worker->jobs);
+		stop = (task->func == NULL);
+		if (stop == FALSE) {
+			task->func(task->data);
+		}
+		g_free(task);
+	}
+
+	return NULL;
+}
+
+/**
+ * Main context idle callback; handles all of the results posted so far.
+ *
+ * @param user_data the worker
+ * @return FALSE to remove the callback
+ */
+static gboolean worker_dispatch(gpointer user_data) {
+	Worker * worker = (Worker *)user_data;
+	WorkerTask * task;
+
+	// Anything posted from here on schedules another dispatch
+	g_atomic_int_set(&worker->scheduled, 0);
+
+	while ((task = g_async_queue_try_pop(worker->results)) != NULL) {
+		task->func(task->data);
+		g_free(task);
+	}
+
+	return FALSE;
+}
+
@@ -0,0 +1,29 @@
+#ifndef __WORKER_H
+#define __WORKER_H
+
+#include <glib.h>
+
+// Defines
+
+// Structure definitions
+
+/**
+ * A function to be run, either on a worker thread or back on the main
+ * context, with the data it was queued with.
+ */
+typedef void (*WorkerFunc)(gpointer data);
+
+typedef struct _Worker Worker;
+
+// Function prototypes
+
+Worker * worker_new();
+void worker_delete(Worker * worker);
+
+void worker_push(Worker * worker, WorkerFunc func, gpointer data);
+void worker_post(Worker * worker, WorkerFunc func, gpointer data, GDestroyNotify discard);
+
+// Function definitions
+
+#endif
+